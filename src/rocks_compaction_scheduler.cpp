@@ -32,22 +32,31 @@
 
 #include "rocks_compaction_scheduler.h"
 
-#include <queue>
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <map>
 
+#include "mongo/bson/bsonobjbuilder.h"
 #include "mongo/db/client.h"
+#include "mongo/platform/endian.h"
 #include "mongo/stdx/condition_variable.h"
 #include "mongo/stdx/mutex.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/util/assert_util.h"
-#include "mongo/util/background.h"
 #include "mongo/util/concurrency/idle_thread_block.h"
 #include "mongo/util/log.h"
+#include "mongo/util/time_support.h"
+#include "rocks_ttl.h"
 #include "rocks_util.h"
 
 #include <rocksdb/compaction_filter.h>
 #include <rocksdb/convenience.h>
 #include <rocksdb/db.h>
 #include <rocksdb/experimental.h>
+#include <rocksdb/listener.h>
 #include <rocksdb/slice.h>
+#include <rocksdb/table_properties.h>
 #include <rocksdb/write_batch.h>
 
 namespace mongo {
@@ -55,18 +64,41 @@ namespace mongo {
         // The order in which compaction ops are executed (priority).
         // Smaller values run first.
         enum : uint32_t {
+            // urgent ops, they free space that nothing else will reclaim
             kOrderOplog,
+            kOrderLastUrgent = kOrderOplog,
+
             kOrderFull,
             kOrderRange,
+            // dropped ranges are hidden by a range tombstone and most of their files are deleted
+            // when they're dropped, so what's left can wait
             kOrderDroppedRange,
         };
 
+        // Deletes the SST files that only hold keys of [begin, end). The end of a dropped range
+        // is the first key of the next prefix, which isn't ours.
+        rocksdb::Status deleteFilesInRange(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+                                           const rocksdb::Slice* begin,
+                                           const rocksdb::Slice* end) {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+            return rocksdb::DeleteFilesInRange(db, cf, begin, end, false /* include_end */);
+#else
+            return rocksdb::DeleteFilesInRange(db, cf, begin, end);
+#endif
+        }
+
+        // Drops the keys of dropped prefixes and the expired records of TTL collections
         class PrefixDeletingCompactionFilter : public rocksdb::CompactionFilter {
         public:
-            explicit PrefixDeletingCompactionFilter(std::unordered_set<uint32_t> droppedPrefixes)
+            PrefixDeletingCompactionFilter(
+                RocksCompactionScheduler::DroppedPrefixes droppedPrefixes,
+                RocksCompactionScheduler::TtlCollections ttlCollections)
                 : _droppedPrefixes(std::move(droppedPrefixes)),
+                  _ttlCollections(std::move(ttlCollections)),
+                  _now(Date_t::now()),
                   _prefixCache(0),
-                  _droppedCache(false) {}
+                  _droppedCache(false),
+                  _ttlCache(nullptr) {}
 
             // filter is not called from multiple threads simultaneously
             virtual bool Filter(int level, const rocksdb::Slice& key,
@@ -79,12 +111,16 @@ namespace mongo {
                     // filter's job to report corruption, so we just silently continue
                     return false;
                 }
-                if (prefix == _prefixCache) {
-                    return _droppedCache;
+                if (prefix != _prefixCache) {
+                    _prefixCache = prefix;
+                    _droppedCache = _droppedPrefixes->find(prefix) != _droppedPrefixes->end();
+                    auto ttl = _ttlCollections->find(prefix);
+                    _ttlCache = ttl != _ttlCollections->end() ? ttl->second.get() : nullptr;
                 }
-                _prefixCache = prefix;
-                _droppedCache = _droppedPrefixes.find(prefix) != _droppedPrefixes.end();
-                return _droppedCache;
+                if (_droppedCache) {
+                    return true;
+                }
+                return _ttlCache && _isExpiredRecord(key, existing_value);
             }
 
             // IgnoreSnapshots is available since RocksDB 4.3
@@ -95,9 +131,31 @@ namespace mongo {
             virtual const char* Name() const { return "PrefixDeletingCompactionFilter"; }
 
         private:
-            std::unordered_set<uint32_t> _droppedPrefixes;
+            // a record key is the prefix followed by the big endian RecordId, the value is the
+            // BSON document
+            bool _isExpiredRecord(const rocksdb::Slice& key, const rocksdb::Slice& value) const {
+                if (key.size() != sizeof(uint32_t) + sizeof(int64_t) ||
+                    value.size() < static_cast<size_t>(BSONObj::kMinBSONLength)) {
+                    return false;
+                }
+                BSONObj doc(value.data());
+                if (static_cast<size_t>(doc.objsize()) != value.size() ||
+                    !_ttlCache->options().isExpired(doc, _now)) {
+                    return false;
+                }
+                int64_t repr;
+                memcpy(&repr, key.data() + sizeof(uint32_t), sizeof(repr));
+                return _ttlCache->queueExpired(RecordId(endian::bigToNative(repr)), doc,
+                                               value.size());
+            }
+
+            RocksCompactionScheduler::DroppedPrefixes _droppedPrefixes;
+            RocksCompactionScheduler::TtlCollections _ttlCollections;
+            // records that expire while the compaction runs are kept
+            const Date_t _now;
             mutable uint32_t _prefixCache;
             mutable bool _droppedCache;
+            mutable RocksTtlCollection* _ttlCache;  // owned by _ttlCollections
         };
 
         class PrefixDeletingCompactionFilterFactory : public rocksdb::CompactionFilterFactory {
@@ -109,12 +167,14 @@ namespace mongo {
             virtual std::unique_ptr<rocksdb::CompactionFilter> CreateCompactionFilter(
                 const rocksdb::CompactionFilter::Context& context) override {
                 auto droppedPrefixes = _compactionScheduler->getDroppedPrefixes();
-                if (droppedPrefixes.size() == 0) {
+                auto ttlCollections = _compactionScheduler->getTtlCollections();
+                if (droppedPrefixes->empty() && ttlCollections->empty()) {
                     // no compaction filter needed
                     return std::unique_ptr<rocksdb::CompactionFilter>(nullptr);
                 } else {
                     return std::unique_ptr<rocksdb::CompactionFilter>(
-                        new PrefixDeletingCompactionFilter(std::move(droppedPrefixes)));
+                        new PrefixDeletingCompactionFilter(std::move(droppedPrefixes),
+                                                           std::move(ttlCollections)));
                 }
             }
 
@@ -125,45 +185,295 @@ namespace mongo {
         private:
             const RocksCompactionScheduler* _compactionScheduler;
         };
+
+        // A prefix is compacted once its tombstones make up this much of its entries in an SST
+        // file. Deletions are cheap to skip in small numbers, so we also require a minimum count
+        const double kDenseTombstonesRatio = 0.3;
+        const uint64_t kMinDenseTombstones = 10000;
+
+        bool tombstonesAreDense(uint64_t entries, uint64_t deletions) {
+            return deletions >= kMinDenseTombstones &&
+                   deletions >= entries * kDenseTombstonesRatio;
+        }
+
+        // Table property with the entries and deletions of every prefix that has deletions in the
+        // SST file. Each prefix takes 20 bytes: the prefix, the number of entries and the number
+        // of deletions, all little endian.
+        const std::string kPrefixDeletionsProperty("mongorocks.prefix-deletions");
+
+        struct PrefixDeletions {
+            uint32_t prefix;
+            uint64_t entries;
+            uint64_t deletions;
+        };
+
+        const size_t kEncodedPrefixDeletionsSize = 20;
+
+        template <typename T>
+        void appendLittleEndian(std::string* out, T value) {
+            value = endian::nativeToLittle(value);
+            out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        template <typename T>
+        T readLittleEndian(const char* data) {
+            T value;
+            memcpy(&value, data, sizeof(value));
+            return endian::littleToNative(value);
+        }
+
+        std::vector<PrefixDeletions> decodePrefixDeletions(const std::string& encoded) {
+            std::vector<PrefixDeletions> result;
+            for (size_t pos = 0; pos + kEncodedPrefixDeletionsSize <= encoded.size();
+                 pos += kEncodedPrefixDeletionsSize) {
+                const char* data = encoded.data() + pos;
+                result.push_back({readLittleEndian<uint32_t>(data),
+                                  readLittleEndian<uint64_t>(data + 4),
+                                  readLittleEndian<uint64_t>(data + 12)});
+            }
+            return result;
+        }
     } // end of anon namespace
 
-    class CompactionBackgroundJob : public BackgroundJob {
+    // Hands the tombstone dense ranges found by the collectors to the scheduler. The factory is
+    // shared with the DB options and may outlive the scheduler, which detaches itself first
+    class PrefixDeletionsCollectorFactory : public rocksdb::TablePropertiesCollectorFactory {
+    public:
+        explicit PrefixDeletionsCollectorFactory(RocksCompactionScheduler* scheduler)
+            : _compactionScheduler(scheduler) {}
+
+        virtual rocksdb::TablePropertiesCollector* CreateTablePropertiesCollector(
+            rocksdb::TablePropertiesCollectorFactory::Context context) override;
+
+        virtual const char* Name() const override { return "PrefixDeletionsCollectorFactory"; }
+
+        void reportTombstoneDenseRange(uint32_t columnFamilyId, uint32_t prefix,
+                                       const std::string& begin, const std::string& end) {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            if (_compactionScheduler) {
+                _compactionScheduler->reportTombstoneDenseRange(columnFamilyId, prefix, begin,
+                                                                end);
+            }
+        }
+
+        void detach() {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            _compactionScheduler = nullptr;
+        }
+
+    private:
+        stdx::mutex _mutex;
+        RocksCompactionScheduler* _compactionScheduler;  // not owned, nullptr once detached
+    };
+
+    namespace {
+        // Counts the entries and deletions of each prefix in an SST file. Keys arrive in order,
+        // so all keys of a prefix are added one after another.
+        class PrefixDeletionsCollector : public rocksdb::TablePropertiesCollector {
+        public:
+            // ranges are only reported if factory isn't nullptr
+            PrefixDeletionsCollector(PrefixDeletionsCollectorFactory* factory,
+                                     uint32_t columnFamilyId)
+                : _factory(factory), _columnFamilyId(columnFamilyId) {}
+
+            virtual rocksdb::Status AddUserKey(const rocksdb::Slice& key,
+                                               const rocksdb::Slice& value,
+                                               rocksdb::EntryType type,
+                                               rocksdb::SequenceNumber seq,
+                                               uint64_t fileSize) override {
+                uint32_t prefix;
+                if (!extractPrefix(key, &prefix)) {
+                    // shorter than a prefix, see PrefixDeletingCompactionFilter::Filter()
+                    return rocksdb::Status::OK();
+                }
+                if (!_hasCurrent || prefix != _current.prefix) {
+                    _finishPrefix(key);
+                    _current = {prefix, 0, 0};
+                    _currentBegin.assign(key.data(), key.size());
+                    _hasCurrent = true;
+                }
+                ++_current.entries;
+                if (type == rocksdb::kEntryDelete || type == rocksdb::kEntrySingleDelete) {
+                    ++_current.deletions;
+                }
+                return rocksdb::Status::OK();
+            }
+
+            virtual rocksdb::Status Finish(rocksdb::UserCollectedProperties* properties) override {
+                _finishPrefix(rocksdb::Slice());
+                std::string encoded;
+                encoded.reserve(_prefixes.size() * kEncodedPrefixDeletionsSize);
+                for (const auto& prefixDeletions : _prefixes) {
+                    appendLittleEndian(&encoded, prefixDeletions.prefix);
+                    appendLittleEndian(&encoded, prefixDeletions.entries);
+                    appendLittleEndian(&encoded, prefixDeletions.deletions);
+                }
+                (*properties)[kPrefixDeletionsProperty] = std::move(encoded);
+                return rocksdb::Status::OK();
+            }
+
+            virtual rocksdb::UserCollectedProperties GetReadableProperties() const override {
+                rocksdb::UserCollectedProperties readable;
+                for (const auto& prefixDeletions : _prefixes) {
+                    readable[kPrefixDeletionsProperty + "." +
+                             std::to_string(prefixDeletions.prefix)] =
+                        std::to_string(prefixDeletions.deletions) + "/" +
+                        std::to_string(prefixDeletions.entries);
+                }
+                return readable;
+            }
+
+            virtual const char* Name() const override { return "PrefixDeletionsCollector"; }
+
+        private:
+            // end is the first key of the next prefix, empty if the prefix ends the file
+            void _finishPrefix(const rocksdb::Slice& end) {
+                if (!_hasCurrent || _current.deletions == 0) {
+                    return;
+                }
+                _prefixes.push_back(_current);
+                if (_factory && tombstonesAreDense(_current.entries, _current.deletions)) {
+                    // only the files overlapping the range of the prefix in this file get
+                    // rewritten
+                    _factory->reportTombstoneDenseRange(
+                        _columnFamilyId, _current.prefix, _currentBegin,
+                        end.empty() ? rocksGetNextPrefix(encodePrefix(_current.prefix))
+                                    : end.ToString());
+                }
+            }
+
+            PrefixDeletionsCollectorFactory* _factory;  // not owned, can be nullptr
+            const uint32_t _columnFamilyId;
+            bool _hasCurrent = false;
+            PrefixDeletions _current;
+            std::string _currentBegin;
+            // prefixes with deletions
+            std::vector<PrefixDeletions> _prefixes;
+        };
+    }  // namespace
+
+    rocksdb::TablePropertiesCollector*
+    PrefixDeletionsCollectorFactory::CreateTablePropertiesCollector(
+        rocksdb::TablePropertiesCollectorFactory::Context context) {
+        // A compaction that keeps tombstones writes them to a file again, reporting it would only
+        // compact the same range over and over. The property is still recorded.
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 9
+        const bool report = context.reason != rocksdb::TableFileCreationReason::kCompaction;
+#else
+        // older versions don't tell, we rely on the rate limit of prefix compactions
+        const bool report = true;
+#endif
+        return new PrefixDeletionsCollector(report ? this : nullptr, context.column_family_id);
+    }
+
+    namespace {
+        const char* opTypeName(uint32_t order) {
+            switch (order) {
+                case kOrderOplog:
+                    return "oplog";
+                case kOrderDroppedRange:
+                    return "dropped-range";
+                case kOrderRange:
+                    return "range";
+                case kOrderFull:
+                    return "full";
+            }
+            return "unknown";
+        }
+
+        // empty begin and end keys stand for the beginning and the end of the key space
+        bool beginsBeforeEnd(const std::string& begin, const std::string& end) {
+            return begin.empty() || end.empty() || begin <= end;
+        }
+    }  // namespace
+
+    class CompactionBackgroundJob {
     public:
         CompactionBackgroundJob(rocksdb::DB* db, RocksCompactionScheduler* compactionScheduler);
-        virtual ~CompactionBackgroundJob();
+        ~CompactionBackgroundJob();
+
+        // schedule compact range operation for execution by one of the workers. The op is
+        // coalesced with the queued ops of the same column family that cover an overlapping range.
+        void scheduleCompactOp(rocksdb::ColumnFamilyHandle* cf, const std::string& begin,
+                               const std::string& end, bool rangeDropped, uint32_t order);
+
+        void setMaxConcurrentCompactions(int maxConcurrent);
+        int getMaxConcurrentCompactions() const;
+
+        void appendStats(BSONObjBuilder* builder) const;
 
-        // schedule compact range operation for execution in _compactionThread
-        void scheduleCompactOp(const std::string& begin, const std::string& end, bool rangeDropped,
-                               uint32_t order);
+        void holdCompactionsForTest(bool hold);
 
     private:
         // struct with compaction operation data
         struct CompactOp {
+            rocksdb::ColumnFamilyHandle* _cf;  // nullptr means the default column family
             std::string _start_str;
             std::string _end_str;
             bool _rangeDropped;
 
             uint32_t _order;
-            bool operator>(const CompactOp& other) const { return _order > other._order; }
+            uint64_t _seq;  // ops of the same order run in the order they were scheduled
+
+            bool urgent() const { return _order <= kOrderLastUrgent; }
+            bool runsBefore(const CompactOp& other) const {
+                return _order != other._order ? _order < other._order : _seq < other._seq;
+            }
+            bool overlaps(const CompactOp& other) const {
+                return _cf == other._cf && beginsBeforeEnd(_start_str, other._end_str) &&
+                       beginsBeforeEnd(other._start_str, _end_str);
+            }
+            // a merged dropped range must only cover dropped data, since its files get deleted.
+            // Urgent ops aren't merged with the others either, a merged op takes the smaller
+            // order and would otherwise promote a full compaction to the urgent lane.
+            bool canCoalesce(const CompactOp& other) const {
+                return _rangeDropped == other._rangeDropped && urgent() == other.urgent() &&
+                       overlaps(other);
+            }
+        };
+
+        struct RunningOp {
+            CompactOp op;
+            Timer timer;
+            uint64_t estimatedBytes = 0;
         };
 
-        static const char * const _name;
+        static const char* const _name;
+        // weight of the latest compaction in the throughput average
+        static constexpr double kThroughputAlpha = 0.2;
 
-        // BackgroundJob
-        virtual std::string name() const override { return _name; }
-        virtual void run() override;
+        void _workerLoop(size_t workerId);
+        void _startWorkers_inlock();
+        // returns the queued op that should run next, or the end of the queue if no op can run
+        std::vector<CompactOp>::iterator _pickNextOp_inlock();
 
-        void compact(const CompactOp& op);
+        bool compact(RunningOp* running);
+        uint64_t _estimateSize(rocksdb::ColumnFamilyHandle* cf, const rocksdb::Slice* start,
+                               const rocksdb::Slice* end) const;
 
         rocksdb::DB* _db;  // not owned
         RocksCompactionScheduler* _compactionScheduler;  // not owned
 
         bool _compactionThreadRunning = true;
-        stdx::mutex _compactionMutex;
+        mutable stdx::mutex _compactionMutex;
         stdx::condition_variable _compactionWakeUp;
-        using CompactQueue =
-            std::priority_queue<CompactOp, std::vector<CompactOp>, std::greater<CompactOp>>;
-        CompactQueue _compactionQueue;
+        std::vector<CompactOp> _compactionQueue;
+        std::list<RunningOp> _runningOps;
+        std::vector<stdx::thread> _workers;
+        uint64_t _nextSeq = 0;
+        // while set, the workers start ops but don't compact them
+        bool _holdForTest = false;
+        stdx::condition_variable _holdReleasedForTest;
+        // Regular ops never run on more than _maxConcurrent workers. Urgent ops may use one extra
+        // worker, so a long full compaction can't hold back the oplog.
+        int _maxConcurrent = RocksCompactionScheduler::kDefaultMaxConcurrentCompactions;
+
+        // stats, protected by _compactionMutex
+        long long _completed = 0;
+        long long _failed = 0;
+        long long _coalesced = 0;
+        // moving average of the compaction throughput in bytes per second, used for the ETAs
+        double _throughputEwma = 0;
     };
 
     const char* const CompactionBackgroundJob::_name = "RocksCompactionThread";
@@ -171,7 +481,8 @@ namespace mongo {
     CompactionBackgroundJob::CompactionBackgroundJob(rocksdb::DB* db,
                                                      RocksCompactionScheduler* compactionScheduler)
         : _db(db), _compactionScheduler(compactionScheduler) {
-        go();
+        stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
+        _startWorkers_inlock();
     }
 
     CompactionBackgroundJob::~CompactionBackgroundJob() {
@@ -179,8 +490,7 @@ namespace mongo {
             stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
             _compactionThreadRunning = false;
             // Clean up the queue
-            CompactQueue tmp;
-            _compactionQueue.swap(tmp);
+            _compactionQueue.clear();
         }
 // From 4.13 public release, CancelAllBackgroundWork() flushes all memtables for databases
 // containing writes that have bypassed the WAL (writes issued with WriteOptions::disableWAL=true)
@@ -189,8 +499,11 @@ namespace mongo {
 #if defined(ROCKSDB_MAJOR) && (ROCKSDB_MAJOR > 4 || (ROCKSDB_MAJOR == 4 && ROCKSDB_MINOR >= 13))
         rocksdb::CancelAllBackgroundWork(_db);
 #endif
-        _compactionWakeUp.notify_one();
-        wait();
+        _compactionWakeUp.notify_all();
+        _holdReleasedForTest.notify_all();
+        for (auto& worker : _workers) {
+            worker.join();
+        }
     }
 
     namespace {
@@ -213,126 +526,452 @@ namespace mongo {
         };
     }
 
-    void CompactionBackgroundJob::run() {
-        Client::initThread(_name);
+    void CompactionBackgroundJob::_startWorkers_inlock() {
+        // one worker more than the limit, for the urgent ops
+        while (_workers.size() < static_cast<size_t>(_maxConcurrent) + 1) {
+            _workers.emplace_back(&CompactionBackgroundJob::_workerLoop, this, _workers.size());
+        }
+    }
+
+    std::vector<CompactionBackgroundJob::CompactOp>::iterator
+    CompactionBackgroundJob::_pickNextOp_inlock() {
+        const int running = static_cast<int>(_runningOps.size());
+        const bool runningDroppedRange =
+            std::any_of(_runningOps.begin(), _runningOps.end(),
+                        [](const RunningOp& runningOp) { return runningOp.op._rangeDropped; });
+        auto next = _compactionQueue.end();
+        for (auto it = _compactionQueue.begin(); it != _compactionQueue.end(); ++it) {
+            if (running >= _maxConcurrent + (it->urgent() ? 1 : 0)) {
+                continue;
+            }
+            // rewriting the leftovers of dropped ranges isn't urgent, so it's done one at a time
+            if (it->_rangeDropped && runningDroppedRange) {
+                continue;
+            }
+            if (next != _compactionQueue.end() && !it->runsBefore(*next)) {
+                continue;
+            }
+            // compacting a range twice at the same time only makes the two compactions wait on
+            // each other. The op stays queued, and absorbs new requests, until the range is free.
+            bool busy = false;
+            for (const auto& runningOp : _runningOps) {
+                if (it->overlaps(runningOp.op)) {
+                    busy = true;
+                    break;
+                }
+            }
+            if (!busy) {
+                next = it;
+            }
+        }
+        return next;
+    }
+
+    void CompactionBackgroundJob::_workerLoop(size_t workerId) {
+        Client::initThread(std::string(_name) + "-" + std::to_string(workerId));
         stdx::unique_lock<stdx::mutex> lk(_compactionMutex);
         while (_compactionThreadRunning) {
-            // check if we have something to compact
-            if (_compactionQueue.empty()) {
+            auto next = _pickNextOp_inlock();
+            if (next == _compactionQueue.end()) {
                 MONGO_IDLE_THREAD_BLOCK;
                 _compactionWakeUp.wait(lk);
-            } else {
-                // get item from queue
-                const CompactOp op(std::move(_compactionQueue.top()));
-                _compactionQueue.pop();
+                continue;
+            }
+
+            // move the op from the queue to the running ops, this starts its timer
+            auto running = _runningOps.emplace(_runningOps.end());
+            running->op = std::move(*next);
+            _compactionQueue.erase(next);
+            _holdReleasedForTest.wait(
+                lk, [&] { return !_holdForTest || !_compactionThreadRunning; });
+            if (!_compactionThreadRunning) {
+                _runningOps.erase(running);
+                break;
+            }
+
+            bool ok;
+            {
                 // unlock mutex for the time of compaction
                 unlock_guard<decltype(lk)> rlk(lk);
                 // do compaction
-                compact(op);
+                ok = compact(&*running);
             }
+
+            if (ok) {
+                ++_completed;
+                const double secs = running->timer.micros() / 1000000.0;
+                if (running->estimatedBytes > 0 && secs > 0) {
+                    const double throughput = running->estimatedBytes / secs;
+                    _throughputEwma = _throughputEwma == 0
+                                          ? throughput
+                                          : kThroughputAlpha * throughput +
+                                                (1 - kThroughputAlpha) * _throughputEwma;
+                }
+            } else {
+                ++_failed;
+            }
+            _runningOps.erase(running);
+            // a worker slot is free, and queued ops overlapping the finished one may run now
+            _compactionWakeUp.notify_all();
         }
         lk.unlock();
         LOG(1) << "Compaction thread terminating" << std::endl;
     }
 
-    void CompactionBackgroundJob::scheduleCompactOp(const std::string& begin,
+    void CompactionBackgroundJob::scheduleCompactOp(rocksdb::ColumnFamilyHandle* cf,
+                                                    const std::string& begin,
                                                     const std::string& end, bool rangeDropped,
                                                     uint32_t order) {
         {
             stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
-            _compactionQueue.push({begin, end, rangeDropped, order});
+            CompactOp op{cf, begin, end, rangeDropped, order, _nextSeq++};
+            // a merged op covers more keys, so it may now overlap ops it didn't overlap before
+            bool merged = true;
+            while (merged) {
+                merged = false;
+                for (auto it = _compactionQueue.begin(); it != _compactionQueue.end();) {
+                    if (!op.canCoalesce(*it)) {
+                        ++it;
+                        continue;
+                    }
+                    if (!op._start_str.empty() &&
+                        (it->_start_str.empty() || it->_start_str < op._start_str)) {
+                        op._start_str = std::move(it->_start_str);
+                    }
+                    if (!op._end_str.empty() &&
+                        (it->_end_str.empty() || it->_end_str > op._end_str)) {
+                        op._end_str = std::move(it->_end_str);
+                    }
+                    op._order = std::min(op._order, it->_order);
+                    op._seq = std::min(op._seq, it->_seq);
+                    it = _compactionQueue.erase(it);
+                    ++_coalesced;
+                    merged = true;
+                }
+            }
+            _compactionQueue.push_back(std::move(op));
         }
         _compactionWakeUp.notify_one();
     }
 
-    void CompactionBackgroundJob::compact(const CompactOp& op) {
+    void CompactionBackgroundJob::setMaxConcurrentCompactions(int maxConcurrent) {
+        {
+            stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
+            _maxConcurrent = maxConcurrent;
+            // we never stop workers, the extra ones stay idle when the limit goes down
+            _startWorkers_inlock();
+        }
+        _compactionWakeUp.notify_all();
+    }
+
+    void CompactionBackgroundJob::holdCompactionsForTest(bool hold) {
+        {
+            stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
+            _holdForTest = hold;
+        }
+        _holdReleasedForTest.notify_all();
+    }
+
+    int CompactionBackgroundJob::getMaxConcurrentCompactions() const {
+        stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
+        return _maxConcurrent;
+    }
+
+    void CompactionBackgroundJob::appendStats(BSONObjBuilder* builder) const {
+        stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
+        builder->append("max-concurrent", _maxConcurrent);
+        builder->append("queued", static_cast<long long>(_compactionQueue.size()));
+        builder->append("queued-urgent",
+                        static_cast<long long>(std::count_if(
+                            _compactionQueue.begin(), _compactionQueue.end(),
+                            [](const CompactOp& op) { return op.urgent(); })));
+        builder->append("completed", _completed);
+        builder->append("failed", _failed);
+        builder->append("coalesced", _coalesced);
+        builder->append("throughput-bytes-per-sec", static_cast<long long>(_throughputEwma));
+
+        BSONArrayBuilder runningBuilder(builder->subarrayStart("running"));
+        for (const auto& running : _runningOps) {
+            const CompactOp& op = running.op;
+            BSONObjBuilder opBuilder(runningBuilder.subobjStart());
+            opBuilder.append("type", opTypeName(op._order));
+            opBuilder.append("column_family",
+                             (op._cf ? op._cf : _db->DefaultColumnFamily())->GetName());
+            opBuilder.append("begin", rocksdb::Slice(op._start_str).ToString(true));
+            opBuilder.append("end", rocksdb::Slice(op._end_str).ToString(true));
+            const long long elapsedMillis = running.timer.millis();
+            opBuilder.append("time_elapsed_millis", elapsedMillis);
+            opBuilder.append("estimated_bytes", static_cast<long long>(running.estimatedBytes));
+            // the size of a range and the average throughput are both estimates, so we never
+            // report an op as done before it is
+            if (_throughputEwma > 0 && running.estimatedBytes > 0) {
+                const double expectedSecs = running.estimatedBytes / _throughputEwma;
+                const double elapsedSecs = elapsedMillis / 1000.0;
+                opBuilder.append("progress", std::min(elapsedSecs / expectedSecs, 0.99));
+                opBuilder.append("eta_secs",
+                                 static_cast<long long>(std::max(expectedSecs - elapsedSecs, 1.0)));
+            }
+        }
+    }
+
+    uint64_t CompactionBackgroundJob::_estimateSize(rocksdb::ColumnFamilyHandle* cf,
+                                                    const rocksdb::Slice* start,
+                                                    const rocksdb::Slice* end) const {
+        uint64_t size = 0;
+        if (end == nullptr) {
+            // GetApproximateSizes() needs a limit, open ended ranges are rare (full compactions)
+            _db->GetIntProperty(cf, "rocksdb.total-sst-files-size", &size);
+            return size;
+        }
+        rocksdb::Range range(start ? *start : rocksdb::Slice(), *end);
+        _db->GetApproximateSizes(cf, &range, 1, &size);
+        return size;
+    }
+
+    bool CompactionBackgroundJob::compact(RunningOp* running) {
+        const CompactOp& op = running->op;
         rocksdb::Slice start_slice(op._start_str);
         rocksdb::Slice end_slice(op._end_str);
 
         rocksdb::Slice* start = !op._start_str.empty() ? &start_slice : nullptr;
         rocksdb::Slice* end = !op._end_str.empty() ? &end_slice : nullptr;
+        rocksdb::ColumnFamilyHandle* cf = op._cf ? op._cf : _db->DefaultColumnFamily();
 
         LOG(1) << "Starting compaction of range: "
               << (start ? start->ToString(true) : "<begin>") << " .. "
               << (end ? end->ToString(true) : "<end>")
+              << " in column family " << cf->GetName()
               << " (rangeDropped is " << op._rangeDropped << ")";
 
         if (op._rangeDropped) {
-            auto s = rocksdb::DeleteFilesInRange(_db, _db->DefaultColumnFamily(), start, end);
+            auto s = deleteFilesInRange(_db, cf, start, end);
             if (!s.ok()) {
                 log() << "Failed to delete files in compacted range: " << s.ToString();
             }
         }
 
+        const uint64_t estimatedBytes = _estimateSize(cf, start, end);
+        {
+            stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
+            running->estimatedBytes = estimatedBytes;
+        }
+
         rocksdb::CompactRangeOptions compact_options;
         compact_options.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForce;
         compact_options.exclusive_manual_compaction = false;
-        auto s = _db->CompactRange(compact_options, start, end);
+        auto s = _db->CompactRange(compact_options, cf, start, end);
         if (!s.ok()) {
             log() << "Failed to compact range: " << s.ToString();
 
             // Let's leave as quickly as possible if in shutdown
             stdx::lock_guard<stdx::mutex> lk(_compactionMutex);
             if (!_compactionThreadRunning) {
-                return;
+                return false;
             }
         }
 
         _compactionScheduler->notifyCompacted(op._start_str, op._end_str, op._rangeDropped, s.ok());
+        return s.ok();
     }
 
     // first four bytes are the default prefix 0
     const std::string RocksCompactionScheduler::kDroppedPrefix("\0\0\0\0droppedprefix-", 18);
 
-    RocksCompactionScheduler::RocksCompactionScheduler() : _db(nullptr), _droppedPrefixesCount(0) {}
+    // prefix 0 as well
+    const std::string RocksCompactionScheduler::kTtlPendingMarker("\0\0\0\0ttl-pending", 15);
+
+    RocksCompactionScheduler::RocksCompactionScheduler()
+        : _db(nullptr),
+          _collectorFactory(std::make_shared<PrefixDeletionsCollectorFactory>(this)),
+          _droppedPrefixes(std::make_shared<std::unordered_set<uint32_t>>()),
+          _droppedPrefixesCount(0),
+          _ttlCollections(std::make_shared<TtlCollectionMap>()),
+          _ttlPendingMarker(false),
+          _ttlReconcile(false) {}
 
     void RocksCompactionScheduler::start(rocksdb::DB* db) {
         _db = db;
-        _timer.reset();
+        // flushes may already report tombstone dense ranges while the DB is being opened
+        stdx::lock_guard<stdx::mutex> lk(_lock);
         _compactionJob.reset(new CompactionBackgroundJob(db, this));
     }
 
-    void RocksCompactionScheduler::reportSkippedDeletionsAboveThreshold(const std::string& prefix) {
-        bool schedule = false;
-        {
-            stdx::lock_guard<stdx::mutex> lk(_lock);
-            if (_timer.minutes() >= kMinCompactionIntervalMins) {
-                schedule = true;
-                _timer.reset();
-            }
+    bool RocksCompactionScheduler::_tryStartPrefixCompaction(const std::string& prefix) {
+        uint32_t int_prefix;
+        if (!extractPrefix(prefix, &int_prefix)) {
+            return false;
+        }
+        stdx::lock_guard<stdx::mutex> lk(_lock);
+        if (!_compactionJob) {
+            return false;
+        }
+        auto it = _lastPrefixCompactions.find(int_prefix);
+        if (it == _lastPrefixCompactions.end()) {
+            _lastPrefixCompactions.emplace(int_prefix, Timer());
+            return true;
+        }
+        if (it->second.minutes() < kMinCompactionIntervalMins) {
+            return false;
         }
-        if (schedule) {
+        it->second.reset();
+        return true;
+    }
+
+    void RocksCompactionScheduler::reportSkippedDeletionsAboveThreshold(
+        rocksdb::ColumnFamilyHandle* cf, const std::string& prefix) {
+        if (_tryStartPrefixCompaction(prefix)) {
             log() << "Scheduling compaction to clean up tombstones for prefix "
                   << rocksdb::Slice(prefix).ToString(true);
             // we schedule compaction now (ignoring error)
-            compactPrefix(prefix);
+            compactPrefix(cf, prefix);
+        }
+    }
+
+    void RocksCompactionScheduler::addColumnFamily(rocksdb::ColumnFamilyHandle* cf) {
+        stdx::lock_guard<stdx::mutex> lk(_lock);
+        _columnFamilies[cf->GetID()] = cf;
+    }
+
+    void RocksCompactionScheduler::removeColumnFamily(rocksdb::ColumnFamilyHandle* cf) {
+        stdx::lock_guard<stdx::mutex> lk(_lock);
+        _columnFamilies.erase(cf->GetID());
+    }
+
+    void RocksCompactionScheduler::reportTombstoneDenseRange(uint32_t columnFamilyId,
+                                                             uint32_t prefix,
+                                                             const std::string& begin,
+                                                             const std::string& end) {
+        rocksdb::ColumnFamilyHandle* cf = nullptr;
+        if (columnFamilyId != kDefaultColumnFamilyId) {
+            stdx::lock_guard<stdx::mutex> lk(_lock);
+            auto it = _columnFamilies.find(columnFamilyId);
+            if (it == _columnFamilies.end()) {
+                // an oplog column family, or one that was dropped
+                return;
+            }
+            cf = it->second;
+        }
+        _reportTombstoneDenseRange(cf, prefix, begin, end);
+    }
+
+    void RocksCompactionScheduler::_reportTombstoneDenseRange(rocksdb::ColumnFamilyHandle* cf,
+                                                              uint32_t prefix,
+                                                              const std::string& begin,
+                                                              const std::string& end) {
+        if (getDroppedPrefixes()->count(prefix)) {
+            // the whole prefix is going away anyway
+            return;
+        }
+        if (_tryStartPrefixCompaction(encodePrefix(prefix))) {
+            LOG(1) << "Scheduling compaction of tombstone dense range "
+                   << rocksdb::Slice(begin).ToString(true) << " .. "
+                   << rocksdb::Slice(end).ToString(true) << " in column family "
+                   << (cf ? cf : _db->DefaultColumnFamily())->GetName();
+            compact(cf, begin, end, false, kOrderRange);
         }
     }
 
+    void RocksCompactionScheduler::compactTombstoneDensePrefixes() {
+        std::vector<rocksdb::ColumnFamilyHandle*> columnFamilies(1, nullptr);
+        {
+            stdx::lock_guard<stdx::mutex> lk(_lock);
+            for (const auto& entry : _columnFamilies) {
+                columnFamilies.push_back(entry.second);
+            }
+        }
+        int scheduled = 0;
+        for (auto cf : columnFamilies) {
+            rocksdb::TablePropertiesCollection tables;
+            auto s = _db->GetPropertiesOfAllTables(cf ? cf : _db->DefaultColumnFamily(), &tables);
+            if (!s.ok()) {
+                log() << "Failed to read table properties: " << s.ToString();
+                continue;
+            }
+            // we only know the entries of a prefix in the files where it has deletions, which is
+            // where its tombstones slow down reads
+            std::map<uint32_t, std::pair<uint64_t, uint64_t>> prefixes;
+            for (const auto& table : tables) {
+                const auto& properties = table.second->user_collected_properties;
+                auto encoded = properties.find(kPrefixDeletionsProperty);
+                if (encoded == properties.end()) {
+                    continue;
+                }
+                for (const auto& prefixDeletions : decodePrefixDeletions(encoded->second)) {
+                    auto& counts = prefixes[prefixDeletions.prefix];
+                    counts.first += prefixDeletions.entries;
+                    counts.second += prefixDeletions.deletions;
+                }
+            }
+            for (const auto& prefix : prefixes) {
+                if (tombstonesAreDense(prefix.second.first, prefix.second.second)) {
+                    const std::string encodedPrefix = encodePrefix(prefix.first);
+                    _reportTombstoneDenseRange(cf, prefix.first, encodedPrefix,
+                                               rocksGetNextPrefix(encodedPrefix));
+                    ++scheduled;
+                }
+            }
+        }
+        log() << scheduled << " prefixes with dense tombstones need compaction";
+    }
+
+    std::shared_ptr<rocksdb::TablePropertiesCollectorFactory>
+    RocksCompactionScheduler::getTablePropertiesCollectorFactory() const {
+        return _collectorFactory;
+    }
+
     RocksCompactionScheduler::~RocksCompactionScheduler() {
+        // the DB might still finish writing a file after we're gone
+        _collectorFactory->detach();
         // We need this to avoid incomplete type deletion
         _compactionJob.reset();
     }
 
-    void RocksCompactionScheduler::compactAll() {
-        compact(std::string(), std::string(), false, kOrderFull);
+    void RocksCompactionScheduler::compactAll(rocksdb::ColumnFamilyHandle* cf) {
+        compact(cf, std::string(), std::string(), false, kOrderFull);
     }
 
-    void RocksCompactionScheduler::compactOplog(const std::string& begin, const std::string& end) {
-        compact(begin, end, false, kOrderOplog);
+    void RocksCompactionScheduler::compactOplog(rocksdb::ColumnFamilyHandle* cf,
+                                                const std::string& begin, const std::string& end) {
+        compact(cf, begin, end, false, kOrderOplog);
     }
 
-    void RocksCompactionScheduler::compactPrefix(const std::string& prefix) {
-        compact(prefix, rocksGetNextPrefix(prefix), false, kOrderRange);
+    void RocksCompactionScheduler::compactRange(rocksdb::ColumnFamilyHandle* cf,
+                                                const std::string& begin, const std::string& end) {
+        compact(cf, begin, end, false, kOrderRange);
+    }
+
+    void RocksCompactionScheduler::compactPrefix(rocksdb::ColumnFamilyHandle* cf,
+                                                 const std::string& prefix) {
+        compact(cf, prefix, rocksGetNextPrefix(prefix), false, kOrderRange);
     }
 
     void RocksCompactionScheduler::compactDroppedPrefix(const std::string& prefix) {
-        compact(prefix, rocksGetNextPrefix(prefix), true, kOrderDroppedRange);
+        // dropped prefixes only ever live in the default column family; idents with a column
+        // family of their own are dropped with DropColumnFamily()
+        compact(nullptr, prefix, rocksGetNextPrefix(prefix), true, kOrderDroppedRange);
     }
 
-    void RocksCompactionScheduler::compact(const std::string& begin, const std::string& end,
+    void RocksCompactionScheduler::compact(rocksdb::ColumnFamilyHandle* cf,
+                                           const std::string& begin, const std::string& end,
                                            bool rangeDropped, uint32_t order) {
-        _compactionJob->scheduleCompactOp(begin, end, rangeDropped, order);
+        _compactionJob->scheduleCompactOp(cf, begin, end, rangeDropped, order);
+    }
+
+    void RocksCompactionScheduler::setMaxConcurrentCompactions(int maxConcurrent) {
+        invariant(maxConcurrent >= 1 && maxConcurrent <= kMaxConcurrentCompactions);
+        _compactionJob->setMaxConcurrentCompactions(maxConcurrent);
+    }
+
+    int RocksCompactionScheduler::getMaxConcurrentCompactions() const {
+        return _compactionJob->getMaxConcurrentCompactions();
+    }
+
+    void RocksCompactionScheduler::holdCompactionsForTest(bool hold) {
+        _compactionJob->holdCompactionsForTest(hold);
+    }
+
+    void RocksCompactionScheduler::appendStats(BSONObjBuilder* builder) const {
+        _compactionJob->appendStats(builder);
     }
 
     rocksdb::CompactionFilterFactory* RocksCompactionScheduler::createCompactionFilterFactory()
@@ -340,51 +979,159 @@ namespace mongo {
         return new PrefixDeletingCompactionFilterFactory(this);
     }
 
-    std::unordered_set<uint32_t> RocksCompactionScheduler::getDroppedPrefixes() const {
+    RocksCompactionScheduler::DroppedPrefixes RocksCompactionScheduler::getDroppedPrefixes()
+        const {
         stdx::lock_guard<stdx::mutex> lk(_droppedPrefixesMutex);
-        // this will copy the set. that way compaction filter has its own copy and doesn't need to
-        // worry about thread safety
+        // the set is never modified once published, so compaction filters can share it
         return _droppedPrefixes;
     }
 
-    void RocksCompactionScheduler::loadDroppedPrefixes(rocksdb::Iterator* iter) {
+    void RocksCompactionScheduler::_updateDroppedPrefixes(
+        const std::vector<uint32_t>& added, const std::vector<uint32_t>& removed) {
+        stdx::lock_guard<stdx::mutex> lk(_droppedPrefixesMutex);
+        auto droppedPrefixes = std::make_shared<std::unordered_set<uint32_t>>(*_droppedPrefixes);
+        droppedPrefixes->insert(added.begin(), added.end());
+        for (auto prefix : removed) {
+            droppedPrefixes->erase(prefix);
+        }
+        _droppedPrefixes = std::move(droppedPrefixes);
+    }
+
+    uint32_t RocksCompactionScheduler::loadDroppedPrefixes(rocksdb::Iterator* iter) {
         invariant(iter);
+        uint32_t maxPrefix = 0;
         const uint32_t rocksdbSkippedDeletionsInitial =
             (uint32_t)get_internal_delete_skipped_count();
-        int dropped_count = 0;
+        std::vector<std::string> prefixes;
+        std::vector<uint32_t> int_prefixes;
         for (iter->Seek(kDroppedPrefix); iter->Valid() && iter->key().starts_with(kDroppedPrefix);
              iter->Next()) {
             invariantRocksOK(iter->status());
             rocksdb::Slice prefix(iter->key());
             prefix.remove_prefix(kDroppedPrefix.size());
 
-            // let's instruct the compaction scheduler to compact dropped prefix
-            ++dropped_count;
             uint32_t int_prefix;
             bool ok = extractPrefix(prefix, &int_prefix);
             invariant(ok);
-            {
-                stdx::lock_guard<stdx::mutex> lk(_droppedPrefixesMutex);
-                _droppedPrefixes.insert(int_prefix);
-            }
-            LOG(1) << "Compacting dropped prefix: " << prefix.ToString(true);
-            compactDroppedPrefix(prefix.ToString());
+            prefixes.push_back(prefix.ToString());
+            int_prefixes.push_back(int_prefix);
+            maxPrefix = std::max(maxPrefix, int_prefix);
         }
-        log() << dropped_count << " dropped prefixes need compaction";
+        _updateDroppedPrefixes(int_prefixes, {});
+
+        // let's instruct the compaction scheduler to compact dropped prefixes
+        for (const auto& prefix : prefixes) {
+            LOG(1) << "Compacting dropped prefix: " << rocksdb::Slice(prefix).ToString(true);
+            compactDroppedPrefix(prefix);
+        }
+        log() << prefixes.size() << " dropped prefixes need compaction";
 
         const uint32_t skippedDroppedPrefixMarkers =
             (uint32_t)get_internal_delete_skipped_count() - rocksdbSkippedDeletionsInitial;
         _droppedPrefixesCount.fetch_add(skippedDroppedPrefixMarkers, std::memory_order_relaxed);
+        return maxPrefix;
+    }
+
+    std::shared_ptr<RocksTtlCollection> RocksCompactionScheduler::openTtlCollection(
+        const std::string& prefix, const RocksTtlOptions& options) {
+        uint32_t int_prefix;
+        bool ok = extractPrefix(prefix, &int_prefix);
+        invariant(ok);
+        stdx::lock_guard<stdx::mutex> lk(_ttlMutex);
+        if (!_ttlPendingMarker) {
+            // a crash from now on can leave expired records behind whose _id index entries and
+            // counters nobody cleans up
+            rocksdb::WriteOptions syncOptions;
+            syncOptions.sync = true;
+            invariantRocksOK(_db->Put(syncOptions, kTtlPendingMarker, rocksdb::Slice()));
+            _ttlPendingMarker = true;
+        }
+        std::shared_ptr<RocksTtlCollection> ttlCollection;
+        auto it = _ttlCollections->find(int_prefix);
+        if (it != _ttlCollections->end()) {
+            // reopened, e.g. after a rename. Records might still wait for clean up
+            ttlCollection = it->second;
+        } else {
+            ttlCollection = std::make_shared<RocksTtlCollection>(options, _ttlReconcile);
+            auto ttlCollections = std::make_shared<TtlCollectionMap>(*_ttlCollections);
+            ttlCollections->emplace(int_prefix, ttlCollection);
+            _ttlCollections = std::move(ttlCollections);
+        }
+        ttlCollection->open();
+        return ttlCollection;
+    }
+
+    RocksCompactionScheduler::TtlCollections RocksCompactionScheduler::getTtlCollections() const {
+        stdx::lock_guard<stdx::mutex> lk(_ttlMutex);
+        return _ttlCollections;
+    }
+
+    void RocksCompactionScheduler::dropTtlCollections(const std::vector<uint32_t>& prefixes) {
+        stdx::lock_guard<stdx::mutex> lk(_ttlMutex);
+        auto ttlCollections = std::make_shared<TtlCollectionMap>(*_ttlCollections);
+        size_t erased = 0;
+        for (auto prefix : prefixes) {
+            erased += ttlCollections->erase(prefix);
+        }
+        if (erased > 0) {
+            _ttlCollections = std::move(ttlCollections);
+        }
+    }
+
+    void RocksCompactionScheduler::loadTtlPendingMarker() {
+        std::string value;
+        auto s = _db->Get(rocksdb::ReadOptions(), kTtlPendingMarker, &value);
+        if (s.IsNotFound()) {
+            return;
+        }
+        invariantRocksOK(s);
+        log() << "TTL collections need to reconcile their _id index and counters with their "
+                 "records, the last shutdown wasn't clean";
+        stdx::lock_guard<stdx::mutex> lk(_ttlMutex);
+        _ttlPendingMarker = true;
+        _ttlReconcile = true;
+    }
+
+    void RocksCompactionScheduler::ttlCleanShutdown() {
+        stdx::lock_guard<stdx::mutex> lk(_ttlMutex);
+        if (!_ttlPendingMarker) {
+            return;
+        }
+        // MongoDB opens all collections on startup, so every collection that still had to
+        // reconcile is in the map
+        for (const auto& entry : *_ttlCollections) {
+            if (!entry.second->isClean()) {
+                log() << "Expired records of TTL collections are left to clean up, they will be "
+                         "reconciled on the next startup";
+                return;
+            }
+        }
+        rocksdb::WriteOptions syncOptions;
+        syncOptions.sync = true;
+        auto s = _db->Delete(syncOptions, kTtlPendingMarker);
+        if (!s.ok()) {
+            log() << "Failed to delete the TTL marker: " << s.ToString();
+            return;
+        }
+        _ttlPendingMarker = false;
     }
 
     Status RocksCompactionScheduler::dropPrefixesAtomic(
-        const std::vector<std::string>& prefixesToDrop, const rocksdb::WriteOptions& syncOptions,
-        rocksdb::WriteBatch& wb) {
+        const std::vector<std::string>& prefixesToDrop,
+        const std::vector<std::pair<std::string, std::string>>& rangesToDrop,
+        const rocksdb::WriteOptions& syncOptions, rocksdb::WriteBatch& wb) {
         // We record the fact that we're deleting this prefix. That way we ensure that the prefix is
         // always deleted
         for (const auto& prefix : prefixesToDrop) {
             wb.Put(kDroppedPrefix + prefix, "");
         }
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        // A range tombstone hides the data at once, so nothing has to skip over it until the
+        // compaction filter gets to it. Compactions drop the keys it covers, too
+        for (const auto& range : rangesToDrop) {
+            invariantRocksOK(wb.DeleteRange(range.first, range.second));
+        }
+#endif
 
         auto s = _db->Write(syncOptions, &wb);
         if (!s.ok()) {
@@ -392,20 +1139,31 @@ namespace mongo {
         }
 
         // instruct compaction filter to start deleting
-        {
-            stdx::lock_guard<stdx::mutex> lk(_droppedPrefixesMutex);
-            for (const auto& prefix : prefixesToDrop) {
-                uint32_t int_prefix;
-                bool ok = extractPrefix(prefix, &int_prefix);
-                invariant(ok);
-                _droppedPrefixes.insert(int_prefix);
+        std::vector<uint32_t> int_prefixes;
+        for (const auto& prefix : prefixesToDrop) {
+            uint32_t int_prefix;
+            bool ok = extractPrefix(prefix, &int_prefix);
+            invariant(ok);
+            int_prefixes.push_back(int_prefix);
+        }
+        _updateDroppedPrefixes(int_prefixes, {});
+
+        // Files that only hold dropped keys can go right away, that's a change to the metadata
+        // of the DB and frees most of the space of a large collection in no time.
+        for (const auto& range : rangesToDrop) {
+            rocksdb::Slice beginSlice(range.first);
+            rocksdb::Slice endSlice(range.second);
+            auto s = deleteFilesInRange(_db, _db->DefaultColumnFamily(), &beginSlice, &endSlice);
+            if (!s.ok()) {
+                log() << "Failed to delete files of dropped range " << beginSlice.ToString(true)
+                      << " .. " << endSlice.ToString(true) << ": " << s.ToString();
             }
         }
 
-        // Suggest compaction for the prefixes that we need to drop, So that
-        // we free space as fast as possible.
-        for (auto& prefix : prefixesToDrop) {
-            compactDroppedPrefix(prefix);
+        // The files that also hold other prefixes get rewritten by compactions. Those run one at
+        // a time after all other compactions, to keep the extra IO low
+        for (const auto& range : rangesToDrop) {
+            compact(nullptr, range.first, range.second, true, kOrderDroppedRange);
         }
 
         return Status::OK();
@@ -414,36 +1172,50 @@ namespace mongo {
     void RocksCompactionScheduler::notifyCompacted(const std::string& begin, const std::string& end,
                                                    bool rangeDropped, bool opSucceeded) {
         if (rangeDropped) {
-            droppedPrefixCompacted(begin, opSucceeded);
+            droppedRangeCompacted(begin, end, opSucceeded);
         }
     }
 
-    void RocksCompactionScheduler::droppedPrefixCompacted(const std::string& prefix,
-                                                          bool opSucceeded) {
-        uint32_t int_prefix;
-        bool ok = extractPrefix(prefix, &int_prefix);
+    void RocksCompactionScheduler::droppedRangeCompacted(const std::string& begin,
+                                                         const std::string& end,
+                                                         bool opSucceeded) {
+        uint32_t beginPrefix;
+        uint32_t endPrefix;
+        bool ok = extractPrefix(begin, &beginPrefix) && extractPrefix(end, &endPrefix);
         invariant(ok);
+        // a range stands for all the dropped prefixes it covers
+        std::vector<uint32_t> compacted;
+        for (auto prefix : *getDroppedPrefixes()) {
+            if (prefix >= beginPrefix && prefix < endPrefix) {
+                compacted.push_back(prefix);
+            }
+        }
+        _updateDroppedPrefixes({}, compacted);
         {
-            stdx::lock_guard<stdx::mutex> lk(_droppedPrefixesMutex);
-            _droppedPrefixes.erase(int_prefix);
+            stdx::lock_guard<stdx::mutex> lk(_lock);
+            for (auto prefix : compacted) {
+                _lastPrefixCompactions.erase(prefix);
+            }
         }
-        if (opSucceeded) {
+        if (opSucceeded && !compacted.empty()) {
+            rocksdb::WriteBatch wb;
+            for (auto prefix : compacted) {
+                wb.Delete(kDroppedPrefix + encodePrefix(prefix));
+            }
             rocksdb::WriteOptions syncOptions;
             syncOptions.sync = true;
-            _db->Delete(syncOptions, kDroppedPrefix + prefix);
-
-            // This operation only happens from one thread, so no concurrent
-            // updates are possible.
-            // The only time this counter may be modified from a different
-            // thread is during startup loading of dropped prefixes.
-            // But that's not a big issue, we'll eventually sync and call
-            // compaction next time if needed.
-            if (_droppedPrefixesCount.fetch_add(1, std::memory_order_relaxed) >=
+            _db->Write(syncOptions, &wb);
+
+            // Several compaction workers may cross the threshold at the same time. That's not a
+            // big issue, the duplicate compactions of prefix 0 are coalesced in the queue and
+            // we'll eventually sync and call compaction next time if needed.
+            if (_droppedPrefixesCount.fetch_add(compacted.size(), std::memory_order_relaxed) +
+                    compacted.size() >
                 kSkippedDeletionsThreshold) {
                 log() << "Compacting dropped prefixes markers";
                 _droppedPrefixesCount.store(0, std::memory_order_relaxed);
                 // Let's compact the full default (system) prefix 0.
-                compactPrefix(encodePrefix(0));
+                compactPrefix(nullptr, encodePrefix(0));
             }
         }
     }
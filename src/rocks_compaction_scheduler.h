@@ -32,7 +32,9 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "mongo/base/status.h"
@@ -40,19 +42,31 @@
 #include "mongo/util/timer.h"
 
 namespace rocksdb {
+    class ColumnFamilyHandle;
     class CompactionFilterFactory;
     class DB;
     class Iterator;
+    class TablePropertiesCollectorFactory;
     class WriteOptions;
     class WriteBatch;
 }
 
 namespace mongo {
 
+    class BSONObjBuilder;
     class CompactionBackgroundJob;
+    class PrefixDeletionsCollectorFactory;
+    class RocksTtlCollection;
+    struct RocksTtlOptions;
 
     class RocksCompactionScheduler {
     public:
+        // immutable, a new set is published whenever prefixes are dropped or cleaned up
+        using DroppedPrefixes = std::shared_ptr<const std::unordered_set<uint32_t>>;
+        // TTL collections by prefix, published like the dropped prefixes
+        using TtlCollectionMap = std::unordered_map<uint32_t, std::shared_ptr<RocksTtlCollection>>;
+        using TtlCollections = std::shared_ptr<const TtlCollectionMap>;
+
         RocksCompactionScheduler();
         ~RocksCompactionScheduler();
 
@@ -60,49 +74,127 @@ namespace mongo {
 
         static int getSkippedDeletionsThreshold() { return kSkippedDeletionsThreshold; }
 
-        void reportSkippedDeletionsAboveThreshold(const std::string& prefix);
-
-        // schedule compact range operation for execution in _compactionThread
-        void compactAll();
-        void compactOplog(const std::string& begin, const std::string& end);
+        static const int kDefaultMaxConcurrentCompactions = 2;
+        static const int kMaxConcurrentCompactions = 8;
+
+        void reportSkippedDeletionsAboveThreshold(rocksdb::ColumnFamilyHandle* cf,
+                                                  const std::string& prefix);
+
+        // Column families besides the default one whose tombstone dense ranges are compacted.
+        // The oplog's aren't added, they're never compacted by range.
+        void addColumnFamily(rocksdb::ColumnFamilyHandle* cf);
+        void removeColumnFamily(rocksdb::ColumnFamilyHandle* cf);
+
+        // Called when a flushed SST file holds many tombstones for a prefix. Compacts
+        // [begin, end), the part of the prefix that the file covers, if the file belongs to the
+        // default column family or an added one. Each prefix is compacted at most once per
+        // kMinCompactionIntervalMins, whatever triggered it.
+        void reportTombstoneDenseRange(uint32_t columnFamilyId, uint32_t prefix,
+                                       const std::string& begin, const std::string& end);
+        // schedules compactions for the prefixes with dense tombstones in the existing SST files
+        void compactTombstoneDensePrefixes();
+        // records the entries and deletions of each prefix in the SST file properties and reports
+        // tombstone dense ranges to the scheduler
+        std::shared_ptr<rocksdb::TablePropertiesCollectorFactory>
+        getTablePropertiesCollectorFactory() const;
+
+        // schedule compact range operation for execution by the compaction workers. A nullptr
+        // column family stands for the default column family. Requests for the same or an
+        // overlapping range are coalesced while they wait in the queue.
+        void compactAll(rocksdb::ColumnFamilyHandle* cf = nullptr);
+        void compactOplog(rocksdb::ColumnFamilyHandle* cf, const std::string& begin,
+                          const std::string& end);
+        void compactRange(rocksdb::ColumnFamilyHandle* cf, const std::string& begin,
+                          const std::string& end);
 
         rocksdb::CompactionFilterFactory* createCompactionFilterFactory() const;
-        std::unordered_set<uint32_t> getDroppedPrefixes() const;
-        void loadDroppedPrefixes(rocksdb::Iterator* iter);
-        Status dropPrefixesAtomic(const std::vector<std::string>& prefixesToDrop,
-                                  const rocksdb::WriteOptions& syncOptions,
-                                  rocksdb::WriteBatch& wb);
+        DroppedPrefixes getDroppedPrefixes() const;
+        // schedules the compactions of the prefixes that were dropped before the last shutdown
+        // and returns the highest one, 0 if there are none
+        uint32_t loadDroppedPrefixes(rocksdb::Iterator* iter);
+        // Writes wb together with the markers of prefixesToDrop. rangesToDrop are [begin, end)
+        // ranges that cover all of prefixesToDrop and no live data. They may also cover prefixes
+        // that are no longer in use, so that a few wide ranges stand for many prefixes
+        Status dropPrefixesAtomic(
+            const std::vector<std::string>& prefixesToDrop,
+            const std::vector<std::pair<std::string, std::string>>& rangesToDrop,
+            const rocksdb::WriteOptions& syncOptions, rocksdb::WriteBatch& wb);
         void notifyCompacted(const std::string& begin, const std::string& end, bool rangeDropped,
                              bool opSucceeded);
 
+        // Compactions drop the expired records of the TTL collections, see rocks_ttl.h. Returns
+        // the collection's expiry state, which lives until the prefix is dropped, and opens it.
+        // The record store closes it again.
+        std::shared_ptr<RocksTtlCollection> openTtlCollection(const std::string& prefix,
+                                                              const RocksTtlOptions& options);
+        TtlCollections getTtlCollections() const;
+        // forgets the expiry state of dropped idents
+        void dropTtlCollections(const std::vector<uint32_t>& prefixes);
+        // Whether the last shutdown left expired records behind that weren't cleaned up
+        void loadTtlPendingMarker();
+        // Called on clean shutdown, once the record stores are closed
+        void ttlCleanShutdown();
+
+        // Regular compactions run on at most maxConcurrent workers at a time, oplog compactions
+        // get one more worker so they don't wait behind long compactions.
+        void setMaxConcurrentCompactions(int maxConcurrent);
+        int getMaxConcurrentCompactions() const;
+
+        // queue length and progress of the running compactions, for serverStatus
+        void appendStats(BSONObjBuilder* builder) const;
+
+        // While hold is set the workers pick ops from the queue as usual, but the ops don't
+        // finish until it's cleared. Lets tests look at the queue while compactions run.
+        void holdCompactionsForTest(bool hold);
+
     private:
-        void compactPrefix(const std::string& prefix);
+        // rate limits the compactions of a prefix
+        bool _tryStartPrefixCompaction(const std::string& prefix);
+        void _reportTombstoneDenseRange(rocksdb::ColumnFamilyHandle* cf, uint32_t prefix,
+                                        const std::string& begin, const std::string& end);
+        void compactPrefix(rocksdb::ColumnFamilyHandle* cf, const std::string& prefix);
         void compactDroppedPrefix(const std::string& prefix);
-        void compact(const std::string& begin, const std::string& end, bool rangeDropped,
-                     uint32_t order);
-        void droppedPrefixCompacted(const std::string& prefix, bool opSucceeded);
+        void compact(rocksdb::ColumnFamilyHandle* cf, const std::string& begin,
+                     const std::string& end, bool rangeDropped, uint32_t order);
+        void droppedRangeCompacted(const std::string& begin, const std::string& end,
+                                   bool opSucceeded);
+        void _updateDroppedPrefixes(const std::vector<uint32_t>& added,
+                                    const std::vector<uint32_t>& removed);
 
     private:
         stdx::mutex _lock;
-        // protected by _lock
-        Timer _timer;
+        // when each prefix was last compacted to clean up tombstones, protected by _lock
+        std::unordered_map<uint32_t, Timer> _lastPrefixCompactions;
+        // the added column families by id, protected by _lock
+        std::unordered_map<uint32_t, rocksdb::ColumnFamilyHandle*> _columnFamilies;
+        static const uint32_t kDefaultColumnFamilyId = 0;
 
         rocksdb::DB* _db;  // not owned
 
-        // Don't trigger compactions more often than every 10min
+        // Don't trigger compactions of a prefix more often than every 10min
         static const int kMinCompactionIntervalMins = 10;
         // We'll compact the prefix if any operation on the prefix reports more than 50.000
         // deletions it had to skip over (this is about 10ms extra overhead)
         static const int kSkippedDeletionsThreshold = 50000;
 
-        // thread for async execution of range compactions
+        // workers for async execution of range compactions, set under _lock by start()
         std::unique_ptr<CompactionBackgroundJob> _compactionJob;
 
+        std::shared_ptr<PrefixDeletionsCollectorFactory> _collectorFactory;
+
         // set of all prefixes that are deleted. we delete them in the background thread
         mutable stdx::mutex _droppedPrefixesMutex;
-        std::unordered_set<uint32_t> _droppedPrefixes;
+        DroppedPrefixes _droppedPrefixes;
         std::atomic<uint32_t> _droppedPrefixesCount;
 
+        mutable stdx::mutex _ttlMutex;  // protects the TTL state below
+        TtlCollections _ttlCollections;
+        // kTtlPendingMarker is persisted while TTL collections might have expired records that
+        // aren't cleaned up. _ttlReconcile tells if it was there on startup
+        bool _ttlPendingMarker;
+        bool _ttlReconcile;
+
         static const std::string kDroppedPrefix;
+        static const std::string kTtlPendingMarker;
     };
 }
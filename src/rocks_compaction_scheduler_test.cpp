@@ -0,0 +1,341 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include <boost/filesystem/operations.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+#include <rocksdb/slice.h>
+#include <rocksdb/write_batch.h>
+
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/unittest/temp_dir.h"
+#include "mongo/unittest/unittest.h"
+#include "mongo/util/time_support.h"
+#include "mongo/util/timer.h"
+
+#include "rocks_compaction_scheduler.h"
+#include "rocks_util.h"
+
+namespace mongo {
+namespace {
+
+    class RocksCompactionSchedulerTest : public unittest::Test {
+    public:
+        RocksCompactionSchedulerTest() : _tempDir("mongo-rocks-compaction-scheduler-test") {
+            boost::filesystem::remove_all(_tempDir.path());
+            open();
+        }
+
+        ~RocksCompactionSchedulerTest() {
+            close();
+        }
+
+    protected:
+        void open() {
+            _scheduler.reset(new RocksCompactionScheduler());
+            rocksdb::DB* db;
+            auto s = rocksdb::DB::Open(options(), _tempDir.path(), &db);
+            ASSERT(s.ok());
+            _db.reset(db);
+            _scheduler->start(_db.get());
+        }
+
+        // held compactions are dropped
+        void close() {
+            _scheduler.reset();
+            for (auto cf : _columnFamilies) {
+                delete cf;
+            }
+            _columnFamilies.clear();
+            _db.reset();
+        }
+
+        rocksdb::Options options() const {
+            rocksdb::Options options;
+            options.create_if_missing = true;
+            // only the scheduler compacts
+            options.disable_auto_compactions = true;
+            options.table_properties_collector_factories.push_back(
+                _scheduler->getTablePropertiesCollectorFactory());
+            return options;
+        }
+
+        rocksdb::ColumnFamilyHandle* createColumnFamily(const std::string& name) {
+            rocksdb::ColumnFamilyHandle* cf;
+            auto s = _db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(options()), name, &cf);
+            ASSERT(s.ok());
+            _columnFamilies.push_back(cf);
+            return cf;
+        }
+
+        static std::string key(uint32_t prefix, uint32_t id) {
+            return encodePrefix(prefix) + encodePrefix(id);
+        }
+
+        // flushes a file with deletions tombstones and liveEntries other keys for the prefix
+        void flushPrefix(rocksdb::ColumnFamilyHandle* cf, uint32_t prefix, uint32_t deletions,
+                         uint32_t liveEntries) {
+            rocksdb::WriteBatch wb;
+            for (uint32_t id = 0; id < deletions + liveEntries; ++id) {
+                if (id < deletions) {
+                    wb.Delete(cf, key(prefix, id));
+                } else {
+                    wb.Put(cf, key(prefix, id), "value");
+                }
+            }
+            ASSERT(_db->Write(rocksdb::WriteOptions(), &wb).ok());
+            ASSERT(_db->Flush(rocksdb::FlushOptions(), cf).ok());
+        }
+
+        // the scheduler reports the ranges while the file is written, so the op is already
+        // queued or running once the flush returns
+        long long numScheduled() { return getStat("queued") + numRunning(); }
+
+        BSONObj stats() {
+            BSONObjBuilder builder;
+            _scheduler->appendStats(&builder);
+            return builder.obj();
+        }
+
+        long long getStat(const char* name) { return stats()[name].numberLong(); }
+
+        long long numRunning() { return stats()["running"].Array().size(); }
+
+        // the workers pick up ops asynchronously
+        void waitForStat(const char* name, long long expected) {
+            Timer timer;
+            while (getStat(name) != expected) {
+                ASSERT_LESS_THAN(timer.seconds(), 30);
+                sleepmillis(1);
+            }
+        }
+
+        void waitForRunning(long long expected) {
+            Timer timer;
+            while (numRunning() != expected) {
+                ASSERT_LESS_THAN(timer.seconds(), 30);
+                sleepmillis(1);
+            }
+        }
+
+        unittest::TempDir _tempDir;
+        std::unique_ptr<RocksCompactionScheduler> _scheduler;
+        std::unique_ptr<rocksdb::DB> _db;
+        std::vector<rocksdb::ColumnFamilyHandle*> _columnFamilies;
+    };
+
+    TEST_F(RocksCompactionSchedulerTest, OverlappingOpsAreCoalesced) {
+        _scheduler->setMaxConcurrentCompactions(1);
+        _scheduler->holdCompactionsForTest(true);
+        // takes the only regular lane, so the ops below stay queued
+        _scheduler->compactRange(nullptr, "x", "y");
+        waitForRunning(1);
+
+        _scheduler->compactRange(nullptr, "a", "c");
+        _scheduler->compactRange(nullptr, "b", "d");
+        ASSERT_EQUALS(1, getStat("queued"));
+        ASSERT_EQUALS(1, getStat("coalesced"));
+
+        _scheduler->compactRange(nullptr, "e", "f");
+        ASSERT_EQUALS(2, getStat("queued"));
+
+        // touches both queued ops, which end up merged into one
+        _scheduler->compactRange(nullptr, "d", "e");
+        ASSERT_EQUALS(1, getStat("queued"));
+        ASSERT_EQUALS(3, getStat("coalesced"));
+
+        _scheduler->holdCompactionsForTest(false);
+        waitForStat("completed", 2);
+        ASSERT_EQUALS(0, getStat("queued"));
+    }
+
+    TEST_F(RocksCompactionSchedulerTest, UrgentOpsAreOnlyCoalescedWithUrgentOps) {
+        _scheduler->setMaxConcurrentCompactions(1);
+        _scheduler->holdCompactionsForTest(true);
+        _scheduler->compactRange(nullptr, "x", "y");
+        waitForRunning(1);
+
+        _scheduler->compactAll();
+        ASSERT_EQUALS(1, getStat("queued"));
+        ASSERT_EQUALS(0, getStat("queued-urgent"));
+
+        // overlaps the full compaction, which must not turn urgent. The oplog op runs on the
+        // extra worker instead
+        _scheduler->compactOplog(nullptr, "a", "b");
+        waitForRunning(2);
+        ASSERT_EQUALS(1, getStat("queued"));
+        ASSERT_EQUALS(0, getStat("queued-urgent"));
+        ASSERT_EQUALS(0, getStat("coalesced"));
+
+        // no lane is left, the urgent ops queue up and are merged with each other
+        _scheduler->compactOplog(nullptr, "c", "d");
+        _scheduler->compactOplog(nullptr, "c", "e");
+        ASSERT_EQUALS(2, getStat("queued"));
+        ASSERT_EQUALS(1, getStat("queued-urgent"));
+        ASSERT_EQUALS(1, getStat("coalesced"));
+
+        _scheduler->holdCompactionsForTest(false);
+        waitForStat("completed", 4);
+        ASSERT_EQUALS(0, getStat("queued"));
+    }
+
+    TEST_F(RocksCompactionSchedulerTest, RegularOpsLeaveTheUrgentLaneFree) {
+        _scheduler->setMaxConcurrentCompactions(2);
+        _scheduler->holdCompactionsForTest(true);
+        _scheduler->compactRange(nullptr, "a", "b");
+        _scheduler->compactRange(nullptr, "c", "d");
+        _scheduler->compactRange(nullptr, "e", "f");
+        waitForRunning(2);
+        ASSERT_EQUALS(1, getStat("queued"));
+
+        _scheduler->compactOplog(nullptr, "g", "h");
+        waitForRunning(3);
+        ASSERT_EQUALS(1, getStat("queued"));
+
+        // a higher limit starts another worker for the queued op
+        _scheduler->setMaxConcurrentCompactions(3);
+        waitForRunning(4);
+        ASSERT_EQUALS(0, getStat("queued"));
+
+        _scheduler->holdCompactionsForTest(false);
+        waitForStat("completed", 4);
+    }
+
+    TEST_F(RocksCompactionSchedulerTest, OverlappingOpWaitsForTheRunningOne) {
+        _scheduler->setMaxConcurrentCompactions(3);
+        _scheduler->holdCompactionsForTest(true);
+        _scheduler->compactRange(nullptr, "a", "c");
+        waitForRunning(1);
+
+        // the running op isn't coalesced with, the new one waits for it although there are free
+        // workers. An op scheduled later that doesn't overlap runs first.
+        _scheduler->compactRange(nullptr, "b", "d");
+        _scheduler->compactRange(nullptr, "x", "y");
+        waitForRunning(2);
+        ASSERT_EQUALS(1, getStat("queued"));
+        ASSERT_EQUALS(0, getStat("coalesced"));
+
+        // the waiting op keeps absorbing requests
+        _scheduler->compactRange(nullptr, "d", "e");
+        ASSERT_EQUALS(1, getStat("queued"));
+        ASSERT_EQUALS(1, getStat("coalesced"));
+
+        // urgent ops wait as well
+        _scheduler->compactOplog(nullptr, "a", "b");
+        ASSERT_EQUALS(2, getStat("queued"));
+        ASSERT_EQUALS(1, getStat("queued-urgent"));
+        ASSERT_EQUALS(2, numRunning());
+
+        _scheduler->holdCompactionsForTest(false);
+        waitForStat("completed", 4);
+        ASSERT_EQUALS(0, getStat("queued"));
+    }
+
+    TEST_F(RocksCompactionSchedulerTest, TombstoneDenseRangeIsCompactedAfterFlush) {
+        _scheduler->holdCompactionsForTest(true);
+        auto cf = _db->DefaultColumnFamily();
+
+        // below the minimum number of tombstones
+        flushPrefix(cf, 1, 9999, 0);
+        ASSERT_EQUALS(0, numScheduled());
+        // enough tombstones, but they're less than 30% of the entries
+        flushPrefix(cf, 2, 10000, 23334);
+        ASSERT_EQUALS(0, numScheduled());
+
+        flushPrefix(cf, 3, 10000, 23333);
+        waitForRunning(1);
+        ASSERT_EQUALS(0, getStat("queued"));
+        BSONObj op = stats()["running"].Array()[0].Obj();
+        ASSERT_EQUALS("range", op["type"].str());
+        ASSERT_EQUALS("default", op["column_family"].str());
+        // from the first key of the prefix in the file to the next prefix
+        ASSERT_EQUALS(rocksdb::Slice(key(3, 0)).ToString(true), op["begin"].str());
+        ASSERT_EQUALS(rocksdb::Slice(encodePrefix(4)).ToString(true), op["end"].str());
+    }
+
+    TEST_F(RocksCompactionSchedulerTest, TombstoneDenseRangesOfAddedColumnFamiliesAreCompacted) {
+        _scheduler->holdCompactionsForTest(true);
+        auto oplog = createColumnFamily("oplog-ident");
+        auto ident = createColumnFamily("ident");
+
+        flushPrefix(oplog, 1, 10000, 0);
+        flushPrefix(ident, 2, 10000, 0);
+        ASSERT_EQUALS(0, numScheduled());
+
+        _scheduler->addColumnFamily(ident);
+        flushPrefix(ident, 3, 10000, 0);
+        waitForRunning(1);
+        BSONObj op = stats()["running"].Array()[0].Obj();
+        ASSERT_EQUALS("ident", op["column_family"].str());
+        ASSERT_EQUALS(rocksdb::Slice(key(3, 0)).ToString(true), op["begin"].str());
+
+        _scheduler->removeColumnFamily(ident);
+        flushPrefix(ident, 4, 10000, 0);
+        ASSERT_EQUALS(1, numScheduled());
+    }
+
+    TEST_F(RocksCompactionSchedulerTest, TombstoneDensePrefixesAreFoundOnStartup) {
+        _scheduler->holdCompactionsForTest(true);
+        // a single file with several prefixes, only the one in the middle is tombstone dense
+        rocksdb::WriteBatch wb;
+        for (uint32_t id = 0; id < 40000; ++id) {
+            wb.Put(key(1, id), "value");
+            wb.Delete(key(2, id));
+            if (id % 4 == 0) {
+                wb.Delete(key(3, id));
+            } else {
+                wb.Put(key(3, id), "value");
+            }
+        }
+        ASSERT(_db->Write(rocksdb::WriteOptions(), &wb).ok());
+        ASSERT(_db->Flush(rocksdb::FlushOptions()).ok());
+        ASSERT_EQUALS(1, numScheduled());
+
+        // the held compaction is dropped, the counts in the file's properties are all that's left
+        close();
+        open();
+        _scheduler->holdCompactionsForTest(true);
+        ASSERT_EQUALS(0, numScheduled());
+
+        _scheduler->compactTombstoneDensePrefixes();
+        waitForRunning(1);
+        ASSERT_EQUALS(0, getStat("queued"));
+        BSONObj op = stats()["running"].Array()[0].Obj();
+        ASSERT_EQUALS(rocksdb::Slice(encodePrefix(2)).ToString(true), op["begin"].str());
+        ASSERT_EQUALS(rocksdb::Slice(encodePrefix(3)).ToString(true), op["end"].str());
+    }
+
+}  // namespace
+}  // namespace mongo
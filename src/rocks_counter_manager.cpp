@@ -68,7 +68,7 @@ namespace mongo {
         return static_cast<long long>(endian::littleToNative(ret));
     }
 
-    void RocksCounterManager::updateCounter(const std::string& counterKey, long long count,
+    void RocksCounterManager::updateCounter(const rocksdb::Slice& counterKey, long long count,
                                             rocksdb::WriteBatch* writeBatch) {
 
         if (_crashSafe) {
@@ -76,7 +76,7 @@ namespace mongo {
             writeBatch->Put(counterKey, _encodeCounter(count, &storage));
         } else {
             stdx::lock_guard<stdx::mutex> lk(_lock);
-            _counters[counterKey] = count;
+            _counters[counterKey.ToString()] = count;
             ++_syncCounter;
             if (!_syncing && _syncCounter >= kSyncEvery) {
                 // let's sync this now. piggyback on writeBatch
@@ -28,29 +28,141 @@
 
 #include "mongo/db/storage/journal_listener.h"
 
+#include <algorithm>
+
 #include <rocksdb/db.h>
 
+#include "mongo/bson/bsonobjbuilder.h"
+
 #include "rocks_durability_manager.h"
 #include "rocks_util.h"
 
 namespace mongo {
     RocksDurabilityManager::RocksDurabilityManager(rocksdb::DB* db, bool durable)
-        : _db(db), _durable(durable), _journalListener(&NoOpJournalListener::instance) {}
+        : _db(db),
+          _durable(durable),
+          _journalListener(&NoOpJournalListener::instance),
+          _syncInProgress(false),
+          _startedRounds(0),
+          _finishedRounds(0),
+          _finishedFlushRounds(0),
+          _flushWaiters(0),
+          _durableSequence(0),
+          _syncsIssued(0),
+          _syncsSkipped(0),
+          _waitersServed(0) {}
 
     void RocksDurabilityManager::setJournalListener(JournalListener* jl) {
         stdx::unique_lock<stdx::mutex> lk(_journalListenerMutex);
         _journalListener = jl;
     }
 
+    void RocksDurabilityManager::addColumnFamily(rocksdb::ColumnFamilyHandle* cf) {
+        stdx::lock_guard<stdx::mutex> lk(_columnFamiliesMutex);
+        _columnFamilies.push_back(cf);
+    }
+
+    void RocksDurabilityManager::removeColumnFamily(rocksdb::ColumnFamilyHandle* cf) {
+        stdx::lock_guard<stdx::mutex> lk(_columnFamiliesMutex);
+        _columnFamilies.erase(std::remove(_columnFamilies.begin(), _columnFamilies.end(), cf),
+                              _columnFamilies.end());
+    }
+
+    rocksdb::Status RocksDurabilityManager::_flush() {
+        std::vector<rocksdb::ColumnFamilyHandle*> handles;
+        {
+            stdx::lock_guard<stdx::mutex> lk(_columnFamiliesMutex);
+            handles = _columnFamilies;
+        }
+        handles.push_back(_db->DefaultColumnFamily());
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        // with atomic_flush (set when there's no WAL) all of them are flushed together
+        auto status = _db->Flush(rocksdb::FlushOptions(), handles);
+        if (status.ok()) {
+            return status;
+        }
+        // a column family might have been dropped meanwhile, go through them one by one
+#endif
+        for (auto cf : handles) {
+            auto status = _db->Flush(rocksdb::FlushOptions(), cf);
+            if (!status.ok()) {
+                stdx::lock_guard<stdx::mutex> lk(_columnFamiliesMutex);
+                const bool dropped = cf != _db->DefaultColumnFamily() &&
+                    std::find(_columnFamilies.begin(), _columnFamilies.end(), cf) ==
+                        _columnFamilies.end();
+                if (!dropped) {
+                    return status;
+                }
+            }
+        }
+        return rocksdb::Status::OK();
+    }
+
     void RocksDurabilityManager::waitUntilDurable(bool forceFlush) {
+        const bool needFlush = forceFlush || !_durable;
         stdx::unique_lock<stdx::mutex> lk(_journalListenerMutex);
-        JournalListener::Token token = _journalListener->getToken();
-        if (!_durable || forceFlush) {
-            invariantRocksOK(_db->Flush(rocksdb::FlushOptions()));
+        // the round in progress (if any) might have taken its token before our writes were done
+        const uint64_t neededRound = _startedRounds + 1;
+        auto isDone = [&] {
+            return (needFlush ? _finishedFlushRounds : _finishedRounds) >= neededRound;
+        };
+
+        if (needFlush) {
+            ++_flushWaiters;
+        }
+        while (!isDone() && _syncInProgress) {
+            _syncFinishedCV.wait(lk);
+        }
+        if (needFlush) {
+            --_flushWaiters;
+        }
+        if (isDone()) {
+            _waitersServed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // We're the leader. Whoever is waiting now gets served by our round. Only the leader
+        // touches _durableSequence, so we can read it without the lock
+        _syncInProgress = true;
+        const uint64_t round = ++_startedRounds;
+        const bool flush = needFlush || _flushWaiters > 0;
+        JournalListener* journalListener = _journalListener;
+        lk.unlock();
+
+        // The token has to be taken before we read the sequence number, so that everything it
+        // stands for is covered by the sync
+        JournalListener::Token token = journalListener->getToken();
+        const uint64_t sequence = _db->GetLatestSequenceNumber();
+        if (!flush && sequence <= _durableSequence) {
+            // nothing has been written since the last sync
+            _syncsSkipped.fetch_add(1, std::memory_order_relaxed);
         } else {
-            invariantRocksOK(_db->SyncWAL());
+            rocksdb::Status status;
+            if (flush) {
+                status = _flush();
+            } else {
+                status = _db->SyncWAL();
+            }
+            invariantRocksOK(status);
+            _syncsIssued.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        lk.lock();
+        _durableSequence = std::max(_durableSequence, sequence);
+        _finishedRounds = round;
+        if (flush) {
+            _finishedFlushRounds = round;
         }
-        _journalListener->onDurable(token);
+        _syncInProgress = false;
+        journalListener->onDurable(token);
+        _waitersServed.fetch_add(1, std::memory_order_relaxed);
+        _syncFinishedCV.notify_all();
+    }
+
+    void RocksDurabilityManager::appendStats(BSONObjBuilder* builder) const {
+        builder->append("syncs-issued", _syncsIssued.load(std::memory_order_relaxed));
+        builder->append("syncs-skipped", _syncsSkipped.load(std::memory_order_relaxed));
+        builder->append("waiters-served", _waitersServed.load(std::memory_order_relaxed));
     }
 
 } // namespace mongo
@@ -30,14 +30,23 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
 #include "mongo/base/disallow_copying.h"
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
 
 namespace rocksdb {
+    class ColumnFamilyHandle;
     class DB;
+    class Status;
 }
 
 namespace mongo {
 
+    class BSONObjBuilder;
     class JournalListener;
 
     class RocksDurabilityManager {
@@ -48,15 +57,54 @@ namespace mongo {
 
         void setJournalListener(JournalListener* jl);
 
+        // Column families other than the default one. Flushes cover all of them
+        void addColumnFamily(rocksdb::ColumnFamilyHandle* cf);
+        void removeColumnFamily(rocksdb::ColumnFamilyHandle* cf);
+
+        /**
+         * Returns once everything written before the call is durable. Concurrent callers are
+         * grouped: one of them syncs the WAL (or flushes, if forceFlush or !durable) on behalf of
+         * all the others that arrived before it started.
+         */
         void waitUntilDurable(bool forceFlush);
 
+        void appendStats(BSONObjBuilder* builder) const;
+
     private:
+        // Flushes the memtables of all column families. The default one goes last: it holds the
+        // counters and the metadata, which must not get ahead of the data they describe
+        rocksdb::Status _flush();
+
         rocksdb::DB* _db;  // not owned
         bool _durable;
+
+        stdx::mutex _columnFamiliesMutex;
+        std::vector<rocksdb::ColumnFamilyHandle*> _columnFamilies;  // not owned
+
+        // Protects everything below except the stats. The leader of a sync round doesn't hold it
+        // while it takes the token and syncs
+        stdx::mutex _journalListenerMutex;
+        stdx::condition_variable _syncFinishedCV;
         // Notified when we commit to the journal.
         JournalListener* _journalListener;
-        // Protects _journalListener.
-        stdx::mutex _journalListenerMutex;
+
+        // A sync round is the leader taking a journal listener token, reading the latest sequence
+        // number and syncing up to it. Rounds are numbered and run one at a time. A waiter is done
+        // once a round that started after it arrived finishes, so that the round's token covers
+        // the waiter's writes.
+        bool _syncInProgress;
+        uint64_t _startedRounds;
+        uint64_t _finishedRounds;
+        // like _finishedRounds, but only counting the rounds that flushed the memtables
+        uint64_t _finishedFlushRounds;
+        // waiters that need the next round to flush
+        int _flushWaiters;
+        // everything up to this sequence number is durable
+        uint64_t _durableSequence;
+
+        std::atomic<long long> _syncsIssued;
+        std::atomic<long long> _syncsSkipped;
+        std::atomic<long long> _waitersServed;
     };
 
 } // namespace mongo
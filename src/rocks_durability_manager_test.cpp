@@ -0,0 +1,252 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include <boost/filesystem/operations.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rocksdb/db.h>
+#include <rocksdb/metadata.h>
+#include <rocksdb/options.h>
+
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/db/storage/journal_listener.h"
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/stdx/thread.h"
+#include "mongo/unittest/temp_dir.h"
+#include "mongo/unittest/unittest.h"
+#include "mongo/util/time_support.h"
+
+#include "rocks_durability_manager.h"
+
+namespace mongo {
+namespace {
+
+    class RocksDurabilityManagerTest : public unittest::Test {
+    public:
+        RocksDurabilityManagerTest() : _tempDir("mongo-rocks-durability-manager-test") {
+            boost::filesystem::remove_all(_tempDir.path());
+            rocksdb::DB* db;
+            rocksdb::Options options;
+            options.create_if_missing = true;
+            auto s = rocksdb::DB::Open(options, _tempDir.path(), &db);
+            ASSERT(s.ok());
+            _db.reset(db);
+            _durabilityManager.reset(new RocksDurabilityManager(_db.get(), true));
+        }
+
+        ~RocksDurabilityManagerTest() {
+            _durabilityManager.reset();
+            for (auto cf : _columnFamilies) {
+                delete cf;
+            }
+        }
+
+    protected:
+        void put(const std::string& key) {
+            ASSERT(_db->Put(rocksdb::WriteOptions(), key, "value").ok());
+        }
+
+        long long getStat(const char* name) {
+            BSONObjBuilder builder;
+            _durabilityManager->appendStats(&builder);
+            return builder.obj()[name].numberLong();
+        }
+
+        // number of sync rounds, whether they synced or found nothing to do
+        long long numRounds() {
+            return getStat("syncs-issued") + getStat("syncs-skipped");
+        }
+
+        unittest::TempDir _tempDir;
+        std::unique_ptr<rocksdb::DB> _db;
+        std::vector<rocksdb::ColumnFamilyHandle*> _columnFamilies;
+        std::unique_ptr<RocksDurabilityManager> _durabilityManager;
+    };
+
+    // Hands out tokens, blocking the first caller until released, so that a round can be held
+    // open while other waiters queue up behind it
+    class BlockingJournalListener : public JournalListener {
+    public:
+        virtual Token getToken() {
+            stdx::unique_lock<stdx::mutex> lk(_mutex);
+            if (_tokens++ == 0) {
+                _cv.notify_all();
+                _cv.wait(lk, [&] { return _released; });
+            }
+            return Token();
+        }
+
+        virtual void onDurable(const Token& token) {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            ++_durable;
+        }
+
+        void waitForFirstToken() {
+            stdx::unique_lock<stdx::mutex> lk(_mutex);
+            _cv.wait(lk, [&] { return _tokens > 0; });
+        }
+
+        void release() {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            _released = true;
+            _cv.notify_all();
+        }
+
+        int numTokens() {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            return _tokens;
+        }
+
+        int numDurable() {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            return _durable;
+        }
+
+    private:
+        stdx::mutex _mutex;
+        stdx::condition_variable _cv;
+        int _tokens = 0;
+        int _durable = 0;
+        bool _released = false;
+    };
+
+    TEST_F(RocksDurabilityManagerTest, SkipsSyncWithoutNewWrites) {
+        put("a");
+        _durabilityManager->waitUntilDurable(false);
+        ASSERT_EQUALS(1, getStat("syncs-issued"));
+        ASSERT_EQUALS(0, getStat("syncs-skipped"));
+
+        // everything up to _durableSequence is on disk already
+        _durabilityManager->waitUntilDurable(false);
+        ASSERT_EQUALS(1, getStat("syncs-issued"));
+        ASSERT_EQUALS(1, getStat("syncs-skipped"));
+
+        put("b");
+        _durabilityManager->waitUntilDurable(false);
+        ASSERT_EQUALS(2, getStat("syncs-issued"));
+        ASSERT_EQUALS(1, getStat("syncs-skipped"));
+        ASSERT_EQUALS(3, getStat("waiters-served"));
+    }
+
+    TEST_F(RocksDurabilityManagerTest, FlushIsNeverSkipped) {
+        put("a");
+        _durabilityManager->waitUntilDurable(true);
+        _durabilityManager->waitUntilDurable(true);
+        ASSERT_EQUALS(2, getStat("syncs-issued"));
+        ASSERT_EQUALS(0, getStat("syncs-skipped"));
+    }
+
+    TEST_F(RocksDurabilityManagerTest, FlushCoversAddedColumnFamilies) {
+        rocksdb::ColumnFamilyHandle* cf;
+        ASSERT(_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(), "other", &cf).ok());
+        _columnFamilies.push_back(cf);
+        _durabilityManager->addColumnFamily(cf);
+        ASSERT(_db->Put(rocksdb::WriteOptions(), cf, "a", "value").ok());
+
+        _durabilityManager->waitUntilDurable(true);
+        std::vector<rocksdb::LiveFileMetaData> files;
+        _db->GetLiveFilesMetaData(&files);
+        bool flushed = false;
+        for (const auto& file : files) {
+            flushed = flushed || file.column_family_name == "other";
+        }
+        ASSERT(flushed);
+
+        // a removed column family is left alone, even when it's gone from the DB
+        _durabilityManager->removeColumnFamily(cf);
+        ASSERT(_db->DropColumnFamily(cf).ok());
+        _durabilityManager->waitUntilDurable(true);
+    }
+
+    TEST_F(RocksDurabilityManagerTest, WaitersArrivingDuringARoundShareTheNextOne) {
+        BlockingJournalListener listener;
+        _durabilityManager->setJournalListener(&listener);
+        put("a");
+
+        // the leader of the first round blocks while taking its token
+        stdx::thread leader([&] { _durabilityManager->waitUntilDurable(false); });
+        listener.waitForFirstToken();
+
+        // these can't be served by the first round, it might have started before their writes
+        const int kNumWaiters = 8;
+        std::vector<stdx::thread> waiters;
+        for (int i = 0; i < kNumWaiters; ++i) {
+            put("b" + std::to_string(i));
+            waiters.emplace_back([&] { _durabilityManager->waitUntilDurable(false); });
+        }
+        // give the waiters time to queue up behind the first round
+        sleepmillis(200);
+        listener.release();
+
+        leader.join();
+        for (auto& waiter : waiters) {
+            waiter.join();
+        }
+
+        // one round for the leader, and a single one for all the waiters
+        ASSERT_EQUALS(2, numRounds());
+        ASSERT_EQUALS(2, listener.numTokens());
+        ASSERT_EQUALS(2, listener.numDurable());
+        ASSERT_EQUALS(kNumWaiters + 1, getStat("waiters-served"));
+        _durabilityManager->setJournalListener(&NoOpJournalListener::instance);
+    }
+
+    TEST_F(RocksDurabilityManagerTest, FlushWaiterIsServedByAFlushRound) {
+        BlockingJournalListener listener;
+        _durabilityManager->setJournalListener(&listener);
+        put("a");
+
+        stdx::thread leader([&] { _durabilityManager->waitUntilDurable(false); });
+        listener.waitForFirstToken();
+
+        // a flush waiter queued behind a sync round makes the next round flush, so a sync
+        // waiter in the same queue is served by it too
+        stdx::thread flushWaiter([&] { _durabilityManager->waitUntilDurable(true); });
+        stdx::thread syncWaiter([&] { _durabilityManager->waitUntilDurable(false); });
+        sleepmillis(200);
+        listener.release();
+
+        leader.join();
+        flushWaiter.join();
+        syncWaiter.join();
+
+        ASSERT_EQUALS(2, numRounds());
+        ASSERT_EQUALS(2, getStat("syncs-issued"));
+        std::vector<rocksdb::LiveFileMetaData> files;
+        _db->GetLiveFilesMetaData(&files);
+        ASSERT_FALSE(files.empty());
+        _durabilityManager->setJournalListener(&NoOpJournalListener::instance);
+    }
+
+} // namespace
+} // namespace mongo
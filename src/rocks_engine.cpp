@@ -34,7 +34,10 @@
 #include "rocks_engine.h"
 
 #include <algorithm>
+#include <limits>
 #include <mutex>
+#include <set>
+#include <vector>
 
 #include <rocksdb/version.h>
 #include <rocksdb/cache.h>
@@ -166,10 +169,15 @@ namespace mongo {
 
     // first four bytes are the default prefix 0
     const std::string RocksEngine::kMetadataPrefix("\0\0\0\0metadata-", 12);
+    const std::string RocksEngine::kOplogColumnFamilyPrefix("oplog-");
 
     RocksEngine::RocksEngine(const std::string& path, bool durable, int formatVersion,
                              bool readOnly)
-        : _path(path), _durable(durable), _formatVersion(formatVersion), _maxPrefix(0) {
+        : _path(path),
+          _durable(durable),
+          _formatVersion(formatVersion),
+          _maxPrefix(0),
+          _recoveryUnitResourcePool(new RocksRecoveryUnitResourcePool(&_transactionEngine)) {
         {  // create block cache
             uint64_t cacheSizeGB = rocksGlobalOptions.cacheSizeGB;
             if (cacheSizeGB == 0) {
@@ -196,20 +204,45 @@ namespace mongo {
         // used in building options for the db
         _compactionScheduler.reset(new RocksCompactionScheduler());
 
-        // open DB
+        // open DB with all of its column families. ListColumnFamilies() fails if the DB doesn't
+        // exist yet, in which case we only have the default one
+        rocksdb::Options options(_options());
+        std::vector<std::string> columnFamilyNames;
+        rocksdb::Status s = rocksdb::DB::ListColumnFamilies(options, path, &columnFamilyNames);
+        if (!s.ok() || columnFamilyNames.empty()) {
+            columnFamilyNames.assign(1, rocksdb::kDefaultColumnFamilyName);
+        }
+        std::vector<rocksdb::ColumnFamilyDescriptor> columnFamilies;
+        for (const auto& name : columnFamilyNames) {
+            columnFamilies.emplace_back(name, _columnFamilyOptions(options, name));
+        }
+
         rocksdb::DB* db;
-        rocksdb::Status s;
+        std::vector<rocksdb::ColumnFamilyHandle*> handles;
         if (readOnly) {
-            s = rocksdb::DB::OpenForReadOnly(_options(), path, &db);
+            s = rocksdb::DB::OpenForReadOnly(options, path, columnFamilies, &handles, &db);
         } else {
-            s = rocksdb::DB::Open(_options(), path, &db);
+            s = rocksdb::DB::Open(options, path, columnFamilies, &handles, &db);
         }
         invariantRocksOK(s);
         _db.reset(db);
 
+        for (auto handle : handles) {
+            if (handle->GetName() == rocksdb::kDefaultColumnFamilyName) {
+                // we always use _db->DefaultColumnFamily() for the default one
+                delete handle;
+            } else {
+                _columnFamilies[handle->GetName()] = handle;
+            }
+        }
+
         _counterManager.reset(
             new RocksCounterManager(_db.get(), rocksGlobalOptions.crashSafeCounters));
 
+        if (!readOnly) {
+            RocksIndexBase::cleanupBulkLoadFiles(_db.get());
+        }
+
         // open iterator
         std::unique_ptr<rocksdb::Iterator> iter(_db->NewIterator(rocksdb::ReadOptions()));
 
@@ -247,17 +280,60 @@ namespace mongo {
 
                 _maxPrefix = std::max(_maxPrefix, identPrefix);
             }
+
+            // drop column families that no ident refers to. This happens when we crash between
+            // creating a column family and persisting its ident's metadata, or between removing
+            // the metadata and dropping the column family in dropIdent()
+            if (!readOnly) {
+                std::set<std::string> referenced;
+                for (const auto& entry : _identMap) {
+                    BSONElement element = entry.second.getField("column_family");
+                    if (!element.eoo()) {
+                        referenced.insert(element.str());
+                    }
+                }
+                for (auto it = _columnFamilies.begin(); it != _columnFamilies.end();) {
+                    if (referenced.count(it->first)) {
+                        ++it;
+                        continue;
+                    }
+                    log() << "Dropping orphaned column family " << it->first;
+                    invariantRocksOK(_db->DropColumnFamily(it->second));
+                    _droppedColumnFamilies.push_back(it->second);
+                    it = _columnFamilies.erase(it);
+                }
+            }
         }
 
+        // start compaction thread and load dropped prefixes. The keys of a dropped prefix are
+        // hidden by a range tombstone and its files may be gone, so the scan above doesn't see
+        // it. Its marker stays until its data is compacted away, and we must not hand it out
+        // again before that
+        _compactionScheduler->start(_db.get());
+        _maxPrefix = std::max(_maxPrefix, _compactionScheduler->loadDroppedPrefixes(iter.get()));
+
         // just to be extra sure. we need this if last collection is oplog -- in that case we
-        // reserve prefix+1 for oplog key tracker
+        // reserve prefix+1, older versions kept the oplog key tracker there
         ++_maxPrefix;
 
-        // start compaction thread and load dropped prefixes
-        _compactionScheduler->start(_db.get());
-        _compactionScheduler->loadDroppedPrefixes(iter.get());
+        {
+            stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+            for (const auto& entry : _columnFamilies) {
+                if (!_isOplogColumnFamily(entry.first)) {
+                    _compactionScheduler->addColumnFamily(entry.second);
+                }
+            }
+        }
+        _compactionScheduler->compactTombstoneDensePrefixes();
+        _compactionScheduler->loadTtlPendingMarker();
 
         _durabilityManager.reset(new RocksDurabilityManager(_db.get(), _durable));
+        {
+            stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+            for (const auto& entry : _columnFamilies) {
+                _durabilityManager->addColumnFamily(entry.second);
+            }
+        }
 
         if (_durable) {
             _journalFlusher = stdx::make_unique<RocksJournalFlusher>(_durabilityManager.get());
@@ -291,16 +367,41 @@ namespace mongo {
     RecoveryUnit* RocksEngine::newRecoveryUnit() {
         return new RocksRecoveryUnit(&_transactionEngine, &_snapshotManager, _db.get(),
                                      _counterManager.get(), _compactionScheduler.get(),
-                                     _durabilityManager.get(), _durable);
+                                     _durabilityManager.get(), _durable,
+                                     _recoveryUnitResourcePool.get());
     }
 
     Status RocksEngine::createRecordStore(OperationContext* opCtx, StringData ns, StringData ident,
                                           const CollectionOptions& options) {
         BSONObjBuilder configBuilder;
-        auto s = _createIdent(ident, &configBuilder);
-        if (s.isOK() && NamespaceString::oplog(ns)) {
+        const bool isOplog = NamespaceString::oplog(ns);
+        auto ttlOptions = RocksTtlOptions::parse(options.storageEngine.getObjectField("rocksdb"));
+        if (ttlOptions.isOK() && ttlOptions.getValue().enabled()) {
+            if (_isReplicatedCollection(ns)) {
+                return Status(ErrorCodes::InvalidOptions,
+                              str::stream() << "can't create TTL collection " << ns
+                                            << ", expiry isn't replicated. Only collections of "
+                                               "the local database or of a standalone node can "
+                                               "have the rocksdb ttl option");
+            }
+            if (!options.collation.isEmpty()) {
+                // the _id index entries of dropped records are cleaned up by their _id
+                return Status(ErrorCodes::InvalidOptions,
+                              str::stream() << "can't create TTL collection " << ns
+                                            << ", it needs the simple collation");
+            }
+            if (options.capped || isOplog) {
+                warning() << "Ignoring the ttl option of capped collection " << ns;
+            } else {
+                // getRecordStore() goes by what we save here, not by the collection's options
+                configBuilder.append("ttl", ttlOptions.getValue().toBSON());
+            }
+        }
+        auto s = _createIdent(ident, &configBuilder, isOplog);
+        if (s.isOK() && isOplog) {
             _oplogIdent = ident.toString();
-            // oplog needs two prefixes, so we also reserve the next one
+            // older versions kept the oplog key tracker under the next prefix. We still reserve
+            // it, the record store deletes whatever it finds there
             uint64_t oplogTrackerPrefix = 0;
             {
                 stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
@@ -323,27 +424,68 @@ namespace mongo {
 
         auto config = _getIdentConfig(ident);
         std::string prefix = _extractPrefix(config);
+        rocksdb::ColumnFamilyHandle* cf = _getColumnFamily(config);
 
         std::unique_ptr<RocksRecordStore> recordStore =
             options.capped
                 ? stdx::make_unique<RocksRecordStore>(
-                      ns, ident, _db.get(), _counterManager.get(), _durabilityManager.get(),
+                      ns, ident, _db.get(), cf, _counterManager.get(), _durabilityManager.get(),
                       _compactionScheduler.get(), prefix,
                       true, options.cappedSize ? options.cappedSize : 4096,  // default size
                       options.cappedMaxDocs ? options.cappedMaxDocs : -1)
-                : stdx::make_unique<RocksRecordStore>(ns, ident, _db.get(), _counterManager.get(),
-                                                      _durabilityManager.get(), _compactionScheduler.get(),
-                                                      prefix);
+                : stdx::make_unique<RocksRecordStore>(ns, ident, _db.get(), cf,
+                                                      _counterManager.get(),
+                                                      _durabilityManager.get(),
+                                                      _compactionScheduler.get(), prefix);
+
+        const RocksTtlOptions ttlOptions = _getTtlOptions(ns, config);
+        if (ttlOptions.enabled()) {
+            recordStore->setTtlCollection(
+                _compactionScheduler->openTtlCollection(prefix, ttlOptions));
+        }
 
         {
             stdx::lock_guard<stdx::mutex> lk(_identObjectMapMutex);
             _identCollectionMap[ident] = recordStore.get();
+            // even while expiry is off, so that it can be turned on again safely
+            if (config.hasField("ttl")) {
+                _ttlNamespaces.insert(ns.toString());
+            } else {
+                _ttlNamespaces.erase(ns.toString());
+            }
         }
         return std::move(recordStore);
     }
 
+    RocksTtlOptions RocksEngine::_getTtlOptions(StringData ns, const BSONObj& config) const {
+        if (!config.hasField("ttl") || storageGlobalParams.readOnly) {
+            return RocksTtlOptions();
+        }
+        auto ttlOptions = RocksTtlOptions::parse(BSON("ttl" << config.getObjectField("ttl")));
+        invariant(ttlOptions.isOK());
+        if (_isReplicatedCollection(ns)) {
+            // created on a standalone node that now runs with replication
+            warning() << "Ignoring the ttl option of " << ns << ", the collection is replicated";
+            return RocksTtlOptions();
+        }
+        return ttlOptions.getValue();
+    }
+
+    bool RocksEngine::_isReplicatedCollection(StringData ns) {
+        return !NamespaceString(ns).isLocal() && isReplicationEnabled();
+    }
+
     Status RocksEngine::createSortedDataInterface(OperationContext* opCtx, StringData ident,
                                                   const IndexDescriptor* desc) {
+        if (!desc->isIdIndex()) {
+            stdx::lock_guard<stdx::mutex> lk(_identObjectMapMutex);
+            if (_ttlNamespaces.count(desc->parentNS())) {
+                // the reaper only cleans up the _id index after compactions drop records
+                return Status(ErrorCodes::CannotCreateIndex,
+                              str::stream() << "TTL collection " << desc->parentNS()
+                                            << " can't have indexes other than _id");
+            }
+        }
         BSONObjBuilder configBuilder;
         // let index add its own config things
         RocksIndexBase::generateConfig(&configBuilder, _formatVersion, desc->version());
@@ -356,14 +498,15 @@ namespace mongo {
 
         auto config = _getIdentConfig(ident);
         std::string prefix = _extractPrefix(config);
+        rocksdb::ColumnFamilyHandle* cf = _getColumnFamily(config);
 
         RocksIndexBase* index;
         if (desc->unique()) {
-            index = new RocksUniqueIndex(_db.get(), prefix, ident.toString(),
+            index = new RocksUniqueIndex(_db.get(), cf, prefix, ident.toString(),
                                          Ordering::make(desc->keyPattern()), std::move(config),
                                          desc->parentNS(), desc->indexName(), desc->isPartial());
         } else {
-            auto si = new RocksStandardIndex(_db.get(), prefix, ident.toString(),
+            auto si = new RocksStandardIndex(_db.get(), cf, prefix, ident.toString(),
                                              Ordering::make(desc->keyPattern()), std::move(config));
             if (rocksGlobalOptions.singleDeleteIndex) {
                 si->enableSingleDelete();
@@ -379,37 +522,142 @@ namespace mongo {
 
     // cannot be rolled back
     Status RocksEngine::dropIdent(OperationContext* opCtx, StringData ident) {
-        auto config = _tryGetIdentConfig(ident);
-        // happens rarely when dropped prefix markers are persisted but metadata changes
-        // are lost due to system crash on standalone with default acknowledgement behavior
-        if (config.isEmpty()) {
-            log() << "Cannot find ident " << ident << " to drop, ignoring";
-            return Status::OK();
-        }
+        return dropIdents(opCtx, {ident.toString()});
+    }
 
+    // cannot be rolled back
+    Status RocksEngine::dropIdents(OperationContext* opCtx,
+                                   const std::vector<std::string>& idents) {
         rocksdb::WriteBatch wb;
-        wb.Delete(kMetadataPrefix + ident.toString());
-
-        // calculate which prefixes we need to drop
-        std::vector<std::string> prefixesToDrop;
-        prefixesToDrop.push_back(_extractPrefix(config));
-        if (_oplogIdent == ident.toString()) {
-            // if we're dropping oplog, we also need to drop keys from RocksOplogKeyTracker (they
-            // are stored at prefix+1)
-            prefixesToDrop.push_back(rocksGetNextPrefix(prefixesToDrop[0]));
+        std::vector<std::string> droppedIdents;
+        std::vector<uint32_t> droppedIdentPrefixes;
+        std::vector<uint32_t> prefixesToDrop;
+        std::vector<std::string> columnFamiliesToDrop;
+        for (const auto& ident : idents) {
+            auto config = _tryGetIdentConfig(ident);
+            // happens rarely when dropped prefix markers are persisted but metadata changes
+            // are lost due to system crash on standalone with default acknowledgement behavior
+            if (config.isEmpty()) {
+                log() << "Cannot find ident " << ident << " to drop, ignoring";
+                continue;
+            }
+            wb.Delete(kMetadataPrefix + ident);
+            droppedIdents.push_back(ident);
+            droppedIdentPrefixes.push_back(config.getField("prefix").numberInt());
+
+            BSONElement columnFamily = config.getField("column_family");
+            if (!columnFamily.eoo()) {
+                // the ident has a column family of its own, so we can drop all of its data at
+                // once. If we crash before dropping the column family, the engine drops it on
+                // startup
+                columnFamiliesToDrop.push_back(columnFamily.str());
+                continue;
+            }
+            const uint32_t prefix = config.getField("prefix").numberInt();
+            prefixesToDrop.push_back(prefix);
+            if (_oplogIdent == ident) {
+                // if we're dropping oplog, we also need to drop prefix+1. older versions stored
+                // the oplog key tracker there and it might not have been cleaned up yet
+                prefixesToDrop.push_back(prefix + 1);
+            }
+        }
+        if (droppedIdents.empty()) {
+            return Status::OK();
         }
 
         // we need to make sure this is on disk before starting to delete data in compactions
         rocksdb::WriteOptions syncOptions;
         syncOptions.sync = true;
-        auto s = _compactionScheduler->dropPrefixesAtomic(prefixesToDrop, syncOptions, wb);
 
-        if (s.isOK()) {
+        Status s = Status::OK();
+        if (prefixesToDrop.empty()) {
+            s = rocksToMongoStatus(_db->Write(syncOptions, &wb));
+        } else {
+            std::vector<std::string> encodedPrefixes;
+            encodedPrefixes.reserve(prefixesToDrop.size());
+            for (auto prefix : prefixesToDrop) {
+                encodedPrefixes.push_back(encodePrefix(prefix));
+            }
+            s = _compactionScheduler->dropPrefixesAtomic(
+                encodedPrefixes, _getDroppedRanges(std::move(prefixesToDrop)), syncOptions, wb);
+        }
+        if (!s.isOK()) {
+            return s;
+        }
+        _compactionScheduler->dropTtlCollections(droppedIdentPrefixes);
+
+        std::vector<rocksdb::ColumnFamilyHandle*> handles;
+        {
             // remove from map
             stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
-            _identMap.erase(ident);
+            for (const auto& ident : droppedIdents) {
+                _identMap.erase(ident);
+            }
+            for (const auto& columnFamily : columnFamiliesToDrop) {
+                auto cfIter = _columnFamilies.find(columnFamily);
+                invariant(cfIter != _columnFamilies.end());
+                handles.push_back(cfIter->second);
+                _durabilityManager->removeColumnFamily(cfIter->second);
+                _compactionScheduler->removeColumnFamily(cfIter->second);
+                _columnFamilies.erase(cfIter);
+                _droppedColumnFamilies.push_back(handles.back());
+            }
         }
-        return s;
+        if (handles.empty()) {
+            return Status::OK();
+        }
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        return rocksToMongoStatus(_db->DropColumnFamilies(handles));
+#else
+        for (auto handle : handles) {
+            auto status = _db->DropColumnFamily(handle);
+            if (!status.ok()) {
+                return rocksToMongoStatus(status);
+            }
+        }
+        return Status::OK();
+#endif
+    }
+
+    std::vector<std::pair<std::string, std::string>> RocksEngine::_getDroppedRanges(
+        std::vector<uint32_t> prefixes) {
+        std::sort(prefixes.begin(), prefixes.end());
+        prefixes.erase(std::unique(prefixes.begin(), prefixes.end()), prefixes.end());
+
+        // Prefixes are never reused, so one that no ident uses anymore was either dropped before
+        // or never got any data. Ranges can span those, so that idents created one after the
+        // other are dropped with a single range.
+        std::vector<uint32_t> livePrefixes;
+        {
+            stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+            livePrefixes.reserve(_identMap.size() + 1);
+            for (const auto& entry : _identMap) {
+                const uint32_t prefix = entry.second.getField("prefix").numberInt();
+                livePrefixes.push_back(prefix);
+                if (entry.first == _oplogIdent) {
+                    // the oplog key tracker of older versions
+                    livePrefixes.push_back(prefix + 1);
+                }
+            }
+        }
+        std::sort(livePrefixes.begin(), livePrefixes.end());
+
+        std::vector<std::pair<std::string, std::string>> ranges;
+        uint32_t first = prefixes.front();
+        uint32_t last = first;
+        for (auto it = prefixes.begin() + 1; it != prefixes.end(); ++it) {
+            // the idents being dropped are still in the map, but none of them is between two
+            // consecutive prefixes
+            auto live = std::upper_bound(livePrefixes.begin(), livePrefixes.end(), last);
+            if (live == livePrefixes.end() || *live >= *it) {
+                last = *it;
+                continue;
+            }
+            ranges.emplace_back(encodePrefix(first), rocksGetNextPrefix(encodePrefix(last)));
+            first = last = *it;
+        }
+        ranges.emplace_back(encodePrefix(first), rocksGetNextPrefix(encodePrefix(last)));
+        return ranges;
     }
 
     bool RocksEngine::hasIdent(OperationContext* opCtx, StringData ident) const {
@@ -434,7 +682,19 @@ namespace mongo {
         _snapshotManager.dropAllSnapshots();
         _counterManager->sync();
         _counterManager.reset();
+        _compactionScheduler->ttlCleanShutdown();
         _compactionScheduler.reset();
+        {
+            stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+            for (auto& entry : _columnFamilies) {
+                delete entry.second;
+            }
+            _columnFamilies.clear();
+            for (auto handle : _droppedColumnFamilies) {
+                delete handle;
+            }
+            _droppedColumnFamilies.clear();
+        }
         _db.reset();
     }
 
@@ -472,6 +732,14 @@ namespace mongo {
 
     void RocksEngine::endBackup(OperationContext* opCtx) { _db->ContinueBackgroundWork(); }
 
+    void RocksEngine::compactAll() {
+        _compactionScheduler->compactAll();
+        stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+        for (const auto& entry : _columnFamilies) {
+            _compactionScheduler->compactAll(entry.second);
+        }
+    }
+
     void RocksEngine::setMaxWriteMBPerSec(int maxWriteMBPerSec) {
         _maxWriteMBPerSec = maxWriteMBPerSec;
         _rateLimiter->SetBytesPerSecond(static_cast<int64_t>(_maxWriteMBPerSec) * 1024 * 1024);
@@ -493,9 +761,20 @@ namespace mongo {
     }
 
     // non public api
-    Status RocksEngine::_createIdent(StringData ident, BSONObjBuilder* configBuilder) {
+    Status RocksEngine::_createIdent(StringData ident, BSONObjBuilder* configBuilder,
+                                     bool isOplog) {
         BSONObj config;
         uint32_t prefix = 0;
+        // keys keep their prefix even inside their own column family, so that the transaction
+        // engine and the counters don't need to know about column families. If asked to, the
+        // oplog gets a column family of its own, so that it can be compacted FIFO style
+        std::string columnFamilyName;
+        if (_formatVersion >= 4 && isOplog && rocksGlobalOptions.oplogFifoCompaction) {
+            columnFamilyName = kOplogColumnFamilyPrefix + ident.toString();
+        } else if (_formatVersion >= 4 && rocksGlobalOptions.columnFamilyPerIdent) {
+            columnFamilyName = ident.toString();
+        }
+        const bool ownColumnFamily = !columnFamilyName.empty();
         {
             stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
             if (_identMap.find(ident) != _identMap.end()) {
@@ -505,12 +784,31 @@ namespace mongo {
 
             prefix = ++_maxPrefix;
             configBuilder->append("prefix", static_cast<int32_t>(prefix));
+            if (ownColumnFamily) {
+                configBuilder->append("column_family", columnFamilyName);
+            }
 
             config = configBuilder->obj();
             _identMap[ident] = config.copy();
         }
 
-        BSONObjBuilder builder;
+        if (ownColumnFamily) {
+            // create the column family before persisting the metadata. If we crash in between,
+            // the orphaned column family is dropped on startup
+            rocksdb::ColumnFamilyHandle* handle;
+            auto s = _db->CreateColumnFamily(_columnFamilyOptions(_options(), columnFamilyName),
+                                             columnFamilyName, &handle);
+            stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+            if (!s.ok()) {
+                _identMap.erase(ident);
+                return rocksToMongoStatus(s);
+            }
+            _columnFamilies[columnFamilyName] = handle;
+            _durabilityManager->addColumnFamily(handle);
+            if (!isOplog) {
+                _compactionScheduler->addColumnFamily(handle);
+            }
+        }
 
         auto s = _db->Put(rocksdb::WriteOptions(), kMetadataPrefix + ident.toString(),
                           rocksdb::Slice(config.objdata(), config.objsize()));
@@ -542,6 +840,17 @@ namespace mongo {
         return encodePrefix(config.getField("prefix").numberInt());
     }
 
+    rocksdb::ColumnFamilyHandle* RocksEngine::_getColumnFamily(const BSONObj& config) {
+        BSONElement element = config.getField("column_family");
+        if (element.eoo()) {
+            return _db->DefaultColumnFamily();
+        }
+        stdx::lock_guard<stdx::mutex> lk(_identMapMutex);
+        auto cfIter = _columnFamilies.find(element.str());
+        invariant(cfIter != _columnFamilies.end());
+        return cfIter->second;
+    }
+
     rocksdb::Options RocksEngine::_options() const {
         // default options
         rocksdb::Options options;
@@ -567,8 +876,21 @@ namespace mongo {
         // keep all RocksDB files opened.
         options.max_open_files = -1;
         options.optimize_filters_for_hits = true;
+        // With a column family per ident, a column family that's rarely written would keep its
+        // WAL files around until its memtable fills up, and memtables would grow with the number
+        // of idents. Flush the column families that pin the oldest WAL once the WAL grows beyond
+        // 1GB, and flush the largest memtable once all of them together take more than 1GB
+        options.max_total_wal_size = 1024 * 1024 * 1024;
+        options.db_write_buffer_size = 1024 * 1024 * 1024;
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        // Without a WAL, the flushes of the column families must not get ahead of one another:
+        // the counters in the default one would describe data that's lost in a crash
+        options.atomic_flush = !_durable;
+#endif
         options.compaction_filter_factory.reset(
             _compactionScheduler->createCompactionFilterFactory());
+        options.table_properties_collector_factories.push_back(
+            _compactionScheduler->getTablePropertiesCollectorFactory());
         options.enable_thread_tracking = true;
         // Enable concurrent memtable
         options.allow_concurrent_memtable_write = true;
@@ -612,4 +934,35 @@ namespace mongo {
 
         return options;
     }
+
+    bool RocksEngine::_isOplogColumnFamily(const std::string& name) {
+        return name.compare(0, kOplogColumnFamilyPrefix.size(), kOplogColumnFamilyPrefix) == 0;
+    }
+
+    rocksdb::ColumnFamilyOptions RocksEngine::_columnFamilyOptions(const rocksdb::Options& options,
+                                                                   const std::string& name) {
+        rocksdb::ColumnFamilyOptions cfOptions(options);
+        if (!_isOplogColumnFamily(name)) {
+            return cfOptions;
+        }
+
+        // The oplog is written in RecordId order and reclaimed oldest first, so there's no point
+        // in compacting it: every rewrite copies data that is about to be deleted. With FIFO
+        // compaction, files are dropped as a whole once the column family outgrows
+        // max_table_files_size. The oplog record store sizes that to its capped size when it's
+        // opened, until then nothing gets dropped
+        cfOptions.compaction_style = rocksdb::kCompactionStyleFIFO;
+        cfOptions.compaction_options_fifo.max_table_files_size =
+            std::numeric_limits<uint64_t>::max();
+#if defined(ROCKSDB_MAJOR) && (ROCKSDB_MAJOR > 5 || (ROCKSDB_MAJOR == 5 && ROCKSDB_MINOR >= 7))
+        // merge small flushed files so that oplog scans don't need to look at too many of them
+        cfOptions.compaction_options_fifo.allow_compaction = true;
+#endif
+        // all files stay in level 0, use the compression we'd use for the bottommost level
+        if (!cfOptions.compression_per_level.empty()) {
+            cfOptions.compression = cfOptions.compression_per_level.back();
+            cfOptions.compression_per_level.clear();
+        }
+        return cfOptions;
+    }
 }
@@ -31,8 +31,10 @@
 
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <boost/optional.hpp>
 
@@ -49,6 +51,7 @@
 #include "rocks_compaction_scheduler.h"
 #include "rocks_counter_manager.h"
 #include "rocks_transaction.h"
+#include "rocks_ttl.h"
 #include "rocks_snapshot_manager.h"
 #include "rocks_durability_manager.h"
 
@@ -68,6 +71,7 @@ namespace mongo {
     struct CollectionOptions;
     class RocksIndexBase;
     class RocksRecordStore;
+    class RocksRecoveryUnitResourcePool;
     class JournalListener;
 
     class RocksEngine final : public KVEngine {
@@ -98,6 +102,11 @@ namespace mongo {
 
         virtual Status dropIdent(OperationContext* opCtx, StringData ident) override;
 
+        // Drops many idents at once, like the collections and indexes of a database. The
+        // metadata of all of them is removed with a single synced write, and the prefixes are
+        // merged into as few ranges as possible for deleting files and compacting.
+        Status dropIdents(OperationContext* opCtx, const std::vector<std::string>& idents);
+
         virtual bool hasIdent(OperationContext* opCtx, StringData ident) const override;
 
         virtual std::vector<std::string> getAllIdents( OperationContext* opCtx ) const override;
@@ -143,6 +152,19 @@ namespace mongo {
          */
         static bool initRsOplogBackgroundThread(StringData ns);
 
+        /**
+         * Initializes a background job that cleans up after the records of a TTL collection that
+         * compactions dropped, see rocks_ttl.h. Returns true if a background job is running for
+         * the namespace.
+         */
+        static bool initTtlReaperThread(StringData ns);
+
+        /**
+         * Whether the node runs with replication. The records of TTL collections can only expire
+         * if the collection isn't replicated, see rocks_ttl.h.
+         */
+        static bool isReplicationEnabled();
+
         virtual void setJournalListener(JournalListener* jl);
 
         // rocks specific api
@@ -156,6 +178,11 @@ namespace mongo {
 
         RocksCompactionScheduler* getCompactionScheduler() const { return _compactionScheduler.get(); }
 
+        RocksDurabilityManager* getDurabilityManager() const { return _durabilityManager.get(); }
+
+        // schedules compaction of the default column family and of every ident's column family
+        void compactAll();
+
         int getMaxWriteMBPerSec() const { return _maxWriteMBPerSec; }
         void setMaxWriteMBPerSec(int maxWriteMBPerSec);
 
@@ -166,12 +193,26 @@ namespace mongo {
         }
 
     private:
-        Status _createIdent(StringData ident, BSONObjBuilder* configBuilder);
+        Status _createIdent(StringData ident, BSONObjBuilder* configBuilder,
+                            bool isOplog = false);
         BSONObj _getIdentConfig(StringData ident);
         BSONObj _tryGetIdentConfig(StringData ident);
         std::string _extractPrefix(const BSONObj& config);
+        // the ranges of the default column family that hold the given prefixes and no live data
+        std::vector<std::pair<std::string, std::string>> _getDroppedRanges(
+            std::vector<uint32_t> prefixes);
+        rocksdb::ColumnFamilyHandle* _getColumnFamily(const BSONObj& config);
+        // the collection's TTL options if its records expire, see rocks_ttl.h. They're saved in
+        // the ident's config when the collection is created
+        RocksTtlOptions _getTtlOptions(StringData ns, const BSONObj& config) const;
+        // collections whose writes are replicated can't be TTL collections
+        static bool _isReplicatedCollection(StringData ns);
 
         rocksdb::Options _options() const;
+        static bool _isOplogColumnFamily(const std::string& name);
+        // options of the column family with the given name, derived from the DB options
+        static rocksdb::ColumnFamilyOptions _columnFamilyOptions(const rocksdb::Options& options,
+                                                                 const std::string& name);
 
         std::string _path;
         std::unique_ptr<rocksdb::DB> _db;
@@ -193,6 +234,13 @@ namespace mongo {
         // protected by _identMapMutex
         uint32_t _maxPrefix;
 
+        // column families of idents that live outside of the default column family, keyed by
+        // column family name. protected by _identMapMutex
+        std::map<std::string, rocksdb::ColumnFamilyHandle*> _columnFamilies;
+        // handles of dropped column families. Cursors and queued compactions might still refer to
+        // them, so we only delete them on shutdown. protected by _identMapMutex
+        std::vector<rocksdb::ColumnFamilyHandle*> _droppedColumnFamilies;
+
         // _identObjectMapMutex protects both _identIndexMap and _identCollectionMap. It should
         // never be locked together with _identMapMutex
         mutable stdx::mutex _identObjectMapMutex;
@@ -200,9 +248,15 @@ namespace mongo {
         StringMap<RocksIndexBase*> _identIndexMap;
         // mapping from ident --> collection object
         StringMap<RocksRecordStore*> _identCollectionMap;
+        // namespaces of the open collections created with the ttl option, whether or not their
+        // records expire right now. They can't have indexes other than _id.
+        // protected by _identObjectMapMutex
+        std::set<std::string> _ttlNamespaces;
 
         // This is for concurrency control
         RocksTransactionEngine _transactionEngine;
+        // recycles what recovery units allocate
+        std::unique_ptr<RocksRecoveryUnitResourcePool> _recoveryUnitResourcePool;
 
         RocksSnapshotManager _snapshotManager;
 
@@ -212,6 +266,8 @@ namespace mongo {
         std::unique_ptr<RocksCompactionScheduler> _compactionScheduler;
 
         static const std::string kMetadataPrefix;
+        // column families of oplogs are named kOplogColumnFamilyPrefix + ident
+        static const std::string kOplogColumnFamilyPrefix;
 
         std::unique_ptr<RocksDurabilityManager> _durabilityManager;
         class RocksJournalFlusher;
@@ -31,18 +31,35 @@
 #include "mongo/stdx/memory.h"
 
 #include <boost/filesystem/operations.hpp>
+#include <algorithm>
+#include <fstream>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <rocksdb/comparator.h>
 #include <rocksdb/db.h>
+#include <rocksdb/metadata.h>
 #include <rocksdb/options.h>
 #include <rocksdb/slice.h>
 
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/db/catalog/collection_options.h"
+#include "mongo/db/operation_context_noop.h"
 #include "mongo/db/storage/kv/kv_engine.h"
 #include "mongo/db/storage/kv/kv_engine_test_harness.h"
+#include "mongo/db/storage/record_store.h"
 #include "mongo/unittest/temp_dir.h"
+#include "mongo/unittest/unittest.h"
+#include "mongo/util/time_support.h"
+#include "mongo/util/timer.h"
 
+#include "rocks_compaction_scheduler.h"
 #include "rocks_engine.h"
+#include "rocks_global_options.h"
+#include "rocks_recovery_unit.h"
+#include "rocks_util.h"
 
 namespace mongo {
 namespace {
@@ -77,5 +94,298 @@ namespace {
         KVHarnessHelper::registerFactory(makeHelper);
         return Status::OK();
     }
+
+    // A durable engine with the newest format version, optionally with a column family per ident
+    class RocksEngineTestHelper {
+    public:
+        explicit RocksEngineTestHelper(bool columnFamilyPerIdent)
+            : _dbpath("mongo-rocks-engine-test-helper"),
+              _savedColumnFamilyPerIdent(rocksGlobalOptions.columnFamilyPerIdent) {
+            boost::filesystem::remove_all(_dbpath.path());
+            rocksGlobalOptions.columnFamilyPerIdent = columnFamilyPerIdent;
+            restart();
+        }
+
+        ~RocksEngineTestHelper() {
+            _engine.reset();
+            rocksGlobalOptions.columnFamilyPerIdent = _savedColumnFamilyPerIdent;
+        }
+
+        RocksEngine* engine() { return _engine.get(); }
+
+        RocksEngine* restart() {
+            _engine.reset();
+            _engine.reset(new RocksEngine(_dbpath.path(), true, 4, false));
+            return _engine.get();
+        }
+
+        std::unique_ptr<OperationContext> newOperationContext() {
+            return stdx::make_unique<OperationContextNoop>(_engine->newRecoveryUnit());
+        }
+
+        std::unique_ptr<RecordStore> createRecordStore(const std::string& ns,
+                                                       const std::string& ident) {
+            auto opCtx = newOperationContext();
+            ASSERT_OK(_engine->createRecordStore(opCtx.get(), ns, ident, CollectionOptions()));
+            return getRecordStore(ns, ident);
+        }
+
+        std::unique_ptr<RecordStore> getRecordStore(const std::string& ns,
+                                                    const std::string& ident) {
+            auto opCtx = newOperationContext();
+            return _engine->getRecordStore(opCtx.get(), ns, ident, CollectionOptions());
+        }
+
+        RecordId insertRecord(RecordStore* rs, const std::string& data) {
+            auto opCtx = newOperationContext();
+            WriteUnitOfWork uow(opCtx.get());
+            auto res = rs->insertRecord(opCtx.get(), data.c_str(), data.size() + 1, Timestamp(),
+                                        false);
+            ASSERT_OK(res.getStatus());
+            uow.commit();
+            return res.getValue();
+        }
+
+        std::string readRecord(RecordStore* rs, const RecordId& loc) {
+            auto opCtx = newOperationContext();
+            RecordData data;
+            if (!rs->findRecord(opCtx.get(), loc, &data)) {
+                return "";
+            }
+            return data.data();
+        }
+
+        // the prefix in the ident's metadata
+        uint32_t identPrefix(const std::string& ident) {
+            std::string config;
+            auto s = _engine->getDB()->Get(rocksdb::ReadOptions(),
+                                           std::string("\0\0\0\0metadata-", 12) + ident, &config);
+            ASSERT(s.ok());
+            return static_cast<uint32_t>(BSONObj(config.data())["prefix"].numberInt());
+        }
+
+        bool hasColumnFamily(const std::string& name) {
+            std::vector<std::string> names;
+            auto s = rocksdb::DB::ListColumnFamilies(rocksdb::DBOptions(), _dbpath.path(), &names);
+            ASSERT(s.ok());
+            return std::find(names.begin(), names.end(), name) != names.end();
+        }
+
+        bool hasLiveFileInColumnFamily(const std::string& name) {
+            std::vector<rocksdb::LiveFileMetaData> files;
+            _engine->getDB()->GetLiveFilesMetaData(&files);
+            for (const auto& file : files) {
+                if (file.column_family_name == name) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        unittest::TempDir _dbpath;
+        const bool _savedColumnFamilyPerIdent;
+        std::unique_ptr<RocksEngine> _engine;
+    };
+
+    TEST(RocksEngineTest, ColumnFamilyPerIdentSurvivesRestart) {
+        RocksEngineTestHelper helper(true);
+        RecordId loc;
+        {
+            auto rs = helper.createRecordStore("a.b", "collection-1");
+            loc = helper.insertRecord(rs.get(), "abc");
+        }
+        ASSERT(helper.hasColumnFamily("collection-1"));
+
+        helper.restart();
+        auto rs = helper.getRecordStore("a.b", "collection-1");
+        ASSERT_EQUALS("abc", helper.readRecord(rs.get(), loc));
+    }
+
+    TEST(RocksEngineTest, ColumnFamilyPerIdentDrop) {
+        RocksEngineTestHelper helper(true);
+        {
+            auto rs = helper.createRecordStore("a.b", "collection-1");
+            helper.insertRecord(rs.get(), "abc");
+        }
+        {
+            auto opCtx = helper.newOperationContext();
+            ASSERT_OK(helper.engine()->dropIdent(opCtx.get(), "collection-1"));
+        }
+        ASSERT_FALSE(helper.hasColumnFamily("collection-1"));
+
+        helper.restart();
+        ASSERT_FALSE(helper.hasColumnFamily("collection-1"));
+        auto opCtx = helper.newOperationContext();
+        auto idents = helper.engine()->getAllIdents(opCtx.get());
+        ASSERT(std::find(idents.begin(), idents.end(), "collection-1") == idents.end());
+    }
+
+    TEST(RocksEngineTest, OrphanedColumnFamilyIsDroppedOnStartup) {
+        RocksEngineTestHelper helper(true);
+        rocksdb::ColumnFamilyHandle* handle;
+        auto s = helper.engine()->getDB()->CreateColumnFamily(rocksdb::ColumnFamilyOptions(),
+                                                               "orphan", &handle);
+        ASSERT(s.ok());
+        delete handle;
+        ASSERT(helper.hasColumnFamily("orphan"));
+
+        helper.restart();
+        ASSERT_FALSE(helper.hasColumnFamily("orphan"));
+    }
+
+    TEST(RocksEngineTest, FlushCoversEveryColumnFamily) {
+        RocksEngineTestHelper helper(true);
+        auto rs = helper.createRecordStore("a.b", "collection-1");
+        helper.insertRecord(rs.get(), "abc");
+        ASSERT_FALSE(helper.hasLiveFileInColumnFamily("collection-1"));
+
+        auto opCtx = helper.newOperationContext();
+        helper.engine()->flushAllFiles(opCtx.get(), true);
+        ASSERT(helper.hasLiveFileInColumnFamily("collection-1"));
+    }
+
+    TEST(RocksEngineTest, StrayBulkLoadFilesAreRemovedOnStartup) {
+        RocksEngineTestHelper helper(false);
+        const std::string dir = helper.engine()->getDB()->GetName() + "/bulkload";
+        boost::filesystem::create_directories(dir);
+        std::ofstream(dir + "/0000002a-0.sst") << "left behind by a crash";
+
+        helper.restart();
+        ASSERT_FALSE(boost::filesystem::exists(dir + "/0000002a-0.sst"));
+    }
+
+    TEST(RocksEngineTest, DeleteRangeIsAppliedAtCommit) {
+        if (!RocksRecoveryUnit::supportsDeleteRange()) {
+            return;
+        }
+        RocksEngineTestHelper helper(false);
+        rocksdb::DB* db = helper.engine()->getDB();
+        rocksdb::ColumnFamilyHandle* cf = db->DefaultColumnFamily();
+        for (auto key : {"range-a", "range-b", "range-c"}) {
+            ASSERT(db->Put(rocksdb::WriteOptions(), key, "committed").ok());
+        }
+
+        auto getValue = [&](RocksRecoveryUnit* ru, const char* key) {
+            std::string value;
+            auto s = ru->Get(cf, key, &value);
+            return s.IsNotFound() ? std::string() : value;
+        };
+
+        // an aborted unit of work drops its range deletions along with its other writes
+        {
+            auto opCtx = helper.newOperationContext();
+            auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx.get());
+            WriteUnitOfWork uow(opCtx.get());
+            ru->deleteRange(cf, "range-a", "range-c");
+            ru->writeBatch()->Put(cf, "range-d", "aborted");
+        }
+        {
+            auto opCtx = helper.newOperationContext();
+            auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx.get());
+            ASSERT_EQUALS("committed", getValue(ru, "range-a"));
+            ASSERT_EQUALS("", getValue(ru, "range-d"));
+        }
+
+        {
+            auto opCtx = helper.newOperationContext();
+            auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx.get());
+            WriteUnitOfWork uow(opCtx.get());
+            // applied in call order: our earlier write in the range is deleted, the later one
+            // survives, and until commit reads still see the deleted keys
+            ru->writeBatch()->Put(cf, "range-a", "ours, deleted");
+            ru->deleteRange(cf, "range-a", "range-c");
+            ru->writeBatch()->Put(cf, "range-b", "ours");
+            ASSERT_EQUALS("ours, deleted", getValue(ru, "range-a"));
+            ASSERT_EQUALS("ours", getValue(ru, "range-b"));
+            uow.commit();
+        }
+        {
+            auto opCtx = helper.newOperationContext();
+            auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx.get());
+            ASSERT_EQUALS("", getValue(ru, "range-a"));
+            ASSERT_EQUALS("ours", getValue(ru, "range-b"));
+            ASSERT_EQUALS("committed", getValue(ru, "range-c"));
+        }
+    }
+
+    TEST(RocksEngineTest, DroppedPrefixIsNotReusedAfterRestart) {
+        RocksEngineTestHelper helper(false);
+        {
+            auto rs = helper.createRecordStore("a.b", "collection-1");
+            helper.insertRecord(rs.get(), "abc");
+        }
+        const uint32_t droppedPrefix = helper.identPrefix("collection-1");
+        // the marker of the dropped prefix stays until its compaction is done
+        helper.engine()->getCompactionScheduler()->holdCompactionsForTest(true);
+        {
+            auto opCtx = helper.newOperationContext();
+            ASSERT_OK(helper.engine()->dropIdent(opCtx.get(), "collection-1"));
+        }
+
+        // the dropped keys are hidden by a range tombstone, so the highest prefix in use is only
+        // known from the marker
+        helper.restart();
+        auto rs = helper.createRecordStore("a.c", "collection-2");
+        ASSERT_GREATER_THAN(helper.identPrefix("collection-2"), droppedPrefix);
+        RecordId loc = helper.insertRecord(rs.get(), "def");
+        ASSERT_EQUALS("def", helper.readRecord(rs.get(), loc));
+    }
+
+    TEST(RocksEngineTest, DropIdentsMergesPrefixesIntoRanges) {
+        RocksEngineTestHelper helper(false);
+        std::vector<RecordId> locs;
+        for (int i = 1; i <= 5; ++i) {
+            const std::string ident = "collection-" + std::to_string(i);
+            auto rs = helper.createRecordStore("a.b" + std::to_string(i), ident);
+            locs.push_back(helper.insertRecord(rs.get(), ident));
+        }
+        // the range of the first two idents
+        const std::string begin = encodePrefix(helper.identPrefix("collection-1"));
+        const std::string end =
+            rocksGetNextPrefix(encodePrefix(helper.identPrefix("collection-2")));
+
+        RocksCompactionScheduler* scheduler = helper.engine()->getCompactionScheduler();
+        auto getStats = [&] {
+            BSONObjBuilder builder;
+            scheduler->appendStats(&builder);
+            return builder.obj();
+        };
+        // only one dropped range is compacted at a time, the held one is running and the others
+        // are queued
+        scheduler->holdCompactionsForTest(true);
+        {
+            auto opCtx = helper.newOperationContext();
+            ASSERT_OK(helper.engine()->dropIdents(
+                opCtx.get(), {"collection-1", "collection-2", "collection-4", "collection-5"}));
+        }
+        // collection-3 is still alive, so the prefixes make two ranges
+        Timer timer;
+        while (getStats()["running"].Array().empty()) {
+            ASSERT_LESS_THAN(timer.seconds(), 30);
+            sleepmillis(1);
+        }
+        BSONObj stats = getStats();
+        ASSERT_EQUALS(1, stats["queued"].numberLong());
+        BSONObj op = stats["running"].Array()[0].Obj();
+        ASSERT_EQUALS("dropped-range", op["type"].str());
+        ASSERT_EQUALS(rocksdb::Slice(begin).ToString(true), op["begin"].str());
+        ASSERT_EQUALS(rocksdb::Slice(end).ToString(true), op["end"].str());
+
+        auto opCtx = helper.newOperationContext();
+        auto idents = helper.engine()->getAllIdents(opCtx.get());
+        ASSERT_EQUALS(1U, idents.size());
+        ASSERT_EQUALS("collection-3", idents[0]);
+
+        // the compactions of the dropped ranges leave the live ident alone
+        scheduler->holdCompactionsForTest(false);
+        while (getStats()["completed"].numberLong() < 2) {
+            ASSERT_LESS_THAN(timer.seconds(), 30);
+            sleepmillis(1);
+        }
+        auto rs = helper.getRecordStore("a.b3", "collection-3");
+        ASSERT_EQUALS("collection-3", helper.readRecord(rs.get(), locs[2]));
+        ASSERT_EQUALS(1, rs->numRecords(opCtx.get()));
+    }
 }
 }
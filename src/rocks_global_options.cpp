@@ -87,6 +87,30 @@ namespace mongo {
                                "This is still experimental. "
                                "Use this only if you know what you're doing")
             .setDefault(moe::Value(false));
+        rocksOptions
+            .addOptionChaining("storage.rocksdb.columnFamilyPerIdent",
+                               "rocksdbColumnFamilyPerIdent", moe::Bool,
+                               "If true, newly created collections and indexes get a RocksDB "
+                               "column family of their own instead of sharing the default one. "
+                               "Dropping such a collection or index frees its space right away. "
+                               "Only applies to databases created with format version 4 or newer")
+            .setDefault(moe::Value(false));
+        rocksOptions
+            .addOptionChaining("storage.rocksdb.oplogTailCacheSizeMB",
+                               "rocksdbOplogTailCacheSizeMB", moe::Int,
+                               "How much of the newest oplog entries to keep in memory for "
+                               "tailing oplog readers, in MB. 0 disables the cache. "
+                               "Defaults to 64MB")
+            .validRange(0, 10240)
+            .setDefault(moe::Value(64));
+        rocksOptions
+            .addOptionChaining("storage.rocksdb.oplogFifoCompaction",
+                               "rocksdbOplogFifoCompaction", moe::Bool,
+                               "This is still experimental. If true, a newly created oplog gets a "
+                               "RocksDB column family of its own that drops whole files of "
+                               "reclaimed entries instead of compacting them. "
+                               "Only applies to databases created with format version 4 or newer")
+            .setDefault(moe::Value(false));
 
         return options->addSection(rocksOptions);
     }
@@ -120,6 +144,18 @@ namespace mongo {
             rocksGlobalOptions.singleDeleteIndex =
               params["storage.rocksdb.singleDeleteIndex"].as<bool>();
         }
+        if (params.count("storage.rocksdb.columnFamilyPerIdent")) {
+            rocksGlobalOptions.columnFamilyPerIdent =
+              params["storage.rocksdb.columnFamilyPerIdent"].as<bool>();
+        }
+        if (params.count("storage.rocksdb.oplogTailCacheSizeMB")) {
+            rocksGlobalOptions.oplogTailCacheSizeMB =
+              params["storage.rocksdb.oplogTailCacheSizeMB"].as<int>();
+        }
+        if (params.count("storage.rocksdb.oplogFifoCompaction")) {
+            rocksGlobalOptions.oplogFifoCompaction =
+              params["storage.rocksdb.oplogFifoCompaction"].as<bool>();
+        }
 
         return Status::OK();
     }
@@ -132,5 +168,8 @@ namespace mongo {
         log() << "[RocksDB] Crash safe counters: " << rocksGlobalOptions.crashSafeCounters;
         log() << "[RocksDB] Counters: " << rocksGlobalOptions.counters;
         log() << "[RocksDB] Use SingleDelete in index: " << rocksGlobalOptions.singleDeleteIndex;
+        log() << "[RocksDB] Column family per ident: " << rocksGlobalOptions.columnFamilyPerIdent;
+        log() << "[RocksDB] Oplog tail cache size MB: " << rocksGlobalOptions.oplogTailCacheSizeMB;
+        log() << "[RocksDB] Oplog FIFO compaction: " << rocksGlobalOptions.oplogFifoCompaction;
     }
 }  // namespace mongo
@@ -42,7 +42,10 @@ namespace mongo {
               maxWriteMBPerSec(1024),
               compression("snappy"),
               crashSafeCounters(false),
-              singleDeleteIndex(false) {}
+              singleDeleteIndex(false),
+              columnFamilyPerIdent(false),
+              oplogTailCacheSizeMB(64),
+              oplogFifoCompaction(false) {}
 
         Status add(moe::OptionSection* options);
         Status store(const moe::Environment& params, const std::vector<std::string>& args);
@@ -57,6 +60,9 @@ namespace mongo {
         bool crashSafeCounters;
         bool counters;
         bool singleDeleteIndex;
+        bool columnFamilyPerIdent;
+        int oplogTailCacheSizeMB;
+        bool oplogFifoCompaction;
     };
 
     extern RocksGlobalOptions rocksGlobalOptions;
@@ -32,6 +32,7 @@
 
 #include "rocks_index.h"
 
+#include <atomic>
 #include <cstdlib>
 #include <memory>
 #include <sstream>
@@ -39,8 +40,12 @@
 #include <vector>
 
 #include <rocksdb/db.h>
+#include <rocksdb/env.h>
 #include <rocksdb/iterator.h>
+#include <rocksdb/sst_file_writer.h>
 #include <rocksdb/utilities/write_batch_with_index.h>
+#include <rocksdb/version.h>
+#include <rocksdb/write_batch.h>
 
 #include "mongo/base/checked_cast.h"
 #include "mongo/bson/bsonobjbuilder.h"
@@ -107,9 +112,11 @@ namespace mongo {
          */
         class RocksCursorBase : public SortedDataInterface::Cursor {
         public:
-            RocksCursorBase(OperationContext* opCtx, rocksdb::DB* db, std::string prefix,
-                            bool forward, Ordering order, KeyString::Version keyStringVersion)
+            RocksCursorBase(OperationContext* opCtx, rocksdb::DB* db,
+                            rocksdb::ColumnFamilyHandle* cf, std::string prefix, bool forward,
+                            Ordering order, KeyString::Version keyStringVersion)
                 : _db(db),
+                  _cf(cf),
                   _prefix(prefix),
                   _forward(forward),
                   _order(order),
@@ -193,7 +200,11 @@ namespace mongo {
                 auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx);
                 if (!_iterator.get() ||
                     _currentSequenceNumber != ru->snapshot()->GetSequenceNumber()) {
-                    _iterator.reset(ru->NewIterator(_prefix));
+                    // after a yield, moving the iterator to the new snapshot is cheaper than
+                    // building a new one
+                    if (!_iterator.get() || !ru->reuseIterator(_iterator.get())) {
+                        _iterator.reset(ru->NewIterator(_cf, _prefix));
+                    }
                     _currentSequenceNumber = ru->snapshot()->GetSequenceNumber();
 
                     if (!_savedEOF) {
@@ -235,7 +246,7 @@ namespace mongo {
                 }
                 if (_iterator.get() == nullptr) {
                     _iterator.reset(RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)
-                            ->NewIterator(_prefix));
+                            ->NewIterator(_cf, _prefix));
                     _iterator->SeekPrefix(rocksdb::Slice(_key.getBuffer(), _key.getSize()));
                     // advanceCursor() should only ever be called in states where the above seek
                     // will succeed in finding the exact key
@@ -310,7 +321,7 @@ namespace mongo {
             RocksIterator * iterator() {
                 if (_iterator.get() == nullptr) {
                     _iterator.reset(RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)
-                            ->NewIterator(_prefix));
+                            ->NewIterator(_cf, _prefix));
                 }
                 return _iterator.get();
             }
@@ -335,6 +346,7 @@ namespace mongo {
             }
 
             rocksdb::DB* _db;                                       // not owned
+            rocksdb::ColumnFamilyHandle* _cf;                       // not owned
             std::string _prefix;
             std::unique_ptr<RocksIterator> _iterator;
             const bool _forward;
@@ -358,15 +370,16 @@ namespace mongo {
             bool _eof = false;
             OperationContext* _opCtx;
 
-            // stores the value associated with the latest call to seekExact()
-            std::string _value;
+            // stores (or pins) the value associated with the latest call to seekExact()
+            rocksdb::PinnableSlice _value;
         };
 
         class RocksStandardCursor final : public RocksCursorBase {
         public:
-            RocksStandardCursor(OperationContext* opCtx, rocksdb::DB* db, std::string prefix,
-                                bool forward, Ordering order, KeyString::Version keyStringVersion)
-                : RocksCursorBase(opCtx, db, prefix, forward, order, keyStringVersion) {
+            RocksStandardCursor(OperationContext* opCtx, rocksdb::DB* db,
+                                rocksdb::ColumnFamilyHandle* cf, std::string prefix, bool forward,
+                                Ordering order, KeyString::Version keyStringVersion)
+                : RocksCursorBase(opCtx, db, cf, prefix, forward, order, keyStringVersion) {
                 iterator();
             }
 
@@ -379,10 +392,11 @@ namespace mongo {
 
         class RocksUniqueCursor final : public RocksCursorBase {
         public:
-            RocksUniqueCursor(OperationContext* opCtx, rocksdb::DB* db, std::string prefix,
-                              bool forward, Ordering order, KeyString::Version keyStringVersion,
+            RocksUniqueCursor(OperationContext* opCtx, rocksdb::DB* db,
+                              rocksdb::ColumnFamilyHandle* cf, std::string prefix, bool forward,
+                              Ordering order, KeyString::Version keyStringVersion,
                               std::string indexName)
-                : RocksCursorBase(opCtx, db, prefix, forward, order, keyStringVersion),
+                : RocksCursorBase(opCtx, db, cf, prefix, forward, order, keyStringVersion),
                   _indexName(std::move(indexName)) {}
 
             boost::optional<IndexKeyEntry> seekExact(const BSONObj& key,
@@ -393,8 +407,9 @@ namespace mongo {
                 std::string prefixedKey(_prefix);
                 _query.resetToKey(stripFieldNames(key), _order);
                 prefixedKey.append(_query.getBuffer(), _query.getSize());
+                _value.Reset();
                 rocksdb::Status status = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)
-                    ->Get(prefixedKey, &_value);
+                    ->Get(_cf, prefixedKey, &_value);
 
                 if (status.IsNotFound()) {
                     _eof = true;
@@ -425,6 +440,158 @@ namespace mongo {
             std::string _indexName;
         };
 
+        const char* const kBulkLoadDir = "/bulkload";
+
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        /**
+         * Removes what a bulk load ingested if the unit of work that makes the index build
+         * permanent aborts. Bulk builds hold the collection lock in MODE_X, so the index has no
+         * other keys and we can remove all of them. The range is compacted by the compaction
+         * workers, the rollback doesn't wait for it.
+         */
+        class IngestChange : public RecoveryUnit::Change {
+        public:
+            IngestChange(rocksdb::DB* db, RocksCompactionScheduler* compactionScheduler,
+                         rocksdb::ColumnFamilyHandle* cf, std::string prefix)
+                : _db(db),
+                  _compactionScheduler(compactionScheduler),
+                  _cf(cf),
+                  _prefix(std::move(prefix)) {}
+
+            virtual void commit() {}
+
+            virtual void rollback() {
+                const std::string end = rocksGetNextPrefix(_prefix);
+                auto s = _db->DeleteRange(rocksdb::WriteOptions(), _cf, _prefix, end);
+                if (!s.ok()) {
+                    // not fatal, an aborted build drops the ident of the index and its keys with it
+                    error() << "Failed to remove the keys of an aborted index build with prefix "
+                            << rocksdb::Slice(_prefix).ToString(true) << ": " << s.ToString();
+                    return;
+                }
+                if (_compactionScheduler) {
+                    _compactionScheduler->compactRange(_cf, _prefix, end);
+                }
+            }
+
+        private:
+            rocksdb::DB* _db;                                // not owned
+            RocksCompactionScheduler* _compactionScheduler;  // not owned, can be nullptr
+            rocksdb::ColumnFamilyHandle* _cf;                // not owned
+            const std::string _prefix;
+        };
+#endif
+
+        /**
+         * Loads keys that arrive in increasing order (as they do in bulk builds) without going
+         * through a WriteBatchWithIndex. Keys are streamed into SST files under <db>/bulkload,
+         * which are ingested with a single IngestExternalFile() call. Since the index is
+         * empty, the files end up in the bottommost level and are never rewritten by compactions.
+         * Memory usage is bounded by the size of one file's filter and index blocks, no matter how
+         * large the index is.
+         *
+         * Keys don't become visible until ingest() succeeds. Ingested keys are removed again if
+         * the next unit of work of opCtx aborts, which is the one that commits the index build.
+         * Files that were never ingested are removed on destruction; the ones left behind by a
+         * crash are removed on startup.
+         *
+         * Without IngestExternalFile() (RocksDB < 6), keys go through opCtx's write batch.
+         */
+        class RocksBulkLoader {
+            MONGO_DISALLOW_COPYING(RocksBulkLoader);
+
+        public:
+            RocksBulkLoader(OperationContext* opCtx, rocksdb::DB* db,
+                            rocksdb::ColumnFamilyHandle* cf, std::string prefix)
+                : _opCtx(opCtx), _db(db), _cf(cf), _prefix(std::move(prefix)) {}
+
+            ~RocksBulkLoader() {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+                // abandons the file that's being written, if any
+                _writer.reset();
+                for (const auto& file : _files) {
+                    _db->GetEnv()->DeleteFile(file);
+                }
+#endif
+            }
+
+            void add(const rocksdb::Slice& key, const rocksdb::Slice& value) {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+                if (!_writer) {
+                    _openFile();
+                }
+                invariantRocksOK(_writer->Put(key, value));
+                if (_writer->FileSize() >= kMaxFileSize) {
+                    _finishFile();
+                }
+#else
+                auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx);
+                ru->writeBatch()->Put(_cf, key, value);
+#endif
+            }
+
+            Status ingest() {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+                if (_writer) {
+                    _finishFile();
+                }
+                if (_files.empty()) {
+                    return Status::OK();
+                }
+                rocksdb::IngestExternalFileOptions options;
+                options.move_files = true;
+                auto s = _db->IngestExternalFile(_cf, _files, options);
+                if (s.ok()) {
+                    LOG(1) << "Ingested " << _files.size() << " files into index with prefix "
+                           << rocksdb::Slice(_prefix).ToString(true);
+                    _files.clear();
+                    auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx);
+                    ru->registerChange(
+                        new IngestChange(_db, ru->getCompactionScheduler(), _cf, _prefix));
+                }
+                return rocksToMongoStatus(s);
+#else
+                WriteUnitOfWork uow(_opCtx);
+                uow.commit();
+                return Status::OK();
+#endif
+            }
+
+        private:
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+            void _openFile() {
+                static std::atomic<uint64_t> fileNumber(0);  // NOLINT
+
+                const std::string dir = _db->GetName() + kBulkLoadDir;
+                invariantRocksOK(_db->GetEnv()->CreateDirIfMissing(dir));
+                // idents can contain '/' with directoryPerDB, the hex encoded prefix can't
+                const std::string name = rocksdb::Slice(_prefix).ToString(true);
+                _files.push_back(str::stream() << dir << "/" << name << "-"
+                                               << fileNumber.fetch_add(1) << ".sst");
+
+                _writer.reset(new rocksdb::SstFileWriter(rocksdb::EnvOptions(),
+                                                         _db->GetOptions(_cf), _cf));
+                invariantRocksOK(_writer->Open(_files.back()));
+            }
+
+            void _finishFile() {
+                invariantRocksOK(_writer->Finish());
+                _writer.reset();
+            }
+
+            std::unique_ptr<rocksdb::SstFileWriter> _writer;
+            std::vector<std::string> _files;
+
+            // roll over to a new file once the current one reaches 256MB
+            static const uint64_t kMaxFileSize = 256 * 1024 * 1024;
+#endif
+
+            OperationContext* _opCtx;
+            rocksdb::DB* _db;                  // not owned
+            rocksdb::ColumnFamilyHandle* _cf;  // not owned
+            const std::string _prefix;
+        };
+
     } // namespace
 
     /**
@@ -432,21 +599,38 @@ namespace mongo {
      */
     class RocksIndexBase::StandardBulkBuilder : public SortedDataBuilderInterface {
     public:
-        StandardBulkBuilder(RocksStandardIndex* index, OperationContext* opCtx) : _index(index),
-                                                                                  _opCtx(opCtx) {}
+        StandardBulkBuilder(RocksStandardIndex* index, OperationContext* opCtx)
+            : _index(index), _loader(opCtx, index->_db, index->_cf, index->_prefix) {}
 
         Status addKey(const BSONObj& key, const RecordId& loc) {
-            return _index->insert(_opCtx, key, loc, true);
+            Status s = checkKeySize(key);
+            if (!s.isOK()) {
+                return s;
+            }
+
+            // same format as RocksStandardIndex::insert()
+            KeyString encodedKey(_index->_keyStringVersion, key, _index->_order, loc);
+            std::string prefixedKey(_makePrefixedKey(_index->_prefix, encodedKey));
+            const KeyString::TypeBits& typeBits = encodedKey.getTypeBits();
+            rocksdb::Slice value;
+            if (!typeBits.isAllZeros()) {
+                value = rocksdb::Slice(reinterpret_cast<const char*>(typeBits.getBuffer()),
+                                       typeBits.getSize());
+            }
+
+            _loader.add(prefixedKey, value);
+            _index->_indexStorageSize.fetch_add(static_cast<long long>(prefixedKey.size()),
+                                                std::memory_order_relaxed);
+            return Status::OK();
         }
 
         void commit(bool mayInterrupt) {
-            WriteUnitOfWork uow(_opCtx);
-            uow.commit();
+            uassertStatusOK(_loader.ingest());
         }
 
     private:
         RocksStandardIndex* _index;
-        OperationContext* _opCtx;
+        RocksBulkLoader _loader;
     };
 
     /**
@@ -459,16 +643,17 @@ namespace mongo {
      */
     class RocksIndexBase::UniqueBulkBuilder : public SortedDataBuilderInterface {
     public:
-        UniqueBulkBuilder(std::string prefix, Ordering ordering,
+        UniqueBulkBuilder(RocksUniqueIndex* index, std::string prefix, Ordering ordering,
                           KeyString::Version keyStringVersion, std::string collectionNamespace,
                           std::string indexName, OperationContext* opCtx,
                           bool dupsAllowed)
-            : _prefix(std::move(prefix)),
+            : _index(index),
+              _loader(opCtx, index->_db, index->_cf, index->_prefix),
+              _prefix(std::move(prefix)),
               _ordering(ordering),
               _keyStringVersion(keyStringVersion),
               _collectionNamespace(std::move(collectionNamespace)),
               _indexName(std::move(indexName)),
-              _opCtx(opCtx),
               _dupsAllowed(dupsAllowed),
               _keyString(keyStringVersion) {}
 
@@ -506,12 +691,11 @@ namespace mongo {
         }
 
         void commit(bool mayInterrupt) {
-            WriteUnitOfWork uow(_opCtx);
             if (!_records.empty()) {
                 // This handles inserting the last unique key.
                 doInsert();
             }
-            uow.commit();
+            uassertStatusOK(_loader.ingest());
         }
 
     private:
@@ -531,18 +715,20 @@ namespace mongo {
             std::string prefixedKey(RocksIndexBase::_makePrefixedKey(_prefix, _keyString));
             rocksdb::Slice valueSlice(value.getBuffer(), value.getSize());
 
-            auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx);
-            ru->writeBatch()->Put(prefixedKey, valueSlice);
+            _loader.add(prefixedKey, valueSlice);
+            _index->_indexStorageSize.fetch_add(static_cast<long long>(prefixedKey.size()),
+                                                std::memory_order_relaxed);
 
             _records.clear();
         }
 
+        RocksUniqueIndex* _index;
+        RocksBulkLoader _loader;
         std::string _prefix;
         Ordering _ordering;
         const KeyString::Version _keyStringVersion;
         std::string _collectionNamespace;
         std::string _indexName;
-        OperationContext* _opCtx;
         const bool _dupsAllowed;
         BSONObj _key;
         KeyString _keyString;
@@ -551,9 +737,11 @@ namespace mongo {
 
     /// RocksIndexBase
 
-    RocksIndexBase::RocksIndexBase(rocksdb::DB* db, std::string prefix, std::string ident,
-                                   Ordering order, const BSONObj& config)
+    RocksIndexBase::RocksIndexBase(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+                                   std::string prefix, std::string ident, Ordering order,
+                                   const BSONObj& config)
         : _db(db),
+          _cf(cf),
           _prefix(prefix),
           _ident(std::move(ident)),
           _order(order)
@@ -561,7 +749,7 @@ namespace mongo {
         uint64_t storageSize;
         std::string nextPrefix = rocksGetNextPrefix(_prefix);
         rocksdb::Range wholeRange(_prefix, nextPrefix);
-        _db->GetApproximateSizes(&wholeRange, 1, &storageSize);
+        _db->GetApproximateSizes(_cf, &wholeRange, 1, &storageSize);
         _indexStorageSize.store(static_cast<long long>(storageSize), std::memory_order_relaxed);
 
         int indexFormatVersion = 0; // default
@@ -595,9 +783,22 @@ namespace mongo {
         }
     }
 
+    void RocksIndexBase::cleanupBulkLoadFiles(rocksdb::DB* db) {
+        const std::string dir = db->GetName() + kBulkLoadDir;
+        std::vector<std::string> children;
+        if (!db->GetEnv()->GetChildren(dir, &children).ok()) {
+            return;
+        }
+        for (const auto& child : children) {
+            if (child != "." && child != "..") {
+                db->GetEnv()->DeleteFile(dir + "/" + child);
+            }
+        }
+    }
+
     bool RocksIndexBase::isEmpty(OperationContext* opCtx) {
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
-        std::unique_ptr<rocksdb::Iterator> it(ru->NewIterator(_prefix));
+        std::unique_ptr<rocksdb::Iterator> it(ru->NewIterator(_cf, _prefix));
 
         it->SeekToFirst();
         return !it->Valid();
@@ -634,11 +835,11 @@ namespace mongo {
 
     /// RocksUniqueIndex
 
-    RocksUniqueIndex::RocksUniqueIndex(rocksdb::DB* db, std::string prefix, std::string ident,
-                                       Ordering order, const BSONObj& config,
-                                       std::string collectionNamespace, std::string indexName,
-                                       bool partial)
-        : RocksIndexBase(db, prefix, ident, order, config),
+    RocksUniqueIndex::RocksUniqueIndex(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+                                       std::string prefix, std::string ident, Ordering order,
+                                       const BSONObj& config, std::string collectionNamespace,
+                                       std::string indexName, bool partial)
+        : RocksIndexBase(db, cf, prefix, ident, order, config),
           _collectionNamespace(std::move(collectionNamespace)),
           _indexName(std::move(indexName)),
           _partial(partial) {}
@@ -651,10 +852,10 @@ namespace mongo {
         }
 
         KeyString encodedKey(_keyStringVersion, key, _order);
-        std::string prefixedKey(_makePrefixedKey(_prefix, encodedKey));
+        RocksKeyBuffer prefixedKey(_prefix, encodedKey.getBuffer(), encodedKey.getSize());
 
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
-        if (!ru->transaction()->registerWrite(prefixedKey)) {
+        if (!ru->transaction()->registerWrite(prefixedKey.stringData())) {
             throw WriteConflictException();
         }
 
@@ -662,7 +863,7 @@ namespace mongo {
                                     std::memory_order_relaxed);
 
         std::string currentValue;
-        auto getStatus = ru->Get(prefixedKey, &currentValue);
+        auto getStatus = ru->Get(_cf, prefixedKey.slice(), &currentValue);
         if (!getStatus.ok() && !getStatus.IsNotFound()) {
             return rocksToMongoStatus(getStatus);
         } else if (getStatus.IsNotFound()) {
@@ -672,7 +873,7 @@ namespace mongo {
                 value.appendTypeBits(encodedKey.getTypeBits());
             }
             rocksdb::Slice valueSlice(value.getBuffer(), value.getSize());
-            ru->writeBatch()->Put(prefixedKey, valueSlice);
+            ru->writeBatch()->Put(_cf, prefixedKey.slice(), valueSlice);
             return Status::OK();
         }
 
@@ -712,7 +913,7 @@ namespace mongo {
         }
 
         rocksdb::Slice valueVectorSlice(valueVector.getBuffer(), valueVector.getSize());
-        ru->writeBatch()->Put(prefixedKey, valueVectorSlice);
+        ru->writeBatch()->Put(_cf, prefixedKey.slice(), valueVectorSlice);
         return Status::OK();
     }
 
@@ -732,11 +933,11 @@ namespace mongo {
         }
 
         KeyString encodedKey(_keyStringVersion, key, _order);
-        std::string prefixedKey(_makePrefixedKey(_prefix, encodedKey));
+        RocksKeyBuffer prefixedKey(_prefix, encodedKey.getBuffer(), encodedKey.getSize());
 
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
         // We can't let two threads unindex the same key
-        if (!ru->transaction()->registerWrite(prefixedKey)) {
+        if (!ru->transaction()->registerWrite(prefixedKey.stringData())) {
             throw WriteConflictException();
         }
 
@@ -745,7 +946,7 @@ namespace mongo {
                 // Check that the record id matches.  We may be called to unindex records that are
                 // not present in the index due to the partial filter expression.
                 std::string val;
-                auto s = ru->Get(prefixedKey, &val);
+                auto s = ru->Get(_cf, prefixedKey.slice(), &val);
                 if (s.IsNotFound()) {
                     return;
                 }
@@ -760,13 +961,13 @@ namespace mongo {
             }
             _indexStorageSize.fetch_sub(static_cast<long long>(prefixedKey.size()),
                                         std::memory_order_relaxed);
-            ru->writeBatch()->Delete(prefixedKey);
+            ru->writeBatch()->Delete(_cf, prefixedKey.slice());
             return;
         }
 
         // dups are allowed, so we have to deal with a vector of RecordIds.
         std::string currentValue;
-        auto getStatus = ru->Get(prefixedKey, &currentValue);
+        auto getStatus = ru->Get(_cf, prefixedKey.slice(), &currentValue);
         if (getStatus.IsNotFound()) {
             return;
         }
@@ -786,7 +987,7 @@ namespace mongo {
                     // Remove the whole entry.
                     _indexStorageSize.fetch_sub(static_cast<long long>(prefixedKey.size()),
                                                 std::memory_order_relaxed);
-                    ru->writeBatch()->Delete(prefixedKey);
+                    ru->writeBatch()->Delete(_cf, prefixedKey.slice());
                     return;
                 }
 
@@ -815,25 +1016,25 @@ namespace mongo {
         }
 
         rocksdb::Slice newValueSlice(newValue.getBuffer(), newValue.getSize());
-        ru->writeBatch()->Put(prefixedKey, newValueSlice);
+        ru->writeBatch()->Put(_cf, prefixedKey.slice(), newValueSlice);
         _indexStorageSize.fetch_sub(static_cast<long long>(prefixedKey.size()),
                                     std::memory_order_relaxed);
     }
 
     std::unique_ptr<SortedDataInterface::Cursor> RocksUniqueIndex::newCursor(OperationContext* opCtx,
                                                                              bool forward) const {
-        return stdx::make_unique<RocksUniqueCursor>(opCtx, _db, _prefix, forward, _order,
+        return stdx::make_unique<RocksUniqueCursor>(opCtx, _db, _cf, _prefix, forward, _order,
                                                     _keyStringVersion, _indexName);
     }
 
     Status RocksUniqueIndex::dupKeyCheck(OperationContext* opCtx, const BSONObj& key,
                                          const RecordId& loc) {
         KeyString encodedKey(_keyStringVersion, key, _order);
-        std::string prefixedKey(_makePrefixedKey(_prefix, encodedKey));
+        RocksKeyBuffer prefixedKey(_prefix, encodedKey.getBuffer(), encodedKey.getSize());
 
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
         std::string value;
-        auto getStatus = ru->Get(prefixedKey, &value);
+        auto getStatus = ru->Get(_cf, prefixedKey.slice(), &value);
         if (!getStatus.ok() && !getStatus.IsNotFound()) {
             return rocksToMongoStatus(getStatus);
         } else if (getStatus.IsNotFound()) {
@@ -857,15 +1058,16 @@ namespace mongo {
 
     SortedDataBuilderInterface* RocksUniqueIndex::getBulkBuilder(OperationContext* opCtx,
                                                                  bool dupsAllowed) {
-        return new RocksIndexBase::UniqueBulkBuilder(_prefix, _order, _keyStringVersion,
+        return new RocksIndexBase::UniqueBulkBuilder(this, _prefix, _order, _keyStringVersion,
                                                      _collectionNamespace, _indexName, opCtx,
                                                      dupsAllowed);
     }
 
     /// RocksStandardIndex
-    RocksStandardIndex::RocksStandardIndex(rocksdb::DB* db, std::string prefix, std::string ident,
-                                           Ordering order, const BSONObj& config)
-        : RocksIndexBase(db, prefix, ident, order, config),
+    RocksStandardIndex::RocksStandardIndex(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+                                           std::string prefix, std::string ident, Ordering order,
+                                           const BSONObj& config)
+        : RocksIndexBase(db, cf, prefix, ident, order, config),
           useSingleDelete(false) {}
 
     Status RocksStandardIndex::insert(OperationContext* opCtx, const BSONObj& key,
@@ -877,9 +1079,9 @@ namespace mongo {
         }
 
         KeyString encodedKey(_keyStringVersion, key, _order, loc);
-        std::string prefixedKey(_makePrefixedKey(_prefix, encodedKey));
+        RocksKeyBuffer prefixedKey(_prefix, encodedKey.getBuffer(), encodedKey.getSize());
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
-        if (!ru->transaction()->registerWrite(prefixedKey)) {
+        if (!ru->transaction()->registerWrite(prefixedKey.stringData())) {
             throw WriteConflictException();
         }
 
@@ -893,7 +1095,7 @@ namespace mongo {
         _indexStorageSize.fetch_add(static_cast<long long>(prefixedKey.size()),
                                     std::memory_order_relaxed);
 
-        ru->writeBatch()->Put(prefixedKey, value);
+        ru->writeBatch()->Put(_cf, prefixedKey.slice(), value);
 
         return Status::OK();
     }
@@ -915,26 +1117,26 @@ namespace mongo {
         }
 
         KeyString encodedKey(_keyStringVersion, key, _order, loc);
-        std::string prefixedKey(_makePrefixedKey(_prefix, encodedKey));
+        RocksKeyBuffer prefixedKey(_prefix, encodedKey.getBuffer(), encodedKey.getSize());
 
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
-        if (!ru->transaction()->registerWrite(prefixedKey)) {
+        if (!ru->transaction()->registerWrite(prefixedKey.stringData())) {
             throw WriteConflictException();
         }
 
         _indexStorageSize.fetch_sub(static_cast<long long>(prefixedKey.size()),
                                     std::memory_order_relaxed);
         if (useSingleDelete) {
-            ru->writeBatch()->SingleDelete(prefixedKey);
+            ru->writeBatch()->SingleDelete(_cf, prefixedKey.slice());
         } else {
-            ru->writeBatch()->Delete(prefixedKey);
+            ru->writeBatch()->Delete(_cf, prefixedKey.slice());
         }
     }
 
     std::unique_ptr<SortedDataInterface::Cursor> RocksStandardIndex::newCursor(
             OperationContext* opCtx,
             bool forward) const {
-        return stdx::make_unique<RocksStandardCursor>(opCtx, _db, _prefix, forward, _order,
+        return stdx::make_unique<RocksStandardCursor>(opCtx, _db, _cf, _prefix, forward, _order,
                                                       _keyStringVersion);
     }
 
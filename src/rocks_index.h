@@ -40,6 +40,7 @@
 #pragma once
 
 namespace rocksdb {
+    class ColumnFamilyHandle;
     class DB;
 }
 
@@ -51,8 +52,8 @@ namespace mongo {
         MONGO_DISALLOW_COPYING(RocksIndexBase);
 
     public:
-        RocksIndexBase(rocksdb::DB* db, std::string prefix, std::string ident, Ordering order,
-                       const BSONObj& config);
+        RocksIndexBase(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf, std::string prefix,
+                       std::string ident, Ordering order, const BSONObj& config);
 
         virtual SortedDataBuilderInterface* getBulkBuilder(OperationContext* opCtx,
                                                            bool dupsAllowed) = 0;
@@ -75,10 +76,14 @@ namespace mongo {
         static void generateConfig(BSONObjBuilder* configBuilder, int formatVersion,
                                    IndexDescriptor::IndexVersion descVersion);
 
+        // removes the files of bulk builds that were interrupted by a crash
+        static void cleanupBulkLoadFiles(rocksdb::DB* db);
+
     protected:
         static std::string _makePrefixedKey(const std::string& prefix, const KeyString& encodedKey);
 
         rocksdb::DB* _db; // not owned
+        rocksdb::ColumnFamilyHandle* _cf; // not owned
 
         // Each key in the index is prefixed with _prefix
         std::string _prefix;
@@ -98,9 +103,10 @@ namespace mongo {
 
     class RocksUniqueIndex : public RocksIndexBase {
     public:
-        RocksUniqueIndex(rocksdb::DB* db, std::string prefix, std::string ident, Ordering order,
-                         const BSONObj& config, std::string collectionNamespace,
-                         std::string indexName, bool partial = false);
+        RocksUniqueIndex(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf, std::string prefix,
+                         std::string ident, Ordering order, const BSONObj& config,
+                         std::string collectionNamespace, std::string indexName,
+                         bool partial = false);
 
         virtual Status insert(OperationContext* opCtx, const BSONObj& key, const RecordId& loc,
                               bool dupsAllowed);
@@ -121,8 +127,8 @@ namespace mongo {
 
     class RocksStandardIndex : public RocksIndexBase {
     public:
-        RocksStandardIndex(rocksdb::DB* db, std::string prefix, std::string ident, Ordering order,
-                           const BSONObj& config);
+        RocksStandardIndex(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf, std::string prefix,
+                           std::string ident, Ordering order, const BSONObj& config);
 
         virtual Status insert(OperationContext* opCtx, const BSONObj& key, const RecordId& loc,
                               bool dupsAllowed);
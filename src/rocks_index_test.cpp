@@ -29,6 +29,7 @@
 #include "mongo/platform/basic.h"
 
 #include <boost/filesystem/operations.hpp>
+#include <iterator>
 #include <string>
 
 #include <rocksdb/comparator.h>
@@ -72,11 +73,13 @@ namespace {
             BSONObjBuilder configBuilder;
             RocksIndexBase::generateConfig(&configBuilder, 3, IndexDescriptor::IndexVersion::kV2);
             if (unique) {
-                return stdx::make_unique<RocksUniqueIndex>(_db.get(), "prefix", "ident", _order,
+                return stdx::make_unique<RocksUniqueIndex>(_db.get(), _db->DefaultColumnFamily(),
+                                                           "prefix", "ident", _order,
                                                            configBuilder.obj(), "test.rocks",
                                                            "testIndex");
             } else {
-                return stdx::make_unique<RocksStandardIndex>(_db.get(), "prefix", "ident", _order,
+                return stdx::make_unique<RocksStandardIndex>(_db.get(), _db->DefaultColumnFamily(),
+                                                             "prefix", "ident", _order,
                                                              configBuilder.obj());
             }
         }
@@ -87,6 +90,16 @@ namespace {
                                                         nullptr, _durabilityManager.get(), true);
         }
 
+        // number of files the bulk loader left behind
+        size_t numBulkLoadFiles() {
+            const boost::filesystem::path dir(_tempDir.path() + "/bulkload");
+            if (!boost::filesystem::exists(dir)) {
+                return 0;
+            }
+            return std::distance(boost::filesystem::directory_iterator(dir),
+                                 boost::filesystem::directory_iterator());
+        }
+
     private:
         Ordering _order;
         string _testNamespace = "mongo-rocks-sorted-data-test";
@@ -204,5 +217,104 @@ namespace {
     TEST(RocksIndexTest, SeekExactRemoveNext_Reverse_Standard) {
         testSeekExactRemoveNext(false, false);
     }
+
+    // keys that don't fit into the inline key buffer
+    void testLongKeys(bool unique) {
+        auto harnessHelper = stdx::make_unique<RocksIndexHarness>();
+        const std::unique_ptr<SortedDataInterface> sorted(
+            harnessHelper->newSortedDataInterface(unique));
+        const BSONObj longKey1 = BSON("" << std::string(600, 'a'));
+        const BSONObj longKey2 = BSON("" << std::string(600, 'b'));
+
+        {
+            const ServiceContext::UniqueOperationContext opCtx(
+                harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            ASSERT_OK(sorted->insert(opCtx.get(), longKey1, loc1, true));
+            ASSERT_OK(sorted->insert(opCtx.get(), longKey2, loc2, true));
+            uow.commit();
+        }
+
+        {
+            const ServiceContext::UniqueOperationContext t1(harnessHelper->newOperationContext());
+            const auto client2 = harnessHelper->serviceContext()->makeClient("c2");
+            const auto t2 = harnessHelper->newOperationContext(client2.get());
+
+            WriteUnitOfWork w1(t1.get());
+            WriteUnitOfWork w2(t2.get());
+            sorted->unindex(t1.get(), longKey1, loc1, true);
+            // writing the same key twice in one transaction is fine
+            sorted->unindex(t1.get(), longKey1, loc1, true);
+            ASSERT_THROWS(sorted->unindex(t2.get(), longKey1, loc1, true),
+                          WriteConflictException);
+            w1.commit();
+        }
+
+        const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+        auto cursor = sorted->newCursor(opCtx.get());
+        ASSERT_EQ(cursor->seek(longKey1, true), IndexKeyEntry(longKey2, loc2));
+        ASSERT_EQ(cursor->next(), boost::none);
+    }
+
+    TEST(RocksIndexTest, LongKeys_Unique) {
+        testLongKeys(true);
+    }
+
+    TEST(RocksIndexTest, LongKeys_Standard) {
+        testLongKeys(false);
+    }
+
+    void testBulkBuild(bool unique, bool commit) {
+        auto harnessHelper = stdx::make_unique<RocksIndexHarness>();
+        const std::unique_ptr<SortedDataInterface> sorted(
+            harnessHelper->newSortedDataInterface(unique));
+
+        {
+            const ServiceContext::UniqueOperationContext opCtx(
+                harnessHelper->newOperationContext());
+            const std::unique_ptr<SortedDataBuilderInterface> builder(
+                sorted->getBulkBuilder(opCtx.get(), false));
+            for (int i = 0; i < 100; ++i) {
+                ASSERT_OK(builder->addKey(BSON("" << i), RecordId(i + 1)));
+            }
+            builder->commit(false);
+
+            // the unit of work that makes the index build permanent
+            WriteUnitOfWork uow(opCtx.get());
+            if (commit) {
+                uow.commit();
+            }
+        }
+
+        {
+            const ServiceContext::UniqueOperationContext opCtx(
+                harnessHelper->newOperationContext());
+            if (commit) {
+                ASSERT_EQUALS(100, sorted->numEntries(opCtx.get()));
+                auto cursor = sorted->newCursor(opCtx.get());
+                ASSERT_EQ(cursor->seek(BSON("" << 42), true),
+                          IndexKeyEntry(BSON("" << 42), RecordId(43)));
+            } else {
+                ASSERT(sorted->isEmpty(opCtx.get()));
+            }
+        }
+        ASSERT_EQUALS(0U, harnessHelper->numBulkLoadFiles());
+    }
+
+    TEST(RocksIndexTest, BulkBuild_Unique) {
+        testBulkBuild(true, true);
+    }
+
+    TEST(RocksIndexTest, BulkBuild_Standard) {
+        testBulkBuild(false, true);
+    }
+
+    TEST(RocksIndexTest, AbortedBulkBuild_Unique) {
+        testBulkBuild(true, false);
+    }
+
+    TEST(RocksIndexTest, AbortedBulkBuild_Standard) {
+        testBulkBuild(false, false);
+    }
 } // namespace
 } // namespace mongo
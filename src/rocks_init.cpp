@@ -40,6 +40,7 @@
 #include "rocks_engine.h"
 #include "rocks_server_status.h"
 #include "rocks_parameters.h"
+#include "rocks_ttl.h"
 
 namespace mongo {
     const std::string kRocksDBEngineName = "rocksdb";
@@ -69,6 +70,9 @@ namespace mongo {
                 auto leaked4 __attribute__((unused)) = new RocksCompactServerParameter(engine);
                 auto leaked5 __attribute__((unused)) = new RocksCacheSizeParameter(engine);
                 auto leaked6 __attribute__((unused)) = new RocksOptionsParameter(engine);
+                auto leaked7 __attribute__((unused)) = new RocksOperationTimingsParameter();
+                auto leaked8 __attribute__((unused)) =
+                    new RocksCompactionConcurrencyParameter(engine);
 
                 // Print options.
                 rocksGlobalOptions.printOptions();
@@ -114,6 +118,11 @@ namespace mongo {
                 return Status::OK();
             }
 
+            // the only collection option is ttl, see rocks_ttl.h
+            virtual Status validateCollectionStorageOptions(const BSONObj& options) const {
+                return RocksTtlOptions::parse(options).getStatus();
+            }
+
             virtual BSONObj createMetadataOptions(const StorageGlobalParams& params) const {
                 BSONObjBuilder builder;
                 builder.append(kRocksFormatVersionString, kRocksFormatVersion);
@@ -134,9 +143,12 @@ namespace mongo {
             // * Version 2 reserves two prefixes for oplog. one prefix keeps the oplog
             // documents and another only keeps keys. That way, we can cleanup the oplog without
             // reading full documents
-            // * Version 3 (current) understands the Decimal128 index format. It also understands
+            // * Version 3 understands the Decimal128 index format. It also understands
             // the version 2, so it's backwards compatible, but not forward compatible
-            const int kRocksFormatVersion = 3;
+            // * Version 4 (current) allows idents to live in a column family of their own (see
+            // rocksdbColumnFamilyPerIdent). Idents still keep their prefix inside the column
+            // family, so version 3 databases open unchanged
+            const int kRocksFormatVersion = 4;
             const int kMinSupportedRocksFormatVersion = 2;
             const std::string kRocksFormatVersionString = "rocksFormatVersion";
             int mutable formatVersion = -1;
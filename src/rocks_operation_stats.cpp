@@ -0,0 +1,179 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include "rocks_operation_stats.h"
+
+#include <algorithm>
+
+#include <rocksdb/iostats_context.h>
+#include <rocksdb/perf_context.h>
+#include <rocksdb/version.h>
+
+#include "mongo/base/checked_cast.h"
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/util/assert_util.h"
+
+namespace mongo {
+
+    namespace {
+        // iterator calls of this thread
+        thread_local long long threadSeeks = 0;
+        thread_local long long threadNexts = 0;
+
+        const rocksdb::PerfContext& perfContext() {
+#if ROCKSDB_MAJOR > 5 || (ROCKSDB_MAJOR == 5 && ROCKSDB_MINOR >= 6)
+            return *rocksdb::get_perf_context();
+#else
+            return rocksdb::perf_context;
+#endif
+        }
+
+        const rocksdb::IOStatsContext& ioStatsContext() {
+#if ROCKSDB_MAJOR > 5 || (ROCKSDB_MAJOR == 5 && ROCKSDB_MINOR >= 6)
+            return *rocksdb::get_iostats_context();
+#else
+            return rocksdb::iostats_context;
+#endif
+        }
+
+        long long nanosToMicros(uint64_t nanos) {
+            return static_cast<long long>(nanos / 1000);
+        }
+    }  // namespace
+
+    std::atomic<bool> RocksOperationStats::_timingsEnabled(false);
+
+    int RocksOperationStats::enableForThread() {
+        const auto previous = rocksdb::GetPerfLevel();
+        const auto level = timingsEnabled() ? rocksdb::PerfLevel::kEnableTimeExceptForMutex
+                                            : rocksdb::PerfLevel::kEnableCount;
+        if (previous != level) {
+            rocksdb::SetPerfLevel(level);
+        }
+        return static_cast<int>(previous);
+    }
+
+    void RocksOperationStats::restoreForThread(int previous) {
+        const auto level = static_cast<rocksdb::PerfLevel>(previous);
+        if (rocksdb::GetPerfLevel() != level) {
+            rocksdb::SetPerfLevel(level);
+        }
+    }
+
+    void RocksOperationStats::countSeek() { ++threadSeeks; }
+
+    void RocksOperationStats::countNext() { ++threadNexts; }
+
+    RocksOperationStats RocksOperationStats::current() {
+        const auto& perf = perfContext();
+        const auto& ioStats = ioStatsContext();
+        RocksOperationStats stats;
+        stats._stats[kBlockCacheHits] = perf.block_cache_hit_count;
+        stats._stats[kBlocksRead] = perf.block_read_count;
+        stats._stats[kBlockBytesRead] = perf.block_read_byte;
+        stats._stats[kTombstonesSkipped] = perf.internal_delete_skipped_count;
+        stats._stats[kKeysSkipped] = perf.internal_key_skipped_count;
+        stats._stats[kSeeks] = threadSeeks;
+        stats._stats[kNexts] = threadNexts;
+        stats._stats[kFileBytesRead] = ioStats.bytes_read;
+        stats._stats[kBlockReadMicros] = nanosToMicros(perf.block_read_time);
+        stats._stats[kGetMicros] =
+            nanosToMicros(perf.get_snapshot_time + perf.get_from_memtable_time +
+                          perf.get_from_output_files_time + perf.get_post_process_time);
+        stats._stats[kSeekMicros] =
+            nanosToMicros(perf.seek_on_memtable_time + perf.seek_child_seek_time +
+                          perf.seek_min_heap_time + perf.seek_internal_seek_time);
+        return stats;
+    }
+
+    RocksOperationStats RocksOperationStats::operator-(const RocksOperationStats& since) const {
+        RocksOperationStats diff;
+        for (size_t i = 0; i < kNumStats; ++i) {
+            // the thread's counters might have been reset in between
+            diff._stats[i] = std::max(0LL, _stats[i] - since._stats[i]);
+        }
+        return diff;
+    }
+
+    BSONObj RocksOperationStats::toBSON() {
+        BSONObjBuilder builder;
+        for (size_t i = 0; i < kNumStats; ++i) {
+            if (_stats[i] != 0) {
+                builder.append(_name(static_cast<Stat>(i)), _stats[i]);
+            }
+        }
+        return builder.obj();
+    }
+
+    std::shared_ptr<StorageStats> RocksOperationStats::getCopy() {
+        return std::make_shared<RocksOperationStats>(*this);
+    }
+
+    StorageStats& RocksOperationStats::operator+=(const StorageStats& other) {
+        return *this += checked_cast<const RocksOperationStats&>(other);
+    }
+
+    RocksOperationStats& RocksOperationStats::operator+=(const RocksOperationStats& other) {
+        for (size_t i = 0; i < kNumStats; ++i) {
+            _stats[i] += other._stats[i];
+        }
+        return *this;
+    }
+
+    const char* RocksOperationStats::_name(Stat stat) {
+        switch (stat) {
+            case kBlockCacheHits:
+                return "blockCacheHits";
+            case kBlocksRead:
+                return "blocksRead";
+            case kBlockBytesRead:
+                return "blockBytesRead";
+            case kTombstonesSkipped:
+                return "tombstonesSkipped";
+            case kKeysSkipped:
+                return "keysSkipped";
+            case kSeeks:
+                return "seeks";
+            case kNexts:
+                return "nexts";
+            case kFileBytesRead:
+                return "fileBytesRead";
+            case kBlockReadMicros:
+                return "blockReadMicros";
+            case kGetMicros:
+                return "getMicros";
+            case kSeekMicros:
+                return "seekMicros";
+            case kNumStats:
+                break;
+        }
+        MONGO_UNREACHABLE;
+    }
+}
@@ -0,0 +1,98 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include "mongo/bson/bsonobj.h"
+#include "mongo/db/storage/storage_stats.h"
+
+namespace mongo {
+
+    /**
+     * What RocksDB did on behalf of one operation: block cache and disk reads, skipped tombstones,
+     * iterator movement and, if enabled, time spent. The numbers come from the PerfContext and
+     * IOStatsContext of the thread running the operation, and end up in the "storage" section of
+     * slow operation log lines and system.profile entries.
+     */
+    class RocksOperationStats final : public StorageStats {
+    public:
+        // Prepares the calling thread for an operation that's about to start. Returns the
+        // thread's previous setting, which restoreForThread() puts back once the operation is
+        // done. Counters are always collected, timings only if setTimingsEnabled(true) was called
+        static int enableForThread();
+        static void restoreForThread(int previous);
+
+        static void setTimingsEnabled(bool enabled) { _timingsEnabled.store(enabled); }
+        static bool timingsEnabled() { return _timingsEnabled.load(); }
+
+        // Called by our iterators, RocksDB doesn't count those for us
+        static void countSeek();
+        static void countNext();
+
+        // totals of the calling thread so far
+        static RocksOperationStats current();
+
+        // what happened since an earlier current()
+        RocksOperationStats operator-(const RocksOperationStats& since) const;
+
+        BSONObj toBSON() final;
+
+        std::shared_ptr<StorageStats> getCopy() final;
+
+        StorageStats& operator+=(const StorageStats& other) final;
+
+        RocksOperationStats& operator+=(const RocksOperationStats& other);
+
+    private:
+        enum Stat {
+            kBlockCacheHits,
+            kBlocksRead,
+            kBlockBytesRead,
+            kTombstonesSkipped,
+            kKeysSkipped,
+            kSeeks,
+            kNexts,
+            kFileBytesRead,
+            kBlockReadMicros,
+            kGetMicros,
+            kSeekMicros,
+            kNumStats
+        };
+
+        static const char* _name(Stat stat);
+
+        std::array<long long, kNumStats> _stats{};
+
+        static std::atomic<bool> _timingsEnabled;
+    };
+
+}
@@ -0,0 +1,264 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include "rocks_oplog_tail_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mongo/db/operation_context.h"
+#include "mongo/db/storage/recovery_unit.h"
+
+namespace mongo {
+
+    class RocksOplogTailCache::InsertChange : public RecoveryUnit::Change {
+    public:
+        InsertChange(RocksOplogTailCache* cache, const RecordId& id) : _cache(cache), _id(id) {}
+
+        virtual void commit() {
+            stdx::lock_guard<stdx::mutex> lk(_cache->_mutex);
+            auto it = _cache->_entries.find(_id);
+            if (it != _cache->_entries.end()) {
+                it->second.committed = true;
+            }
+        }
+
+        virtual void rollback() {
+            stdx::lock_guard<stdx::mutex> lk(_cache->_mutex);
+            auto it = _cache->_entries.find(_id);
+            if (it != _cache->_entries.end()) {
+                _cache->_erase_inlock(it, std::next(it));
+            }
+        }
+
+    private:
+        RocksOplogTailCache* _cache;
+        const RecordId _id;
+    };
+
+    class RocksOplogTailCache::UpdateChange : public RecoveryUnit::Change {
+    public:
+        // the entry was committed before the update marked it pending
+        UpdateChange(RocksOplogTailCache* cache, const RecordId& id, const char* data, int len,
+                     bool wasCommitted)
+            : _cache(cache), _id(id), _data(data, len), _wasCommitted(wasCommitted) {}
+
+        virtual void commit() {
+            stdx::lock_guard<stdx::mutex> lk(_cache->_mutex);
+            auto it = _cache->_entries.find(_id);
+            if (it != _cache->_entries.end()) {
+                // if the insert is part of our unit of work, it has committed by now
+                _cache->_put_inlock(_id, _data.data(), _data.size(),
+                                    _wasCommitted || it->second.committed);
+            }
+        }
+
+        virtual void rollback() {
+            stdx::lock_guard<stdx::mutex> lk(_cache->_mutex);
+            auto it = _cache->_entries.find(_id);
+            if (it != _cache->_entries.end()) {
+                it->second.committed = _wasCommitted;
+            }
+        }
+
+    private:
+        RocksOplogTailCache* _cache;
+        const RecordId _id;
+        const std::string _data;
+        const bool _wasCommitted;
+    };
+
+    class RocksOplogTailCache::DeleteChange : public RecoveryUnit::Change {
+    public:
+        // deletes [begin, end], or everything from begin if end is null. wasCommitted are the
+        // entries in there that were committed before the delete marked them pending
+        DeleteChange(RocksOplogTailCache* cache, const RecordId& begin, const RecordId& end,
+                     std::vector<RecordId> wasCommitted)
+            : _cache(cache), _begin(begin), _end(end), _wasCommitted(std::move(wasCommitted)) {}
+
+        virtual void commit() {
+            stdx::lock_guard<stdx::mutex> lk(_cache->_mutex);
+            auto& entries = _cache->_entries;
+            _cache->_erase_inlock(entries.lower_bound(_begin),
+                                  _end.isNull() ? entries.end() : entries.upper_bound(_end));
+        }
+
+        virtual void rollback() {
+            stdx::lock_guard<stdx::mutex> lk(_cache->_mutex);
+            for (const auto& id : _wasCommitted) {
+                auto it = _cache->_entries.find(id);
+                if (it != _cache->_entries.end()) {
+                    it->second.committed = true;
+                }
+            }
+        }
+
+    private:
+        RocksOplogTailCache* _cache;
+        const RecordId _begin;
+        const RecordId _end;
+        const std::vector<RecordId> _wasCommitted;
+    };
+
+    RocksOplogTailCache::RocksOplogTailCache(int64_t maxBytes, const RecordId& highestExisting)
+        : _maxBytes(maxBytes), _bytes(0), _watermark(highestExisting) {}
+
+    void RocksOplogTailCache::insertRecord(OperationContext* opCtx, const RecordId& id,
+                                           const char* data, int len) {
+        {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            if (id <= _watermark) {
+                // we can't use it anyway, everything up to the watermark is read from RocksDB
+                return;
+            }
+            _put_inlock(id, data, len, false);
+        }
+        opCtx->recoveryUnit()->registerChange(new InsertChange(this, id));
+    }
+
+    void RocksOplogTailCache::updateRecord(OperationContext* opCtx, const RecordId& id,
+                                           const char* data, int len) {
+        bool wasCommitted;
+        {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            auto it = _entries.find(id);
+            wasCommitted = !_markPending_inlock(it, it == _entries.end() ? it : std::next(it))
+                                .empty();
+        }
+        opCtx->recoveryUnit()->registerChange(new UpdateChange(this, id, data, len,
+                                                               wasCommitted));
+    }
+
+    void RocksOplogTailCache::deleteRecord(OperationContext* opCtx, const RecordId& id) {
+        _registerDelete(opCtx, id, id);
+    }
+
+    void RocksOplogTailCache::truncateFrom(OperationContext* opCtx, const RecordId& first) {
+        _registerDelete(opCtx, first, RecordId());
+    }
+
+    void RocksOplogTailCache::truncate(OperationContext* opCtx) {
+        _registerDelete(opCtx, RecordId::min(), RecordId());
+    }
+
+    void RocksOplogTailCache::reclaimUpTo(const RecordId& last) {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        _erase_inlock(_entries.begin(), _entries.upper_bound(last));
+        _watermark = std::max(_watermark, last);
+    }
+
+    bool RocksOplogTailCache::next(const RecordId& after, boost::optional<Record>* record,
+                                   bool* committed) const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        if (after < _watermark) {
+            return false;
+        }
+        auto it = _entries.upper_bound(after);
+        if (it == _entries.end()) {
+            *record = boost::none;
+            *committed = true;
+        } else {
+            *record = Record{it->first, RecordData(it->second.data, it->second.size)};
+            *committed = it->second.committed;
+        }
+        return true;
+    }
+
+    bool RocksOplogTailCache::exists(const RecordId& id, bool* found) const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        if (id <= _watermark) {
+            return false;
+        }
+        *found = _entries.find(id) != _entries.end();
+        return true;
+    }
+
+    int64_t RocksOplogTailCache::bytes() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _bytes;
+    }
+
+    RecordId RocksOplogTailCache::watermark() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _watermark;
+    }
+
+    void RocksOplogTailCache::_put_inlock(const RecordId& id, const char* data, int len,
+                                          bool committed) {
+        auto it = _entries.find(id);
+        if (it != _entries.end()) {
+            _erase_inlock(it, std::next(it));
+        }
+        auto buffer = SharedBuffer::allocate(len);
+        memcpy(buffer.get(), data, len);
+        _entries.emplace(id, Entry{std::move(buffer), len, committed});
+        _bytes += len;
+
+        // Evict the oldest entries. Readers hold on to the buffers of the records they return,
+        // so those stay valid
+        while (_bytes > _maxBytes && !_entries.empty()) {
+            auto oldest = _entries.begin();
+            _watermark = std::max(_watermark, oldest->first);
+            _erase_inlock(oldest, std::next(oldest));
+        }
+    }
+
+    void RocksOplogTailCache::_registerDelete(OperationContext* opCtx, const RecordId& begin,
+                                              const RecordId& end) {
+        std::vector<RecordId> wasCommitted;
+        {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            wasCommitted = _markPending_inlock(
+                _entries.lower_bound(begin),
+                end.isNull() ? _entries.end() : _entries.upper_bound(end));
+        }
+        opCtx->recoveryUnit()->registerChange(
+            new DeleteChange(this, begin, end, std::move(wasCommitted)));
+    }
+
+    std::vector<RecordId> RocksOplogTailCache::_markPending_inlock(Entries::iterator begin,
+                                                                   Entries::iterator end) {
+        std::vector<RecordId> wasCommitted;
+        for (auto it = begin; it != end; ++it) {
+            if (it->second.committed) {
+                wasCommitted.push_back(it->first);
+                it->second.committed = false;
+            }
+        }
+        return wasCommitted;
+    }
+
+    void RocksOplogTailCache::_erase_inlock(Entries::iterator begin, Entries::iterator end) {
+        for (auto it = begin; it != end; ++it) {
+            _bytes -= it->second.size;
+        }
+        _entries.erase(begin, end);
+    }
+}
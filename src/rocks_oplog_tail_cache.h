@@ -0,0 +1,122 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "mongo/base/disallow_copying.h"
+#include "mongo/db/record_id.h"
+#include "mongo/db/storage/record_data.h"
+#include "mongo/db/storage/record_store.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/util/shared_buffer.h"
+
+namespace mongo {
+
+    class OperationContext;
+
+    /**
+     * Keeps copies of the newest oplog entries in memory, so that forward oplog cursors close to
+     * the end of the oplog don't need to go to RocksDB at all.
+     *
+     * Entries are added when they are inserted, before their unit of work commits, and removed
+     * again if it rolls back. That way an entry is always in the cache before it can become
+     * visible. Until the commit has finished, an entry is pending: readers that reach a pending
+     * entry they are allowed to see have to read it from RocksDB instead. Updates and deletes make
+     * the entries they touch pending in the same way until they commit or roll back.
+     *
+     * The cache is complete above a watermark: every oplog record with a RecordId higher than it
+     * is in the cache. Evicting the oldest entries to stay within the byte budget, or dropping
+     * reclaimed ones, raises the watermark.
+     */
+    class RocksOplogTailCache {
+        MONGO_DISALLOW_COPYING(RocksOplogTailCache);
+
+    public:
+        // The cache starts out empty and complete above highestExisting
+        RocksOplogTailCache(int64_t maxBytes, const RecordId& highestExisting);
+
+        // Adds a record that opCtx's unit of work inserts. It's removed again on rollback
+        void insertRecord(OperationContext* opCtx, const RecordId& id, const char* data, int len);
+
+        // These apply the corresponding change once opCtx's unit of work commits. Until then the
+        // records they touch are pending, and they're restored if it rolls back
+        void updateRecord(OperationContext* opCtx, const RecordId& id, const char* data, int len);
+        void deleteRecord(OperationContext* opCtx, const RecordId& id);
+        // deletes every record at or after first
+        void truncateFrom(OperationContext* opCtx, const RecordId& first);
+        void truncate(OperationContext* opCtx);
+
+        // Records up to and including last have already been deleted
+        void reclaimUpTo(const RecordId& last);
+
+        /**
+         * Looks for the first record after `after`. Returns false if the cache can't tell,
+         * because records right after `after` might not be cached. Otherwise sets *record to the
+         * record, or to boost::none if there's none, and *committed to whether the record's unit
+         * of work has committed.
+         */
+        bool next(const RecordId& after, boost::optional<Record>* record, bool* committed) const;
+
+        // Returns false if the cache can't tell whether the record exists, otherwise sets *found
+        bool exists(const RecordId& id, bool* found) const;
+
+        int64_t bytes() const;
+        RecordId watermark() const;
+
+    private:
+        class InsertChange;
+        class UpdateChange;
+        class DeleteChange;
+
+        struct Entry {
+            SharedBuffer data;
+            int size;
+            bool committed;
+        };
+        typedef std::map<RecordId, Entry> Entries;
+
+        void _put_inlock(const RecordId& id, const char* data, int len, bool committed);
+        void _registerDelete(OperationContext* opCtx, const RecordId& begin, const RecordId& end);
+        // marks [begin, end) pending, returns the ids of those that were committed
+        std::vector<RecordId> _markPending_inlock(Entries::iterator begin, Entries::iterator end);
+        // erases [begin, end)
+        void _erase_inlock(Entries::iterator begin, Entries::iterator end);
+
+        const int64_t _maxBytes;
+
+        mutable stdx::mutex _mutex;  // protects everything below
+        Entries _entries;
+        int64_t _bytes;
+        // every record higher than this is in _entries
+        RecordId _watermark;
+    };
+}
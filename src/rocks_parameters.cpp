@@ -30,6 +30,8 @@
 #include "mongo/platform/basic.h"
 
 #include "rocks_parameters.h"
+#include "rocks_compaction_scheduler.h"
+#include "rocks_operation_stats.h"
 #include "rocks_util.h"
 
 #include "mongo/logger/parse_log_component_settings.h"
@@ -115,7 +117,7 @@ namespace mongo {
     }
 
     Status RocksCompactServerParameter::setFromString(const std::string& str) {
-        _engine->getCompactionScheduler()->compactAll();
+        _engine->compactAll();
         return Status::OK();
     }
 
@@ -215,4 +217,66 @@ namespace mongo {
         return Status(ErrorCodes::BadValue, "This action is supported for RocksDB 4.13 and up");
 #endif
     }
+
+    RocksCompactionConcurrencyParameter::RocksCompactionConcurrencyParameter(RocksEngine* engine)
+        : ServerParameter(ServerParameterSet::getGlobal(),
+                          "rocksdbRuntimeConfigMaxConcurrentCompactions", false, true),
+          _engine(engine) {}
+
+    void RocksCompactionConcurrencyParameter::append(OperationContext* opCtx, BSONObjBuilder& b,
+                                                     const std::string& name) {
+        b.append(name, _engine->getCompactionScheduler()->getMaxConcurrentCompactions());
+    }
+
+    Status RocksCompactionConcurrencyParameter::set(const BSONElement& newValueElement) {
+        if (!newValueElement.isNumber()) {
+            return Status(ErrorCodes::BadValue, str::stream() << name() << " has to be a number");
+        }
+        return _set(newValueElement.numberInt());
+    }
+
+    Status RocksCompactionConcurrencyParameter::setFromString(const std::string& str) {
+        int num = 0;
+        Status status = parseNumberFromString(str, &num);
+        if (!status.isOK()) return status;
+        return _set(num);
+    }
+
+    Status RocksCompactionConcurrencyParameter::_set(int newNum) {
+        if (newNum < 1 || newNum > RocksCompactionScheduler::kMaxConcurrentCompactions) {
+            return Status(ErrorCodes::BadValue,
+                          str::stream() << name() << " has to be between 1 and "
+                                        << RocksCompactionScheduler::kMaxConcurrentCompactions);
+        }
+        log() << "RocksDB: running up to " << newNum << " compactions at the same time";
+        _engine->getCompactionScheduler()->setMaxConcurrentCompactions(newNum);
+        return Status::OK();
+    }
+
+    RocksOperationTimingsParameter::RocksOperationTimingsParameter()
+        : ServerParameter(ServerParameterSet::getGlobal(), "rocksdbOperationTimings", false, true) {}
+
+    void RocksOperationTimingsParameter::append(OperationContext* opCtx, BSONObjBuilder& b,
+                                                const std::string& name) {
+        b.append(name, RocksOperationStats::timingsEnabled());
+    }
+
+    Status RocksOperationTimingsParameter::set(const BSONElement& newValueElement) {
+        if (newValueElement.type() != Bool && !newValueElement.isNumber()) {
+            return Status(ErrorCodes::BadValue, str::stream() << name() << " has to be a boolean");
+        }
+        RocksOperationStats::setTimingsEnabled(newValueElement.trueValue());
+        return Status::OK();
+    }
+
+    Status RocksOperationTimingsParameter::setFromString(const std::string& str) {
+        if (str == "true" || str == "1") {
+            RocksOperationStats::setTimingsEnabled(true);
+        } else if (str == "false" || str == "0") {
+            RocksOperationStats::setTimingsEnabled(false);
+        } else {
+            return Status(ErrorCodes::BadValue, str::stream() << name() << " has to be a boolean");
+        }
+        return Status::OK();
+    }
 }
@@ -116,4 +116,34 @@ namespace mongo {
     private:
         RocksEngine* _engine;
     };
+
+    // Limits how many of the compactions scheduled by the storage engine (dropped prefixes, oplog,
+    // tombstone cleanup and rocksdbCompact) run at the same time:
+    // db.adminCommand({setParameter:1, rocksdbRuntimeConfigMaxConcurrentCompactions: 4})
+    class RocksCompactionConcurrencyParameter : public ServerParameter {
+        MONGO_DISALLOW_COPYING(RocksCompactionConcurrencyParameter);
+
+    public:
+        RocksCompactionConcurrencyParameter(RocksEngine* engine);
+        virtual void append(OperationContext* opCtx, BSONObjBuilder& b, const std::string& name);
+        virtual Status set(const BSONElement& newValueElement);
+        virtual Status setFromString(const std::string& str);
+
+    private:
+        Status _set(int newNum);
+        RocksEngine* _engine;
+    };
+
+    // Adds timings of RocksDB calls to the per-operation storage statistics in slow operation logs
+    // and the profiler. Without it, only counters are collected. Timings cost a few percent:
+    // db.adminCommand({setParameter:1, rocksdbOperationTimings: true})
+    class RocksOperationTimingsParameter : public ServerParameter {
+        MONGO_DISALLOW_COPYING(RocksOperationTimingsParameter);
+
+    public:
+        RocksOperationTimingsParameter();
+        virtual void append(OperationContext* opCtx, BSONObjBuilder& b, const std::string& name);
+        virtual Status set(const BSONElement& newValueElement);
+        virtual Status setFromString(const std::string& str);
+    };
 }
@@ -36,12 +36,15 @@
 #include <mutex>
 #include <memory>
 #include <algorithm>
+#include <limits>
 
 #include <rocksdb/comparator.h>
 #include <rocksdb/db.h>
 #include <rocksdb/experimental.h>
+#include <rocksdb/metadata.h>
 #include <rocksdb/options.h>
 #include <rocksdb/slice.h>
+#include <rocksdb/write_batch.h>
 #include <rocksdb/utilities/write_batch_with_index.h>
 
 #include "mongo/base/checked_cast.h"
@@ -51,6 +54,7 @@
 #include "mongo/db/operation_context.h"
 #include "mongo/db/storage/oplog_hack.h"
 #include "mongo/platform/endian.h"
+#include "mongo/platform/random.h"
 #include "mongo/stdx/memory.h"
 #include "mongo/util/assert_util.h"
 #include "mongo/util/background.h"
@@ -62,7 +66,10 @@
 #include "rocks_durability_manager.h"
 #include "rocks_compaction_scheduler.h"
 #include "rocks_engine.h"
+#include "rocks_global_options.h"
+#include "rocks_oplog_tail_cache.h"
 #include "rocks_recovery_unit.h"
+#include "rocks_ttl.h"
 #include "rocks_util.h"
 
 namespace mongo {
@@ -71,6 +78,28 @@ namespace mongo {
         return std::min(cappedMaxSize / 10, int64_t(16 * 1024 * 1024));
     }
 
+    namespace {
+        // Compacts a range we've deleted with a range tombstone, once the deletion is committed
+        class CompactRangeChange : public RecoveryUnit::Change {
+        public:
+            CompactRangeChange(RocksCompactionScheduler* compactionScheduler,
+                               rocksdb::ColumnFamilyHandle* cf, std::string begin, std::string end)
+                : _compactionScheduler(compactionScheduler),
+                  _cf(cf),
+                  _begin(std::move(begin)),
+                  _end(std::move(end)) {}
+
+            virtual void commit() { _compactionScheduler->compactRange(_cf, _begin, _end); }
+            virtual void rollback() {}
+
+        private:
+            RocksCompactionScheduler* _compactionScheduler;  // not owned
+            rocksdb::ColumnFamilyHandle* _cf;                // not owned
+            const std::string _begin;
+            const std::string _end;
+        };
+    }  // namespace
+
     class RocksRecordStore::CappedInsertChange : public RecoveryUnit::Change {
     public:
         CappedInsertChange(CappedVisibilityManager* cappedVisibilityManager, RocksRecordStore* rs,
@@ -95,7 +124,10 @@ namespace mongo {
 
     CappedVisibilityManager::CappedVisibilityManager(RocksRecordStore* rs,
                                                      RocksDurabilityManager* durabilityManger)
-        : _rs(rs), _oplog_highestSeen(RecordId::min()), _shuttingDown(false) {
+        : _rs(rs),
+          _lowestHiddenRecord(RecordId::max().repr()),
+          _oplog_highestSeen(RecordId::min()),
+          _shuttingDown(false) {
         if (_rs->_isOplog) {
             _oplogJournalThread = stdx::thread(&CappedVisibilityManager::oplogJournalThreadLoop,
                                                this, durabilityManger);
@@ -113,11 +145,21 @@ namespace mongo {
         dassert(_uncommittedRecords.empty() || _uncommittedRecords.back() < record);
         SortedRecordIds::iterator it =
             _uncommittedRecords.insert(_uncommittedRecords.end(), record);
+        if (it == _uncommittedRecords.begin()) {
+            _updateLowestHiddenRecord_inlock();
+        }
         opCtx->recoveryUnit()->registerChange(
             new RocksRecordStore::CappedInsertChange(this, _rs, it));
         _oplog_highestSeen = record;
     }
 
+    void CappedVisibilityManager::_updateLowestHiddenRecord_inlock() {
+        _lowestHiddenRecord.store(_uncommittedRecords.empty()
+                                      ? RecordId::max().repr()
+                                      : _uncommittedRecords.front().repr(),
+                                  std::memory_order_release);
+    }
+
     RecordId CappedVisibilityManager::getNextAndAddUncommittedRecord(
         OperationContext* opCtx, std::function<RecordId()> nextId) {
         stdx::lock_guard<stdx::mutex> lk(_uncommittedRecordIdsMutex);
@@ -151,6 +193,7 @@ namespace mongo {
             for (auto&& op : opsAboutToBeJournaled) {
                 _uncommittedRecords.erase(op);
             }
+            _updateLowestHiddenRecord_inlock();
 
             _opsBecameVisibleCV.notify_all();
             lk.unlock();
@@ -201,19 +244,15 @@ namespace mongo {
                 _opsWaitingForJournalCV.notify_one();
             }
         } else {
+            const bool wasLowest = it == _uncommittedRecords.begin();
             _uncommittedRecords.erase(it);
+            if (wasLowest) {
+                _updateLowestHiddenRecord_inlock();
+            }
             _opsBecameVisibleCV.notify_all();
         }
     }
 
-    bool CappedVisibilityManager::isCappedHidden(const RecordId& record) const {
-        stdx::lock_guard<stdx::mutex> lk(_uncommittedRecordIdsMutex);
-        if (_uncommittedRecords.empty()) {
-            return false;
-        }
-        return _uncommittedRecords.front() <= record;
-    }
-
     void CappedVisibilityManager::updateHighestSeen(const RecordId& record) {
         if (record > _oplog_highestSeen) {
             stdx::lock_guard<stdx::mutex> lk(_uncommittedRecordIdsMutex);
@@ -237,52 +276,238 @@ namespace mongo {
         }
     }
 
-    RecordId CappedVisibilityManager::lowestCappedHiddenRecord() const {
-        stdx::lock_guard<stdx::mutex> lk(_uncommittedRecordIdsMutex);
-        return _uncommittedRecords.empty() ? RecordId() : _uncommittedRecords.front();
-    }
+    class RocksRecordStore::OplogStones::InsertChange : public RecoveryUnit::Change {
+    public:
+        InsertChange(OplogStones* oplogStones, int64_t bytesInserted,
+                     const RecordId& highestInserted, int64_t countInserted)
+            : _oplogStones(oplogStones),
+              _bytesInserted(bytesInserted),
+              _highestInserted(highestInserted),
+              _countInserted(countInserted) {}
+
+        virtual void commit() {
+            _oplogStones->_currentRecords.fetch_add(_countInserted);
+            int64_t newCurrentBytes = _oplogStones->_currentBytes.fetch_add(_bytesInserted) +
+                                      _bytesInserted;
+            if (newCurrentBytes >= _oplogStones->_minBytesPerStone.load()) {
+                _oplogStones->_createNewStoneIfNeeded(_highestInserted);
+            }
+        }
+
+        virtual void rollback() {}
+
+    private:
+        OplogStones* _oplogStones;
+        int64_t _bytesInserted;
+        RecordId _highestInserted;
+        int64_t _countInserted;
+    };
 
-    // this object keeps track of keys in oplog. The format is this:
-    // <prefix>RecordId --> dataSize (small endian 32 bytes)
-    // <prefix> is oplog_prefix+1 (reserved by rocks_engine.cpp)
-    // That way we can cheaply delete old record in the oplog without actually reading oplog
-    // collection.
-    // All of the locking is done somewhere else -- we write exactly the same data as oplog, so we
-    // assume oplog already locked the relevant keys
-    class RocksOplogKeyTracker {
+    class RocksRecordStore::OplogStones::TruncateChange : public RecoveryUnit::Change {
     public:
-        RocksOplogKeyTracker(std::string prefix) : _prefix(std::move(prefix)) {}
-        void insertKey(RocksRecoveryUnit* ru, const RecordId& loc, int len) {
-            uint32_t lenLittleEndian = endian::nativeToLittle(static_cast<uint32_t>(len));
-            ru->writeBatch()->Put(RocksRecordStore::_makePrefixedKey(_prefix, loc),
-                                  rocksdb::Slice(reinterpret_cast<const char*>(&lenLittleEndian),
-                                                 sizeof(lenLittleEndian)));
+        TruncateChange(OplogStones* oplogStones) : _oplogStones(oplogStones) {}
+
+        virtual void commit() {
+            _oplogStones->_currentRecords.store(0);
+            _oplogStones->_currentBytes.store(0);
+
+            stdx::lock_guard<stdx::mutex> lk(_oplogStones->_mutex);
+            _oplogStones->_stones.clear();
+        }
+
+        virtual void rollback() {}
+
+    private:
+        OplogStones* _oplogStones;
+    };
+
+    RocksRecordStore::OplogStones::OplogStones(RocksRecordStore* rs)
+        : _rs(rs), _currentRecords(0), _currentBytes(0), _minBytesPerStone(0) {
+        invariant(rs->_isCapped && rs->_isOplog);
+        setMaxSize(rs->_cappedMaxSize);
+        _calculateStones();
+    }
+
+    void RocksRecordStore::OplogStones::setMaxSize(int64_t maxSize) {
+        // Like WiredTiger, aim for stones of about the maximum BSON document size, within bounds
+        const int64_t numStones = std::max(
+            static_cast<int64_t>(kMinStonesToKeep),
+            std::min(maxSize / BSONObjMaxInternalSize, static_cast<int64_t>(kMaxStonesToKeep)));
+
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        _numStonesToKeep = static_cast<size_t>(numStones);
+        _minBytesPerStone.store(std::max(maxSize / numStones, static_cast<int64_t>(1)));
+    }
+
+    bool RocksRecordStore::OplogStones::hasExcessStones() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _stones.size() > _numStonesToKeep;
+    }
+
+    boost::optional<RocksRecordStore::OplogStones::Stone>
+    RocksRecordStore::OplogStones::peekOldestStone() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        if (_stones.empty()) {
+            return {};
+        }
+        return _stones.front();
+    }
+
+    void RocksRecordStore::OplogStones::popOldestStone() {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        invariant(!_stones.empty());
+        _stones.pop_front();
+    }
+
+    size_t RocksRecordStore::OplogStones::numStones() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _stones.size();
+    }
+
+    void RocksRecordStore::OplogStones::updateCurrentStoneAfterInsertOnCommit(
+        OperationContext* opCtx, int64_t bytesInserted, const RecordId& highestInserted,
+        int64_t countInserted) {
+        opCtx->recoveryUnit()->registerChange(
+            new InsertChange(this, bytesInserted, highestInserted, countInserted));
+    }
+
+    void RocksRecordStore::OplogStones::clearStonesOnCommit(OperationContext* opCtx) {
+        opCtx->recoveryUnit()->registerChange(new TruncateChange(this));
+    }
+
+    void RocksRecordStore::OplogStones::updateStonesAfterCappedTruncateAfter(
+        int64_t recordsRemoved, int64_t bytesRemoved, const RecordId& firstRemovedId) {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+
+        int64_t recordsInRemovedStones = 0;
+        int64_t bytesInRemovedStones = 0;
+        while (!_stones.empty() && _stones.back().lastRecord >= firstRemovedId) {
+            recordsInRemovedStones += _stones.back().records;
+            bytesInRemovedStones += _stones.back().bytes;
+            _stones.pop_back();
+        }
+
+        // Whatever was removed beyond the dropped stones came out of the current one. The stone
+        // that now comes last may also have lost records; we don't know how many, so it keeps its
+        // size and we might reclaim it a bit early
+        _currentRecords.store(std::max(
+            _currentRecords.load() - (recordsRemoved - recordsInRemovedStones), int64_t(0)));
+        _currentBytes.store(
+            std::max(_currentBytes.load() - (bytesRemoved - bytesInRemovedStones), int64_t(0)));
+    }
+
+    void RocksRecordStore::OplogStones::_createNewStoneIfNeeded(const RecordId& lastRecord) {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        if (_currentBytes.load() < _minBytesPerStone.load()) {
+            // somebody else created a stone in the meantime
+            return;
         }
-        void deleteKey(RocksRecoveryUnit* ru, const RecordId& loc) {
-            ru->writeBatch()->Delete(RocksRecordStore::_makePrefixedKey(_prefix, loc));
-            _deletedKeysSinceCompaction++;
+        if (!_stones.empty() && lastRecord <= _stones.back().lastRecord) {
+            // commits can finish out of order. This one is covered by the previous stone, the next
+            // commit will close the current stone
+            return;
         }
-        rocksdb::Iterator* newIterator(RocksRecoveryUnit* ru) {
-            return ru->NewIterator(_prefix, true);
+
+        Stone stone{_currentRecords.exchange(0), _currentBytes.exchange(0), lastRecord};
+        LOG(2) << "created oplog stone ending at " << lastRecord << " with " << stone.records
+               << " records and " << stone.bytes << " bytes";
+        _stones.push_back(stone);
+    }
+
+    void RocksRecordStore::OplogStones::_calculateStones() {
+        const int64_t numRecords = _rs->_numRecords.load();
+        const int64_t dataSize = _rs->_dataSize.load();
+        log() << "The oplog contains " << numRecords << " records totalling to " << dataSize
+              << " bytes";
+
+        // Only sample if there are enough records to pick samples from for every stone
+        const int64_t minRecordsToSample =
+            static_cast<int64_t>(kMinSampleRatio) * kRandomSamplesPerStone * _numStonesToKeep;
+        if (numRecords <= 0 || dataSize <= 0 || numRecords < minRecordsToSample) {
+            _calculateStonesByScanning();
+        } else {
+            _calculateStonesBySampling(numRecords, dataSize);
         }
-        int decodeSize(const rocksdb::Slice& value) {
-            uint32_t size =
-                endian::littleToNative(*reinterpret_cast<const uint32_t*>(value.data()));
-            return static_cast<int>(size);
+    }
+
+    void RocksRecordStore::OplogStones::_calculateStonesByScanning() {
+        log() << "Scanning the oplog to determine where to place markers for truncation";
+
+        int64_t numRecords = 0;
+        int64_t dataSize = 0;
+        std::unique_ptr<RocksIterator> iter(
+            RocksRecoveryUnit::NewIteratorNoSnapshot(_rs->_db, _rs->_cf, _rs->_prefix));
+        for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+            _currentRecords.fetch_add(1);
+            const int64_t newCurrentBytes = _currentBytes.fetch_add(iter->value().size()) +
+                                            iter->value().size();
+            ++numRecords;
+            dataSize += iter->value().size();
+            if (newCurrentBytes >= _minBytesPerStone.load()) {
+                _createNewStoneIfNeeded(_makeRecordId(iter->key()));
+            }
         }
-        void resetDeletedSinceCompaction() {
-            _deletedKeysSinceCompaction = 0;
+        invariantRocksOK(iter->status());
+
+        // the counters might have drifted, we know the exact numbers now
+        _rs->_numRecords.store(numRecords);
+        _rs->_dataSize.store(dataSize);
+    }
+
+    void RocksRecordStore::OplogStones::_calculateStonesBySampling(int64_t numRecords,
+                                                                   int64_t dataSize) {
+        log() << "Sampling the oplog to determine where to place markers for truncation";
+
+        const int64_t avgRecordSize = std::max(dataSize / numRecords, int64_t(1));
+        const int64_t minBytesPerStone = _minBytesPerStone.load();
+        const int64_t estRecordsPerStone =
+            std::max((minBytesPerStone + avgRecordSize - 1) / avgRecordSize, int64_t(1));
+        const int64_t estBytesPerStone = estRecordsPerStone * avgRecordSize;
+        const int64_t wholeStones = numRecords / estRecordsPerStone;
+        if (wholeStones == 0) {
+            _calculateStonesByScanning();
+            return;
+        }
+
+        // Sample the records the way a random cursor does, seeking into the key ranges of the
+        // SST files that hold them weighted by size, so bytes rather than time are sampled
+        const int64_t numSamples = kRandomSamplesPerStone * wholeStones;
+        RandomCursor cursor(nullptr, _rs->_db, _rs->_cf, _rs->_prefix, nullptr, false);
+        std::vector<RecordId> samples;
+        samples.reserve(numSamples);
+        for (int64_t i = 0; i < numSamples; ++i) {
+            auto record = cursor.next();
+            if (!record) {
+                // the oplog is empty after all, the counters were off
+                _calculateStonesByScanning();
+                return;
+            }
+            samples.push_back(record->id);
         }
-        long long getDeletedSinceCompaction() {
-            return _deletedKeysSinceCompaction;
+        std::sort(samples.begin(), samples.end());
+
+        {
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            for (int64_t i = 1; i <= wholeStones; ++i) {
+                const RecordId& lastRecord = samples[i * kRandomSamplesPerStone - 1];
+                if (!_stones.empty() && lastRecord <= _stones.back().lastRecord) {
+                    continue;
+                }
+                LOG(1) << "placing an oplog stone at " << lastRecord;
+                _stones.push_back({estRecordsPerStone, estBytesPerStone, lastRecord});
+            }
         }
 
-    private:
-        std::atomic<long long> _deletedKeysSinceCompaction;
-        std::string _prefix;
-    };
+        _currentRecords.store(
+            std::max(numRecords - estRecordsPerStone * static_cast<int64_t>(_stones.size()),
+                     int64_t(0)));
+        _currentBytes.store(
+            std::max(dataSize - estBytesPerStone * static_cast<int64_t>(_stones.size()),
+                     int64_t(0)));
+    }
 
     RocksRecordStore::RocksRecordStore(StringData ns, StringData id, rocksdb::DB* db,
+                                       rocksdb::ColumnFamilyHandle* cf,
                                        RocksCounterManager* counterManager,
                                        RocksDurabilityManager* durabilityManager,
                                        RocksCompactionScheduler* compactionScheduler,
@@ -290,6 +515,7 @@ namespace mongo {
                                        int64_t cappedMaxDocs, CappedCallback* cappedCallback)
         : RecordStore(ns),
           _db(db),
+          _cf(cf),
           _counterManager(counterManager),
           _compactionScheduler(compactionScheduler),
           _prefix(std::move(prefix)),
@@ -300,8 +526,6 @@ namespace mongo {
           _cappedCallback(cappedCallback),
           _cappedDeleteCheckCount(0),
           _isOplog(NamespaceString::oplog(ns)),
-          _oplogKeyTracker(_isOplog ? new RocksOplogKeyTracker(rocksGetNextPrefix(_prefix))
-                                    : nullptr),
           _cappedOldestKeyHint(0),
           _cappedVisibilityManager((_isCapped || _isOplog)
                                        ? new CappedVisibilityManager(this, durabilityManager)
@@ -326,16 +550,17 @@ namespace mongo {
 
         // Get next id
         std::unique_ptr<RocksIterator> iter(
-            RocksRecoveryUnit::NewIteratorNoSnapshot(_db, _prefix));
+            RocksRecoveryUnit::NewIteratorNoSnapshot(_db, _cf, _prefix));
         // first check if the collection is empty
         iter->SeekPrefix("");
         bool emptyCollection = !iter->Valid();
+        RecordId lastId;
         if (!emptyCollection) {
             // if it's not empty, find next RecordId
             iter->SeekToLast();
             dassert(iter->Valid());
             rocksdb::Slice lastSlice = iter->key();
-            RecordId lastId = _makeRecordId(lastSlice);
+            lastId = _makeRecordId(lastSlice);
             if (_isOplog || _isCapped) {
                 _cappedVisibilityManager->updateHighestSeen(lastId);
             }
@@ -355,6 +580,22 @@ namespace mongo {
           _numRecords.store(0);
         }
 
+        if (_isOplog) {
+            _deleteLegacyOplogKeyTracker();
+            _oplogInFifoColumnFamily = _configureOplogColumnFamily();
+            if (RocksRecoveryUnit::supportsRefreshIterator()) {
+                _tailingIterators = std::make_shared<TailingIteratorPool>(_db, _cf, _prefix);
+            }
+            if (rocksGlobalOptions.oplogTailCacheSizeMB > 0) {
+                _oplogTailCache = std::make_shared<RocksOplogTailCache>(
+                    static_cast<int64_t>(rocksGlobalOptions.oplogTailCacheSizeMB) * 1024 * 1024,
+                    lastId);
+            }
+            if (_isCapped) {
+                _oplogStones.reset(new OplogStones(this));
+            }
+        }
+
         _hasBackgroundThread = RocksEngine::initRsOplogBackgroundThread(ns);
     }
 
@@ -363,11 +604,25 @@ namespace mongo {
             stdx::lock_guard<stdx::timed_mutex> lk(_cappedDeleterMutex);
             _shuttingDown = true;
         }
-        delete _oplogKeyTracker;
 
         if (_cappedVisibilityManager) {
           _cappedVisibilityManager->joinOplogJournalThreadLoop();
         }
+
+        if (_ttlCollection) {
+            _ttlCollection->close();
+        }
+    }
+
+    void RocksRecordStore::setTtlCollection(std::shared_ptr<RocksTtlCollection> ttlCollection) {
+        invariant(!_isCapped && !_ttlCollection);
+        _ttlCollection = std::move(ttlCollection);
+        RocksEngine::initTtlReaperThread(ns());
+    }
+
+    void RocksRecordStore::expiredRecordReaped(OperationContext* opCtx, int64_t dataSize) {
+        _changeNumRecords(opCtx, -1);
+        _increaseDataSize(opCtx, -dataSize);
     }
 
     int64_t RocksRecordStore::storageSize(OperationContext* opCtx, BSONObjBuilder* extraInfo,
@@ -379,7 +634,7 @@ namespace mongo {
     }
 
     RecordData RocksRecordStore::dataFor(OperationContext* opCtx, const RecordId& loc) const {
-        RecordData rd = _getDataFor(_db, _prefix, opCtx, loc);
+        RecordData rd = _getDataFor(_cf, _prefix, opCtx, loc);
         massert(28605, "Didn't find RecordId in RocksRecordStore", (rd.data() != nullptr));
         return rd;
     }
@@ -393,13 +648,13 @@ namespace mongo {
         }
 
         std::string oldValue;
-        auto status = ru->Get(key, &oldValue);
+        auto status = ru->Get(_cf, key, &oldValue);
         invariantRocksOK(status);
         int oldLength = oldValue.size();
 
-        ru->writeBatch()->Delete(key);
-        if (_isOplog) {
-            _oplogKeyTracker->deleteKey(ru, dl);
+        ru->writeBatch()->Delete(_cf, key);
+        if (_oplogTailCache) {
+            _oplogTailCache->deleteRecord(opCtx, dl);
         }
 
         _changeNumRecords(opCtx, -1);
@@ -496,6 +751,10 @@ namespace mongo {
 
     int64_t RocksRecordStore::cappedDeleteAsNeeded_inlock(OperationContext* opCtx,
                                                           const RecordId& justInserted) {
+        if (_oplogStones) {
+            return _reclaimOplog(opCtx, justInserted);
+        }
+
         // we do this is a sub transaction in case it aborts
         RocksRecoveryUnit* realRecoveryUnit =
             checked_cast<RocksRecoveryUnit*>(opCtx->releaseRecoveryUnit());
@@ -513,22 +772,11 @@ namespace mongo {
         if (_cappedMaxDocs != -1 && numRecords > _cappedMaxDocs) {
             docsOverCap = numRecords - _cappedMaxDocs;
         }
-        BSONObj emptyBson;
 
         try {
             WriteUnitOfWork wuow(opCtx);
             auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
-            std::unique_ptr<rocksdb::Iterator> iter;
-            if (_isOplog) {
-                // we're using _oplogKeyTracker to find which keys to delete -- this is much faster
-                // because we don't need to read any values. We theoretically need values to pass
-                // the document to the cappedCallback, but the callback is only using
-                // documents to remove them from indexes. opLog doesn't have indexes, so there
-                // should be no need for us to reconstruct the document to pass it to the callback
-                iter.reset(_oplogKeyTracker->newIterator(ru));
-            } else {
-                iter.reset(ru->NewIterator(_prefix));
-            }
+            std::unique_ptr<rocksdb::Iterator> iter(ru->NewIterator(_cf, _prefix));
             int64_t storage;
             iter->Seek(RocksRecordStore::_makeKey(_cappedOldestKeyHint, &storage));
 
@@ -559,17 +807,9 @@ namespace mongo {
                     break;
                 }
 
-                rocksdb::Slice oldValue;
+                rocksdb::Slice oldValue = iter->value();
                 ++docsRemoved;
-                if (_isOplog) {
-                    // trick the callback by giving it empty bson document
-                    oldValue = rocksdb::Slice(emptyBson.objdata(), emptyBson.objsize());
-                    // we keep data size in the value
-                    sizeSaved += _oplogKeyTracker->decodeSize(iter->value());
-                } else {
-                    oldValue = iter->value();
-                    sizeSaved += oldValue.size();
-                }
+                sizeSaved += oldValue.size();
 
                 {
                     stdx::lock_guard<stdx::mutex> lk(_cappedCallbackMutex);
@@ -580,10 +820,7 @@ namespace mongo {
                     }
                 }
 
-                ru->writeBatch()->Delete(key);
-                if (_isOplog) {
-                    _oplogKeyTracker->deleteKey(ru, newestOld);
-                }
+                ru->writeBatch()->Delete(_cf, key);
 
                 iter->Next();
             }
@@ -625,28 +862,192 @@ namespace mongo {
         delete opCtx->releaseRecoveryUnit();
         opCtx->setRecoveryUnit(realRecoveryUnit, realRUstate);
 
-        if (_isOplog) {
-            if ((_oplogSinceLastCompaction.minutes() >= kOplogCompactEveryMins) ||
-            (_oplogKeyTracker->getDeletedSinceCompaction() >= kOplogCompactEveryDeletedRecords)) {
-                log() << "Scheduling oplog compactions. time since last " << _oplogSinceLastCompaction.minutes() <<
-                    " deleted since last " << _oplogKeyTracker->getDeletedSinceCompaction();
-                _oplogSinceLastCompaction.reset();
-                // schedule compaction for oplog
-                std::string oldestAliveKey(_makePrefixedKey(_prefix, _cappedOldestKeyHint));
-                _compactionScheduler->compactOplog(_prefix, oldestAliveKey);
-
-                // schedule compaction for oplog tracker
-                std::string oplogKeyTrackerPrefix(rocksGetNextPrefix(_prefix));
-                oldestAliveKey = _makePrefixedKey(oplogKeyTrackerPrefix, _cappedOldestKeyHint);
-                _compactionScheduler->compactOplog(oplogKeyTrackerPrefix, oldestAliveKey);
-
-                _oplogKeyTracker->resetDeletedSinceCompaction();
+        return docsRemoved;
+    }
+
+    int64_t RocksRecordStore::_reclaimOplog(OperationContext* opCtx,
+                                            const RecordId& justInserted) {
+        // we do this is a sub transaction, the caller might be in the middle of one
+        RocksRecoveryUnit* realRecoveryUnit =
+            checked_cast<RocksRecoveryUnit*>(opCtx->releaseRecoveryUnit());
+        invariant(realRecoveryUnit);
+        OperationContext::RecoveryUnitState const realRUstate =
+            opCtx->setRecoveryUnit(realRecoveryUnit->newRocksRecoveryUnit(),
+                                   OperationContext::kNotInUnitOfWork);
+
+        int64_t docsRemoved = 0;
+        try {
+            while (!_shuttingDown && _oplogStones->hasExcessStones()) {
+                auto stone = _oplogStones->peekOldestStone();
+                invariant(stone);
+                // don't go past the record we just inserted, and wait for older transactions to
+                // commit before deleting what they've written
+                if (stone->lastRecord >= justInserted ||
+                    _cappedVisibilityManager->isCappedHidden(stone->lastRecord)) {
+                    break;
+                }
+
+                // The oplog has no indexes, so unlike other capped collections we don't need to
+                // tell the capped callback about every document we delete. Nobody updates old
+                // oplog entries either, so we don't need to register writes
+                const RecordId nextAlive(stone->lastRecord.repr() + 1);
+                const std::string beginKey(_makePrefixedKey(_prefix, _cappedOldestKeyHint));
+                const std::string endKey(_makePrefixedKey(_prefix, nextAlive));
+                WriteUnitOfWork wuow(opCtx);
+                auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
+                if (_oplogInFifoColumnFamily) {
+                    _checkOplogStoneBeforeReclaim(opCtx, stone->lastRecord);
+                }
+                if (RocksRecoveryUnit::supportsDeleteRange()) {
+                    ru->deleteRange(_cf, beginKey, endKey);
+                } else {
+                    std::unique_ptr<RocksIterator> iter(ru->NewIterator(_cf, _prefix, true));
+                    int64_t storage;
+                    for (iter->Seek(_makeKey(_cappedOldestKeyHint, &storage));
+                         iter->Valid() && _makeRecordId(iter->key()) < nextAlive; iter->Next()) {
+                        ru->writeBatch()->Delete(
+                            _cf, _makePrefixedKey(_prefix, _makeRecordId(iter->key())));
+                    }
+                    invariantRocksOK(iter->status());
+                }
+                _changeNumRecords(opCtx, -stone->records);
+                _increaseDataSize(opCtx, -stone->bytes);
+                wuow.commit();
+
+                _oplogStones->popOldestStone();
+                if (_oplogTailCache) {
+                    _oplogTailCache->reclaimUpTo(stone->lastRecord);
+                }
+                _cappedOldestKeyHint = nextAlive;
+                docsRemoved += stone->records;
+                ++_oplogStonesSinceLastCompaction;
+                LOG(1) << "Reclaimed an oplog stone of " << stone->records << " records and "
+                       << stone->bytes << " bytes ending at " << stone->lastRecord;
             }
+        } catch (...) {
+            delete opCtx->releaseRecoveryUnit();
+            opCtx->setRecoveryUnit(realRecoveryUnit, realRUstate);
+            throw;
+        }
+
+        delete opCtx->releaseRecoveryUnit();
+        opCtx->setRecoveryUnit(realRecoveryUnit, realRUstate);
+
+        if (_oplogInFifoColumnFamily) {
+            const uint64_t needed = _oplogColumnFamilyMaxSizeNeeded();
+            if (needed > _oplogColumnFamilyMaxSize.load()) {
+                // grow by a quarter more than needed, so that we don't do this on every insert
+                log() << "Oplog reclaiming is behind, letting its column family grow to "
+                      << needed + needed / 4 << " bytes";
+                _setOplogColumnFamilyMaxSize(needed + needed / 4);
+            }
+        }
+
+        if (!_oplogInFifoColumnFamily && _oplogStonesSinceLastCompaction > 0 &&
+            (_oplogSinceLastCompaction.minutes() >= kOplogCompactEveryMins ||
+             _oplogStonesSinceLastCompaction >= kOplogCompactEveryStones)) {
+            log() << "Scheduling oplog compaction. time since last "
+                  << _oplogSinceLastCompaction.minutes() << " stones reclaimed since last "
+                  << _oplogStonesSinceLastCompaction;
+            _oplogSinceLastCompaction.reset();
+            _oplogStonesSinceLastCompaction = 0;
+            std::string oldestAliveKey(_makePrefixedKey(_prefix, _cappedOldestKeyHint));
+            _compactionScheduler->compactOplog(_cf, _prefix, oldestAliveKey);
         }
 
         return docsRemoved;
     }
 
+    void RocksRecordStore::_deleteLegacyOplogKeyTracker() {
+        // Before oplog stones we kept a <RecordId -> size> entry for every oplog entry under the
+        // prefix after the oplog's. That prefix is still reserved for the oplog, we just clean up
+        // whatever is left there once
+        const std::string trackerPrefix(rocksGetNextPrefix(_prefix));
+        std::unique_ptr<RocksIterator> iter(
+            RocksRecoveryUnit::NewIteratorNoSnapshot(_db, _cf, trackerPrefix));
+        iter->SeekToFirst();
+        if (!iter->Valid()) {
+            invariantRocksOK(iter->status());
+            return;
+        }
+
+        log() << "Deleting the oplog key tracker, oplog stones replace it";
+        const std::string endKey(rocksGetNextPrefix(trackerPrefix));
+        rocksdb::WriteOptions syncOptions;
+        syncOptions.sync = true;
+        if (RocksRecoveryUnit::supportsDeleteRange()) {
+            rocksdb::WriteBatch wb;
+            invariantRocksOK(wb.DeleteRange(_cf, trackerPrefix, endKey));
+            invariantRocksOK(_db->Write(syncOptions, &wb));
+        } else {
+            rocksdb::WriteBatch wb;
+            for (; iter->Valid(); iter->Next()) {
+                wb.Delete(_cf, trackerPrefix + iter->key().ToString());
+            }
+            invariantRocksOK(iter->status());
+            invariantRocksOK(_db->Write(syncOptions, &wb));
+        }
+        _compactionScheduler->compactRange(_cf, trackerPrefix, endKey);
+    }
+
+    bool RocksRecordStore::_configureOplogColumnFamily() {
+        rocksdb::ColumnFamilyDescriptor descriptor;
+        invariantRocksOK(_cf->GetDescriptor(&descriptor));
+        if (descriptor.options.compaction_style != rocksdb::kCompactionStyleFIFO) {
+            return false;
+        }
+        if (!_isCapped) {
+            return true;
+        }
+
+        _oplogMemtableBytes =
+            descriptor.options.write_buffer_size * descriptor.options.max_write_buffer_number;
+        _setOplogColumnFamilyMaxSize(_oplogColumnFamilyMaxSizeNeeded());
+        return true;
+    }
+
+    uint64_t RocksRecordStore::_oplogColumnFamilyMaxSizeNeeded() const {
+        // Stones delete reclaimed records with range tombstones, and FIFO compaction later drops
+        // the files holding them. Leave room for twice what we keep plus the memtables, so that
+        // files are only dropped once everything in them has been reclaimed. We usually keep the
+        // capped size, but more while reclaiming falls behind, e.g. while an old transaction
+        // keeps records hidden. The limit applies to the files as stored, so go by their size
+        // rather than by _dataSize, which doesn't know about compression or tombstoned entries
+        uint64_t sstFilesSize = 0;
+        _db->GetIntProperty(_cf, "rocksdb.total-sst-files-size", &sstFilesSize);
+        const uint64_t kept = std::max(static_cast<uint64_t>(_cappedMaxSize), sstFilesSize);
+        return 2 * kept + _oplogMemtableBytes;
+    }
+
+    void RocksRecordStore::_setOplogColumnFamilyMaxSize(uint64_t maxTableFilesSize) {
+        auto s = _db->SetOptions(
+            _cf, {{"compaction_options_fifo",
+                   "{max_table_files_size=" + std::to_string(maxTableFilesSize) + ";}"}});
+        if (!s.ok()) {
+            log() << "Failed to size the oplog column family to " << maxTableFilesSize
+                  << " bytes: " << s.ToString();
+            return;
+        }
+        _oplogColumnFamilyMaxSize.store(maxTableFilesSize);
+    }
+
+    void RocksRecordStore::_checkOplogStoneBeforeReclaim(OperationContext* opCtx,
+                                                         const RecordId& lastRecord) {
+        // Nothing but reclaiming deletes the records of a stone, so if none of them is left,
+        // FIFO compaction dropped them while they were still live
+        auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
+        std::unique_ptr<RocksIterator> iter(ru->NewIterator(_cf, _prefix, true));
+        int64_t storage;
+        iter->Seek(_makeKey(_cappedOldestKeyHint, &storage));
+        invariantRocksOK(iter->status());
+        if (!iter->Valid() || _makeRecordId(iter->key()) > lastRecord) {
+            severe() << "FIFO compaction dropped oplog entries from " << _cappedOldestKeyHint
+                     << " to " << lastRecord << " before they were reclaimed. The oplog column "
+                     << "family is limited to " << _oplogColumnFamilyMaxSize.load() << " bytes";
+            fassertFailedNoTrace(90418);
+        }
+    }
+
     StatusWith<RecordId> RocksRecordStore::insertRecord( OperationContext* opCtx,
                                                         const char* data,
                                                         int len,
@@ -677,9 +1078,12 @@ namespace mongo {
 
         // No need to register the write here, since we just allocated a new RecordId so no other
         // transaction can access this key before we commit
-        ru->writeBatch()->Put(_makePrefixedKey(_prefix, loc), rocksdb::Slice(data, len));
-        if (_isOplog) {
-            _oplogKeyTracker->insertKey(ru, loc, len);
+        ru->writeBatch()->Put(_cf, _makePrefixedKey(_prefix, loc), rocksdb::Slice(data, len));
+        if (_oplogTailCache) {
+            _oplogTailCache->insertRecord(opCtx, loc, data, len);
+        }
+        if (_oplogStones) {
+            _oplogStones->updateCurrentStoneAfterInsertOnCommit(opCtx, len, loc, 1);
         }
 
         _changeNumRecords( opCtx, 1 );
@@ -736,14 +1140,14 @@ namespace mongo {
         }
 
         std::string old_value;
-        auto status = ru->Get(key, &old_value);
+        auto status = ru->Get(_cf, key, &old_value);
         invariantRocksOK(status);
 
         int old_length = old_value.size();
 
-        ru->writeBatch()->Put(key, rocksdb::Slice(data, len));
-        if (_isOplog) {
-            _oplogKeyTracker->insertKey(ru, loc, len);
+        ru->writeBatch()->Put(_cf, key, rocksdb::Slice(data, len));
+        if (_oplogTailCache) {
+            _oplogTailCache->updateRecord(opCtx, loc, data, len);
         }
 
         _increaseDataSize(opCtx, len - old_length);
@@ -781,15 +1185,150 @@ namespace mongo {
             startIterator = _cappedOldestKeyHint;
         }
 
-        return stdx::make_unique<Cursor>(opCtx, _db, _prefix, _cappedVisibilityManager, forward,
-                                         _isCapped, startIterator);
+        return stdx::make_unique<Cursor>(opCtx, _db, _cf, _prefix, _cappedVisibilityManager,
+                                         forward, _isCapped, startIterator, RecordId(),
+                                         _tailingIterators, _oplogTailCache);
+    }
+
+    std::vector<RecordId> RocksRecordStore::getPartitionBoundaries(OperationContext* opCtx,
+                                                                   size_t numPartitions) const {
+        std::vector<RecordId> boundaries;
+        auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
+        std::unique_ptr<RocksIterator> iter(ru->NewIterator(_cf, _prefix));
+        iter->SeekToFirst();
+        if (numPartitions < 2 || !iter->Valid()) {
+            invariantRocksOK(iter->status());
+            return boundaries;
+        }
+        const RecordId firstLoc = _makeRecordId(iter->key());
+        iter->SeekToLast();
+        invariant(iter->Valid());
+        const RecordId lastLoc = _makeRecordId(iter->key());
+        const std::string firstKey(_makePrefixedKey(_prefix, firstLoc));
+        const std::string lastKey(_makePrefixedKey(_prefix, lastLoc));
+
+        // Candidate split points: the SST file boundaries that fall into the record store, plus
+        // points spread evenly over the RecordId range for the data that's still in memtables
+        std::vector<std::string> candidates;
+        std::vector<rocksdb::LiveFileMetaData> files;
+        _db->GetLiveFilesMetaData(&files);
+        const std::string cfName = _cf->GetName();
+        for (const auto& file : files) {
+            if (file.column_family_name != cfName) {
+                continue;
+            }
+            for (const auto* key : {&file.smallestkey, &file.largestkey}) {
+                if (*key > firstKey && *key < lastKey) {
+                    candidates.push_back(*key);
+                }
+            }
+        }
+        const size_t kCandidatesPerPartition = 16;
+        const size_t numEvenCandidates = numPartitions * kCandidatesPerPartition;
+        const uint64_t width = static_cast<uint64_t>(lastLoc.repr()) - firstLoc.repr();
+        for (size_t i = 1; i < numEvenCandidates; ++i) {
+            // (width / n) * i + (width % n) * i / n, so that nothing overflows
+            const uint64_t offset = width / numEvenCandidates * i +
+                width % numEvenCandidates * i / numEvenCandidates;
+            candidates.push_back(_makePrefixedKey(
+                _prefix, RecordId(static_cast<int64_t>(firstLoc.repr() + offset))));
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        // how much data lies before each candidate
+        std::vector<rocksdb::Range> ranges;
+        ranges.reserve(candidates.size() + 1);
+        for (const auto& candidate : candidates) {
+            ranges.emplace_back(firstKey, candidate);
+        }
+        ranges.emplace_back(firstKey, lastKey);
+        std::vector<uint64_t> sizes(ranges.size());
+        _db->GetApproximateSizes(_cf, ranges.data(), static_cast<int>(ranges.size()),
+                                 sizes.data());
+        const uint64_t totalSize = sizes.back();
+
+        size_t candidate = 0;
+        for (size_t partition = 1; partition < numPartitions; ++partition) {
+            if (totalSize > 0) {
+                const uint64_t target = totalSize / numPartitions * partition;
+                while (candidate + 1 < candidates.size() && sizes[candidate] < target) {
+                    ++candidate;
+                }
+            } else {
+                // nothing is in SST files yet, assume the records are spread evenly
+                candidate = candidates.size() * partition / numPartitions;
+            }
+            if (candidate >= candidates.size()) {
+                break;
+            }
+            // snap to the first record at or after the candidate
+            const std::string& key = candidates[candidate];
+            iter->Seek(rocksdb::Slice(key.data() + _prefix.size(), key.size() - _prefix.size()));
+            if (!iter->Valid()) {
+                invariantRocksOK(iter->status());
+                break;
+            }
+            RecordId boundary = _makeRecordId(iter->key());
+            if (boundary > firstLoc && (boundaries.empty() || boundary > boundaries.back())) {
+                boundaries.push_back(boundary);
+            }
+        }
+        return boundaries;
+    }
+
+    std::vector<std::unique_ptr<SeekableRecordCursor>> RocksRecordStore::getPartitionedCursors(
+        const std::vector<OperationContext*>& opCtxs) const {
+        invariant(!opCtxs.empty());
+        auto snapshot = RocksRecoveryUnit::getRocksRecoveryUnit(opCtxs[0])->shareSnapshot();
+        for (size_t i = 1; i < opCtxs.size(); ++i) {
+            RocksRecoveryUnit::getRocksRecoveryUnit(opCtxs[i])->attachSharedSnapshot(snapshot);
+        }
+
+        const std::vector<RecordId> boundaries = getPartitionBoundaries(opCtxs[0], opCtxs.size());
+        std::vector<std::unique_ptr<SeekableRecordCursor>> cursors;
+        for (size_t i = 0; i <= boundaries.size(); ++i) {
+            const RecordId begin = i == 0 ? RecordId() : boundaries[i - 1];
+            const RecordId end = i == boundaries.size() ? RecordId() : boundaries[i];
+            cursors.push_back(stdx::make_unique<Cursor>(opCtxs[i], _db, _cf, _prefix,
+                                                        _cappedVisibilityManager, true, _isCapped,
+                                                        begin, end));
+        }
+        return cursors;
+    }
+
+    std::unique_ptr<RecordCursor> RocksRecordStore::getRandomCursor(
+        OperationContext* opCtx) const {
+        return getRandomCursor(opCtx, false);
+    }
+
+    std::unique_ptr<RecordCursor> RocksRecordStore::getRandomCursor(OperationContext* opCtx,
+                                                                    bool avoidDuplicates) const {
+        return stdx::make_unique<RandomCursor>(opCtx, _db, _cf, _prefix, _cappedVisibilityManager,
+                                               avoidDuplicates);
     }
 
     Status RocksRecordStore::truncate(OperationContext* opCtx) {
+        if (_oplogStones) {
+            _oplogStones->clearStonesOnCommit(opCtx);
+        }
+        if (_oplogTailCache) {
+            _oplogTailCache->truncate(opCtx);
+        }
+
+        if (RocksRecoveryUnit::supportsDeleteRange()) {
+            // We hold the collection lock in MODE_X, so we don't need to worry about write
+            // conflicts. One range tombstone is much cheaper than reading and deleting every record
+            _deleteRecordsToEnd(opCtx, std::string());
+            _changeNumRecords(opCtx, -numRecords(opCtx));
+            _increaseDataSize(opCtx, -dataSize(opCtx));
+            return Status::OK();
+        }
+
         // We can't use getCursor() here because we need to ignore the visibility of records (i.e.
         // we need to delete all records, regardless of visibility)
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
-        std::unique_ptr<RocksIterator> iterator(ru->NewIterator(_prefix, _isOplog));
+        std::unique_ptr<RocksIterator> iterator(ru->NewIterator(_cf, _prefix, _isOplog));
         for (iterator->SeekToFirst(); iterator->Valid(); iterator->Next()) {
             deleteRecord(opCtx, _makeRecordId(iterator->key()));
         }
@@ -805,7 +1344,8 @@ namespace mongo {
         std::string endString(_makePrefixedKey(_prefix, RecordId::max()));
         rocksdb::Slice beginRange(beginString);
         rocksdb::Slice endRange(endString);
-        return rocksToMongoStatus(_db->CompactRange(&beginRange, &endRange));
+        return rocksToMongoStatus(
+            _db->CompactRange(rocksdb::CompactRangeOptions(), _cf, &beginRange, &endRange));
     }
 
     Status RocksRecordStore::validate( OperationContext* opCtx,
@@ -905,10 +1445,9 @@ namespace mongo {
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
         ru->setOplogReadTill(_cappedVisibilityManager->oplogStartHack());
 
-        // we use _oplogKeyTracker, which contains exactly the same keys as oplog. the difference is
-        // that values are different (much smaller), so reading is faster. in this case, we only
-        // need keys (we never touch the values), so this works nicely
-        std::unique_ptr<rocksdb::Iterator> iter(_oplogKeyTracker->newIterator(ru));
+        // we only look at the keys here, the oplog iterator takes care of hiding uncommitted
+        // entries
+        std::unique_ptr<rocksdb::Iterator> iter(ru->NewIterator(_cf, _prefix, true));
         int64_t storage;
         iter->Seek(_makeKey(startingPosition, &storage));
         if (!iter->Valid()) {
@@ -949,7 +1488,12 @@ namespace mongo {
         // copied from WiredTigerRecordStore::cappedTruncateAfter()
         WriteUnitOfWork wuow(opCtx);
         RecordId lastKeptId = end;
+        RecordId firstRemovedId;
         int64_t recordsRemoved = 0;
+        int64_t bytesRemoved = 0;
+        // We're called under an exclusive lock, so we can remove the records with a range tombstone
+        // and only need to look at them for the callback and the counters
+        const bool useDeleteRange = RocksRecoveryUnit::supportsDeleteRange();
 
         if (inclusive) {
             auto reverseCursor = getCursor(opCtx, false);
@@ -968,13 +1512,32 @@ namespace mongo {
                         uassertStatusOK(
                             _cappedCallback->aboutToDeleteCapped(opCtx, record->id, record->data));
                     }
-                    deleteRecord(opCtx, record->id);
+                    if (recordsRemoved == 0) {
+                        firstRemovedId = record->id;
+                    }
+                    if (!useDeleteRange) {
+                        deleteRecord(opCtx, record->id);
+                    }
                     ++recordsRemoved;
+                    bytesRemoved += record->data.size();
                 }
             }
         }
 
         if (recordsRemoved) {
+            if (useDeleteRange) {
+                int64_t storage;
+                _deleteRecordsToEnd(opCtx, _makeKey(firstRemovedId, &storage).ToString());
+                _changeNumRecords(opCtx, -recordsRemoved);
+                _increaseDataSize(opCtx, -bytesRemoved);
+            }
+            if (_oplogStones) {
+                _oplogStones->updateStonesAfterCappedTruncateAfter(recordsRemoved, bytesRemoved,
+                                                                   firstRemovedId);
+            }
+            if (_oplogTailCache) {
+                _oplogTailCache->truncateFrom(opCtx, firstRemovedId);
+            }
             // Forget that we've ever seen a higher timestamp than we now have.
             _cappedVisibilityManager->setHighestSeen(lastKeptId);
         }
@@ -993,6 +1556,7 @@ namespace mongo {
     }
 
     std::string RocksRecordStore::_makePrefixedKey(const std::string& prefix, const RecordId& loc) {
+        // 12 bytes fit into std::string's inline buffer, so record keys don't allocate
         int64_t storage;
         auto encodedLoc = _makeKey(loc, &storage);
         std::string key(prefix);
@@ -1009,27 +1573,61 @@ namespace mongo {
 
     bool RocksRecordStore::findRecord( OperationContext* opCtx,
                                        const RecordId& loc, RecordData* out ) const {
-        RecordData rd = _getDataFor(_db, _prefix, opCtx, loc);
+        RecordData rd = _getDataFor(_cf, _prefix, opCtx, loc);
         if ( rd.data() == NULL )
             return false;
         *out = rd;
         return true;
     }
 
-    RecordData RocksRecordStore::_getDataFor(rocksdb::DB* db, const std::string& prefix,
-                                             OperationContext* opCtx, const RecordId& loc) {
+    void RocksRecordStore::findRecords(OperationContext* opCtx, const std::vector<RecordId>& locs,
+                                       std::vector<RecordData>* out) const {
+        const size_t numKeys = locs.size();
+        std::vector<std::string> keys;
+        std::vector<rocksdb::Slice> keySlices;
+        keys.reserve(numKeys);
+        keySlices.reserve(numKeys);
+        for (const auto& loc : locs) {
+            keys.push_back(_makePrefixedKey(_prefix, loc));
+            keySlices.emplace_back(keys.back());
+        }
+
+        std::unique_ptr<rocksdb::PinnableSlice[]> values(new rocksdb::PinnableSlice[numKeys]);
+        std::vector<rocksdb::Status> statuses(numKeys);
         RocksRecoveryUnit* ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
+        ru->MultiGet(_cf, numKeys, keySlices.data(), values.get(), statuses.data());
+
+        out->clear();
+        out->reserve(numKeys);
+        for (size_t i = 0; i < numKeys; ++i) {
+            if (statuses[i].IsNotFound()) {
+                out->push_back(RecordData(nullptr, 0));
+                continue;
+            }
+            invariantRocksOK(statuses[i]);
 
-        std::string valueStorage;
-        auto status = ru->Get(_makePrefixedKey(prefix, loc), &valueStorage);
+            SharedBuffer data = SharedBuffer::allocate(values[i].size());
+            memcpy(data.get(), values[i].data(), values[i].size());
+            out->push_back(RecordData(data, values[i].size()));
+        }
+    }
+
+    RecordData RocksRecordStore::_getDataFor(rocksdb::ColumnFamilyHandle* cf,
+                                             const std::string& prefix, OperationContext* opCtx,
+                                             const RecordId& loc) {
+        RocksRecoveryUnit* ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
+
+        // RecordData needs to own its buffer, so we copy once, straight out of the block cache
+        rocksdb::PinnableSlice value;
+        auto status = ru->Get(cf, _makePrefixedKey(prefix, loc), &value);
         if (status.IsNotFound()) {
             return RecordData(nullptr, 0);
         }
         invariantRocksOK(status);
 
-        SharedBuffer data = SharedBuffer::allocate(valueStorage.size());
-        memcpy(data.get(), valueStorage.data(), valueStorage.size());
-        return RecordData(data, valueStorage.size());
+        SharedBuffer data = SharedBuffer::allocate(value.size());
+        memcpy(data.get(), value.data(), value.size());
+        return RecordData(data, value.size());
     }
 
     void RocksRecordStore::_changeNumRecords(OperationContext* opCtx, int64_t amount) {
@@ -1042,25 +1640,88 @@ namespace mongo {
         ru->incrementCounter(_dataSizeKey, &_dataSize, amount);
     }
 
+    void RocksRecordStore::_deleteRecordsToEnd(OperationContext* opCtx,
+                                               const std::string& beginSuffix) {
+        RocksRecoveryUnit* ru = RocksRecoveryUnit::getRocksRecoveryUnit(opCtx);
+        std::string beginKey(_prefix + beginSuffix);
+        std::string endKey(rocksGetNextPrefix(_prefix));
+        ru->deleteRange(_cf, beginKey, endKey);
+        ru->registerChange(new CompactRangeChange(_compactionScheduler, _cf, std::move(beginKey),
+                                                  std::move(endKey)));
+    }
+
     // --------
 
+    class RocksRecordStore::TailingIteratorPool {
+    public:
+        TailingIteratorPool(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf, std::string prefix)
+            : _db(db), _cf(cf), _prefix(std::move(prefix)) {}
+
+        // Returns an iterator that reads the latest data
+        std::unique_ptr<rocksdb::Iterator> get() {
+            std::unique_ptr<rocksdb::Iterator> iterator;
+            {
+                stdx::lock_guard<stdx::mutex> lk(_mutex);
+                if (!_idle.empty()) {
+                    iterator = std::move(_idle.back());
+                    _idle.pop_back();
+                }
+            }
+            if (iterator && RocksRecoveryUnit::refreshIterator(iterator.get())) {
+                return iterator;
+            }
+            return std::unique_ptr<rocksdb::Iterator>(
+                RocksRecoveryUnit::NewIteratorNoSnapshot(_db, _cf, _prefix));
+        }
+
+        void put(std::unique_ptr<rocksdb::Iterator> iterator) {
+            if (!iterator->status().ok()) {
+                return;
+            }
+            stdx::lock_guard<stdx::mutex> lk(_mutex);
+            if (_idle.size() < kMaxIdleIterators) {
+                _idle.push_back(std::move(iterator));
+            }
+        }
+
+    private:
+        // every idle iterator pins the memtables and files it has last seen
+        static const size_t kMaxIdleIterators = 16;
+
+        rocksdb::DB* _db;                  // not owned
+        rocksdb::ColumnFamilyHandle* _cf;  // not owned
+        const std::string _prefix;
+
+        stdx::mutex _mutex;
+        std::vector<std::unique_ptr<rocksdb::Iterator>> _idle;
+    };
+
     RocksRecordStore::Cursor::Cursor(
             OperationContext* opCtx,
             rocksdb::DB* db,
+            rocksdb::ColumnFamilyHandle* cf,
             std::string prefix,
             std::shared_ptr<CappedVisibilityManager> cappedVisibilityManager,
             bool forward,
             bool isCapped,
-            RecordId startIterator)
+            RecordId startIterator,
+            RecordId endIterator,
+            std::shared_ptr<TailingIteratorPool> tailingIterators,
+            std::shared_ptr<RocksOplogTailCache> tailCache)
         : _opCtx(opCtx),
           _db(db),
+          _cf(cf),
           _prefix(std::move(prefix)),
           _cappedVisibilityManager(cappedVisibilityManager),
           _forward(forward),
           _isCapped(isCapped),
-          _readUntilForOplog(RocksRecoveryUnit::getRocksRecoveryUnit(opCtx)->getOplogReadTill()) {
-        _currentSequenceNumber =
-          RocksRecoveryUnit::getRocksRecoveryUnit(opCtx)->snapshot()->GetSequenceNumber();
+          _readUntilForOplog(RocksRecoveryUnit::getRocksRecoveryUnit(opCtx)->getOplogReadTill()),
+          _endIterator(std::move(endIterator)) {
+        if (forward && !_readUntilForOplog.isNull()) {
+            // only forward oplog reads are bounded by the oplog's visibility
+            _tailingIterators = std::move(tailingIterators);
+            _tailCache = std::move(tailCache);
+        }
 
         if (forward && !startIterator.isNull()) {
             // This is a hack to speed up first/last record retrieval from the oplog
@@ -1071,6 +1732,10 @@ namespace mongo {
         }
     }
 
+    RocksRecordStore::Cursor::~Cursor() {
+        releaseIterator();
+    }
+
     // requires !_eof
     void RocksRecordStore::Cursor::positionIterator() {
         _skipNextAdvance = false;
@@ -1116,19 +1781,78 @@ namespace mongo {
         if (_iterator.get() != nullptr) {
             return _iterator.get();
         }
-        _iterator.reset(RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)
-                ->NewIterator(_prefix, /* isOplog */ !_readUntilForOplog.isNull()));
+        auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx);
+        if (_tailingIterators && ru->canUseTailingIterator()) {
+            // everything up to _readUntilForOplog was committed before we started, so reading
+            // the latest data shows the same records as the snapshot would. Reusing an iterator
+            // is much cheaper than building one on top of the write batch and a snapshot
+            _iterator = _tailingIterators->get();
+            _tailing = true;
+        } else {
+            _iterator.reset(
+                ru->NewIterator(_cf, _prefix, /* isOplog */ !_readUntilForOplog.isNull()));
+            _currentSequenceNumber = ru->snapshot()->GetSequenceNumber();
+        }
         if (!_needFirstSeek) {
             positionIterator();
         }
         return _iterator.get();
     }
 
+    bool RocksRecordStore::Cursor::nextFromTailCache(boost::optional<Record>* record) {
+        // same restrictions as for tailing iterators: the cache holds the latest data
+        if (!RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)->canUseTailingIterator()) {
+            return false;
+        }
+        bool committed;
+        if (!_tailCache->next(_lastLoc, record, &committed)) {
+            return false;
+        }
+        if (!*record) {
+            _eof = true;
+            return true;
+        }
+
+        const RecordId id = (*record)->id;
+        if (id > _readUntilForOplog ||
+            (id == _readUntilForOplog && _cappedVisibilityManager->isCappedHidden(id))) {
+            // same as curr()
+            _lastLoc = id;
+            _eof = true;
+            *record = boost::none;
+            return true;
+        }
+        if (!committed) {
+            // it's visible, so its commit is done in RocksDB but not in the cache yet
+            return false;
+        }
+
+        // _iterator isn't where we are anymore
+        releaseIterator();
+        _lastLoc = id;
+        return true;
+    }
+
+    void RocksRecordStore::Cursor::releaseIterator() {
+        if (_tailing) {
+            _tailing = false;
+            _tailingIterators->put(std::move(_iterator));
+        }
+        _iterator.reset();
+    }
+
     boost::optional<Record> RocksRecordStore::Cursor::next() {
         if (_eof) {
             return {};
         }
 
+        if (_tailCache && !_needFirstSeek && !_skipNextAdvance) {
+            boost::optional<Record> record;
+            if (nextFromTailCache(&record)) {
+                return record;
+            }
+        }
+
         auto iter = iterator();
         // ignore _eof
 
@@ -1156,10 +1880,11 @@ namespace mongo {
     boost::optional<Record> RocksRecordStore::Cursor::seekExact(const RecordId& id) {
         _needFirstSeek = false;
         _skipNextAdvance = false;
-        _iterator.reset();
+        releaseIterator();
 
+        _seekExactResult.Reset();
         rocksdb::Status status = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)
-            ->Get(_makePrefixedKey(_prefix, id), &_seekExactResult);
+            ->Get(_cf, _makePrefixedKey(_prefix, id), &_seekExactResult);
 
         if (status.IsNotFound()) {
             _eof = true;
@@ -1181,9 +1906,23 @@ namespace mongo {
 
     bool RocksRecordStore::Cursor::restore() {
         auto ru = RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx);
-        if (!_iterator.get() || _currentSequenceNumber != ru->snapshot()->GetSequenceNumber()) {
-            _iterator.reset(ru->NewIterator(_prefix, /* isOplog */ !_readUntilForOplog.isNull()));
-            _currentSequenceNumber = ru->snapshot()->GetSequenceNumber();
+        if (_tailing) {
+            // a tailing iterator doesn't depend on the snapshot. Refreshing it is enough to see
+            // what got committed during the yield
+            if (!ru->canUseTailingIterator() ||
+                !RocksRecoveryUnit::refreshIterator(_iterator.get())) {
+                _tailing = false;
+                _iterator.reset();
+            }
+        } else if (_iterator.get() &&
+                   _currentSequenceNumber != ru->snapshot()->GetSequenceNumber()) {
+            // the snapshot changed, usually because we yielded. Moving the iterator to the new
+            // snapshot is cheaper than building a new one; positionIterator() seeks it below
+            if (ru->reuseIterator(static_cast<RocksIterator*>(_iterator.get()))) {
+                _currentSequenceNumber = ru->snapshot()->GetSequenceNumber();
+            } else {
+                _iterator.reset();
+            }
         }
 
         _skipNextAdvance = false;
@@ -1191,14 +1930,26 @@ namespace mongo {
         if (_eof) return true;
         if (_needFirstSeek) return true;
 
-        positionIterator();
+        bool found;
+        if (!_iterator.get() && _tailCache && ru->canUseTailingIterator() &&
+            _tailCache->exists(_lastLoc, &found)) {
+            // no need for an iterator if we'll continue from the cache. next() falls back to one
+            // if the cache can't help
+            _eof = _isCapped && !found;
+        } else if (_iterator.get()) {
+            positionIterator();
+        } else {
+            // positions the new iterator
+            iterator();
+        }
         // Return false if the collection is capped and we reached an EOF. Otherwise return true.
         return _cappedVisibilityManager && _eof ? false : true;
     }
 
     void RocksRecordStore::Cursor::detachFromOperationContext() {
         _opCtx = nullptr;
-        _iterator.reset();
+        // idle cursors shouldn't pin anything, the next cursor might as well use the iterator
+        releaseIterator();
     }
 
     void RocksRecordStore::Cursor::reattachToOperationContext(OperationContext* opCtx) {
@@ -1215,6 +1966,11 @@ namespace mongo {
         _eof = false;
         _lastLoc = _makeRecordId(_iterator->key());
 
+        if (_forward && !_endIterator.isNull() && _lastLoc >= _endIterator) {
+            _eof = true;
+            return {};
+        }
+
         if (_cappedVisibilityManager && _forward) {  // isCapped and forward?
             if (_readUntilForOplog.isNull()) {
                 // this is the normal capped case
@@ -1237,12 +1993,186 @@ namespace mongo {
         return {{_lastLoc, {dataSlice.data(), static_cast<int>(dataSlice.size())}}};
     }
 
+    // --------
+
+    RocksRecordStore::RandomCursor::RandomCursor(
+        OperationContext* opCtx, rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+        std::string prefix, std::shared_ptr<CappedVisibilityManager> cappedVisibilityManager,
+        bool avoidDuplicates)
+        : _opCtx(opCtx),
+          _db(db),
+          _cf(cf),
+          _prefix(std::move(prefix)),
+          _cappedVisibilityManager(std::move(cappedVisibilityManager)),
+          _avoidDuplicates(avoidDuplicates),
+          _random(std::unique_ptr<SecureRandom>(SecureRandom::create())->nextInt64()) {}
+
+    boost::optional<Record> RocksRecordStore::RandomCursor::next() {
+        if (!_seekRangesLoaded) {
+            _loadSeekRanges();
+        }
+        if (_seekRanges.empty()) {
+            return {};
+        }
+
+        auto iter = _getIterator();
+        int64_t locStorage;
+        iter->Seek(_makeKey(_randomSeekPoint(), &locStorage));
+        if (!_onVisibleRecord()) {
+            // we went past the last visible record, wrap around
+            iter->SeekToFirst();
+            if (!_onVisibleRecord()) {
+                return {};
+            }
+        }
+
+        RecordId loc = _makeRecordId(iter->key());
+        if (_avoidDuplicates) {
+            // move on to the next record we haven't returned yet. If we're back where we started,
+            // we've returned everything
+            const RecordId start = loc;
+            while (_returned.count(loc.repr())) {
+                iter->Next();
+                if (!_onVisibleRecord()) {
+                    iter->SeekToFirst();
+                    invariant(_onVisibleRecord());
+                }
+                loc = _makeRecordId(iter->key());
+                if (loc == start) {
+                    return {};
+                }
+            }
+            _returned.insert(loc.repr());
+        }
+
+        auto dataSlice = iter->value();
+        return {{loc, {dataSlice.data(), static_cast<int>(dataSlice.size())}}};
+    }
+
+    bool RocksRecordStore::RandomCursor::restore() {
+        // the snapshot might have changed, the iterator is recreated on the next call to next()
+        _iterator.reset();
+        return true;
+    }
+
+    void RocksRecordStore::RandomCursor::detachFromOperationContext() {
+        _opCtx = nullptr;
+        _iterator.reset();
+    }
+
+    void RocksRecordStore::RandomCursor::reattachToOperationContext(OperationContext* opCtx) {
+        _opCtx = opCtx;
+    }
+
+    void RocksRecordStore::RandomCursor::_loadSeekRanges() {
+        _seekRangesLoaded = true;
+
+        auto iter = _getIterator();
+        iter->SeekToFirst();
+        if (!_onVisibleRecord()) {
+            return;
+        }
+        const RecordId firstLoc = _makeRecordId(iter->key());
+        iter->SeekToLast();
+        invariant(iter->Valid());
+        const RecordId lastLoc = _makeRecordId(iter->key());
+
+        const std::string firstKey(_makePrefixedKey(_prefix, firstLoc));
+        const std::string lastKey(_makePrefixedKey(_prefix, lastLoc));
+        // maps a key bounding an SST file onto the RecordIds we have
+        auto toRepr = [&](const std::string& key) {
+            if (key <= firstKey) {
+                return firstLoc.repr();
+            }
+            if (key >= lastKey) {
+                return lastLoc.repr();
+            }
+            invariant(key.size() >= _prefix.size() + sizeof(int64_t));
+            return _makeRecordId(rocksdb::Slice(key.data() + _prefix.size(), sizeof(int64_t)))
+                .repr();
+        };
+
+        std::vector<rocksdb::LiveFileMetaData> files;
+        _db->GetLiveFilesMetaData(&files);
+        const std::string cfName = _cf->GetName();
+        for (const auto& file : files) {
+            if (file.column_family_name != cfName || file.largestkey < firstKey ||
+                file.smallestkey > lastKey) {
+                continue;
+            }
+            const int64_t first = toRepr(file.smallestkey);
+            const int64_t last = toRepr(file.largestkey);
+            if (first <= last) {
+                _seekRanges.push_back({first, last, std::max(file.size, uint64_t(1))});
+            }
+        }
+
+        uint64_t memtableSize = 0;
+// GetApproximateMemTableStats() is available since RocksDB 6
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        uint64_t memtableCount = 0;
+        const std::string endKey(rocksGetNextPrefix(_prefix));
+        _db->GetApproximateMemTableStats(_cf, rocksdb::Range(_prefix, endKey), &memtableCount,
+                                         &memtableSize);
+#endif
+        if (memtableSize > 0 || _seekRanges.empty()) {
+            // we don't know where in the memtables our records are
+            _seekRanges.push_back(
+                {firstLoc.repr(), lastLoc.repr(), std::max(memtableSize, uint64_t(1))});
+        }
+
+        for (const auto& range : _seekRanges) {
+            _totalWeight += range.weight;
+        }
+    }
+
+    RecordId RocksRecordStore::RandomCursor::_randomSeekPoint() {
+        uint64_t pick = static_cast<uint64_t>(_random.nextInt64()) % _totalWeight;
+        auto range = _seekRanges.begin();
+        while (pick >= range->weight) {
+            pick -= range->weight;
+            ++range;
+        }
+        // unsigned arithmetic, the width of the range might not fit into an int64_t
+        const uint64_t width = static_cast<uint64_t>(range->last) - range->first;
+        uint64_t offset = static_cast<uint64_t>(_random.nextInt64());
+        if (width != std::numeric_limits<uint64_t>::max()) {
+            offset %= width + 1;
+        }
+        return RecordId(static_cast<int64_t>(range->first + offset));
+    }
+
+    bool RocksRecordStore::RandomCursor::_onVisibleRecord() {
+        if (!_iterator->Valid()) {
+            invariantRocksOK(_iterator->status());
+            return false;
+        }
+        return !_cappedVisibilityManager ||
+               !_cappedVisibilityManager->isCappedHidden(_makeRecordId(_iterator->key()));
+    }
+
+    rocksdb::Iterator* RocksRecordStore::RandomCursor::_getIterator() {
+        if (!_iterator && !_opCtx) {
+            _iterator.reset(RocksRecoveryUnit::NewIteratorNoSnapshot(_db, _cf, _prefix));
+        } else if (!_iterator) {
+            _iterator.reset(
+                RocksRecoveryUnit::getRocksRecoveryUnit(_opCtx)->NewIterator(_cf, _prefix));
+        }
+        return _iterator.get();
+    }
+
     Status RocksRecordStore::updateCappedSize(OperationContext* opCtx, long long cappedSize) {
         if (_cappedMaxSize == cappedSize) {
             return Status::OK();
         }
         _cappedMaxSize = cappedSize;
         _cappedMaxSizeSlack = cappedMaxSizeSlackFromSize(cappedSize);
+        if (_oplogStones) {
+            _oplogStones->setMaxSize(cappedSize);
+        }
+        if (_oplogInFifoColumnFamily) {
+            _configureOplogColumnFamily();
+        }
         return Status::OK();
     }
 
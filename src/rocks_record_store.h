@@ -30,23 +30,28 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <memory>
 #include <string>
 #include <memory>
+#include <unordered_set>
 #include <vector>
 #include <functional>
 
 #include <rocksdb/options.h>
+#include <rocksdb/slice.h>
 
 #include "mongo/db/storage/capped_callback.h"
 #include "mongo/db/storage/record_store.h"
 #include "mongo/platform/atomic_word.h"
+#include "mongo/platform/random.h"
 #include "mongo/stdx/condition_variable.h"
 #include "mongo/stdx/mutex.h"
 #include "mongo/stdx/thread.h"
 #include "mongo/util/timer.h"
 
 namespace rocksdb {
+    class ColumnFamilyHandle;
     class DB;
     class Iterator;
     class Slice;
@@ -55,11 +60,12 @@ namespace rocksdb {
 namespace mongo {
 
     class RocksCounterManager;
+    class RocksOplogTailCache;
     class RocksDurabilityManager;
     class RocksCompactionScheduler;
     class RocksRecoveryUnit;
-    class RocksOplogKeyTracker;
     class RocksRecordStore;
+    class RocksTtlCollection;
 
     typedef std::list<RecordId> SortedRecordIds;
 
@@ -75,10 +81,18 @@ namespace mongo {
         RecordId getNextAndAddUncommittedRecord(OperationContext* opCtx,
                                                 std::function<RecordId()> nextId);
 
-        bool isCappedHidden(const RecordId& record) const;
-        RecordId oplogStartHack() const;
+        // These two don't take the mutex, they're called for every record a capped cursor returns
+        bool isCappedHidden(const RecordId& record) const {
+            auto lowest = _lowestHiddenRecord.load(std::memory_order_acquire);
+            // RecordId::max() stands for nothing being hidden, it doesn't hide itself
+            return lowest != RecordId::max().repr() && record.repr() >= lowest;
+        }
+        RecordId lowestCappedHiddenRecord() const {
+            auto lowest = _lowestHiddenRecord.load(std::memory_order_acquire);
+            return lowest == RecordId::max().repr() ? RecordId() : RecordId(lowest);
+        }
 
-        RecordId lowestCappedHiddenRecord() const;
+        RecordId oplogStartHack() const;
 
         void waitForAllEarlierOplogWritesToBeVisible(OperationContext* opCtx) const;
         void oplogJournalThreadLoop(RocksDurabilityManager* durabilityManager);
@@ -86,11 +100,17 @@ namespace mongo {
 
     private:
         void _addUncommittedRecord_inlock(OperationContext* opCtx, const RecordId& record);
+        // publishes the front of _uncommittedRecords to _lowestHiddenRecord. Needs to be called
+        // whenever the front changes
+        void _updateLowestHiddenRecord_inlock();
 
         // protects the state
         mutable stdx::mutex _uncommittedRecordIdsMutex;
         RocksRecordStore* const _rs;
         SortedRecordIds _uncommittedRecords;
+        // The repr of _uncommittedRecords.front(), or RecordId::max().repr() if it's empty.
+        // Written under the mutex, read without it. All records at or above it are hidden
+        std::atomic<int64_t> _lowestHiddenRecord;
         RecordId _oplog_highestSeen;
         bool _shuttingDown;
 
@@ -104,6 +124,7 @@ namespace mongo {
     class RocksRecordStore : public RecordStore {
     public:
         RocksRecordStore(StringData ns, StringData id, rocksdb::DB* db,
+                         rocksdb::ColumnFamilyHandle* cf,
                          RocksCounterManager* counterManager,
                          RocksDurabilityManager* durabilityManager,
                          RocksCompactionScheduler* compactionScheduler,
@@ -136,6 +157,14 @@ namespace mongo {
                                  const RecordId& loc,
                                  RecordData* out ) const;
 
+        /**
+         * Batched version of findRecord(). (*out)[i] is set to the record stored at locs[i], or to
+         * an empty RecordData (data() == nullptr) if there is none. Lookups that miss the block
+         * cache are issued together rather than one after another.
+         */
+        void findRecords(OperationContext* opCtx, const std::vector<RecordId>& locs,
+                         std::vector<RecordData>* out) const;
+
         virtual void deleteRecord( OperationContext* opCtx, const RecordId& dl );
 
         virtual StatusWith<RecordId> insertRecord( OperationContext* opCtx,
@@ -164,6 +193,33 @@ namespace mongo {
 
         std::unique_ptr<SeekableRecordCursor> getCursor(OperationContext* opCtx, bool forward) const final;
 
+        /**
+         * Splits the record store into at most numPartitions ranges that hold about the same
+         * amount of data, going by RocksDB's size estimates, and returns the RecordIds at which
+         * the second and later ranges start. Boundaries are existing records as of the snapshot of
+         * opCtx's recovery unit.
+         */
+        std::vector<RecordId> getPartitionBoundaries(OperationContext* opCtx,
+                                                     size_t numPartitions) const;
+
+        /**
+         * Returns one forward cursor per partition of the record store, as computed by
+         * getPartitionBoundaries(opCtxs.size()). Cursor i uses opCtxs[i], which can then be used
+         * on a thread of its own, and all of them read from the snapshot of opCtxs[0]. The
+         * recovery units of the other operations must not have a snapshot yet and must only be
+         * used for reading until they abandon the shared one. There might be fewer cursors than
+         * operations if the record store is small.
+         */
+        std::vector<std::unique_ptr<SeekableRecordCursor>> getPartitionedCursors(
+            const std::vector<OperationContext*>& opCtxs) const;
+
+        std::unique_ptr<RecordCursor> getRandomCursor(OperationContext* opCtx) const final;
+
+        // Like above. If avoidDuplicates is set, the cursor never returns the same record twice and
+        // it's exhausted once it has returned every record.
+        std::unique_ptr<RecordCursor> getRandomCursor(OperationContext* opCtx,
+                                                      bool avoidDuplicates) const;
+
         virtual Status truncate( OperationContext* opCtx );
 
         virtual bool compactSupported() const { return true; }
@@ -212,17 +268,38 @@ namespace mongo {
         static rocksdb::Comparator* newRocksCollectionComparator();
 
         class CappedInsertChange;
+        class OplogStones;
+
+        // nullptr unless this is a capped oplog
+        OplogStones* oplogStones() const { return _oplogStones.get(); }
+
+        // Compactions drop the expired records of a TTL collection, see rocks_ttl.h. The record
+        // store keeps ttlCollection open until it's destroyed
+        void setTtlCollection(std::shared_ptr<RocksTtlCollection> ttlCollection);
+        // nullptr unless this is a TTL collection
+        const std::shared_ptr<RocksTtlCollection>& ttlCollection() const { return _ttlCollection; }
+        // Updates the counters for an expired record that a compaction dropped
+        void expiredRecordReaped(OperationContext* opCtx, int64_t dataSize);
+
     private:
         friend class CappedVisibilityManager;
-        // we just need to expose _makePrefixedKey to RocksOplogKeyTracker
-        friend class RocksOplogKeyTracker;
+        friend class OplogStones;
+
+        // Idle tailing iterators over the oplog, handed from one forward oplog cursor to the next
+        class TailingIteratorPool;
+
         // NOTE: Cursor might outlive the RecordStore. That's why we use all those
         // shared_ptrs
         class Cursor : public SeekableRecordCursor {
         public:
-            Cursor(OperationContext* opCtx, rocksdb::DB* db, std::string prefix,
+            Cursor(OperationContext* opCtx, rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+                   std::string prefix,
                    std::shared_ptr<CappedVisibilityManager> cappedVisibilityManager,
-                   bool forward, bool _isCapped, RecordId startIterator);
+                   bool forward, bool _isCapped, RecordId startIterator,
+                   RecordId endIterator = RecordId(),
+                   std::shared_ptr<TailingIteratorPool> tailingIterators = nullptr,
+                   std::shared_ptr<RocksOplogTailCache> tailCache = nullptr);
+            ~Cursor();
 
             boost::optional<Record> next() final;
             boost::optional<Record> seekExact(const RecordId& id) final;
@@ -242,6 +319,7 @@ namespace mongo {
 
             OperationContext* _opCtx;
             rocksdb::DB* _db; // not owned
+            rocksdb::ColumnFamilyHandle* _cf; // not owned
             std::string _prefix;
             std::shared_ptr<CappedVisibilityManager> _cappedVisibilityManager;
             bool _forward;
@@ -249,18 +327,82 @@ namespace mongo {
             bool _eof = false;
             bool _needFirstSeek = true;
             bool _skipNextAdvance = false;
-            rocksdb::SequenceNumber _currentSequenceNumber;
+            // snapshot that _iterator reads from, unless it's tailing
+            rocksdb::SequenceNumber _currentSequenceNumber = 0;
             const RecordId _readUntilForOplog;
+            // if not null, a forward cursor stops before this record
+            const RecordId _endIterator;
             RecordId _lastLoc;
             std::unique_ptr<rocksdb::Iterator> _iterator;
-            std::string _seekExactResult;
+            // if set, forward oplog reads use a tailing iterator from this pool when the recovery
+            // unit allows it. _tailing tells whether _iterator is one
+            std::shared_ptr<TailingIteratorPool> _tailingIterators;
+            bool _tailing = false;
+            // if set, forward oplog reads close to the end of the oplog are served from it
+            std::shared_ptr<RocksOplogTailCache> _tailCache;
+            // pins the block that holds the record returned by the latest seekExact()
+            rocksdb::PinnableSlice _seekExactResult;
             void positionIterator();
             rocksdb::Iterator* iterator();
+            // drops _iterator, tailing iterators go back to the pool
+            void releaseIterator();
+            // returns false if the record after _lastLoc isn't in _tailCache
+            bool nextFromTailCache(boost::optional<Record>* record);
+        };
+
+        // Returns records found at random points of the record store. The seek points are drawn
+        // from the key ranges of the SST files (and memtables) that hold the record store,
+        // weighted by their sizes, so sampling doesn't need to scan anything. The distribution is
+        // close to, but not exactly, uniform.
+        class RandomCursor : public RecordCursor {
+        public:
+            // Without an opCtx, the cursor reads the latest data without a snapshot.
+            // cappedVisibilityManager can be nullptr
+            RandomCursor(OperationContext* opCtx, rocksdb::DB* db, rocksdb::ColumnFamilyHandle* cf,
+                         std::string prefix,
+                         std::shared_ptr<CappedVisibilityManager> cappedVisibilityManager,
+                         bool avoidDuplicates);
+
+            boost::optional<Record> next() final;
+            void save() final {}
+            bool restore() final;
+            void detachFromOperationContext() final;
+            void reattachToOperationContext(OperationContext* opCtx) final;
+
+        private:
+            // an inclusive range of RecordId reprs to seek into, picked with probability
+            // proportional to weight
+            struct SeekRange {
+                int64_t first;
+                int64_t last;
+                uint64_t weight;
+            };
+
+            void _loadSeekRanges();
+            RecordId _randomSeekPoint();
+            // true if the iterator points to a record that's visible to us
+            bool _onVisibleRecord();
+            rocksdb::Iterator* _getIterator();
+
+            OperationContext* _opCtx;
+            rocksdb::DB* _db;                  // not owned
+            rocksdb::ColumnFamilyHandle* _cf;  // not owned
+            std::string _prefix;
+            std::shared_ptr<CappedVisibilityManager> _cappedVisibilityManager;
+            const bool _avoidDuplicates;
+            std::unique_ptr<rocksdb::Iterator> _iterator;
+
+            bool _seekRangesLoaded = false;
+            std::vector<SeekRange> _seekRanges;
+            uint64_t _totalWeight = 0;
+            PseudoRandom _random;
+            // reprs of the records we've returned, if _avoidDuplicates
+            std::unordered_set<int64_t> _returned;
         };
 
         static RecordId _makeRecordId( const rocksdb::Slice& slice );
 
-        static RecordData _getDataFor(rocksdb::DB* db, const std::string& prefix,
+        static RecordData _getDataFor(rocksdb::ColumnFamilyHandle* cf, const std::string& prefix,
                                       OperationContext* opCtx, const RecordId& loc);
 
         RecordId _nextId();
@@ -273,7 +415,31 @@ namespace mongo {
         void _changeNumRecords(OperationContext* opCtx, int64_t amount);
         void _increaseDataSize(OperationContext* opCtx, int64_t amount);
 
+        // Deletes every record from the one keyed by beginSuffix (an encoded RecordId, or empty for
+        // all of them) to the end of the record store with range tombstones, and compacts the
+        // deleted range once we commit. Doesn't touch the counters and doesn't register writes, so
+        // the caller needs to hold the collection lock in MODE_X.
+        // REQUIRES: RocksRecoveryUnit::supportsDeleteRange()
+        void _deleteRecordsToEnd(OperationContext* opCtx, const std::string& beginSuffix);
+
+        // cappedDeleteAsNeeded_inlock() for the oplog: deletes whole stones while there are more
+        // than we need to keep
+        int64_t _reclaimOplog(OperationContext* opCtx, const RecordId& justInserted);
+
+        // Older versions kept a copy of every oplog key under the next prefix, removes it
+        void _deleteLegacyOplogKeyTracker();
+
+        // If the oplog lives in a FIFO column family, sizes it to the capped size. Returns whether
+        // it does
+        bool _configureOplogColumnFamily();
+        // the FIFO limit that keeps everything we haven't reclaimed yet
+        uint64_t _oplogColumnFamilyMaxSizeNeeded() const;
+        void _setOplogColumnFamilyMaxSize(uint64_t maxTableFilesSize);
+        // fasserts if FIFO compaction dropped the records of the stone we're reclaiming
+        void _checkOplogStoneBeforeReclaim(OperationContext* opCtx, const RecordId& lastRecord);
+
         rocksdb::DB* _db;                      // not owned
+        rocksdb::ColumnFamilyHandle* _cf;      // not owned
         RocksCounterManager* _counterManager;  // not owned
         RocksCompactionScheduler* _compactionScheduler;  // not owned
         std::string _prefix;
@@ -289,15 +455,28 @@ namespace mongo {
         int _cappedDeleteCheckCount;      // see comment in ::cappedDeleteAsNeeded
 
         const bool _isOplog;
-        // nullptr iff _isOplog == false
-        RocksOplogKeyTracker* _oplogKeyTracker;
+        // nullptr unless _isOplog && _isCapped
+        std::unique_ptr<OplogStones> _oplogStones;
+        // nullptr unless _isOplog
+        std::shared_ptr<TailingIteratorPool> _tailingIterators;
+        // nullptr unless _isOplog and the cache is enabled
+        std::shared_ptr<RocksOplogTailCache> _oplogTailCache;
         // keep track of when we compacted oplog last time. only valid when _isOplog == true.
         // Protected by _cappedDeleterMutex.
         Timer _oplogSinceLastCompaction;
+        int _oplogStonesSinceLastCompaction = 0;
+        // a FIFO column family drops reclaimed oplog files by itself, we never compact it
+        bool _oplogInFifoColumnFamily = false;
+        // the FIFO column family's memtable budget and its max_table_files_size. The latter
+        // only grows while reclaiming is behind
+        uint64_t _oplogMemtableBytes = 0;
+        std::atomic<uint64_t> _oplogColumnFamilyMaxSize{0};
+        // nullptr unless this is a TTL collection
+        std::shared_ptr<RocksTtlCollection> _ttlCollection;
         // compact oplog every 30 min
         static const int kOplogCompactEveryMins = 30;
-        // compact oplog every 500K deletes
-        static const int kOplogCompactEveryDeletedRecords = 500000;
+        // or every time we've reclaimed that many stones
+        static const int kOplogCompactEveryStones = 5;
 
         // invariant: there is no live records earlier than _cappedOldestKeyHint. There might be
         // some records that are dead after _cappedOldestKeyHint.
@@ -321,4 +500,72 @@ namespace mongo {
         bool _shuttingDown;
         bool _hasBackgroundThread;
     };
+
+    /**
+     * Splits the oplog into "stones" of at least minBytesPerStone bytes each, in insertion order,
+     * so that the oldest entries can be reclaimed one stone at a time with a single range deletion
+     * instead of looking at every entry. Stones only live in memory: they are rebuilt when the
+     * oplog is opened, by scanning small oplogs and by sampling large ones.
+     */
+    class RocksRecordStore::OplogStones {
+    public:
+        struct Stone {
+            int64_t records;      // number of records in the stone
+            int64_t bytes;        // size of the records in the stone
+            RecordId lastRecord;  // RecordId of the newest record in the stone
+        };
+
+        OplogStones(RocksRecordStore* rs);
+
+        bool hasExcessStones() const;
+
+        boost::optional<Stone> peekOldestStone() const;
+        void popOldestStone();
+
+        // Accounts for records that opCtx's unit of work inserted, once it commits
+        void updateCurrentStoneAfterInsertOnCommit(OperationContext* opCtx, int64_t bytesInserted,
+                                                   const RecordId& highestInserted,
+                                                   int64_t countInserted);
+
+        void clearStonesOnCommit(OperationContext* opCtx);
+
+        // Forgets about the stones that hold records at or after firstRemovedId
+        void updateStonesAfterCappedTruncateAfter(int64_t recordsRemoved, int64_t bytesRemoved,
+                                                  const RecordId& firstRemovedId);
+
+        void setMaxSize(int64_t maxSize);
+
+        size_t numStones() const;
+        int64_t currentRecords() const { return _currentRecords.load(); }
+        int64_t currentBytes() const { return _currentBytes.load(); }
+        int64_t minBytesPerStone() const { return _minBytesPerStone.load(); }
+
+    private:
+        class InsertChange;
+        class TruncateChange;
+
+        void _calculateStones();
+        void _calculateStonesByScanning();
+        void _calculateStonesBySampling(int64_t numRecords, int64_t dataSize);
+        void _createNewStoneIfNeeded(const RecordId& lastRecord);
+
+        // bounds on the number of stones we keep around
+        static const size_t kMinStonesToKeep = 10;
+        static const size_t kMaxStonesToKeep = 100;
+        // how many samples per stone we take when rebuilding the stones of a large oplog
+        static const int kRandomSamplesPerStone = 10;
+        // oplogs with fewer than that many records per sample are scanned instead
+        static const int kMinSampleRatio = 10;
+
+        RocksRecordStore* _rs;  // not owned
+
+        mutable stdx::mutex _mutex;  // protects _stones and _numStonesToKeep
+        std::deque<Stone> _stones;
+        size_t _numStonesToKeep;
+
+        // the stone being filled, it's not in _stones yet
+        std::atomic<int64_t> _currentRecords;
+        std::atomic<int64_t> _currentBytes;
+        std::atomic<int64_t> _minBytesPerStone;
+    };
 }
@@ -44,6 +44,16 @@ bool RocksEngine::initRsOplogBackgroundThread(StringData ns) {
     return NamespaceString::oplog(ns);
 }
 
+// static
+bool RocksEngine::initTtlReaperThread(StringData ns) {
+    return true;
+}
+
+// static
+bool RocksEngine::isReplicationEnabled() {
+    return false;
+}
+
 MONGO_INITIALIZER(SetGlobalEnvironment)(InitializerContext* context) {
     setGlobalServiceContext(stdx::make_unique<ServiceContextNoop>());
     return Status::OK();
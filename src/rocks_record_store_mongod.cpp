@@ -31,18 +31,24 @@
 
 #include "mongo/platform/basic.h"
 
+#include <algorithm>
 #include <set>
 #include <mutex>
 
 #include "mongo/base/checked_cast.h"
 #include "mongo/db/catalog/collection.h"
 #include "mongo/db/catalog/database.h"
+#include "mongo/db/catalog/index_catalog.h"
 #include "mongo/db/client.h"
 #include "mongo/db/concurrency/d_concurrency.h"
+#include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/db/db_raii.h"
+#include "mongo/db/index/index_access_method.h"
+#include "mongo/db/index/index_descriptor.h"
 #include "mongo/db/service_context.h"
 #include "mongo/db/namespace_string.h"
 #include "mongo/db/operation_context.h"
+#include "mongo/db/repl/replication_coordinator.h"
 #include "mongo/util/background.h"
 #include "mongo/util/exit.h"
 #include "mongo/util/log.h"
@@ -50,6 +56,7 @@
 #include "rocks_engine.h"
 #include "rocks_record_store.h"
 #include "rocks_recovery_unit.h"
+#include "rocks_ttl.h"
 
 namespace mongo {
 
@@ -137,6 +144,141 @@ namespace mongo {
             std::string _name;
         };
 
+        std::set<NamespaceString> _ttlReaperNamespaces;
+
+        // the _id index of a TTL collection, through the index catalog
+        class IndexAccessMethodIdIndex : public RocksTtlIdIndex {
+        public:
+            explicit IndexAccessMethodIdIndex(IndexAccessMethod* iam) : _iam(iam) {}
+
+            virtual RecordId find(OperationContext* opCtx, const BSONObj& id) {
+                BSONObjBuilder keyBuilder;
+                keyBuilder.appendAs(id.firstElement(), "");
+                return _iam->findSingle(opCtx, keyBuilder.obj());
+            }
+
+            virtual void remove(OperationContext* opCtx, const BSONObj& id, const RecordId& loc) {
+                InsertDeleteOptions options;
+                options.logIfError = true;
+                int64_t numDeleted = 0;
+                uassertStatusOK(_iam->remove(opCtx, id, loc, options, &numDeleted));
+            }
+
+            virtual void forEach(OperationContext* opCtx, const EntryCallback& callback) {
+                auto cursor = _iam->newCursor(opCtx);
+                for (auto entry = cursor->seek(BSON("" << MINKEY), true); entry;
+                     entry = cursor->next()) {
+                    BSONObjBuilder idBuilder;
+                    idBuilder.appendAs(entry->key.firstElement(), "_id");
+                    callback(idBuilder.obj(), entry->loc);
+                }
+            }
+
+        private:
+            IndexAccessMethod* _iam;  // not owned
+        };
+
+        /**
+         * Cleans up after the expired records of a TTL collection that compactions dropped: removes
+         * their _id index entries and updates the counters. The thread stops once the collection
+         * has been gone for a while, e.g. after it was dropped or renamed.
+         */
+        class RocksTtlReaperThread : public BackgroundJob {
+        public:
+            RocksTtlReaperThread(const NamespaceString& ns)
+                : BackgroundJob(true /* deleteSelf */), _ns(ns) {
+                _name = std::string("RocksTtlReaperThread for ") + _ns.toString();
+            }
+
+            virtual std::string name() const {
+                return _name;
+            }
+
+            virtual void run() {
+                Client::initThread(_name.c_str());
+
+                int roundsWithoutCollection = 0;
+                while (!globalInShutdownDeprecated()) {
+                    bool foundCollection = true;
+                    int64_t reaped = _reapExpiredRecords(&foundCollection);
+                    LOG(2) << "RocksTtlReaperThread reaped " << reaped;
+                    roundsWithoutCollection = foundCollection ? 0 : roundsWithoutCollection + 1;
+                    if (roundsWithoutCollection >= kMaxRoundsWithoutCollection) {
+                        stdx::lock_guard<stdx::mutex> lock(_backgroundThreadMutex);
+                        _ttlReaperNamespaces.erase(_ns);
+                        break;
+                    }
+                    // wake up every 100ms while there's work
+                    sleepmillis(reaped == 0 ? 1000 : 100);
+                }
+
+                log() << "shutting down";
+            }
+
+        private:
+            /**
+             * @return Number of expired records cleaned up.
+             */
+            int64_t _reapExpiredRecords(bool* foundCollection) {
+                if (!getGlobalServiceContext()->getGlobalStorageEngine()) {
+                    LOG(1) << "no global storage engine yet";
+                    return 0;
+                }
+
+                const auto opCtx = cc().makeOperationContext();
+
+                AutoGetDb autoDb(opCtx.get(), _ns.db(), MODE_IX);
+                Database* db = autoDb.getDb();
+                if (!db) {
+                    LOG(2) << "no database " << _ns.db();
+                    *foundCollection = false;
+                    return 0;
+                }
+
+                Lock::CollectionLock collectionLock(opCtx->lockState(), _ns.ns(), MODE_IX);
+                Collection* collection = db->getCollection(opCtx.get(), _ns);
+                if (!collection) {
+                    LOG(2) << "no collection " << _ns;
+                    *foundCollection = false;
+                    return 0;
+                }
+                return _reapExpiredRecords(opCtx.get(), collection, foundCollection);
+            }
+
+            int64_t _reapExpiredRecords(OperationContext* opCtx, Collection* collection,
+                                        bool* foundCollection) {
+                RocksRecordStore* rs =
+                    checked_cast<RocksRecordStore*>(collection->getRecordStore());
+                auto ttlCollection = rs->ttlCollection();
+                if (!ttlCollection) {
+                    // another collection took the name
+                    *foundCollection = false;
+                    return 0;
+                }
+                IndexCatalog* indexCatalog = collection->getIndexCatalog();
+                IndexDescriptor* idIndex = indexCatalog->findIdIndex(opCtx);
+                if (!idIndex) {
+                    return 0;
+                }
+                IndexAccessMethodIdIndex ttlIdIndex(indexCatalog->getIndex(idIndex));
+
+                if (ttlCollection->needsReconcile()) {
+                    if (ttlCollection->reconcile(opCtx, rs, &ttlIdIndex)) {
+                        log() << "Reconciled TTL collection " << _ns;
+                    }
+                    return 0;
+                }
+                return ttlCollection->reapExpired(opCtx, rs, &ttlIdIndex, kBatchSize);
+            }
+
+            static const size_t kBatchSize = 1000;
+            // a minute
+            static const int kMaxRoundsWithoutCollection = 60;
+
+            NamespaceString _ns;
+            std::string _name;
+        };
+
     }  // namespace
 
     // static
@@ -165,4 +307,30 @@ namespace mongo {
         return true;
     }
 
+    // static
+    bool RocksEngine::isReplicationEnabled() {
+        auto replCoord = repl::ReplicationCoordinator::get(getGlobalServiceContext());
+        return replCoord &&
+               replCoord->getReplicationMode() != repl::ReplicationCoordinator::modeNone;
+    }
+
+    // static
+    bool RocksEngine::initTtlReaperThread(StringData ns) {
+        if (storageGlobalParams.repair || storageGlobalParams.readOnly) {
+            LOG(1) << "not starting RocksTtlReaperThread for " << ns
+                   << " because we are either in repair or read-only mode";
+            return false;
+        }
+
+        stdx::lock_guard<stdx::mutex> lock(_backgroundThreadMutex);
+        NamespaceString nss(ns);
+        if (!_ttlReaperNamespaces.count(nss)) {
+            log() << "Starting RocksTtlReaperThread " << ns;
+            BackgroundJob* backgroundThread = new RocksTtlReaperThread(nss);
+            backgroundThread->go();
+            _ttlReaperNamespaces.insert(nss);
+        }
+        return true;
+    }
+
 }  // namespace mongo
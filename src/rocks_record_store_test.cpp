@@ -28,8 +28,12 @@
 
 #include "mongo/platform/basic.h"
 
+#include <atomic>
 #include <boost/filesystem/operations.hpp>
+#include <limits>
 #include <memory>
+#include <random>
+#include <set>
 #include <vector>
 
 #include <rocksdb/comparator.h>
@@ -40,10 +44,13 @@
 #include "mongo/base/init.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/db/storage/record_store_test_harness.h"
+#include "mongo/stdx/thread.h"
+#include "mongo/util/scopeguard.h"
 #include "mongo/unittest/unittest.h"
 #include "mongo/unittest/temp_dir.h"
 
 #include "rocks_compaction_scheduler.h"
+#include "rocks_operation_stats.h"
 #include "rocks_record_store.h"
 #include "rocks_recovery_unit.h"
 #include "rocks_transaction.h"
@@ -73,7 +80,9 @@ namespace mongo {
           return newNonCappedRecordStore("foo.bar");
         }
         std::unique_ptr<RecordStore> newNonCappedRecordStore(const std::string& ns) {
-            return stdx::make_unique<RocksRecordStore>(ns, "1", _db.get(), _counterManager.get(),
+            return stdx::make_unique<RocksRecordStore>(ns, "1", _db.get(),
+                                                       _db->DefaultColumnFamily(),
+                                                       _counterManager.get(),
                                                        _durabilityManager.get(),
                                                        _compactionScheduler.get(), "prefix");
         }
@@ -86,13 +95,63 @@ namespace mongo {
         std::unique_ptr<RecordStore> newCappedRecordStore(const std::string& ns,
                                                           int64_t cappedMaxSize,
                                                           int64_t cappedMaxDocs) {
-            return stdx::make_unique<RocksRecordStore>(ns, "1", _db.get(), _counterManager.get(),
+            return stdx::make_unique<RocksRecordStore>(ns, "1", _db.get(),
+                                                       _db->DefaultColumnFamily(),
+                                                       _counterManager.get(),
                                                        _durabilityManager.get(),
                                                        _compactionScheduler.get(),
                                                        "prefix", true,
                                                        cappedMaxSize, cappedMaxDocs);
         }
 
+        // An oplog in a FIFO column family of its own, like RocksEngine sets it up, but with small
+        // memtables and no compression
+        std::unique_ptr<RecordStore> newOplogInFifoColumnFamily(int64_t cappedMaxSize) {
+            rocksdb::ColumnFamilyOptions options;
+            options.compaction_style = rocksdb::kCompactionStyleFIFO;
+            options.compaction_options_fifo.max_table_files_size =
+                std::numeric_limits<uint64_t>::max();
+            options.compression = rocksdb::kNoCompression;
+            options.write_buffer_size = kFifoWriteBufferSize;
+            options.max_write_buffer_number = 2;
+            rocksdb::ColumnFamilyHandle* cf;
+            ASSERT(_db->CreateColumnFamily(options, "oplog-test", &cf).ok());
+            _fifoColumnFamily.reset(cf);
+            return stdx::make_unique<RocksRecordStore>("local.oplog.foo", "1", _db.get(), cf,
+                                                       _counterManager.get(),
+                                                       _durabilityManager.get(),
+                                                       _compactionScheduler.get(), "prefix", true,
+                                                       cappedMaxSize, -1);
+        }
+
+        uint64_t fifoMaxTableFilesSize() {
+            return _db->GetOptions(_fifoColumnFamily.get())
+                .compaction_options_fifo.max_table_files_size;
+        }
+
+        uint64_t fifoSstFilesSize() {
+            uint64_t size = 0;
+            ASSERT(_db->GetIntProperty(_fifoColumnFamily.get(), "rocksdb.total-sst-files-size",
+                                       &size));
+            return size;
+        }
+
+        // flushes the FIFO column family and lets FIFO compaction drop what's over its limit
+        void compactFifoColumnFamily() {
+            ASSERT(_db->Flush(rocksdb::FlushOptions(), _fifoColumnFamily.get()).ok());
+            ASSERT(_db->CompactRange(rocksdb::CompactRangeOptions(), _fifoColumnFamily.get(),
+                                     nullptr, nullptr)
+                       .ok());
+        }
+
+        static const int64_t kFifoWriteBufferSize = 64 * 1024;
+
+        // moves everything into a single SST file, replacing the files that were there before
+        void flushAndCompact() {
+            ASSERT(_db->Flush(rocksdb::FlushOptions()).ok());
+            ASSERT(_db->CompactRange(rocksdb::CompactRangeOptions(), nullptr, nullptr).ok());
+        }
+
         std::unique_ptr<RecoveryUnit> newRecoveryUnit() final {
             return stdx::make_unique<RocksRecoveryUnit>(&_transactionEngine, &_snapshotManager,
                                                         _db.get(), _counterManager.get(), nullptr,
@@ -107,6 +166,7 @@ namespace mongo {
         string _testNamespace = "mongo-rocks-record-store-test";
         unittest::TempDir _tempDir;
         std::unique_ptr<rocksdb::DB> _db;
+        std::unique_ptr<rocksdb::ColumnFamilyHandle> _fifoColumnFamily;
         RocksTransactionEngine _transactionEngine;
         RocksSnapshotManager _snapshotManager;
         std::unique_ptr<RocksDurabilityManager> _durabilityManager;
@@ -218,6 +278,183 @@ namespace mongo {
         }
     }
 
+    TEST(RocksRecordStoreTest, FindRecords) {
+        auto harnessHelper = stdx::make_unique<RocksRecordStoreHarnessHelper>();
+        std::unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+        RocksRecordStore* rrs = dynamic_cast<RocksRecordStore*>(rs.get());
+
+        std::vector<RecordId> locs;
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            for (const char* data : {"a", "b", "c"}) {
+                StatusWith<RecordId> res = rs->insertRecord(opCtx.get(), data, 2, Timestamp(),
+                                                            false);
+                ASSERT_OK(res.getStatus());
+                locs.push_back(res.getValue());
+            }
+            uow.commit();
+        }
+
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            // our own uncommitted writes have to be visible
+            ASSERT_OK(rs->updateRecord(opCtx.get(), locs[1], "B", 2, false, NULL));
+            rs->deleteRecord(opCtx.get(), locs[2]);
+
+            std::vector<RecordId> toFind{locs[0], locs[1], locs[2], RecordId(424242)};
+            std::vector<RecordData> found;
+            rrs->findRecords(opCtx.get(), toFind, &found);
+            ASSERT_EQUALS(4U, found.size());
+            ASSERT_EQUALS(string("a"), found[0].data());
+            ASSERT_EQUALS(string("B"), found[1].data());
+            ASSERT(found[2].data() == nullptr);
+            ASSERT(found[3].data() == nullptr);
+        }
+    }
+
+    TEST(RocksRecordStoreTest, TruncateThenInsert) {
+        auto harnessHelper = stdx::make_unique<RocksRecordStoreHarnessHelper>();
+        std::unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            for (const char* data : {"a", "b", "c"}) {
+                ASSERT_OK(rs->insertRecord(opCtx.get(), data, 2, Timestamp(), false).getStatus());
+            }
+            uow.commit();
+        }
+
+        RecordId loc;
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            ASSERT_OK(rs->truncate(opCtx.get()));
+            ASSERT_EQUALS(0, rs->numRecords(opCtx.get()));
+            ASSERT_EQUALS(0, rs->dataSize(opCtx.get()));
+
+            // writes that follow the truncation in the same unit of work have to survive it
+            StatusWith<RecordId> res = rs->insertRecord(opCtx.get(), "d", 2, Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            loc = res.getValue();
+            uow.commit();
+        }
+
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            ASSERT_EQUALS(1, rs->numRecords(opCtx.get()));
+            ASSERT_EQUALS(2, rs->dataSize(opCtx.get()));
+
+            auto cursor = rs->getCursor(opCtx.get());
+            auto record = cursor->next();
+            ASSERT(record);
+            ASSERT_EQUALS(loc, record->id);
+            ASSERT_EQUALS(string("d"), record->data.data());
+            ASSERT(!cursor->next());
+        }
+    }
+
+    TEST(RocksRecordStoreTest, RandomCursorAvoidDuplicates) {
+        auto harnessHelper = stdx::make_unique<RocksRecordStoreHarnessHelper>();
+        std::unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+        RocksRecordStore* rrs = dynamic_cast<RocksRecordStore*>(rs.get());
+
+        const int kNumRecords = 100;
+        std::set<RecordId> locs;
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            for (int i = 0; i < kNumRecords; ++i) {
+                StatusWith<RecordId> res = rs->insertRecord(opCtx.get(), "a", 2, Timestamp(),
+                                                            false);
+                ASSERT_OK(res.getStatus());
+                locs.insert(res.getValue());
+            }
+            uow.commit();
+        }
+
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            auto cursor = rrs->getRandomCursor(opCtx.get(), true);
+            std::set<RecordId> seen;
+            for (int i = 0; i < kNumRecords; ++i) {
+                auto record = cursor->next();
+                ASSERT(record);
+                ASSERT(locs.count(record->id));
+                ASSERT(seen.insert(record->id).second);
+            }
+            ASSERT(!cursor->next());
+        }
+
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            auto cursor = rs->getRandomCursor(opCtx.get());
+            for (int i = 0; i < 2 * kNumRecords; ++i) {
+                auto record = cursor->next();
+                ASSERT(record);
+                ASSERT(locs.count(record->id));
+            }
+        }
+    }
+
+    TEST(RocksRecordStoreTest, PartitionedCursors) {
+        auto harnessHelper = stdx::make_unique<RocksRecordStoreHarnessHelper>();
+        std::unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+        RocksRecordStore* rrs = dynamic_cast<RocksRecordStore*>(rs.get());
+
+        const int kNumRecords = 1000;
+        std::set<RecordId> locs;
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            for (int i = 0; i < kNumRecords; ++i) {
+                StatusWith<RecordId> res = rs->insertRecord(opCtx.get(), "a", 2, Timestamp(),
+                                                            false);
+                ASSERT_OK(res.getStatus());
+                locs.insert(res.getValue());
+            }
+            uow.commit();
+        }
+
+        const int kNumPartitions = 4;
+        std::vector<ServiceContext::UniqueClient> clients;
+        std::vector<ServiceContext::UniqueOperationContext> opCtxs;
+        std::vector<OperationContext*> rawOpCtxs;
+        for (int i = 0; i < kNumPartitions; ++i) {
+            clients.push_back(harnessHelper->serviceContext()->makeClient("c" + std::to_string(i)));
+            opCtxs.push_back(harnessHelper->newOperationContext(clients.back().get()));
+            rawOpCtxs.push_back(opCtxs.back().get());
+        }
+
+        auto cursors = rrs->getPartitionedCursors(rawOpCtxs);
+        ASSERT_EQUALS(static_cast<size_t>(kNumPartitions), cursors.size());
+
+        {
+            // records inserted after the cursors were created must not show up in any of them
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            ASSERT_OK(rs->insertRecord(opCtx.get(), "b", 2, Timestamp(), false).getStatus());
+            uow.commit();
+        }
+
+        std::set<RecordId> seen;
+        RecordId previous;
+        for (auto& cursor : cursors) {
+            size_t partitionSize = 0;
+            while (auto record = cursor->next()) {
+                ASSERT(previous.isNull() || previous < record->id);
+                ASSERT(locs.count(record->id));
+                ASSERT(seen.insert(record->id).second);
+                previous = record->id;
+                ++partitionSize;
+            }
+            ASSERT_GREATER_THAN(partitionSize, 0U);
+        }
+        ASSERT_EQUALS(locs.size(), seen.size());
+    }
+
     StatusWith<RecordId> insertBSON(ServiceContext::UniqueOperationContext& opCtx,
                                    std::unique_ptr<RecordStore>& rs,
                                    const Timestamp& opTime) {
@@ -327,6 +564,378 @@ namespace mongo {
         }
     }
 
+    TEST(RocksRecordStoreTest, CappedVisibility) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newCappedRecordStore(100000, -1));
+        CappedVisibilityManager manager(dynamic_cast<RocksRecordStore*>(rs.get()), nullptr);
+
+        // nothing is hidden, not even RecordId::max()
+        ASSERT_FALSE(manager.isCappedHidden(RecordId(1)));
+        ASSERT_FALSE(manager.isCappedHidden(RecordId::max()));
+        ASSERT_EQ(RecordId(), manager.lowestCappedHiddenRecord());
+
+        ServiceContext::UniqueOperationContext opCtx1(harnessHelper.newOperationContext());
+        ServiceContext::UniqueOperationContext opCtx2(harnessHelper.newOperationContext());
+        std::unique_ptr<WriteUnitOfWork> uow1(new WriteUnitOfWork(opCtx1.get()));
+        std::unique_ptr<WriteUnitOfWork> uow2(new WriteUnitOfWork(opCtx2.get()));
+        manager.addUncommittedRecord(opCtx1.get(), RecordId(5));
+        manager.addUncommittedRecord(opCtx2.get(), RecordId(7));
+        ASSERT_FALSE(manager.isCappedHidden(RecordId(4)));
+        ASSERT(manager.isCappedHidden(RecordId(5)));
+        ASSERT(manager.isCappedHidden(RecordId(6)));
+        ASSERT(manager.isCappedHidden(RecordId::max()));
+        ASSERT_EQ(RecordId(5), manager.lowestCappedHiddenRecord());
+
+        // the lowest uncommitted record goes away, the next one is the lowest hidden now
+        uow1.reset();
+        ASSERT_FALSE(manager.isCappedHidden(RecordId(6)));
+        ASSERT(manager.isCappedHidden(RecordId(7)));
+        ASSERT_EQ(RecordId(7), manager.lowestCappedHiddenRecord());
+
+        uow2->commit();
+        uow2.reset();
+        ASSERT_FALSE(manager.isCappedHidden(RecordId(7)));
+        ASSERT_FALSE(manager.isCappedHidden(RecordId::max()));
+        ASSERT_EQ(RecordId(), manager.lowestCappedHiddenRecord());
+    }
+
+    TEST(RocksRecordStoreTest, CappedVisibilityIsPublishedAtomically) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newCappedRecordStore(100000, -1));
+        CappedVisibilityManager manager(dynamic_cast<RocksRecordStore*>(rs.get()), nullptr);
+
+        // readers don't take the mutex, but they must never see a committed record as hidden,
+        // nor a lowest hidden record that was already committed
+        const int64_t kNumRecords = 20000;
+        std::atomic<int64_t> committed(0);  // NOLINT
+        ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+        stdx::thread writer([&] {
+            for (int64_t i = 1; i <= kNumRecords; ++i) {
+                WriteUnitOfWork uow(opCtx.get());
+                manager.addUncommittedRecord(opCtx.get(), RecordId(i));
+                uow.commit();
+                committed.store(i);
+            }
+        });
+
+        int64_t lastCommitted = 0;
+        while (lastCommitted < kNumRecords) {
+            lastCommitted = committed.load();
+            const RecordId lowest = manager.lowestCappedHiddenRecord();
+            ASSERT(lowest.isNull() || lowest.repr() > lastCommitted);
+            if (lastCommitted > 0) {
+                ASSERT_FALSE(manager.isCappedHidden(RecordId(lastCommitted)));
+            }
+        }
+        writer.join();
+        ASSERT_EQ(RecordId(), manager.lowestCappedHiddenRecord());
+    }
+
+    TEST(RocksRecordStoreTest, OplogStones) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(
+            harnessHelper.newCappedRecordStore("local.oplog.foo", 10000, -1));
+        RocksRecordStore* rrs = dynamic_cast<RocksRecordStore*>(rs.get());
+        ASSERT(rrs->oplogStones());
+
+        ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+        for (unsigned i = 1; i <= 2000; ++i) {
+            ASSERT_OK(insertBSON(opCtx, rs, Timestamp(i, 1)).getStatus());
+        }
+
+        // whole stones are reclaimed once there are too many of them, which keeps the oplog
+        // within about a stone of its maximum size
+        auto stones = rrs->oplogStones();
+        ASSERT_GT(stones->numStones(), 0U);
+        ASSERT_LTE(rs->dataSize(opCtx.get()), 10000 + 2 * stones->minBytesPerStone());
+        ASSERT_LT(rs->numRecords(opCtx.get()), 2000);
+
+        // the oldest surviving record is the first one after the last reclaimed stone
+        auto cursor = rs->getCursor(opCtx.get(), true);
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT_GT(record->id, RecordId(1, 1));
+        ASSERT_EQ(rs->oplogStartHack(opCtx.get(), RecordId(1, 1)), RecordId());
+    }
+
+    TEST(RocksRecordStoreTest, OplogFifoColumnFamilyKeepsUnreclaimedEntries) {
+        const int64_t kCappedMaxSize = 64 * 1024;
+        const int64_t kMemtableBytes = 2 * RocksRecordStoreHarnessHelper::kFifoWriteBufferSize;
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newOplogInFifoColumnFamily(kCappedMaxSize));
+        RocksRecordStore* rrs = dynamic_cast<RocksRecordStore*>(rs.get());
+        ASSERT_EQ(static_cast<uint64_t>(2 * kCappedMaxSize + kMemtableBytes),
+                  harnessHelper.fifoMaxTableFilesSize());
+
+        // an uncommitted entry hides all the later ones, so none of them can be reclaimed
+        ServiceContext::UniqueOperationContext blocker(harnessHelper.newOperationContext());
+        std::unique_ptr<WriteUnitOfWork> blockerUow(new WriteUnitOfWork(blocker.get()));
+        ASSERT_OK(insertBSON(blocker, rs, Timestamp(1, 1)).getStatus());
+
+        // many times the capped size, in many flushed files
+        ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+        std::mt19937 random(42);
+        std::string payload(1000, 'a');
+        const unsigned kNumEntries = 1000;
+        for (unsigned i = 2; i <= kNumEntries; ++i) {
+            for (auto& c : payload) {
+                c = static_cast<char>('a' + random() % 26);
+            }
+            BSONObj obj = BSON("ts" << Timestamp(i, 1) << "payload" << payload);
+            WriteUnitOfWork wuow(opCtx.get());
+            ASSERT_OK(rrs->oplogDiskLocRegister(opCtx.get(), Timestamp(i, 1)));
+            ASSERT_OK(rs->insertRecord(opCtx.get(), obj.objdata(), obj.objsize(), Timestamp(),
+                                       false)
+                          .getStatus());
+            wuow.commit();
+        }
+        ASSERT_GT(rs->dataSize(opCtx.get()), 10 * kCappedMaxSize);
+
+        // FIFO compaction's limit grew with what couldn't be reclaimed, so it drops nothing
+        ASSERT_GT(harnessHelper.fifoSstFilesSize(), static_cast<uint64_t>(4 * kCappedMaxSize));
+        ASSERT_GT(harnessHelper.fifoMaxTableFilesSize(), harnessHelper.fifoSstFilesSize());
+        harnessHelper.compactFifoColumnFamily();
+
+        blockerUow.reset();
+        rs->waitForAllEarlierOplogWritesToBeVisible(opCtx.get());
+        ServiceContext::UniqueOperationContext reader(harnessHelper.newOperationContext());
+        auto cursor = rs->getCursor(reader.get(), true);
+        long long numEntries = 0;
+        RecordId expected(2, 1);
+        while (auto record = cursor->next()) {
+            ASSERT_EQ(expected, record->id);
+            expected = RecordId(expected.repr() + (1LL << 32));
+            ++numEntries;
+        }
+        ASSERT_EQ(static_cast<long long>(kNumEntries - 1), numEntries);
+        ASSERT_EQ(numEntries, rs->numRecords(reader.get()));
+    }
+
+    TEST(RocksRecordStoreTest, OplogCursorYield) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(
+            harnessHelper.newCappedRecordStore("local.oplog.foo", 100000, -1));
+
+        ServiceContext::UniqueOperationContext writer(harnessHelper.newOperationContext());
+        ASSERT_EQ(insertBSON(writer, rs, Timestamp(1, 1)).getValue(), RecordId(1, 1));
+        ASSERT_EQ(insertBSON(writer, rs, Timestamp(1, 2)).getValue(), RecordId(1, 2));
+
+        auto client = harnessHelper.serviceContext()->makeClient("reader");
+        auto reader = harnessHelper.newOperationContext(client.get());
+        auto cursor = rs->getCursor(reader.get(), true);
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, RecordId(1, 1));
+
+        // records that get committed during the yield are past what the cursor may see
+        cursor->save();
+        ASSERT_EQ(insertBSON(writer, rs, Timestamp(1, 3)).getValue(), RecordId(1, 3));
+        reader->recoveryUnit()->abandonSnapshot();
+        ASSERT(cursor->restore());
+        record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, RecordId(1, 2));
+        ASSERT(!cursor->next());
+
+        // same after moving to another operation
+        cursor->save();
+        cursor->detachFromOperationContext();
+        cursor->reattachToOperationContext(reader.get());
+        ASSERT(cursor->restore());
+        ASSERT(!cursor->next());
+        cursor.reset();
+
+        // a new cursor sees them
+        reader->recoveryUnit()->abandonSnapshot();
+        cursor = rs->getCursor(reader.get(), true);
+        for (unsigned i = 1; i <= 3; ++i) {
+            record = cursor->next();
+            ASSERT(record);
+            ASSERT_EQ(record->id, RecordId(1, i));
+        }
+        ASSERT(!cursor->next());
+    }
+
+    void testCursorRestoreOnNewSnapshot(bool forward) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newNonCappedRecordStore());
+
+        ServiceContext::UniqueOperationContext writer(harnessHelper.newOperationContext());
+        std::vector<RecordId> ids;
+        for (int i = 0; i < 3; ++i) {
+            WriteUnitOfWork wuow(writer.get());
+            auto res = rs->insertRecord(writer.get(), "a", 2, Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            ids.push_back(res.getValue());
+            wuow.commit();
+        }
+
+        auto client = harnessHelper.serviceContext()->makeClient("reader");
+        auto reader = harnessHelper.newOperationContext(client.get());
+        auto cursor = rs->getCursor(reader.get(), forward);
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, forward ? ids[0] : ids[2]);
+
+        // the record the cursor would have returned next goes away during the yield
+        cursor->save();
+        {
+            WriteUnitOfWork wuow(writer.get());
+            rs->deleteRecord(writer.get(), ids[1]);
+            wuow.commit();
+        }
+        reader->recoveryUnit()->abandonSnapshot();
+        ASSERT(cursor->restore());
+        record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, forward ? ids[2] : ids[0]);
+        ASSERT(!cursor->next());
+    }
+
+    TEST(RocksRecordStoreTest, CursorRestoreOnNewSnapshotForward) {
+        testCursorRestoreOnNewSnapshot(true);
+    }
+
+    TEST(RocksRecordStoreTest, CursorRestoreOnNewSnapshotReverse) {
+        testCursorRestoreOnNewSnapshot(false);
+    }
+
+    TEST(RocksRecordStoreTest, CursorSeesWritesMadeMidScan) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newNonCappedRecordStore());
+
+        ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+        std::vector<RecordId> ids;
+        for (int i = 0; i < 4; ++i) {
+            WriteUnitOfWork wuow(opCtx.get());
+            auto res = rs->insertRecord(opCtx.get(), "a", 2, Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            ids.push_back(res.getValue());
+            wuow.commit();
+        }
+        opCtx->recoveryUnit()->abandonSnapshot();
+
+        // the cursors start out reading from the DB only, then have to pick up our writes
+        {
+            auto cursor = rs->getCursor(opCtx.get(), true);
+            auto record = cursor->next();
+            ASSERT(record);
+            ASSERT_EQ(record->id, ids[0]);
+
+            WriteUnitOfWork wuow(opCtx.get());
+            rs->deleteRecord(opCtx.get(), ids[0]);
+            rs->deleteRecord(opCtx.get(), ids[1]);
+            auto res = rs->insertRecord(opCtx.get(), "b", 2, Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            for (auto id : {ids[2], ids[3], res.getValue()}) {
+                record = cursor->next();
+                ASSERT(record);
+                ASSERT_EQ(record->id, id);
+            }
+            ASSERT(!cursor->next());
+        }
+        opCtx->recoveryUnit()->abandonSnapshot();
+
+        {
+            auto cursor = rs->getCursor(opCtx.get(), false);
+            auto record = cursor->next();
+            ASSERT(record);
+            ASSERT_EQ(record->id, ids[3]);
+
+            WriteUnitOfWork wuow(opCtx.get());
+            rs->deleteRecord(opCtx.get(), ids[3]);
+            rs->deleteRecord(opCtx.get(), ids[2]);
+            for (auto id : {ids[1], ids[0]}) {
+                record = cursor->next();
+                ASSERT(record);
+                ASSERT_EQ(record->id, id);
+            }
+            ASSERT(!cursor->next());
+        }
+    }
+
+    TEST(RocksRecordStoreTest, OperationStatistics) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newNonCappedRecordStore());
+        {
+            // nothing asks for statistics
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+            ASSERT_FALSE(opCtx->recoveryUnit()->getOperationStatistics());
+        }
+
+        RocksOperationStats::setTimingsEnabled(true);
+        ON_BLOCK_EXIT([] { RocksOperationStats::setTimingsEnabled(false); });
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+            WriteUnitOfWork wuow(opCtx.get());
+            for (int i = 0; i < 3; ++i) {
+                ASSERT_OK(rs->insertRecord(opCtx.get(), "a", 2, Timestamp(), false).getStatus());
+            }
+            wuow.commit();
+        }
+
+        ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+        auto cursor = rs->getCursor(opCtx.get(), true);
+        while (cursor->next()) {
+        }
+        auto stats = opCtx->recoveryUnit()->getOperationStatistics();
+        ASSERT(stats);
+        BSONObj obj = stats->toBSON();
+        ASSERT_EQ(obj["seeks"].numberLong(), 1);
+        ASSERT_EQ(obj["nexts"].numberLong(), 3);
+    }
+
+    TEST(RocksRecordStoreTest, OplogTailCache) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(
+            harnessHelper.newCappedRecordStore("local.oplog.foo", 100000, -1));
+
+        ServiceContext::UniqueOperationContext writer(harnessHelper.newOperationContext());
+        ASSERT_EQ(insertBSON(writer, rs, Timestamp(1, 1)).getValue(), RecordId(1, 1));
+        ASSERT_EQ(insertBSON(writer, rs, Timestamp(1, 2)).getValue(), RecordId(1, 2));
+
+        // an insert that rolls back must never show up
+        {
+            auto client = harnessHelper.serviceContext()->makeClient("rollback");
+            auto opCtx = harnessHelper.newOperationContext(client.get());
+            WriteUnitOfWork wuow(opCtx.get());
+            RocksRecordStore* rrs = dynamic_cast<RocksRecordStore*>(rs.get());
+            ASSERT_OK(rrs->oplogDiskLocRegister(opCtx.get(), Timestamp(1, 3)));
+            BSONObj obj = BSON("ts" << Timestamp(1, 3));
+            ASSERT_OK(rs->insertRecord(opCtx.get(), obj.objdata(), obj.objsize(), Timestamp(),
+                                       false).getStatus());
+        }
+        ASSERT_EQ(insertBSON(writer, rs, Timestamp(1, 4)).getValue(), RecordId(1, 4));
+
+        auto client = harnessHelper.serviceContext()->makeClient("reader");
+        auto reader = harnessHelper.newOperationContext(client.get());
+        auto cursor = rs->getCursor(reader.get(), true);
+        ASSERT(cursor->seekExact(RecordId(1, 1)));
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, RecordId(1, 2));
+        ASSERT_BSONOBJ_EQ(record->data.toBson(), BSON("ts" << Timestamp(1, 2)));
+        record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, RecordId(1, 4));
+        ASSERT(!cursor->next());
+
+        // records removed by cappedTruncateAfter are gone from the cache too
+        cursor.reset();
+        reader->recoveryUnit()->abandonSnapshot();
+        {
+            auto client = harnessHelper.serviceContext()->makeClient("truncate");
+            auto opCtx = harnessHelper.newOperationContext(client.get());
+            rs->cappedTruncateAfter(opCtx.get(), RecordId(1, 2), false);
+        }
+        cursor = rs->getCursor(reader.get(), true);
+        ASSERT(cursor->seekExact(RecordId(1, 1)));
+        record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQ(record->id, RecordId(1, 2));
+        ASSERT(!cursor->next());
+    }
+
     void testDeleteSeekExactRecord(bool forward, bool capped) {
         RocksRecordStoreHarnessHelper harnessHelper;
         std::unique_ptr<RecordStore> rs;
@@ -376,6 +985,67 @@ namespace mongo {
         testDeleteSeekExactRecord(false, false);
     }
 
+    TEST(RocksRecordStoreTest, SeekExactRecordStaysValidUntilNextCall) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newNonCappedRecordStore());
+        const std::string original(1000, 'a');
+        RecordId loc;
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            auto res = rs->insertRecord(opCtx.get(), original.c_str(), original.size() + 1,
+                                        Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            loc = res.getValue();
+            uow.commit();
+        }
+        // the record is read from a table file, so its value can be pinned
+        harnessHelper.flushAndCompact();
+
+        ServiceContext::UniqueOperationContext reader(harnessHelper.newOperationContext());
+        auto cursor = rs->getCursor(reader.get(), true);
+        auto record = cursor->seekExact(loc);
+        ASSERT(record);
+
+        // the file the record came from goes away
+        {
+            ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+            WriteUnitOfWork uow(opCtx.get());
+            const std::string updated(1000, 'b');
+            ASSERT_OK(rs->updateRecord(opCtx.get(), loc, updated.c_str(), updated.size() + 1,
+                                       false, NULL));
+            uow.commit();
+        }
+        harnessHelper.flushAndCompact();
+        ASSERT_EQUALS(original, record->data.data());
+
+        ASSERT(!cursor->next());
+    }
+
+    TEST(RocksRecordStoreTest, SeekExactCopiesRecordFromWriteBatch) {
+        RocksRecordStoreHarnessHelper harnessHelper;
+        std::unique_ptr<RecordStore> rs(harnessHelper.newNonCappedRecordStore());
+        ServiceContext::UniqueOperationContext opCtx(harnessHelper.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        auto res = rs->insertRecord(opCtx.get(), "abc", 4, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        const RecordId loc = res.getValue();
+
+        auto cursor = rs->getCursor(opCtx.get(), true);
+        auto record = cursor->seekExact(loc);
+        ASSERT(record);
+
+        // our own writes change the record and grow the batch, which moves its buffer
+        ASSERT_OK(rs->updateRecord(opCtx.get(), loc, "def", 4, false, NULL));
+        const std::string filler(64 * 1024, 'x');
+        for (int i = 0; i < 100; ++i) {
+            ASSERT_OK(rs->insertRecord(opCtx.get(), filler.c_str(), filler.size() + 1,
+                                       Timestamp(), false)
+                          .getStatus());
+        }
+        ASSERT_EQUALS(string("abc"), record->data.data());
+    }
+
     TEST(RocksRecordStoreTest, OplogHackOnNonOplog) {
         RocksRecordStoreHarnessHelper harnessHelper;
         std::unique_ptr<RecordStore> rs(
@@ -32,6 +32,8 @@
 
 #include "rocks_recovery_unit.h"
 
+#include <algorithm>
+
 #include <rocksdb/comparator.h>
 #include <rocksdb/db.h>
 #include <rocksdb/iterator.h>
@@ -40,12 +42,15 @@
 #include <rocksdb/perf_context.h>
 #include <rocksdb/write_batch.h>
 #include <rocksdb/utilities/write_batch_with_index.h>
+#include <rocksdb/version.h>
 
 #include "mongo/base/checked_cast.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/db/operation_context.h"
 #include "mongo/db/server_options.h"
 #include "mongo/db/storage/journal_listener.h"
+#include "mongo/stdx/memory.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/util/log.h"
 
 #include "rocks_transaction.h"
@@ -62,21 +67,57 @@ namespace mongo {
 
         logger::LogSeverity kSlowTransactionSeverity = logger::LogSeverity::Debug(1);
 
+// Iterator::Refresh(const Snapshot*) appeared in RocksDB 8.6
+#if defined(ROCKSDB_MAJOR) && (ROCKSDB_MAJOR > 8 || (ROCKSDB_MAJOR == 8 && ROCKSDB_MINOR >= 6))
+#define ROCKS_ITERATOR_REFRESH_SNAPSHOT 1
+#endif
+
+        // Forwards to a DB iterator it doesn't own. A write batch iterator takes ownership of its
+        // base, so this lets the DB iterator outlive the write batch iterator built on top of it
+        class UnownedIterator : public rocksdb::Iterator {
+        public:
+            explicit UnownedIterator(rocksdb::Iterator* iterator) : _iterator(iterator) {}
+
+            virtual bool Valid() const { return _iterator->Valid(); }
+            virtual void SeekToFirst() { _iterator->SeekToFirst(); }
+            virtual void SeekToLast() { _iterator->SeekToLast(); }
+            virtual void Seek(const rocksdb::Slice& target) { _iterator->Seek(target); }
+            virtual void SeekForPrev(const rocksdb::Slice& target) {
+                // noop, see PrefixStrippingIterator::SeekForPrev()
+            }
+            virtual void Next() { _iterator->Next(); }
+            virtual void Prev() { _iterator->Prev(); }
+            virtual rocksdb::Slice key() const { return _iterator->key(); }
+            virtual rocksdb::Slice value() const { return _iterator->value(); }
+            virtual rocksdb::Status status() const { return _iterator->status(); }
+
+        private:
+            rocksdb::Iterator* _iterator;  // not owned
+        };
+
         class PrefixStrippingIterator : public RocksIterator {
         public:
-            // baseIterator is consumed
-            PrefixStrippingIterator(std::string prefix, Iterator* baseIterator,
+            // dbIterator is consumed. If writeBatch is not null, the iterator merges in its
+            // contents as soon as it holds anything
+            PrefixStrippingIterator(rocksdb::ColumnFamilyHandle* cf, std::string prefix,
+                                    Iterator* dbIterator, rocksdb::WriteBatchWithIndex* writeBatch,
                                     RocksCompactionScheduler* compactionScheduler,
                                     std::unique_ptr<rocksdb::Slice> upperBound)
                 : _rocksdbSkippedDeletionsInitial(0),
+                  _cf(cf),
                   _prefix(std::move(prefix)),
                   _nextPrefix(rocksGetNextPrefix(_prefix)),
                   _prefixSlice(_prefix.data(), _prefix.size()),
                   _prefixSliceEpsilon(_prefix.data(), _prefix.size() + 1),
-                  _baseIterator(baseIterator),
+                  _dbIterator(dbIterator),
+                  _writeBatch(writeBatch),
+                  _baseIterator(dbIterator),
                   _compactionScheduler(compactionScheduler),
                   _upperBound(std::move(upperBound)) {
                 *_upperBound.get() = rocksdb::Slice(_nextPrefix);
+                if (needsBatchIterator()) {
+                    useBatchIterator();
+                }
             }
 
             ~PrefixStrippingIterator() {}
@@ -87,48 +128,64 @@ namespace mongo {
             }
 
             virtual void SeekToFirst() {
+                RocksOperationStats::countSeek();
                 startOp();
+                if (needsBatchIterator()) {
+                    useBatchIterator();
+                }
                 // seek to first key bigger than prefix
                 _baseIterator->Seek(_prefixSliceEpsilon);
                 endOp();
             }
             virtual void SeekToLast() {
+                RocksOperationStats::countSeek();
                 startOp();
-                // we can't have upper bound set to _nextPrefix since we need to seek to it
-                *_upperBound.get() = rocksdb::Slice("\xFF\xFF\xFF\xFF");
-                _baseIterator->Seek(_nextPrefix);
-                // reset back to original value
-                *_upperBound.get() = rocksdb::Slice(_nextPrefix);
-                if (!_baseIterator->Valid()) {
-                    _baseIterator->SeekToLast();
-                }
-                if (_baseIterator->Valid() && !_baseIterator->key().starts_with(_prefixSlice)) {
-                    _baseIterator->Prev();
+                if (needsBatchIterator()) {
+                    useBatchIterator();
                 }
+                seekToLast();
                 endOp();
             }
 
             virtual void Seek(const rocksdb::Slice& target) {
+                RocksOperationStats::countSeek();
                 startOp();
-                std::unique_ptr<char[]> buffer(new char[_prefix.size() + target.size()]);
-                memcpy(buffer.get(), _prefix.data(), _prefix.size());
-                memcpy(buffer.get() + _prefix.size(), target.data(), target.size());
-                _baseIterator->Seek(rocksdb::Slice(buffer.get(), _prefix.size() + target.size()));
+                if (needsBatchIterator()) {
+                    useBatchIterator();
+                }
+                RocksKeyBuffer key(_prefixSlice, target.data(), target.size());
+                _baseIterator->Seek(key.slice());
                 endOp();
             }
 
             virtual void Next() {
+                RocksOperationStats::countNext();
                 startOp();
-                _baseIterator->Next();
+                if (needsBatchIterator()) {
+                    switchToBatchIterator(true);
+                } else {
+                    _baseIterator->Next();
+                }
                 endOp();
             }
 
             virtual void Prev() {
+                RocksOperationStats::countNext();
                 startOp();
-                _baseIterator->Prev();
+                if (needsBatchIterator()) {
+                    switchToBatchIterator(false);
+                } else {
+                    _baseIterator->Prev();
+                }
                 endOp();
             }
 
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+            virtual rocksdb::Status Refresh() {
+                return _baseIterator->Refresh();
+            }
+#endif
+
             virtual void SeekForPrev(const rocksdb::Slice& target) {
               // noop since we don't use it and it's only available in
               // RocksDB 4.12 and higher
@@ -147,31 +204,108 @@ namespace mongo {
             // This Seek is specific because it will succeed only if it finds a key with `target`
             // prefix. If there is no such key, it will be !Valid()
             virtual void SeekPrefix(const rocksdb::Slice& target) {
-                std::unique_ptr<char[]> buffer(new char[_prefix.size() + target.size()]);
-                memcpy(buffer.get(), _prefix.data(), _prefix.size());
-                memcpy(buffer.get() + _prefix.size(), target.data(), target.size());
-
-                std::string tempUpperBound = rocksGetNextPrefix(
-                    rocksdb::Slice(buffer.get(), _prefix.size() + target.size()));
+                RocksOperationStats::countSeek();
+                if (needsBatchIterator()) {
+                    useBatchIterator();
+                }
+                RocksKeyBuffer key(_prefixSlice, target.data(), target.size());
+                RocksKeyBuffer tempUpperBound(_prefixSlice, target.data(), target.size());
+                rocksIncrementKey(tempUpperBound.data(), tempUpperBound.size());
 
-                *_upperBound.get() = rocksdb::Slice(tempUpperBound);
+                *_upperBound.get() = tempUpperBound.slice();
                 if (target.size() == 0) {
                     // if target is empty, we'll try to seek to <prefix>, which is not good
                     _baseIterator->Seek(_prefixSliceEpsilon);
                 } else {
-                    _baseIterator->Seek(
-                        rocksdb::Slice(buffer.get(), _prefix.size() + target.size()));
+                    _baseIterator->Seek(key.slice());
                 }
                 // reset back to original value
                 *_upperBound.get() = rocksdb::Slice(_nextPrefix);
             }
 
+            // Points the DB iterator at snapshot and makes it merge in writeBatch from now on. On
+            // failure the iterator must not be used anymore
+            bool refresh(const rocksdb::Snapshot* snapshot,
+                         rocksdb::WriteBatchWithIndex* writeBatch) {
+#ifdef ROCKS_ITERATOR_REFRESH_SNAPSHOT
+                if (!_writeBatch) {
+                    // not one of ours, see NewIteratorNoSnapshot()
+                    return false;
+                }
+                // the write batch the old iterator reads from might be gone already
+                _batchIterator.reset();
+                _baseIterator = _dbIterator.get();
+                _writeBatch = writeBatch;
+                if (!_dbIterator->Refresh(snapshot).ok()) {
+                    return false;
+                }
+                if (needsBatchIterator()) {
+                    useBatchIterator();
+                }
+                return true;
+#else
+                return false;
+#endif
+            }
+
         private:
+            // We read straight from the DB until our unit of work writes something. Once it does,
+            // the next call that moves the iterator switches to merging in the write batch
+            bool needsBatchIterator() {
+                return _writeBatch && !_batchIterator &&
+                       _writeBatch->GetWriteBatch()->Count() != 0;
+            }
+
+            void useBatchIterator() {
+                _batchIterator.reset(_writeBatch->NewIteratorWithBase(
+                    _cf, new UnownedIterator(_dbIterator.get())));
+                _baseIterator = _batchIterator.get();
+            }
+
+            // Switches to the write batch in the middle of a scan and takes the step Next() or
+            // Prev() was asked for from where we were
+            void switchToBatchIterator(bool forward) {
+                if (!_baseIterator->Valid()) {
+                    useBatchIterator();
+                    return;
+                }
+                const std::string current = _baseIterator->key().ToString();
+                useBatchIterator();
+                _baseIterator->Seek(current);
+                if (forward) {
+                    // if we deleted the current key, we're on the next one already
+                    if (_baseIterator->Valid() && _baseIterator->key() == current) {
+                        _baseIterator->Next();
+                    }
+                } else if (_baseIterator->Valid()) {
+                    _baseIterator->Prev();
+                } else {
+                    // nothing on or after the current key, so the previous one is the last one
+                    seekToLast();
+                }
+            }
+
+            void seekToLast() {
+                // we can't have upper bound set to _nextPrefix since we need to seek to it
+                *_upperBound.get() = rocksdb::Slice("\xFF\xFF\xFF\xFF");
+                _baseIterator->Seek(_nextPrefix);
+                // reset back to original value
+                *_upperBound.get() = rocksdb::Slice(_nextPrefix);
+                if (!_baseIterator->Valid()) {
+                    _baseIterator->SeekToLast();
+                }
+                if (_baseIterator->Valid() && !_baseIterator->key().starts_with(_prefixSlice)) {
+                    _baseIterator->Prev();
+                }
+            }
+
             void startOp() {
                 if (_compactionScheduler == nullptr) {
                     return;
                 }
-                if (rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kDisable) {
+                // units of work count already, iterators used outside of one don't
+                _raisedPerfLevel = rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kDisable;
+                if (_raisedPerfLevel) {
                     rocksdb::SetPerfLevel(rocksdb::kEnableCount);
                 }
                 _rocksdbSkippedDeletionsInitial = get_internal_delete_skipped_count();
@@ -182,20 +316,32 @@ namespace mongo {
                 }
                 int skippedDeletionsOp = get_internal_delete_skipped_count() -
                                          _rocksdbSkippedDeletionsInitial;
+                if (_raisedPerfLevel) {
+                    rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+                }
                 if (skippedDeletionsOp >=
                     RocksCompactionScheduler::getSkippedDeletionsThreshold()) {
-                    _compactionScheduler->reportSkippedDeletionsAboveThreshold(_prefix);
+                    _compactionScheduler->reportSkippedDeletionsAboveThreshold(_cf, _prefix);
                 }
             }
 
             int _rocksdbSkippedDeletionsInitial;
+            // whether startOp() turned counting on, endOp() turns it off again
+            bool _raisedPerfLevel = false;
 
+            rocksdb::ColumnFamilyHandle* _cf;  // not owned
             std::string _prefix;
             std::string _nextPrefix;
             rocksdb::Slice _prefixSlice;
             // the first possible key bigger than prefix. we use this for SeekToFirst()
             rocksdb::Slice _prefixSliceEpsilon;
-            std::unique_ptr<Iterator> _baseIterator;
+            // declared before _batchIterator, which reads from it, so that it's destroyed last
+            std::unique_ptr<Iterator> _dbIterator;
+            rocksdb::WriteBatchWithIndex* _writeBatch;  // not owned, can be nullptr
+            // merges _writeBatch with _dbIterator. nullptr until _writeBatch gets written to
+            std::unique_ptr<Iterator> _batchIterator;
+            // whichever of the two we read from
+            Iterator* _baseIterator;
 
             // can be nullptr
             RocksCompactionScheduler* _compactionScheduler;  // not owned
@@ -212,19 +358,28 @@ namespace mongo {
                                          RocksCounterManager* counterManager,
                                          RocksCompactionScheduler* compactionScheduler,
                                          RocksDurabilityManager* durabilityManager,
-                                         bool durable)
+                                         bool durable,
+                                         RocksRecoveryUnitResourcePool* resourcePool)
         : _transactionEngine(transactionEngine),
           _snapshotManager(snapshotManager),
           _db(db),
           _counterManager(counterManager),
           _compactionScheduler(compactionScheduler),
           _durabilityManager(durabilityManager),
+          _resourcePool(resourcePool),
           _durable(durable),
-          _transaction(transactionEngine),
-          _writeBatch(rocksdb::BytewiseComparator(), 0, true),
+          _resources(resourcePool ? resourcePool->get()
+                                  : stdx::make_unique<Resources>(transactionEngine)),
+          _transaction(_resources->transaction),
+          _writeBatch(_resources->writeBatch),
           _snapshot(nullptr),
           _preparedSnapshot(nullptr),
-          _mySnapshotId(nextSnapshotId.fetchAndAdd(1)) {
+          _deltaCounters(_resources->deltaCounters),
+          _changes(_resources->changes),
+          _mySnapshotId(nextSnapshotId.fetchAndAdd(1)),
+          _previousPerfLevel(RocksOperationStats::enableForThread()),
+          _statsThread(stdx::this_thread::get_id()),
+          _statsBaseline(RocksOperationStats::current()) {
         RocksRecoveryUnit::_totalLiveRecoveryUnits.fetch_add(1, std::memory_order_relaxed);
     }
 
@@ -235,6 +390,13 @@ namespace mongo {
             _preparedSnapshot = nullptr;
         }
         _abort();
+        if (_resourcePool) {
+            _resourcePool->put(std::move(_resources));
+        }
+        if (stdx::this_thread::get_id() == _statsThread) {
+            // units nest, e.g. for capped deletes, so this only undoes what we did
+            RocksOperationStats::restoreForThread(_previousPerfLevel);
+        }
         RocksRecoveryUnit::_totalLiveRecoveryUnits.fetch_sub(1, std::memory_order_relaxed);
     }
 
@@ -270,11 +432,20 @@ namespace mongo {
 
     void RocksRecoveryUnit::abandonSnapshot() {
         _deltaCounters.clear();
-        _writeBatch.Clear();
+        _clearWriteBatch();
         _releaseSnapshot();
         _areWriteUnitOfWorksBanned = false;
     }
 
+    std::shared_ptr<StorageStats> RocksRecoveryUnit::getOperationStatistics() const {
+        if (stdx::this_thread::get_id() != _statsThread) {
+            // the counters are per thread, we'd be comparing with another thread's
+            return nullptr;
+        }
+        return std::make_shared<RocksOperationStats>(RocksOperationStats::current() -
+                                                     _statsBaseline);
+    }
+
     rocksdb::WriteBatchWithIndex* RocksRecoveryUnit::writeBatch() { return &_writeBatch; }
 
     void RocksRecoveryUnit::setOplogReadTill(const RecordId& record) { _oplogReadTill = record; }
@@ -311,8 +482,9 @@ namespace mongo {
             }
         }
 
+        // our snapshot id might be recorded even if the snapshot itself has been shared
+        _transaction.abort();
         if (_snapshot) {
-            _transaction.abort();
             _db->ReleaseSnapshot(_snapshot);
             _snapshot = nullptr;
         }
@@ -333,7 +505,7 @@ namespace mongo {
 
     void RocksRecoveryUnit::_commit() {
         rocksdb::WriteBatch* wb = _writeBatch.GetWriteBatch();
-        for (auto pair : _deltaCounters) {
+        for (const auto& pair : _deltaCounters) {
             auto& counter = pair.second;
             counter._value->fetch_add(counter._delta, std::memory_order::memory_order_relaxed);
             long long newValue = counter._value->load(std::memory_order::memory_order_relaxed);
@@ -350,7 +522,7 @@ namespace mongo {
             _transaction.commit();
         }
         _deltaCounters.clear();
-        _writeBatch.Clear();
+        _clearWriteBatch();
     }
 
     void RocksRecoveryUnit::_abort() {
@@ -368,7 +540,7 @@ namespace mongo {
         }
 
         _deltaCounters.clear();
-        _writeBatch.Clear();
+        _clearWriteBatch();
 
         _releaseSnapshot();
     }
@@ -389,10 +561,11 @@ namespace mongo {
             _timer.reset(new Timer());
         }
 
+        if (_snapshotHolder.get() != nullptr) {
+            return _snapshotHolder->snapshot;
+        }
         if (_readFromMajorityCommittedSnapshot) {
-            if (_snapshotHolder.get() == nullptr) {
-                _snapshotHolder = _snapshotManager->getCommittedSnapshot();
-            }
+            _snapshotHolder = _snapshotManager->getCommittedSnapshot();
             return _snapshotHolder->snapshot;
         }
         if (!_snapshot) {
@@ -405,62 +578,197 @@ namespace mongo {
         return _snapshot;
     }
 
-    rocksdb::Status RocksRecoveryUnit::Get(const rocksdb::Slice& key, std::string* value) {
-        if (_writeBatch.GetWriteBatch()->Count() > 0) {
-            std::unique_ptr<rocksdb::WBWIIterator> wb_iterator(_writeBatch.NewIterator());
-            wb_iterator->Seek(key);
-            if (wb_iterator->Valid() && wb_iterator->Entry().key == key) {
-                const auto& entry = wb_iterator->Entry();
-                if (entry.type == rocksdb::WriteType::kDeleteRecord) {
-                    return rocksdb::Status::NotFound();
-                }
-                *value = std::string(entry.value.data(), entry.value.size());
-                return rocksdb::Status::OK();
+    std::shared_ptr<RocksSnapshotManager::SnapshotHolder> RocksRecoveryUnit::shareSnapshot() {
+        snapshot();
+        if (_snapshotHolder.get() == nullptr) {
+            // from now on the holder owns the snapshot. _transaction keeps its snapshot id
+            _snapshotHolder =
+                std::make_shared<RocksSnapshotManager::SnapshotHolder>(_db, _snapshot);
+            _snapshot = nullptr;
+        }
+        return _snapshotHolder;
+    }
+
+    void RocksRecoveryUnit::attachSharedSnapshot(
+        std::shared_ptr<RocksSnapshotManager::SnapshotHolder> holder) {
+        invariant(!hasSnapshot());
+        _snapshotHolder = std::move(holder);
+    }
+
+    void RocksRecoveryUnit::_clearWriteBatch() {
+        _resources->writeBatchHighWater = std::max(_resources->writeBatchHighWater,
+                                                   _writeBatch.GetWriteBatch()->GetDataSize());
+        _writeBatch.Clear();
+    }
+
+    bool RocksRecoveryUnit::_isDeletion(rocksdb::WriteType type) {
+        return type == rocksdb::WriteType::kDeleteRecord ||
+               type == rocksdb::WriteType::kSingleDeleteRecord;
+    }
+
+    rocksdb::Status RocksRecoveryUnit::Get(rocksdb::ColumnFamilyHandle* cf,
+                                           const rocksdb::Slice& key, std::string* value) {
+        // values that can't be pinned are copied straight into *value
+        rocksdb::PinnableSlice pinnableValue(value);
+        auto status = Get(cf, key, &pinnableValue);
+        if (status.ok() && pinnableValue.IsPinned()) {
+            value->assign(pinnableValue.data(), pinnableValue.size());
+        }
+        return status;
+    }
+
+    rocksdb::Status RocksRecoveryUnit::Get(rocksdb::ColumnFamilyHandle* cf,
+                                           const rocksdb::Slice& key,
+                                           rocksdb::PinnableSlice* value) {
+        rocksdb::ReadOptions options;
+        options.snapshot = snapshot();
+        if (_writeBatch.GetWriteBatch()->Count() == 0) {
+            // nothing of ours to look at, which is always the case for read-only units of work
+            return _db->Get(options, cf, key, value);
+        }
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        // one lookup in the batch's index, then the DB if the batch doesn't decide it. This also
+        // gets single deletes and merges right. Values from the batch are copied into value,
+        // since the batch can change under us
+        return _writeBatch.GetFromBatchAndDB(_db, options, cf, key, value);
+#else
+        std::unique_ptr<rocksdb::WBWIIterator> wb_iterator(_writeBatch.NewIterator(cf));
+        wb_iterator->Seek(key);
+        if (wb_iterator->Valid() && wb_iterator->Entry().key == key) {
+            const auto& entry = wb_iterator->Entry();
+            if (_isDeletion(entry.type)) {
+                return rocksdb::Status::NotFound();
             }
+            // the write batch can change under us, so we need our own copy
+            value->PinSelf(entry.value);
+            return rocksdb::Status::OK();
         }
+        return _db->Get(options, cf, key, value);
+#endif
+    }
+
+    void RocksRecoveryUnit::MultiGet(rocksdb::ColumnFamilyHandle* cf, size_t numKeys,
+                                     const rocksdb::Slice* keys, rocksdb::PinnableSlice* values,
+                                     rocksdb::Status* statuses) {
+// The batched MultiGet() API is available since RocksDB 6.4
+#if defined(ROCKSDB_MAJOR) && (ROCKSDB_MAJOR > 6 || (ROCKSDB_MAJOR == 6 && ROCKSDB_MINOR >= 4))
         rocksdb::ReadOptions options;
         options.snapshot = snapshot();
-        return _db->Get(options, key, value);
+// With async_io (RocksDB 7.5+) MultiGet() reads the blocks it misses in parallel
+#if ROCKSDB_MAJOR > 7 || (ROCKSDB_MAJOR == 7 && ROCKSDB_MINOR >= 5)
+        options.async_io = true;
+#endif
+        _db->MultiGet(options, cf, numKeys, keys, values, statuses);
+
+        if (_writeBatch.GetWriteBatch()->Count() == 0) {
+            return;
+        }
+        // overlay our own writes. We read those keys from the DB needlessly, but that's cheaper
+        // than splitting the batch, and they're rare on the paths that fetch many records
+        std::unique_ptr<rocksdb::WBWIIterator> wb_iterator(_writeBatch.NewIterator(cf));
+        for (size_t i = 0; i < numKeys; ++i) {
+            wb_iterator->Seek(keys[i]);
+            if (wb_iterator->Valid() && wb_iterator->Entry().key == keys[i]) {
+                const auto& entry = wb_iterator->Entry();
+                values[i].Reset();
+                if (_isDeletion(entry.type)) {
+                    statuses[i] = rocksdb::Status::NotFound();
+                } else {
+                    values[i].PinSelf(entry.value);
+                    statuses[i] = rocksdb::Status::OK();
+                }
+            }
+        }
+#else
+        for (size_t i = 0; i < numKeys; ++i) {
+            statuses[i] = Get(cf, keys[i], &values[i]);
+        }
+#endif
+    }
+
+    bool RocksRecoveryUnit::supportsDeleteRange() {
+// Range tombstones are usable in production since RocksDB 6
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        return true;
+#else
+        return false;
+#endif
     }
 
-    RocksIterator* RocksRecoveryUnit::NewIterator(std::string prefix, bool isOplog) {
+    void RocksRecoveryUnit::deleteRange(rocksdb::ColumnFamilyHandle* cf,
+                                        const rocksdb::Slice& begin, const rocksdb::Slice& end) {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        // WriteBatchWithIndex refuses range deletions, so this goes to the underlying batch: it
+        // keeps its place among our other writes, but the index doesn't know about it
+        invariantRocksOK(_writeBatch.GetWriteBatch()->DeleteRange(cf, begin, end));
+#else
+        invariant(!"deleteRange() needs RocksDB 6 or newer");
+#endif
+    }
+
+    RocksIterator* RocksRecoveryUnit::NewIterator(rocksdb::ColumnFamilyHandle* cf,
+                                                  std::string prefix, bool isOplog) {
         std::unique_ptr<rocksdb::Slice> upperBound(new rocksdb::Slice());
         rocksdb::ReadOptions options;
         options.iterate_upper_bound = upperBound.get();
         options.snapshot = snapshot();
-        auto iterator = _writeBatch.NewIteratorWithBase(_db->NewIterator(options));
-        auto prefixIterator = new PrefixStrippingIterator(std::move(prefix), iterator,
-                                                          isOplog ? nullptr : _compactionScheduler,
-                                                          std::move(upperBound));
-        return prefixIterator;
+        return new PrefixStrippingIterator(cf, std::move(prefix), _db->NewIterator(options, cf),
+                                           &_writeBatch, isOplog ? nullptr : _compactionScheduler,
+                                           std::move(upperBound));
     }
 
-    RocksIterator* RocksRecoveryUnit::NewIteratorNoSnapshot(rocksdb::DB* db, std::string prefix) {
+    bool RocksRecoveryUnit::reuseIterator(RocksIterator* iterator) {
+        return static_cast<PrefixStrippingIterator*>(iterator)->refresh(snapshot(), &_writeBatch);
+    }
+
+    RocksIterator* RocksRecoveryUnit::NewIteratorNoSnapshot(rocksdb::DB* db,
+                                                            rocksdb::ColumnFamilyHandle* cf,
+                                                            std::string prefix) {
         std::unique_ptr<rocksdb::Slice> upperBound(new rocksdb::Slice());
         rocksdb::ReadOptions options;
         options.iterate_upper_bound = upperBound.get();
-        auto iterator = db->NewIterator(options);
-        return new PrefixStrippingIterator(std::move(prefix), iterator, nullptr,
+        auto iterator = db->NewIterator(options, cf);
+        return new PrefixStrippingIterator(cf, std::move(prefix), iterator, nullptr, nullptr,
                                            std::move(upperBound));
     }
 
+    bool RocksRecoveryUnit::refreshIterator(rocksdb::Iterator* iterator) {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        return iterator->Refresh().ok();
+#else
+        return false;
+#endif
+    }
+
+    bool RocksRecoveryUnit::supportsRefreshIterator() {
+#if defined(ROCKSDB_MAJOR) && ROCKSDB_MAJOR >= 6
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool RocksRecoveryUnit::canUseTailingIterator() {
+        return !_readFromMajorityCommittedSnapshot && !_snapshotHolder &&
+               _writeBatch.GetWriteBatch()->Count() == 0;
+    }
+
     void RocksRecoveryUnit::incrementCounter(const rocksdb::Slice& counterKey,
                                              std::atomic<long long>* counter, long long delta) {
         if (delta == 0) {
             return;
         }
 
-        auto pair = _deltaCounters.find(counterKey.ToString());
+        auto pair = _findDeltaCounter(counterKey);
         if (pair == _deltaCounters.end()) {
-            _deltaCounters[counterKey.ToString()] =
-                mongo::RocksRecoveryUnit::Counter(counter, delta);
+            _deltaCounters.emplace_back(counterKey, Counter(counter, delta));
         } else {
             pair->second._delta += delta;
         }
     }
 
     long long RocksRecoveryUnit::getDeltaCounter(const rocksdb::Slice& counterKey) {
-        auto counter = _deltaCounters.find(counterKey.ToString());
+        auto counter = _findDeltaCounter(counterKey);
         if (counter == _deltaCounters.end()) {
             return 0;
         } else {
@@ -472,7 +780,56 @@ namespace mongo {
         _deltaCounters.clear();
     }
 
+    RocksRecoveryUnit::CounterMap::iterator RocksRecoveryUnit::_findDeltaCounter(
+        const rocksdb::Slice& counterKey) {
+        return std::find_if(_deltaCounters.begin(), _deltaCounters.end(),
+                            [&](const CounterMap::value_type& pair) {
+                                return pair.first == counterKey;
+                            });
+    }
+
     RocksRecoveryUnit* RocksRecoveryUnit::getRocksRecoveryUnit(OperationContext* opCtx) {
         return checked_cast<RocksRecoveryUnit*>(opCtx->recoveryUnit());
     }
+
+    std::unique_ptr<RocksRecoveryUnit::Resources> RocksRecoveryUnitResourcePool::get() {
+        auto& stripe = _getStripe();
+        {
+            stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+            if (!stripe.resources.empty()) {
+                auto resources = std::move(stripe.resources.back());
+                stripe.resources.pop_back();
+                return resources;
+            }
+        }
+        return stdx::make_unique<RocksRecoveryUnit::Resources>(_transactionEngine);
+    }
+
+    void RocksRecoveryUnitResourcePool::put(
+        std::unique_ptr<RocksRecoveryUnit::Resources> resources) {
+        invariant(resources->writeBatch.GetWriteBatch()->Count() == 0);
+        invariant(resources->deltaCounters.empty() && resources->changes.empty());
+        if (resources->writeBatchHighWater > kMaxWriteBatchBytes) {
+            // keeping it would keep its entry buffer
+            return;
+        }
+        auto& stripe = _getStripe();
+        stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+        if (stripe.resources.size() < kMaxPerStripe) {
+            stripe.resources.push_back(std::move(resources));
+        }
+    }
+
+    size_t RocksRecoveryUnitResourcePool::numPooled() {
+        size_t numPooled = 0;
+        for (auto& stripe : _stripes) {
+            stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+            numPooled += stripe.resources.size();
+        }
+        return numPooled;
+    }
+
+    RocksRecoveryUnitResourcePool::Stripe& RocksRecoveryUnitResourcePool::_getStripe() {
+        return _stripes[std::hash<stdx::thread::id>()(stdx::this_thread::get_id()) % kNumStripes];
+    }
 }
@@ -30,11 +30,13 @@
 
 #include <atomic>
 #include <map>
+#include <memory>
 #include <stack>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
+#include <rocksdb/comparator.h>
 #include <rocksdb/slice.h>
 #include <rocksdb/write_batch.h>
 #include <rocksdb/utilities/write_batch_with_index.h>
@@ -43,6 +45,8 @@
 #include "mongo/base/owned_pointer_vector.h"
 #include "mongo/db/record_id.h"
 #include "mongo/db/storage/recovery_unit.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/util/timer.h"
 
 #include "rocks_compaction_scheduler.h"
@@ -50,8 +54,10 @@
 #include "rocks_counter_manager.h"
 #include "rocks_snapshot_manager.h"
 #include "rocks_durability_manager.h"
+#include "rocks_operation_stats.h"
 
 namespace rocksdb {
+    class ColumnFamilyHandle;
     class DB;
     class Snapshot;
     class WriteBatchWithIndex;
@@ -74,6 +80,7 @@ namespace mongo {
     };
 
     class OperationContext;
+    class RocksRecoveryUnitResourcePool;
 
     class RocksRecoveryUnit : public RecoveryUnit {
         MONGO_DISALLOW_COPYING(RocksRecoveryUnit);
@@ -82,7 +89,8 @@ namespace mongo {
                           RocksSnapshotManager* snapshotManager, rocksdb::DB* db,
                           RocksCounterManager* counterManager,
                           RocksCompactionScheduler* compactionScheduler,
-                          RocksDurabilityManager* durabilityManager, bool durable);
+                          RocksDurabilityManager* durabilityManager, bool durable,
+                          RocksRecoveryUnitResourcePool* resourcePool = nullptr);
         virtual ~RocksRecoveryUnit();
 
         virtual void beginUnitOfWork(OperationContext* opCtx);
@@ -93,6 +101,10 @@ namespace mongo {
 
         virtual void abandonSnapshot();
 
+        // What RocksDB did for this unit's operation so far. Only available on the thread that
+        // created the unit
+        std::shared_ptr<StorageStats> getOperationStatistics() const override;
+
         Status setReadFromMajorityCommittedSnapshot() final;
         bool isReadingFromMajorityCommittedSnapshot() const final {
             return _readFromMajorityCommittedSnapshot;
@@ -120,14 +132,89 @@ namespace mongo {
 
         bool hasSnapshot() { return _snapshot != nullptr || _snapshotHolder.get() != nullptr; }
 
-        RocksTransaction* transaction() { return &_transaction; }
-
-        rocksdb::Status Get(const rocksdb::Slice& key, std::string* value);
+        /**
+         * Returns shared ownership of this unit's snapshot, taking one if needed, so that units on
+         * other threads can read from the same point in time with attachSharedSnapshot(). This
+         * unit can keep writing; write conflicts are still checked against its snapshot.
+         */
+        std::shared_ptr<RocksSnapshotManager::SnapshotHolder> shareSnapshot();
 
-        RocksIterator* NewIterator(std::string prefix, bool isOplog = false);
+        /**
+         * Makes this unit read from a snapshot that another unit shared. Such a unit is only good
+         * for reading: its transaction doesn't know about the snapshot, so it can't detect write
+         * conflicts. It lets go of the snapshot once it's abandoned.
+         */
+        void attachSharedSnapshot(std::shared_ptr<RocksSnapshotManager::SnapshotHolder> holder);
 
-        static RocksIterator* NewIteratorNoSnapshot(rocksdb::DB* db, std::string prefix);
+        RocksTransaction* transaction() { return &_transaction; }
 
+        rocksdb::Status Get(rocksdb::ColumnFamilyHandle* cf, const rocksdb::Slice& key,
+                            std::string* value);
+
+        /**
+         * Like above, but avoids copying the value out of the block cache whenever possible. The
+         * value stays valid until *value is Reset() or destroyed.
+         */
+        rocksdb::Status Get(rocksdb::ColumnFamilyHandle* cf, const rocksdb::Slice& key,
+                            rocksdb::PinnableSlice* value);
+
+        /**
+         * Looks up numKeys keys at once, seeing this unit's own writes. values and statuses must
+         * have room for numKeys entries each; statuses[i] is NotFound() if keys[i] doesn't exist.
+         */
+        void MultiGet(rocksdb::ColumnFamilyHandle* cf, size_t numKeys, const rocksdb::Slice* keys,
+                      rocksdb::PinnableSlice* values, rocksdb::Status* statuses);
+
+        // Whether deleteRange() can be used with the RocksDB we're built against
+        static bool supportsDeleteRange();
+
+        /**
+         * Deletes every key in [begin, end) of cf with a single range tombstone, without
+         * registering writes with the transaction engine. The tombstone is recorded in the write
+         * batch in call order, so at commit it deletes what was committed before and this unit's
+         * earlier writes to the range, while its later writes survive. The batch's index doesn't
+         * see it: Get(), MultiGet() and iterators of this unit keep seeing the deleted keys until
+         * it commits. An abort drops it with the rest of the batch.
+         */
+        void deleteRange(rocksdb::ColumnFamilyHandle* cf, const rocksdb::Slice& begin,
+                         const rocksdb::Slice& end);
+
+        /**
+         * Iterates over the keys with the given prefix as of this unit's snapshot, seeing its own
+         * writes. While the unit hasn't written anything the iterator reads straight from the DB;
+         * it starts merging in the write batch from its first move after the unit writes. The
+         * iterator must not outlive this unit, unless reuseIterator() hands it to another one.
+         */
+        RocksIterator* NewIterator(rocksdb::ColumnFamilyHandle* cf, std::string prefix,
+                                   bool isOplog = false);
+
+        /**
+         * Makes an iterator from NewIterator(), of this or of an earlier recovery unit of the same
+         * operation, read from this unit's current snapshot and write batch without rebuilding
+         * it. The iterator is unpositioned afterwards. Returns false if that isn't possible (it
+         * needs RocksDB 8.6), in which case the iterator must be replaced.
+         */
+        bool reuseIterator(RocksIterator* iterator);
+
+        static RocksIterator* NewIteratorNoSnapshot(rocksdb::DB* db,
+                                                    rocksdb::ColumnFamilyHandle* cf,
+                                                    std::string prefix);
+
+        /**
+         * Makes an iterator from NewIteratorNoSnapshot() read the latest data, which is cheaper
+         * than creating a new one. Returns false if that isn't possible, in which case the
+         * iterator must not be used anymore.
+         */
+        static bool refreshIterator(rocksdb::Iterator* iterator);
+        static bool supportsRefreshIterator();
+
+        // True if this unit hasn't written anything and doesn't read from a committed or shared
+        // snapshot. A reader bounded by the oplog's visibility then sees the same records through
+        // a refreshed NewIteratorNoSnapshot() iterator as through NewIterator()
+        bool canUseTailingIterator();
+
+        // counterKey is not copied. Like counter, it has to stay valid until this unit of work
+        // commits or aborts
         void incrementCounter(const rocksdb::Slice& counterKey,
                               std::atomic<long long>* counter, long long delta);
 
@@ -140,7 +227,8 @@ namespace mongo {
 
         RocksRecoveryUnit* newRocksRecoveryUnit() {
             return new RocksRecoveryUnit(_transactionEngine, _snapshotManager, _db, _counterManager,
-                                         _compactionScheduler, _durabilityManager, _durable);
+                                         _compactionScheduler, _durabilityManager, _durable,
+                                         _resourcePool);
         }
 
         struct Counter {
@@ -151,7 +239,26 @@ namespace mongo {
                                                                       _delta(delta) {}
         };
 
-        typedef std::unordered_map<std::string, Counter> CounterMap;
+        // A unit of work touches few counters, so a vector that keeps its capacity beats a map
+        typedef std::vector<std::pair<rocksdb::Slice, Counter>> CounterMap;
+
+        typedef OwnedPointerVector<Change> Changes;
+
+        // The parts of a unit that are worth keeping for the next one, see
+        // RocksRecoveryUnitResourcePool. A unit hands them back cleared
+        struct Resources {
+            explicit Resources(RocksTransactionEngine* transactionEngine)
+                : transaction(transactionEngine),
+                  writeBatch(rocksdb::BytewiseComparator(), 0, true) {}
+
+            RocksTransaction transaction;
+            rocksdb::WriteBatchWithIndex writeBatch;
+            CounterMap deltaCounters;
+            Changes changes;
+            // the most the write batch ever held. Clearing it frees the index, but the buffer
+            // holding the batch's entries keeps its capacity
+            size_t writeBatchHighWater = 0;
+        };
 
         static RocksRecoveryUnit* getRocksRecoveryUnit(OperationContext* opCtx);
 
@@ -163,24 +270,39 @@ namespace mongo {
 
         rocksdb::DB* getDB() const { return _db; }
 
+        // can be nullptr
+        RocksCompactionScheduler* getCompactionScheduler() const { return _compactionScheduler; }
+
     private:
         void _releaseSnapshot();
 
         void _commit();
 
         void _abort();
+
+        CounterMap::iterator _findDeltaCounter(const rocksdb::Slice& counterKey);
+
+        // whether a write batch entry of that type hides the key
+        static bool _isDeletion(rocksdb::WriteType type);
+
+        void _clearWriteBatch();
+
         RocksTransactionEngine* _transactionEngine;      // not owned
         RocksSnapshotManager* _snapshotManager;          // not owned
         rocksdb::DB* _db;                                // not owned
         RocksCounterManager* _counterManager;            // not owned
         RocksCompactionScheduler* _compactionScheduler;  // not owned
         RocksDurabilityManager* _durabilityManager;      // not owned
+        RocksRecoveryUnitResourcePool* _resourcePool;    // not owned, can be nullptr
 
         const bool _durable;
 
-        RocksTransaction _transaction;
+        // _transaction, _writeBatch, _deltaCounters and _changes live in here
+        std::unique_ptr<Resources> _resources;
+
+        RocksTransaction& _transaction;
 
-        rocksdb::WriteBatchWithIndex _writeBatch;
+        rocksdb::WriteBatchWithIndex& _writeBatch;
 
         // bare because we need to call ReleaseSnapshot when we're done with this
         const rocksdb::Snapshot* _snapshot; // owned
@@ -190,10 +312,9 @@ namespace mongo {
         const rocksdb::Snapshot* _preparedSnapshot;  // owned
 
         std::unique_ptr<Timer> _timer;
-        CounterMap _deltaCounters;
+        CounterMap& _deltaCounters;
 
-        typedef OwnedPointerVector<Change> Changes;
-        Changes _changes;
+        Changes& _changes;
 
         uint64_t _mySnapshotId;
 
@@ -201,12 +322,56 @@ namespace mongo {
 
         static std::atomic<int> _totalLiveRecoveryUnits;
 
-        // If we read from a committed snapshot, then ownership of the snapshot
-        // should be shared here to ensure that it is not released early
+        // If we read from a committed snapshot, or from a snapshot shared between units, then
+        // ownership of the snapshot should be shared here to ensure that it is not released early
         std::shared_ptr<RocksSnapshotManager::SnapshotHolder> _snapshotHolder;
 
         bool _readFromMajorityCommittedSnapshot = false;
         bool _areWriteUnitOfWorksBanned = false;
+
+        // the perf level the creating thread had before
+        const int _previousPerfLevel;
+        // the creating thread's RocksDB counters at creation time
+        const stdx::thread::id _statsThread;
+        const RocksOperationStats _statsBaseline;
+    };
+
+    /**
+     * Keeps the resources of finished recovery units for the next ones, so that starting an
+     * operation doesn't construct a write batch, a transaction and the vectors that go with them.
+     * The entry buffers of kept write batches are reused too; their indexes are not, clearing a
+     * WriteBatchWithIndex frees the arena its index lives in. Striped by thread to keep threads
+     * that start operations from contending. Write batches that grew large are let go rather
+     * than kept.
+     */
+    class RocksRecoveryUnitResourcePool {
+        MONGO_DISALLOW_COPYING(RocksRecoveryUnitResourcePool);
+    public:
+        explicit RocksRecoveryUnitResourcePool(RocksTransactionEngine* transactionEngine)
+            : _transactionEngine(transactionEngine) {}
+
+        std::unique_ptr<RocksRecoveryUnit::Resources> get();
+
+        // resources must be cleared
+        void put(std::unique_ptr<RocksRecoveryUnit::Resources> resources);
+
+        // number of resources kept for reuse
+        size_t numPooled();
+
+    private:
+        static const size_t kNumStripes = 16;
+        static const size_t kMaxPerStripe = 8;
+        static const size_t kMaxWriteBatchBytes = 1024 * 1024;
+
+        struct Stripe {
+            stdx::mutex lock;
+            std::vector<std::unique_ptr<RocksRecoveryUnit::Resources>> resources;
+        };
+
+        Stripe& _getStripe();
+
+        RocksTransactionEngine* _transactionEngine;  // not owned
+        Stripe _stripes[kNumStripes];
     };
 
 }
@@ -0,0 +1,254 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include <atomic>
+#include <boost/filesystem/operations.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+#include <rocksdb/perf_level.h>
+#include <rocksdb/utilities/write_batch_with_index.h>
+
+#include "mongo/stdx/memory.h"
+#include "mongo/unittest/temp_dir.h"
+#include "mongo/unittest/unittest.h"
+#include "mongo/util/scopeguard.h"
+
+#include "rocks_counter_manager.h"
+#include "rocks_durability_manager.h"
+#include "rocks_operation_stats.h"
+#include "rocks_recovery_unit.h"
+#include "rocks_snapshot_manager.h"
+#include "rocks_transaction.h"
+
+namespace mongo {
+namespace {
+
+    class RocksRecoveryUnitTest : public unittest::Test {
+    public:
+        RocksRecoveryUnitTest()
+            : _tempDir("mongo-rocks-recovery-unit-test"), _pool(&_transactionEngine) {
+            boost::filesystem::remove_all(_tempDir.path());
+            rocksdb::DB* db;
+            rocksdb::Options options;
+            options.create_if_missing = true;
+            auto s = rocksdb::DB::Open(options, _tempDir.path(), &db);
+            ASSERT(s.ok());
+            _db.reset(db);
+            _counterManager.reset(new RocksCounterManager(_db.get(), true));
+            _durabilityManager.reset(new RocksDurabilityManager(_db.get(), true));
+        }
+
+    protected:
+        std::unique_ptr<RocksRecoveryUnit> newRecoveryUnit() {
+            return stdx::make_unique<RocksRecoveryUnit>(
+                &_transactionEngine, &_snapshotManager, _db.get(), _counterManager.get(), nullptr,
+                _durabilityManager.get(), true, &_pool);
+        }
+
+        unittest::TempDir _tempDir;
+        std::unique_ptr<rocksdb::DB> _db;
+        RocksTransactionEngine _transactionEngine;
+        RocksSnapshotManager _snapshotManager;
+        std::unique_ptr<RocksCounterManager> _counterManager;
+        std::unique_ptr<RocksDurabilityManager> _durabilityManager;
+        RocksRecoveryUnitResourcePool _pool;
+    };
+
+    class CountingChange : public RecoveryUnit::Change {
+    public:
+        CountingChange(int* commits, int* rollbacks) : _commits(commits), _rollbacks(rollbacks) {}
+        virtual void commit() { ++*_commits; }
+        virtual void rollback() { ++*_rollbacks; }
+
+    private:
+        int* _commits;
+        int* _rollbacks;
+    };
+
+    TEST_F(RocksRecoveryUnitTest, ResourcesAreReused) {
+        ASSERT_EQUALS(0U, _pool.numPooled());
+        RocksTransaction* transaction;
+        {
+            auto ru = newRecoveryUnit();
+            transaction = ru->transaction();
+        }
+        ASSERT_EQUALS(1U, _pool.numPooled());
+
+        {
+            auto ru = newRecoveryUnit();
+            ASSERT_EQUALS(0U, _pool.numPooled());
+            ASSERT_EQUALS(transaction, ru->transaction());
+        }
+        ASSERT_EQUALS(1U, _pool.numPooled());
+    }
+
+    TEST_F(RocksRecoveryUnitTest, PoolIsBounded) {
+        // all units are made on this thread, so they share a stripe that keeps at most 8
+        std::vector<std::unique_ptr<RocksRecoveryUnit>> units;
+        for (int i = 0; i < 12; ++i) {
+            units.push_back(newRecoveryUnit());
+        }
+        units.clear();
+        ASSERT_EQUALS(8U, _pool.numPooled());
+    }
+
+    TEST_F(RocksRecoveryUnitTest, LargeWriteBatchIsLetGo) {
+        {
+            auto ru = newRecoveryUnit();
+            const std::string value(600 * 1024, 'x');
+            ru->writeBatch()->Put("a", value);
+            ru->writeBatch()->Put("b", value);
+        }
+        // the batch held more than 1MB, its buffer would stay that large
+        ASSERT_EQUALS(0U, _pool.numPooled());
+
+        {
+            auto ru = newRecoveryUnit();
+            ru->writeBatch()->Put("a", "small");
+        }
+        ASSERT_EQUALS(1U, _pool.numPooled());
+    }
+
+    TEST_F(RocksRecoveryUnitTest, StateIsResetForTheNextUnit) {
+        std::atomic<long long> counter(0);  // NOLINT
+        const rocksdb::Slice counterKey("counter");
+        int commits = 0;
+        int rollbacks = 0;
+        RocksTransaction* transaction;
+        {
+            auto ru = newRecoveryUnit();
+            transaction = ru->transaction();
+            ASSERT(ru->snapshot());
+            ASSERT(ru->transaction()->registerWrite("a"));
+            ru->writeBatch()->Put("a", "value");
+            ru->incrementCounter(counterKey, &counter, 5);
+            ru->registerChange(new CountingChange(&commits, &rollbacks));
+            ASSERT_EQUALS(1U, _transactionEngine.numActiveSnapshots());
+            // destroyed without committing
+        }
+        ASSERT_EQUALS(0, commits);
+        ASSERT_EQUALS(1, rollbacks);
+        ASSERT_EQUALS(0, counter.load());
+        ASSERT_EQUALS(0U, _transactionEngine.numActiveSnapshots());
+        ASSERT_EQUALS(1U, _pool.numPooled());
+
+        auto ru = newRecoveryUnit();
+        ASSERT_EQUALS(transaction, ru->transaction());
+        ASSERT_FALSE(ru->hasSnapshot());
+        ASSERT_EQUALS(0U, ru->writeBatch()->GetWriteBatch()->Count());
+        ASSERT_EQUALS(0, ru->getDeltaCounter(counterKey));
+        std::string value;
+        ASSERT(ru->Get(_db->DefaultColumnFamily(), "a", &value).IsNotFound());
+
+        // the reused transaction keeps its id, but it no longer holds "a"
+        auto other = newRecoveryUnit();
+        ASSERT(other->transaction()->registerWrite("a"));
+        ASSERT_FALSE(ru->transaction()->registerWrite("a"));
+
+        // and committing through it still works
+        ru->transaction()->recordSnapshotId();
+        ASSERT(ru->transaction()->registerWrite("b"));
+        ru->writeBatch()->Put("b", "value");
+        ru->registerChange(new CountingChange(&commits, &rollbacks));
+        ru->commitUnitOfWork();
+        ASSERT_EQUALS(1, commits);
+        ASSERT(_db->Get(rocksdb::ReadOptions(), "b", &value).ok());
+    }
+
+    TEST_F(RocksRecoveryUnitTest, ReadsOwnWrites) {
+        rocksdb::ColumnFamilyHandle* cf = _db->DefaultColumnFamily();
+        for (auto key : {"put", "delete", "single-delete", "untouched"}) {
+            ASSERT(_db->Put(rocksdb::WriteOptions(), key, "committed").ok());
+        }
+
+        auto ru = newRecoveryUnit();
+        ru->writeBatch()->Put(cf, "put", "ours");
+        ru->writeBatch()->Put(cf, "new", "ours");
+        ru->writeBatch()->Delete(cf, "delete");
+        ru->writeBatch()->SingleDelete(cf, "single-delete");
+
+        const std::vector<rocksdb::Slice> keys = {"put", "new", "delete", "single-delete",
+                                                   "untouched", "missing"};
+        const std::vector<std::string> expected = {"ours", "ours", "", "", "committed", ""};
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            rocksdb::PinnableSlice value;
+            auto s = ru->Get(cf, keys[i], &value);
+            if (expected[i].empty()) {
+                ASSERT(s.IsNotFound());
+            } else {
+                ASSERT(s.ok());
+                ASSERT_EQUALS(expected[i], value.ToString());
+            }
+        }
+
+        std::vector<rocksdb::PinnableSlice> values(keys.size());
+        std::vector<rocksdb::Status> statuses(keys.size());
+        ru->MultiGet(cf, keys.size(), keys.data(), values.data(), statuses.data());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (expected[i].empty()) {
+                ASSERT(statuses[i].IsNotFound());
+            } else {
+                ASSERT(statuses[i].ok());
+                ASSERT_EQUALS(expected[i], values[i].ToString());
+            }
+        }
+    }
+
+    TEST_F(RocksRecoveryUnitTest, TimingsAreOnlyCollectedWhenAskedFor) {
+        rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+        {
+            auto ru = newRecoveryUnit();
+            ASSERT(rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kEnableCount);
+            ASSERT(ru->getOperationStatistics());
+        }
+        ASSERT(rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kDisable);
+
+        RocksOperationStats::setTimingsEnabled(true);
+        ON_BLOCK_EXIT([] { RocksOperationStats::setTimingsEnabled(false); });
+        {
+            auto ru = newRecoveryUnit();
+            ASSERT(rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kEnableTimeExceptForMutex);
+            ASSERT(ru->getOperationStatistics());
+            {
+                // units nest, each one puts back what it found
+                auto nested = newRecoveryUnit();
+            }
+            ASSERT(rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kEnableTimeExceptForMutex);
+        }
+        ASSERT(rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kDisable);
+    }
+
+} // namespace
+} // namespace mongo
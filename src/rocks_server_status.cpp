@@ -43,6 +43,7 @@
 #include "mongo/util/assert_util.h"
 #include "mongo/util/scopeguard.h"
 
+#include "rocks_compaction_scheduler.h"
 #include "rocks_recovery_unit.h"
 #include "rocks_engine.h"
 #include "rocks_stats_parser.h"
@@ -160,6 +161,14 @@ namespace mongo {
                    static_cast<long long>(_engine->getTransactionEngine()->numKeysTracked()));
         bob.append("transaction-engine-snapshots",
                    static_cast<long long>(_engine->getTransactionEngine()->numActiveSnapshots()));
+        {
+            BSONObjBuilder durabilityBuilder(bob.subobjStart("durability"));
+            _engine->getDurabilityManager()->appendStats(&durabilityBuilder);
+        }
+        {
+            BSONObjBuilder compactionBuilder(bob.subobjStart("compaction-scheduler"));
+            _engine->getCompactionScheduler()->appendStats(&compactionBuilder);
+        }
 
         std::vector<rocksdb::ThreadStatus> threadList;
         auto s = rocksdb::Env::Default()->GetThreadList(&threadList);
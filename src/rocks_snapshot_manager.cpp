@@ -99,6 +99,10 @@ namespace mongo {
         db = rru->getDB();
     }
 
+    RocksSnapshotManager::SnapshotHolder::SnapshotHolder(rocksdb::DB* db_,
+                                                         const rocksdb::Snapshot* snapshot_)
+        : name(0), snapshot(snapshot_), db(db_) {}
+
     RocksSnapshotManager::SnapshotHolder::~SnapshotHolder() {
         if (snapshot != nullptr) {
             invariant(db != nullptr);
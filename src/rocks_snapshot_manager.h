@@ -50,6 +50,8 @@ public:
         const rocksdb::Snapshot* snapshot;
         rocksdb::DB* db;
         SnapshotHolder(OperationContext* opCtx, uint64_t name_);
+        // takes ownership of snapshot_, which isn't a named committed snapshot
+        SnapshotHolder(rocksdb::DB* db_, const rocksdb::Snapshot* snapshot_);
         ~SnapshotHolder();
     };
 
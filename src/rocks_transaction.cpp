@@ -30,7 +30,10 @@
 
 #include "rocks_transaction.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cstring>
+#include <iterator>
 #include <map>
 #include <memory>
 #include <string>
@@ -40,62 +43,95 @@
 #include "mongo/util/assert_util.h"
 
 namespace mongo {
+    RocksTransactionEngine::KeyShard::KeyShard()
+        : keyInfo(SimpleStringDataComparator::kInstance.makeStringDataUnorderedMap<
+                  std::pair<uint64_t, KeysSortedBySnapshotListIter>>()),
+          uncommittedTransactionId(
+              SimpleStringDataComparator::kInstance.makeStringDataUnorderedMap<uint64_t>()) {}
+
     RocksTransactionEngine::RocksTransactionEngine()
         : _latestSnapshotId(1),
           _nextTransactionId(1),
-          _keyInfo(SimpleStringDataComparator::kInstance.makeStringDataUnorderedMap<
-                   std::pair<uint64_t, KeysSortedBySnapshotListIter>>()) {}
+          _oldestActiveSnapshot(0),
+          _releasesSinceCleanup(0),
+          _numActiveSnapshots(0) {}
 
     size_t RocksTransactionEngine::numKeysTracked() {
-        stdx::lock_guard<stdx::mutex> lk(_lock);
-        return _keyInfo.size();
+        size_t numKeys = 0;
+        for (auto& shard : _keyShards) {
+            stdx::lock_guard<stdx::mutex> lk(shard.lock);
+            numKeys += shard.keyInfo.size();
+        }
+        return numKeys;
     }
     size_t RocksTransactionEngine::numActiveSnapshots() {
-        stdx::lock_guard<stdx::mutex> lk(_lock);
-        return _activeSnapshots.size();
-    }
-
-    std::list<uint64_t>::iterator RocksTransactionEngine::_getLatestSnapshotId_inlock() {
-        return _activeSnapshots.insert(_activeSnapshots.end(), _latestSnapshotId);
+        size_t numSnapshots = 0;
+        for (auto& stripe : _snapshotStripes) {
+            stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+            numSnapshots += stripe.activeSnapshots.size();
+        }
+        return numSnapshots;
     }
 
-    bool RocksTransactionEngine::_isKeyCommittedAfterSnapshot_inlock(const std::string& key,
+    bool RocksTransactionEngine::_isKeyCommittedAfterSnapshot_inlock(KeyShard* shard,
+                                                                     StringData key,
                                                                      uint64_t snapshotId) {
-        auto iter = _keyInfo.find(key);
-        return iter != _keyInfo.end() && iter->second.first > snapshotId;
+        auto iter = shard->keyInfo.find(key);
+        return iter != shard->keyInfo.end() && iter->second.first > snapshotId;
     }
 
-    void RocksTransactionEngine::_registerCommittedKey_inlock(const std::string& key,
+    void RocksTransactionEngine::_registerCommittedKey_inlock(KeyShard* shard,
+                                                              StringData key,
                                                               uint64_t newSnapshotId) {
-        auto iter = _keyInfo.find(key);
-        if (iter != _keyInfo.end()) {
-            _keysSortedBySnapshot.erase(iter->second.second);
-            _keyInfo.erase(iter);
+        auto iter = shard->keyInfo.find(key);
+        if (iter != shard->keyInfo.end()) {
+            shard->keysSortedBySnapshot.erase(iter->second.second);
+            shard->keyInfo.erase(iter);
         }
 
-        auto listIter = _keysSortedBySnapshot.insert(_keysSortedBySnapshot.end(),
-                                                     {key, newSnapshotId});
-        _keyInfo.insert({StringData(listIter->first), {newSnapshotId, listIter}});
+        // Commits get their ids before taking the shard lock, so they can arrive slightly out of
+        // order. Walk back from the end to keep the list sorted; this is almost always a no-op
+        auto position = shard->keysSortedBySnapshot.end();
+        while (position != shard->keysSortedBySnapshot.begin() &&
+               std::prev(position)->second > newSnapshotId) {
+            --position;
+        }
+        auto listIter =
+            shard->keysSortedBySnapshot.insert(position, {key.toString(), newSnapshotId});
+        shard->keyInfo.insert({StringData(listIter->first), {newSnapshotId, listIter}});
     }
 
-    void RocksTransactionEngine::_cleanUpKeysCommittedBeforeSnapshot_inlock(uint64_t snapshotId) {
-        while (!_keysSortedBySnapshot.empty() &&
-               _keysSortedBySnapshot.begin()->second <= snapshotId) {
-            auto keyInfoIter = _keyInfo.find(_keysSortedBySnapshot.begin()->first);
-            invariant(keyInfoIter != _keyInfo.end());
-            _keyInfo.erase(keyInfoIter);
-            _keysSortedBySnapshot.pop_front();
+    void RocksTransactionEngine::_cleanUpKeysCommittedBeforeSnapshot_inlock(KeyShard* shard,
+                                                                            uint64_t snapshotId) {
+        while (!shard->keysSortedBySnapshot.empty() &&
+               shard->keysSortedBySnapshot.begin()->second <= snapshotId) {
+            auto keyInfoIter = shard->keyInfo.find(shard->keysSortedBySnapshot.begin()->first);
+            invariant(keyInfoIter != shard->keyInfo.end());
+            shard->keyInfo.erase(keyInfoIter);
+            shard->keysSortedBySnapshot.pop_front();
         }
     }
 
-    void RocksTransactionEngine::_cleanupSnapshot_inlock(
-        const std::list<uint64_t>::iterator& snapshotIter) {
-        bool needCleanup = _activeSnapshots.begin() == snapshotIter;
-        _activeSnapshots.erase(snapshotIter);
-        if (needCleanup) {
-            _cleanUpKeysCommittedBeforeSnapshot_inlock(_activeSnapshots.empty()
-                                                           ? std::numeric_limits<uint64_t>::max()
-                                                           : *_activeSnapshots.begin());
+    uint64_t RocksTransactionEngine::_getOldestActiveSnapshot() {
+        // We need to read the latest snapshot id before looking at the stripes. A snapshot that
+        // gets recorded in a stripe after we've looked at it reads _latestSnapshotId (under the
+        // stripe lock) after we did, so it can't be older than this
+        uint64_t oldest = _latestSnapshotId.load();
+        for (auto& stripe : _snapshotStripes) {
+            stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+            if (!stripe.activeSnapshots.empty()) {
+                oldest = std::min(oldest, stripe.activeSnapshots.front());
+            }
+        }
+        return oldest;
+    }
+
+    void RocksTransactionEngine::_cleanUpKeys() {
+        const uint64_t oldest = _getOldestActiveSnapshot();
+        _oldestActiveSnapshot.store(oldest);
+        for (auto& shard : _keyShards) {
+            stdx::lock_guard<stdx::mutex> lk(shard.lock);
+            _cleanUpKeysCommittedBeforeSnapshot_inlock(&shard, oldest);
         }
     }
 
@@ -103,40 +139,45 @@ namespace mongo {
         if (_writtenKeys.empty()) {
             return;
         }
-        uint64_t newSnapshotId = 0;
-        {
-            stdx::lock_guard<stdx::mutex> lk(_transactionEngine->_lock);
-            for (const auto& key : _writtenKeys) {
-                invariant(
-                    !_transactionEngine->_isKeyCommittedAfterSnapshot_inlock(key, _snapshotId));
-                invariant(_transactionEngine->_uncommittedTransactionId[key] == _transactionId);
-                _transactionEngine->_uncommittedTransactionId.erase(key);
-            }
-            newSnapshotId = _transactionEngine->_latestSnapshotId + 1;
-            for (const auto& key : _writtenKeys) {
-                _transactionEngine->_registerCommittedKey_inlock(key, newSnapshotId);
-            }
-            _cleanup_inlock();
-            _transactionEngine->_latestSnapshotId = newSnapshotId;
+        // Our writes are already in the DB, so any snapshot that records this id (or a later one)
+        // sees them. Until we move our keys from uncommitted to committed below, other
+        // transactions see them as write-uncommitted conflicts
+        const uint64_t newSnapshotId = _transactionEngine->_latestSnapshotId.fetch_add(1) + 1;
+        const uint64_t oldestActiveSnapshot = _transactionEngine->_oldestActiveSnapshot.load();
+        for (auto key : _writtenKeys) {
+            auto shard = &_transactionEngine->_getKeyShard(key);
+            stdx::lock_guard<stdx::mutex> lk(shard->lock);
+            invariant(
+                !_transactionEngine->_isKeyCommittedAfterSnapshot_inlock(shard, key, _snapshotId));
+            auto uncommittedIter = shard->uncommittedTransactionId.find(key);
+            invariant(uncommittedIter != shard->uncommittedTransactionId.end() &&
+                      uncommittedIter->second == _transactionId);
+            shard->uncommittedTransactionId.erase(uncommittedIter);
+            _transactionEngine->_registerCommittedKey_inlock(shard, key, newSnapshotId);
+            _transactionEngine->_cleanUpKeysCommittedBeforeSnapshot_inlock(shard,
+                                                                           oldestActiveSnapshot);
         }
+        _cleanup();
         // cleanup
         _writtenKeys.clear();
+        _keyArena.clear();
     }
 
-    bool RocksTransaction::registerWrite(const std::string& key) {
-        stdx::lock_guard<stdx::mutex> lk(_transactionEngine->_lock);
-        if (_transactionEngine->_isKeyCommittedAfterSnapshot_inlock(key, _snapshotId)) {
+    bool RocksTransaction::registerWrite(StringData key) {
+        auto shard = &_transactionEngine->_getKeyShard(key);
+        stdx::lock_guard<stdx::mutex> lk(shard->lock);
+        if (_transactionEngine->_isKeyCommittedAfterSnapshot_inlock(shard, key, _snapshotId)) {
             // write-committed write conflict
             return false;
         }
-        auto uncommittedTransactionIter = _transactionEngine->_uncommittedTransactionId.find(key);
-        if (uncommittedTransactionIter != _transactionEngine->_uncommittedTransactionId.end() &&
-            uncommittedTransactionIter->second != _transactionId) {
-            // write-uncommitted write conflict
-            return false;
+        auto uncommittedTransactionIter = shard->uncommittedTransactionId.find(key);
+        if (uncommittedTransactionIter != shard->uncommittedTransactionId.end()) {
+            // either we wrote this key before, or it's a write-uncommitted write conflict
+            return uncommittedTransactionIter->second == _transactionId;
         }
-        _writtenKeys.insert(key);
-        _transactionEngine->_uncommittedTransactionId[key] = _transactionId;
+        auto ownKey = _keyArena.add(key);
+        _writtenKeys.push_back(ownKey);
+        shard->uncommittedTransactionId.insert({ownKey, _transactionId});
         return true;
     }
 
@@ -144,31 +185,84 @@ namespace mongo {
         if (_writtenKeys.empty() && !_snapshotInitialized) {
             return;
         }
-        {
-            stdx::lock_guard<stdx::mutex> lk(_transactionEngine->_lock);
-            for (const auto& key : _writtenKeys) {
-                _transactionEngine->_uncommittedTransactionId.erase(key);
-            }
-            _cleanup_inlock();
+        for (auto key : _writtenKeys) {
+            auto shard = &_transactionEngine->_getKeyShard(key);
+            stdx::lock_guard<stdx::mutex> lk(shard->lock);
+            shard->uncommittedTransactionId.erase(key);
         }
+        _cleanup();
         _writtenKeys.clear();
+        _keyArena.clear();
     }
 
     void RocksTransaction::recordSnapshotId() {
+        _cleanup();
+        _transactionEngine->_numActiveSnapshots.fetch_add(1);
+        auto& stripe = _transactionEngine->_getSnapshotStripe(_transactionId);
         {
-            stdx::lock_guard<stdx::mutex> lk(_transactionEngine->_lock);
-            _cleanup_inlock();
-            _activeSnapshotsIter = _transactionEngine->_getLatestSnapshotId_inlock();
+            // _getOldestActiveSnapshot() relies on us reading _latestSnapshotId under the lock
+            stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+            _activeSnapshotsIter = stripe.activeSnapshots.insert(
+                stripe.activeSnapshots.end(), _transactionEngine->_latestSnapshotId.load());
+            _snapshotId = *_activeSnapshotsIter;
         }
-        _snapshotId = *_activeSnapshotsIter;
         _snapshotInitialized = true;
     }
 
-    void RocksTransaction::_cleanup_inlock() {
-        if (_snapshotInitialized) {
-            _transactionEngine->_cleanupSnapshot_inlock(_activeSnapshotsIter);
-            _snapshotInitialized = false;
-            _snapshotId = std::numeric_limits<uint64_t>::max();
+    void RocksTransaction::_cleanup() {
+        if (!_snapshotInitialized) {
+            return;
+        }
+        auto& stripe = _transactionEngine->_getSnapshotStripe(_transactionId);
+        bool wasOldest;
+        {
+            stdx::lock_guard<stdx::mutex> lk(stripe.lock);
+            wasOldest = stripe.activeSnapshots.begin() == _activeSnapshotsIter;
+            stripe.activeSnapshots.erase(_activeSnapshotsIter);
+        }
+        _snapshotInitialized = false;
+        _snapshotId = std::numeric_limits<uint64_t>::max();
+        const bool wasLast = _transactionEngine->_numActiveSnapshots.fetch_sub(1) == 1;
+
+        // Releasing the oldest snapshot of a stripe might let us forget about some keys. Looking
+        // at all the stripes and shards is not cheap, so we only do it every now and then, or
+        // when nothing can conflict with the keys anymore
+        if (wasLast ||
+            (wasOldest &&
+             _transactionEngine->_releasesSinceCleanup.fetch_add(1) %
+                     RocksTransactionEngine::kCleanupInterval ==
+                 0)) {
+            _transactionEngine->_cleanUpKeys();
+        }
+    }
+
+    StringData RocksTransaction::KeyArena::add(StringData key) {
+        if (key.size() > kBlockSize) {
+            _largeKeys.emplace_back(key.rawData(), key.size());
+            return _largeKeys.back();
+        }
+        if (_blocks.empty() || _used + key.size() > kBlockSize) {
+            if (!_blocks.empty()) {
+                ++_current;
+            }
+            if (_current == _blocks.size()) {
+                _blocks.emplace_back(new char[kBlockSize]);
+            }
+            _used = 0;
+        }
+        char* data = _blocks[_current].get() + _used;
+        memcpy(data, key.rawData(), key.size());
+        _used += key.size();
+        return StringData(data, key.size());
+    }
+
+    void RocksTransaction::KeyArena::clear() {
+        // hold on to one block, big transactions shouldn't pin memory for the rest of the session
+        if (_blocks.size() > 1) {
+            _blocks.resize(1);
         }
+        _current = 0;
+        _used = 0;
+        _largeKeys.clear();
     }
 }
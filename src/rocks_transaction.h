@@ -29,11 +29,13 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <set>
 #include <unordered_map>
 #include <memory>
 #include <string>
 #include <list>
+#include <vector>
 
 #include "mongo/stdx/mutex.h"
 
@@ -51,55 +53,91 @@ namespace mongo {
         size_t numActiveSnapshots();
 
     private:
-        // REQUIRES: transaction engine lock locked
-        std::list<uint64_t>::iterator _getLatestSnapshotId_inlock();
+        // The following data structures keep information about when were the keys committed.
+        // They can answer the following questions:
+        // * Which stored committed key has the earliest snapshot
+        // * When was a certain key committed
+        // _keysSortedBySnapshot is a list of {key, sequence_id} and it's sorted by the sequence_id.
+        // _keyInfo is a map from the key to the two-part information about the key:
+        // * snapshot ID of the last commit to this key
+        // * an iterator pointing to the corresponding entry in _keysSortedBySnapshot. This is used
+        // to update the list at the same time as we update the _keyInfo
+        typedef std::list<std::pair<std::string, uint64_t>> KeysSortedBySnapshotList;
+        typedef std::list<std::pair<std::string, uint64_t>>::iterator KeysSortedBySnapshotListIter;
 
-        // REQUIRES: transaction engine lock locked
-        // Cleans up the snapshot from the _activeSnapshots list
-        void _cleanupSnapshot_inlock(const std::list<uint64_t>::iterator& snapshotIter);
+        // Keys are partitioned by hash into independently locked shards, so that transactions
+        // touching different keys don't contend on a single mutex
+        struct KeyShard {
+            KeyShard();
+
+            stdx::mutex lock;
+            KeysSortedBySnapshotList keysSortedBySnapshot;
+            // map of key -> pair{seq_id, pointer to corresponding keysSortedBySnapshot}
+            // key is a StringData and it points to the actual string in keysSortedBySnapshot
+            StringDataUnorderedMap<std::pair<uint64_t, KeysSortedBySnapshotListIter>> keyInfo;
+            // key is a StringData and it points into the key arena of the writing transaction,
+            // which erases its entries before it lets go of its keys
+            StringDataUnorderedMap<uint64_t> uncommittedTransactionId;
+        };
+
+        // Active snapshots are spread over stripes by transaction id. Each list is sorted, since
+        // snapshot ids are only ever appended under the stripe lock
+        struct SnapshotStripe {
+            stdx::mutex lock;
+            std::list<uint64_t> activeSnapshots;
+        };
+
+        static const size_t kNumKeyShards = 64;
+        static const size_t kNumSnapshotStripes = 16;
+        // recompute the oldest active snapshot every that many releases of a stripe's oldest
+        // snapshot
+        static const uint64_t kCleanupInterval = 16;
+
+        KeyShard& _getKeyShard(StringData key) {
+            return _keyShards[SimpleStringDataComparator::kInstance.hash(key) % kNumKeyShards];
+        }
+
+        SnapshotStripe& _getSnapshotStripe(uint64_t transactionId) {
+            return _snapshotStripes[transactionId % kNumSnapshotStripes];
+        }
 
         uint64_t _getNextTransactionId() {
-          return _nextTransactionId.fetch_add(1);
+            return _nextTransactionId.fetch_add(1);
         }
 
         // returns true if the key was committed after the snapshotId, thus causing a write
         // conflict
-        // REQUIRES: transaction engine lock locked
-        bool _isKeyCommittedAfterSnapshot_inlock(const std::string& key, uint64_t snapshotId);
+        // REQUIRES: shard lock locked
+        bool _isKeyCommittedAfterSnapshot_inlock(KeyShard* shard, StringData key,
+                                                 uint64_t snapshotId);
 
-        // REQUIRES: transaction engine lock locked
-        void _registerCommittedKey_inlock(const std::string& key, uint64_t newSnapshotId);
+        // REQUIRES: shard lock locked
+        void _registerCommittedKey_inlock(KeyShard* shard, StringData key,
+                                          uint64_t newSnapshotId);
 
-        // REQUIRES: transaction engine lock locked
-        void _cleanUpKeysCommittedBeforeSnapshot_inlock(uint64_t snapshotId);
+        // REQUIRES: shard lock locked
+        void _cleanUpKeysCommittedBeforeSnapshot_inlock(KeyShard* shard, uint64_t snapshotId);
+
+        // Returns a snapshot id that's not newer than any snapshot that is active now or will be
+        // recorded in the future
+        uint64_t _getOldestActiveSnapshot();
+
+        // Forgets about keys that no active (or future) snapshot can conflict with
+        void _cleanUpKeys();
 
         friend class RocksTransaction;
-        uint64_t _latestSnapshotId;
+        std::atomic<uint64_t> _latestSnapshotId;
         std::atomic<uint64_t> _nextTransactionId;
-        // Lock when mutating state here
-        stdx::mutex _lock;
-
-        // The following data structures keep information about when were the keys committed.
-        // They can answer the following questions:
-        // * Which stored committed key has the earliest snapshot
-        // * When was a certain key committed
-        // _keysSortedBySnapshot is a list of {key, sequence_id} and it's sorted by the sequence_id.
-        // Committing keys are always monotonically increasing, so to keep it sorted we just need to
-        // push to the end.
-        // _keyInfo is a map from the key to the two-part information about the key:
-        // * snapshot ID of the last commit to this key
-        // * an iterator pointing to the corresponding entry in _keysSortedBySnapshot. This is used
-        // to update the list at the same time as we update the _keyInfo
-        typedef std::list<std::pair<std::string, uint64_t>> KeysSortedBySnapshotList;
-        typedef std::list<std::pair<std::string, uint64_t>>::iterator KeysSortedBySnapshotListIter;
-        KeysSortedBySnapshotList _keysSortedBySnapshot;
-        // map of key -> pair{seq_id, pointer to corresponding _keysSortedBySnapshot}
-        // key is a StringData and it points to the actual string in _keysSortedBySnapshot
-        StringDataUnorderedMap<std::pair<uint64_t, KeysSortedBySnapshotListIter>> _keyInfo;
-        std::unordered_map<std::string, uint64_t> _uncommittedTransactionId;
-
-        // this list is sorted
-        std::list<uint64_t> _activeSnapshots;
+        // last value computed by _getOldestActiveSnapshot(). Keys committed at or before it can
+        // be forgotten
+        std::atomic<uint64_t> _oldestActiveSnapshot;
+        std::atomic<uint64_t> _releasesSinceCleanup;
+        // number of snapshots in all stripes. Releasing the last one always cleans up, so that
+        // an idle engine doesn't hold on to keys
+        std::atomic<uint64_t> _numActiveSnapshots;
+
+        KeyShard _keyShards[kNumKeyShards];
+        SnapshotStripe _snapshotStripes[kNumSnapshotStripes];
     };
 
     class RocksTransaction {
@@ -114,7 +152,7 @@ namespace mongo {
 
         // returns true if OK
         // returns false on conflict
-        bool registerWrite(const std::string& key);
+        bool registerWrite(StringData key);
 
         void commit();
 
@@ -123,8 +161,26 @@ namespace mongo {
         void recordSnapshotId();
 
     private:
-        // REQUIRES: transaction engine lock locked
-        void _cleanup_inlock();
+        // Copies of the keys we wrote. Blocks are kept across transactions, so that a unit of
+        // work writing a handful of keys doesn't allocate
+        class KeyArena {
+        public:
+            StringData add(StringData key);
+            void clear();
+
+        private:
+            static const size_t kBlockSize = 4096;
+
+            std::vector<std::unique_ptr<char[]>> _blocks;
+            // block we're filling and how much of it is used
+            size_t _current = 0;
+            size_t _used = 0;
+            // keys that don't fit into a block
+            std::list<std::string> _largeKeys;
+        };
+
+        // releases our snapshot, if any
+        void _cleanup();
 
         friend class RocksTransactionEngine;
         bool _snapshotInitialized;
@@ -132,6 +188,8 @@ namespace mongo {
         std::list<uint64_t>::iterator _activeSnapshotsIter;
         uint64_t _transactionId;
         RocksTransactionEngine* _transactionEngine;
-        std::set<std::string> _writtenKeys;
+        KeyArena _keyArena;
+        // distinct keys, pointing into _keyArena
+        std::vector<StringData> _writtenKeys;
     };
 }
@@ -0,0 +1,168 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mongo/stdx/memory.h"
+#include "mongo/unittest/unittest.h"
+
+#include "rocks_transaction.h"
+
+namespace mongo {
+namespace {
+
+    // enough keys to land in every shard
+    const int kNumKeys = 1000;
+
+    std::string makeKey(int i) {
+        return "key-" + std::to_string(i);
+    }
+
+    TEST(RocksTransactionTest, WriteCommittedConflict) {
+        RocksTransactionEngine engine;
+        RocksTransaction t1(&engine);
+        RocksTransaction t2(&engine);
+        t1.recordSnapshotId();
+        t2.recordSnapshotId();
+
+        ASSERT(t1.registerWrite("a"));
+        t1.commit();
+        ASSERT_FALSE(t2.registerWrite("a"));
+        ASSERT(t2.registerWrite("b"));
+
+        // a snapshot taken after the commit doesn't conflict
+        RocksTransaction t3(&engine);
+        t3.recordSnapshotId();
+        ASSERT(t3.registerWrite("a"));
+    }
+
+    TEST(RocksTransactionTest, WriteUncommittedConflict) {
+        RocksTransactionEngine engine;
+        RocksTransaction t1(&engine);
+        RocksTransaction t2(&engine);
+        t1.recordSnapshotId();
+        t2.recordSnapshotId();
+
+        ASSERT(t1.registerWrite("a"));
+        ASSERT_FALSE(t2.registerWrite("a"));
+        // writing the same key twice is fine
+        ASSERT(t1.registerWrite("a"));
+
+        t1.abort();
+        ASSERT(t2.registerWrite("a"));
+    }
+
+    TEST(RocksTransactionTest, ConflictsAcrossShards) {
+        RocksTransactionEngine engine;
+        RocksTransaction reader(&engine);
+        reader.recordSnapshotId();
+        {
+            RocksTransaction writer(&engine);
+            writer.recordSnapshotId();
+            for (int i = 0; i < kNumKeys; ++i) {
+                ASSERT(writer.registerWrite(makeKey(i)));
+            }
+            writer.commit();
+        }
+        ASSERT_EQUALS(static_cast<size_t>(kNumKeys), engine.numKeysTracked());
+
+        for (int i = 0; i < kNumKeys; ++i) {
+            ASSERT_FALSE(reader.registerWrite(makeKey(i)));
+        }
+        ASSERT(reader.registerWrite(makeKey(kNumKeys)));
+    }
+
+    TEST(RocksTransactionTest, ConflictsAcrossSnapshotStripes) {
+        RocksTransactionEngine engine;
+        // transaction ids are consecutive, so these cover every stripe
+        std::vector<std::unique_ptr<RocksTransaction>> readers;
+        for (int i = 0; i < 40; ++i) {
+            readers.push_back(stdx::make_unique<RocksTransaction>(&engine));
+            readers.back()->recordSnapshotId();
+        }
+        ASSERT_EQUALS(40U, engine.numActiveSnapshots());
+
+        {
+            RocksTransaction writer(&engine);
+            writer.recordSnapshotId();
+            ASSERT(writer.registerWrite("a"));
+            writer.commit();
+        }
+        ASSERT_EQUALS(40U, engine.numActiveSnapshots());
+
+        // releasing some of the snapshots, including the oldest ones, must not forget a key that
+        // the others can still conflict with
+        for (int i = 0; i < 20; ++i) {
+            readers[i].reset();
+        }
+        ASSERT_EQUALS(1U, engine.numKeysTracked());
+        for (int i = 20; i < 40; ++i) {
+            ASSERT_FALSE(readers[i]->registerWrite("a"));
+        }
+    }
+
+    TEST(RocksTransactionTest, KeysAreForgottenAfterLastRelease) {
+        RocksTransactionEngine engine;
+        std::unique_ptr<RocksTransaction> reader(new RocksTransaction(&engine));
+        reader->recordSnapshotId();
+        for (int round = 0; round < 3; ++round) {
+            RocksTransaction writer(&engine);
+            writer.recordSnapshotId();
+            for (int i = 0; i < kNumKeys; ++i) {
+                ASSERT(writer.registerWrite(makeKey(i)));
+            }
+            writer.commit();
+            // the reader's snapshot is older than the commit, it can still conflict with the
+            // keys
+            ASSERT_EQUALS(static_cast<size_t>(kNumKeys), engine.numKeysTracked());
+            reader.reset(new RocksTransaction(&engine));
+            reader->recordSnapshotId();
+        }
+
+        reader.reset();
+        ASSERT_EQUALS(0U, engine.numActiveSnapshots());
+        ASSERT_EQUALS(0U, engine.numKeysTracked());
+    }
+
+    TEST(RocksTransactionTest, CommitWithoutOtherSnapshotsForgetsKeys) {
+        RocksTransactionEngine engine;
+        RocksTransaction writer(&engine);
+        writer.recordSnapshotId();
+        ASSERT(writer.registerWrite("a"));
+        ASSERT(writer.registerWrite("b"));
+        writer.commit();
+        ASSERT_EQUALS(0U, engine.numActiveSnapshots());
+        ASSERT_EQUALS(0U, engine.numKeysTracked());
+    }
+
+} // namespace
+} // namespace mongo
@@ -0,0 +1,292 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "mongo/platform/basic.h"
+
+#include "rocks_ttl.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/db/concurrency/write_conflict_exception.h"
+#include "mongo/db/operation_context.h"
+#include "mongo/db/storage/recovery_unit.h"
+#include "mongo/util/assert_util.h"
+#include "mongo/util/log.h"
+#include "mongo/util/mongoutils/str.h"
+
+#include "rocks_record_store.h"
+
+namespace mongo {
+
+    StatusWith<RocksTtlOptions> RocksTtlOptions::parse(const BSONObj& engineOptions) {
+        RocksTtlOptions options;
+        for (auto&& elem : engineOptions) {
+            if (elem.fieldNameStringData() != "ttl") {
+                return Status(ErrorCodes::InvalidOptions,
+                              str::stream() << "unknown rocksdb collection option: "
+                                            << elem.fieldNameStringData());
+            }
+            if (elem.type() != Object) {
+                return Status(ErrorCodes::InvalidOptions, "rocksdb option ttl must be an object");
+            }
+            bool hasExpireAfterSeconds = false;
+            for (auto&& ttlElem : elem.Obj()) {
+                const StringData name = ttlElem.fieldNameStringData();
+                if (name == "field") {
+                    if (ttlElem.type() != String || ttlElem.valueStringData().empty()) {
+                        return Status(ErrorCodes::InvalidOptions,
+                                      "ttl.field must be a non-empty string");
+                    }
+                    if (ttlElem.valueStringData().find('.') != std::string::npos ||
+                        ttlElem.valueStringData() == "_id") {
+                        return Status(ErrorCodes::InvalidOptions,
+                                      "ttl.field must be a top level field other than _id");
+                    }
+                    options.field = ttlElem.str();
+                } else if (name == "expireAfterSeconds") {
+                    if (!ttlElem.isNumber() || ttlElem.safeNumberLong() < 0 ||
+                        ttlElem.safeNumberLong() > std::numeric_limits<int32_t>::max()) {
+                        return Status(ErrorCodes::InvalidOptions,
+                                      "ttl.expireAfterSeconds must be a non-negative 32-bit "
+                                      "number");
+                    }
+                    options.expireAfterSeconds = ttlElem.safeNumberLong();
+                    hasExpireAfterSeconds = true;
+                } else {
+                    return Status(ErrorCodes::InvalidOptions,
+                                  str::stream() << "unknown ttl option: " << name);
+                }
+            }
+            if (options.field.empty() || !hasExpireAfterSeconds) {
+                return Status(ErrorCodes::InvalidOptions,
+                              "ttl needs both field and expireAfterSeconds");
+            }
+        }
+        return options;
+    }
+
+    BSONObj RocksTtlOptions::toBSON() const {
+        return BSON("field" << field << "expireAfterSeconds" << expireAfterSeconds);
+    }
+
+    bool RocksTtlOptions::isExpired(const BSONObj& doc, Date_t now) const {
+        BSONElement elem = doc.getField(field);
+        bool hasDate = false;
+        Date_t earliest = Date_t::max();
+        auto consider = [&](const BSONElement& e) {
+            if (e.type() == Date) {
+                hasDate = true;
+                earliest = std::min(earliest, e.date());
+            }
+        };
+        if (elem.type() == Array) {
+            for (auto&& e : elem.Obj()) {
+                consider(e);
+            }
+        } else {
+            consider(elem);
+        }
+        return hasDate && earliest <= now - Seconds(expireAfterSeconds);
+    }
+
+    RocksTtlCollection::RocksTtlCollection(RocksTtlOptions options, bool needsReconcile)
+        : _options(std::move(options)), _openCount(0), _needsReconcile(needsReconcile) {}
+
+    bool RocksTtlCollection::queueExpired(const RecordId& loc, const BSONObj& doc,
+                                          int64_t dataSize) {
+        BSONElement id = doc["_id"];
+        if (id.eoo()) {
+            return false;
+        }
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        if (_openCount == 0 || _needsReconcile || _expired.size() >= kMaxQueuedRecords) {
+            return false;
+        }
+        BSONObjBuilder idBuilder;
+        idBuilder.append(id);
+        _expired.push_back({loc, idBuilder.obj(), dataSize, 0});
+        return true;
+    }
+
+    std::vector<RocksTtlCollection::ExpiredRecord> RocksTtlCollection::takeExpired(
+        size_t maxRecords) {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        const size_t count = std::min(maxRecords, _expired.size());
+        std::vector<ExpiredRecord> records(_expired.begin(), _expired.begin() + count);
+        _expired.erase(_expired.begin(), _expired.begin() + count);
+        return records;
+    }
+
+    void RocksTtlCollection::retryExpired(std::vector<ExpiredRecord> records) {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        for (auto& record : records) {
+            if (++record.attempts < kMaxReapAttempts) {
+                _expired.push_back(std::move(record));
+            }
+        }
+    }
+
+    size_t RocksTtlCollection::numQueued() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _expired.size();
+    }
+
+    void RocksTtlCollection::open() {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        ++_openCount;
+    }
+
+    void RocksTtlCollection::close() {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        invariant(_openCount > 0);
+        --_openCount;
+    }
+
+    bool RocksTtlCollection::needsReconcile() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _needsReconcile;
+    }
+
+    void RocksTtlCollection::reconciled() {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        _needsReconcile = false;
+    }
+
+    bool RocksTtlCollection::isClean() const {
+        stdx::lock_guard<stdx::mutex> lk(_mutex);
+        return _expired.empty() && !_needsReconcile;
+    }
+
+    namespace {
+        // removes the entry of id if it points to loc
+        bool removeIdIndexEntry(OperationContext* opCtx, RocksTtlIdIndex* idIndex,
+                                const BSONObj& id, const RecordId& loc) {
+            if (idIndex->find(opCtx, id) != loc) {
+                return false;
+            }
+            idIndex->remove(opCtx, id, loc);
+            return true;
+        }
+
+        const size_t kReconcileBatchSize = 1000;
+    }  // namespace
+
+    int64_t RocksTtlCollection::reapExpired(OperationContext* opCtx, RocksRecordStore* rs,
+                                            RocksTtlIdIndex* idIndex, size_t maxRecords) {
+        auto expired = takeExpired(maxRecords);
+        if (expired.empty()) {
+            return 0;
+        }
+        const Date_t now = Date_t::now();
+        std::vector<ExpiredRecord> retry;
+        int64_t reaped = 0;
+        try {
+            WriteUnitOfWork wuow(opCtx);
+            for (const auto& record : expired) {
+                RecordData data;
+                if (rs->findRecord(opCtx, record.loc, &data)) {
+                    BSONObj doc = data.toBson();
+                    if (doc["_id"].woCompare(record.id.firstElement(), false) == 0) {
+                        // Either the compaction that dropped the record hasn't finished yet, or
+                        // a newer version of the record is still there
+                        if (_options.isExpired(doc, now)) {
+                            retry.push_back(record);
+                        }
+                        continue;
+                    }
+                    // the RecordId was reused after a restart, the record is gone
+                }
+                if (!removeIdIndexEntry(opCtx, idIndex, record.id, record.loc)) {
+                    // the record was deleted or cleaned up already
+                    continue;
+                }
+                rs->expiredRecordReaped(opCtx, record.dataSize);
+                ++reaped;
+            }
+            wuow.commit();
+        } catch (const WriteConflictException&) {
+            LOG(1) << "write conflict while reaping expired records of " << rs->ns();
+            retry = std::move(expired);
+            reaped = 0;
+        } catch (const DBException& e) {
+            log() << "error while reaping expired records of " << rs->ns() << ": "
+                  << redact(e.toStatus());
+            retry = std::move(expired);
+            reaped = 0;
+        }
+        retryExpired(std::move(retry));
+        return reaped;
+    }
+
+    bool RocksTtlCollection::reconcile(OperationContext* opCtx, RocksRecordStore* rs,
+                                       RocksTtlIdIndex* idIndex) {
+        std::vector<std::pair<BSONObj, RecordId>> dangling;
+        idIndex->forEach(opCtx, [&](const BSONObj& id, const RecordId& loc) {
+            RecordData data;
+            if (rs->findRecord(opCtx, loc, &data) &&
+                data.toBson()["_id"].woCompare(id.firstElement(), false) == 0) {
+                return;
+            }
+            dangling.emplace_back(id.getOwned(), loc);
+        });
+        opCtx->recoveryUnit()->abandonSnapshot();
+
+        try {
+            for (size_t i = 0; i < dangling.size(); i += kReconcileBatchSize) {
+                WriteUnitOfWork wuow(opCtx);
+                const size_t end = std::min(dangling.size(), i + kReconcileBatchSize);
+                for (size_t j = i; j < end; ++j) {
+                    removeIdIndexEntry(opCtx, idIndex, dangling[j].first, dangling[j].second);
+                }
+                wuow.commit();
+            }
+        } catch (const WriteConflictException&) {
+            LOG(1) << "write conflict while reconciling " << rs->ns() << ", will retry";
+            return false;
+        }
+        log() << "Removed " << dangling.size() << " dangling _id index entries of " << rs->ns();
+
+        long long numRecords = 0;
+        long long dataSize = 0;
+        auto cursor = rs->getCursor(opCtx, true);
+        while (auto record = cursor->next()) {
+            ++numRecords;
+            dataSize += record->data.size();
+        }
+        cursor.reset();
+        rs->updateStatsAfterRepair(opCtx, numRecords, dataSize);
+        opCtx->recoveryUnit()->abandonSnapshot();
+        reconciled();
+        return true;
+    }
+}
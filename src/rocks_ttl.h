@@ -0,0 +1,173 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "mongo/base/disallow_copying.h"
+#include "mongo/base/status_with.h"
+#include "mongo/bson/bsonobj.h"
+#include "mongo/db/record_id.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/util/time_support.h"
+
+namespace mongo {
+
+    class OperationContext;
+    class RocksRecordStore;
+
+    /**
+     * Records of a TTL collection expire expireAfterSeconds after the date in their top level
+     * field `field`, or after the earliest date if it holds an array. Records without a date
+     * there never expire. Set when the collection is created:
+     *
+     *   db.createCollection("sessions", {storageEngine: {rocksdb:
+     *       {ttl: {field: "lastUse", expireAfterSeconds: 3600}}}})
+     *
+     * Unlike a TTL index, nothing deletes expired records: compactions drop them while they
+     * rewrite the collection's files, which costs no tombstones and no extra writes. The reaper
+     * thread then removes their _id index entries and updates the collection's counters.
+     *
+     * Expiry isn't replicated: there are no oplog entries and no change stream events, and
+     * compactions drop records that older snapshots can still see. The option is therefore only
+     * accepted for collections that aren't replicated, those of the local database or any
+     * collection of a standalone node. A collection that was created on a standalone node
+     * ignores it once the node runs with replication, but still can't get other indexes.
+     *
+     * Limitations:
+     * - An expired record can outlive its expiry by a lot, until a compaction gets to its file.
+     * - Until the reaper catches up, counts are a bit high and the _id index still has the
+     *   record's entry: queries skip it, but inserting a document with the same _id fails.
+     * - The _id index is the only index allowed, and the collection must use the simple
+     *   collation. Capped collections ignore the option. The options can't be changed after the
+     *   collection was created.
+     * - After an unclean shutdown, the queue of records to clean up is lost. Each TTL collection
+     *   then scans its _id index and recounts its records before any more records expire.
+     */
+    struct RocksTtlOptions {
+        std::string field;
+        long long expireAfterSeconds = 0;
+
+        // Parses the rocksdb section of a collection's storageEngine options. Returns disabled
+        // options if there is no ttl section
+        static StatusWith<RocksTtlOptions> parse(const BSONObj& engineOptions);
+        // the ttl section that parse() accepts
+        BSONObj toBSON() const;
+
+        bool enabled() const { return !field.empty(); }
+        bool isExpired(const BSONObj& doc, Date_t now) const;
+    };
+
+    /**
+     * The _id index of a TTL collection, as far as the reaper needs it. Ids are {_id: <value>}.
+     */
+    class RocksTtlIdIndex {
+    public:
+        using EntryCallback = std::function<void(const BSONObj& id, const RecordId& loc)>;
+
+        virtual ~RocksTtlIdIndex() = default;
+
+        // the record the entry of id points to, a null RecordId if there's no entry
+        virtual RecordId find(OperationContext* opCtx, const BSONObj& id) = 0;
+        virtual void remove(OperationContext* opCtx, const BSONObj& id, const RecordId& loc) = 0;
+        // calls callback for every entry, in order
+        virtual void forEach(OperationContext* opCtx, const EntryCallback& callback) = 0;
+    };
+
+    /**
+     * Expiry state of a TTL collection, shared by its record store, the compaction filters that
+     * drop its expired records, and the reaper thread that cleans up after them.
+     */
+    class RocksTtlCollection {
+        MONGO_DISALLOW_COPYING(RocksTtlCollection);
+
+    public:
+        // a record that a compaction dropped
+        struct ExpiredRecord {
+            RecordId loc;
+            BSONObj id;  // {_id: <value>}, owned
+            int64_t dataSize;
+            int attempts;
+        };
+
+        // the reaper retries a record this often, once a second, while it's still there
+        static const int kMaxReapAttempts = 3600;
+        // compactions keep the records they can't queue
+        static const size_t kMaxQueuedRecords = 100000;
+
+        RocksTtlCollection(RocksTtlOptions options, bool needsReconcile);
+
+        const RocksTtlOptions& options() const { return _options; }
+
+        // Called by compaction filters for an expired record. Returns true if the record can be
+        // dropped, it's then queued for the reaper. Records stay while the collection isn't open,
+        // needs reconciling or has too many queued records.
+        bool queueExpired(const RecordId& loc, const BSONObj& doc, int64_t dataSize);
+
+        std::vector<ExpiredRecord> takeExpired(size_t maxRecords);
+        // puts back the records that were still there, until they've been tried too often
+        void retryExpired(std::vector<ExpiredRecord> records);
+        size_t numQueued() const;
+
+        // while the collection's record store is open
+        void open();
+        void close();
+
+        // set after an unclean shutdown, until the reaper has reconciled the _id index and the
+        // counters with the records
+        bool needsReconcile() const;
+        void reconciled();
+
+        // true if no clean up is pending
+        bool isClean() const;
+
+        // Removes the _id index entries of up to maxRecords queued records and takes them off
+        // the counters of rs. Returns the number of records cleaned up, records that are still
+        // there are retried later.
+        int64_t reapExpired(OperationContext* opCtx, RocksRecordStore* rs,
+                            RocksTtlIdIndex* idIndex, size_t maxRecords);
+        // After an unclean shutdown, the records that compactions dropped before the crash
+        // might not have been cleaned up. Removes the _id index entries that point to no record
+        // and recounts the records. Returns false if it has to be retried. Like a repair, the
+        // counts can be a bit off if the collection is written to meanwhile.
+        bool reconcile(OperationContext* opCtx, RocksRecordStore* rs, RocksTtlIdIndex* idIndex);
+
+    private:
+        const RocksTtlOptions _options;
+
+        mutable stdx::mutex _mutex;  // protects everything below
+        std::deque<ExpiredRecord> _expired;
+        int _openCount;
+        bool _needsReconcile;
+    };
+}
@@ -0,0 +1,294 @@
+/**
+ *    Copyright (C) 2014 MongoDB Inc.
+ *
+ *    This program is free software: you can redistribute it and/or  modify
+ *    it under the terms of the GNU Affero General Public License, version 3,
+ *    as published by the Free Software Foundation.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Affero General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Affero General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    As a special exception, the copyright holders give permission to link the
+ *    code of portions of this program with the OpenSSL library under certain
+ *    conditions as described in each individual source file and distribute
+ *    linked combinations including the program with the OpenSSL library. You
+ *    must comply with the GNU Affero General Public License in all respects for
+ *    all of the code used other than as permitted herein. If you modify file(s)
+ *    with this exception, you may extend this exception to your version of the
+ *    file(s), but you are not obligated to do so. If you do not wish to do so,
+ *    delete this exception statement from your version. If you delete this
+ *    exception statement from all source files in the program, then also delete
+ *    it in the license file.
+ */
+
+#include "mongo/platform/basic.h"
+
+#include <boost/filesystem/operations.hpp>
+#include <memory>
+#include <string>
+
+#include <rocksdb/db.h>
+#include <rocksdb/options.h>
+
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/db/catalog/collection_options.h"
+#include "mongo/db/index/index_descriptor.h"
+#include "mongo/db/operation_context_noop.h"
+#include "mongo/db/storage/record_store.h"
+#include "mongo/stdx/memory.h"
+#include "mongo/unittest/temp_dir.h"
+#include "mongo/unittest/unittest.h"
+#include "mongo/util/time_support.h"
+
+#include "rocks_engine.h"
+#include "rocks_index.h"
+#include "rocks_record_store.h"
+#include "rocks_ttl.h"
+#include "rocks_util.h"
+
+namespace mongo {
+namespace {
+
+    // the _id index of the tests, which isn't known to the engine
+    class SortedDataIdIndex : public RocksTtlIdIndex {
+    public:
+        explicit SortedDataIdIndex(SortedDataInterface* index) : _index(index) {}
+
+        virtual RecordId find(OperationContext* opCtx, const BSONObj& id) {
+            const BSONObj key = toKey(id);
+            auto entry = _index->newCursor(opCtx, true)->seek(key, true);
+            if (!entry || entry->key.woCompare(key, BSONObj(), false) != 0) {
+                return RecordId();
+            }
+            return entry->loc;
+        }
+
+        virtual void remove(OperationContext* opCtx, const BSONObj& id, const RecordId& loc) {
+            _index->unindex(opCtx, toKey(id), loc, false);
+        }
+
+        virtual void forEach(OperationContext* opCtx, const EntryCallback& callback) {
+            auto cursor = _index->newCursor(opCtx, true);
+            for (auto entry = cursor->seek(BSON("" << MINKEY), true); entry;
+                 entry = cursor->next()) {
+                BSONObjBuilder idBuilder;
+                idBuilder.appendAs(entry->key.firstElement(), "_id");
+                callback(idBuilder.obj(), entry->loc);
+            }
+        }
+
+        static BSONObj toKey(const BSONObj& id) {
+            BSONObjBuilder keyBuilder;
+            keyBuilder.appendAs(id.firstElement(), "");
+            return keyBuilder.obj();
+        }
+
+    private:
+        SortedDataInterface* _index;  // not owned
+    };
+
+    class RocksTtlTest : public unittest::Test {
+    public:
+        RocksTtlTest() : _dbpath("mongo-rocks-ttl-test") {
+            boost::filesystem::remove_all(_dbpath.path());
+            open();
+        }
+
+        ~RocksTtlTest() { close(); }
+
+    protected:
+        static const int kNumRecords = 10;
+
+        static CollectionOptions ttlOptions() {
+            CollectionOptions options;
+            options.storageEngine =
+                BSON("rocksdb" << BSON("ttl" << BSON("field"
+                                                     << "t"
+                                                     << "expireAfterSeconds"
+                                                     << 3600)));
+            return options;
+        }
+
+        void open() {
+            _engine.reset(new RocksEngine(_dbpath.path(), true, 4, false));
+            const CollectionOptions options = ttlOptions();
+            auto opCtx = newOperationContext();
+            ASSERT_OK(_engine->createRecordStore(opCtx.get(), kNs, "collection-ttl", options));
+            _rs = _engine->getRecordStore(opCtx.get(), kNs, "collection-ttl", options);
+
+            BSONObjBuilder configBuilder;
+            RocksIndexBase::generateConfig(&configBuilder, 4, IndexDescriptor::IndexVersion::kV2);
+            _index = stdx::make_unique<RocksUniqueIndex>(
+                _engine->getDB(), _engine->getDB()->DefaultColumnFamily(),
+                encodePrefix(kIndexPrefix), "index-ttl", Ordering::make(BSON("_id" << 1)),
+                configBuilder.obj(), kNs, "_id_");
+            _idIndex = stdx::make_unique<SortedDataIdIndex>(_index.get());
+        }
+
+        // A clean shutdown with records left to clean up leaves the same state behind as a
+        // crash: the queue is lost and the marker stays
+        void close() {
+            _idIndex.reset();
+            _index.reset();
+            _rs.reset();
+            _engine.reset();
+        }
+
+        void restart() {
+            close();
+            open();
+        }
+
+        std::unique_ptr<OperationContext> newOperationContext() {
+            return stdx::make_unique<OperationContextNoop>(_engine->newRecoveryUnit());
+        }
+
+        RocksRecordStore* rs() { return dynamic_cast<RocksRecordStore*>(_rs.get()); }
+
+        RocksTtlCollection* ttlCollection() { return rs()->ttlCollection().get(); }
+
+        // records with an even id expired an hour ago, the others are fresh
+        void insertRecords() {
+            const Date_t now = Date_t::now();
+            auto opCtx = newOperationContext();
+            WriteUnitOfWork uow(opCtx.get());
+            for (int i = 0; i < kNumRecords; ++i) {
+                BSONObj doc = BSON("_id" << i << "t" << (i % 2 ? now : now - Hours(2)));
+                auto res = _rs->insertRecord(opCtx.get(), doc.objdata(), doc.objsize(),
+                                             Timestamp(), false);
+                ASSERT_OK(res.getStatus());
+                _locs[i] = res.getValue();
+                ASSERT_OK(_index->insert(opCtx.get(), SortedDataIdIndex::toKey(doc),
+                                         res.getValue(), false));
+            }
+            uow.commit();
+        }
+
+        // expired records are dropped while the collection's files are rewritten
+        void compact() {
+            rocksdb::CompactRangeOptions options;
+            options.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForce;
+            ASSERT(_engine->getDB()->CompactRange(options, nullptr, nullptr).ok());
+        }
+
+        bool hasRecord(int i) {
+            auto opCtx = newOperationContext();
+            RecordData data;
+            return _rs->findRecord(opCtx.get(), _locs[i], &data);
+        }
+
+        RecordId findIdIndexEntry(int i) {
+            auto opCtx = newOperationContext();
+            return _idIndex->find(opCtx.get(), BSON("_id" << i));
+        }
+
+        long long numRecords() {
+            auto opCtx = newOperationContext();
+            return _rs->numRecords(opCtx.get());
+        }
+
+        const std::string kNs = "test.sessions";
+        // far above the prefixes of the engine's idents
+        const uint32_t kIndexPrefix = 1000000;
+
+        unittest::TempDir _dbpath;
+        std::unique_ptr<RocksEngine> _engine;
+        std::unique_ptr<RecordStore> _rs;
+        std::unique_ptr<RocksUniqueIndex> _index;
+        std::unique_ptr<SortedDataIdIndex> _idIndex;
+        RecordId _locs[kNumRecords];
+    };
+
+    TEST_F(RocksTtlTest, CompactionsDropExpiredRecords) {
+        insertRecords();
+        compact();
+        for (int i = 0; i < kNumRecords; ++i) {
+            ASSERT_EQUALS(i % 2 == 1, hasRecord(i));
+        }
+        // the counters and the _id index are only updated by the reaper
+        ASSERT_EQUALS(5U, ttlCollection()->numQueued());
+        ASSERT_EQUALS(kNumRecords, numRecords());
+        ASSERT_EQUALS(_locs[0], findIdIndexEntry(0));
+    }
+
+    TEST_F(RocksTtlTest, ReaperCleansUpAfterDroppedRecords) {
+        insertRecords();
+        compact();
+
+        {
+            auto opCtx = newOperationContext();
+            ASSERT_EQUALS(2,
+                          ttlCollection()->reapExpired(opCtx.get(), rs(), _idIndex.get(), 2));
+            ASSERT_EQUALS(3U, ttlCollection()->numQueued());
+            ASSERT_EQUALS(3,
+                          ttlCollection()->reapExpired(opCtx.get(), rs(), _idIndex.get(), 100));
+        }
+        ASSERT(ttlCollection()->isClean());
+
+        ASSERT_EQUALS(5, numRecords());
+        for (int i = 0; i < kNumRecords; ++i) {
+            ASSERT_EQUALS(i % 2 ? _locs[i] : RecordId(), findIdIndexEntry(i));
+        }
+        // nothing is left to clean up, so the next startup doesn't reconcile
+        restart();
+        ASSERT_FALSE(ttlCollection()->needsReconcile());
+    }
+
+    TEST_F(RocksTtlTest, ReconcileAfterUncleanShutdown) {
+        insertRecords();
+        compact();
+        ASSERT_EQUALS(5U, ttlCollection()->numQueued());
+
+        restart();
+        ASSERT(ttlCollection()->needsReconcile());
+        ASSERT_EQUALS(0U, ttlCollection()->numQueued());
+        ASSERT_EQUALS(kNumRecords, numRecords());
+
+        {
+            auto opCtx = newOperationContext();
+            ASSERT(ttlCollection()->reconcile(opCtx.get(), rs(), _idIndex.get()));
+        }
+        ASSERT_FALSE(ttlCollection()->needsReconcile());
+        ASSERT_EQUALS(5, numRecords());
+        for (int i = 0; i < kNumRecords; ++i) {
+            ASSERT_EQUALS(i % 2 ? _locs[i] : RecordId(), findIdIndexEntry(i));
+        }
+
+        restart();
+        ASSERT_FALSE(ttlCollection()->needsReconcile());
+    }
+
+    TEST_F(RocksTtlTest, NonSimpleCollationIsRejected) {
+        CollectionOptions options = ttlOptions();
+        options.collation = BSON("locale"
+                                 << "fr");
+        auto opCtx = newOperationContext();
+        ASSERT_EQUALS(ErrorCodes::InvalidOptions,
+                      _engine->createRecordStore(opCtx.get(), "test.fr", "collection-fr", options)
+                          .code());
+    }
+
+    TEST_F(RocksTtlTest, OptionsAreTakenFromCreation) {
+        auto opCtx = newOperationContext();
+        ASSERT_OK(_engine->createRecordStore(opCtx.get(), "test.plain", "collection-plain",
+                                             CollectionOptions()));
+        ASSERT_OK(_engine->createRecordStore(opCtx.get(), "test.saved", "collection-saved",
+                                             ttlOptions()));
+
+        // what the collection is opened with doesn't matter
+        auto plain = _engine->getRecordStore(opCtx.get(), "test.plain", "collection-plain",
+                                             ttlOptions());
+        ASSERT_FALSE(dynamic_cast<RocksRecordStore*>(plain.get())->ttlCollection());
+        auto saved = _engine->getRecordStore(opCtx.get(), "test.saved", "collection-saved",
+                                             CollectionOptions());
+        ASSERT(dynamic_cast<RocksRecordStore*>(saved.get())->ttlCollection());
+    }
+
+}  // namespace
+}  // namespace mongo
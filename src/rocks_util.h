@@ -28,26 +28,68 @@
 
 #pragma once
 
+#include <cstring>
+#include <memory>
 #include <string>
+#include <rocksdb/slice.h>
 #include <rocksdb/status.h>
 
+#include "mongo/base/string_data.h"
 #include "mongo/util/assert_util.h"
 
 namespace mongo {
 
-    inline std::string rocksGetNextPrefix(const rocksdb::Slice& prefix) {
-        // next prefix lexicographically, assume same length
-        std::string nextPrefix(prefix.data(), prefix.size());
-        for (int i = static_cast<int>(nextPrefix.size()) - 1; i >= 0; --i) {
-            nextPrefix[i]++;
+    // turns key into the next key of the same length lexicographically
+    inline void rocksIncrementKey(char* key, size_t size) {
+        for (int i = static_cast<int>(size) - 1; i >= 0; --i) {
+            key[i]++;
             // if it's == 0, that means we've overflowed, so need to keep adding
-            if (nextPrefix[i] != 0) {
+            if (key[i] != 0) {
                 break;
             }
         }
+    }
+
+    inline std::string rocksGetNextPrefix(const rocksdb::Slice& prefix) {
+        // next prefix lexicographically, assume same length
+        std::string nextPrefix(prefix.data(), prefix.size());
+        rocksIncrementKey(&nextPrefix[0], nextPrefix.size());
         return nextPrefix;
     }
 
+    /**
+     * prefix + suffix, built in an inline buffer so that keys of up to kInlineSize bytes don't
+     * need a heap allocation. Meant to live on the stack for the duration of one operation.
+     */
+    class RocksKeyBuffer {
+    public:
+        static const size_t kInlineSize = 256;
+
+        RocksKeyBuffer(const rocksdb::Slice& prefix, const char* suffix, size_t suffixSize)
+            : _size(prefix.size() + suffixSize) {
+            if (_size > kInlineSize) {
+                _heap.reset(new char[_size]);
+            }
+            memcpy(data(), prefix.data(), prefix.size());
+            memcpy(data() + prefix.size(), suffix, suffixSize);
+        }
+
+        RocksKeyBuffer(const RocksKeyBuffer&) = delete;
+        RocksKeyBuffer& operator=(const RocksKeyBuffer&) = delete;
+
+        char* data() { return _heap ? _heap.get() : _inline; }
+        const char* data() const { return _heap ? _heap.get() : _inline; }
+        size_t size() const { return _size; }
+
+        rocksdb::Slice slice() const { return rocksdb::Slice(data(), _size); }
+        StringData stringData() const { return StringData(data(), _size); }
+
+    private:
+        const size_t _size;
+        std::unique_ptr<char[]> _heap;
+        char _inline[kInlineSize];
+    };
+
     std::string encodePrefix(uint32_t prefix);
     bool extractPrefix(const rocksdb::Slice& slice, uint32_t* prefix);
     int get_internal_delete_skipped_count();